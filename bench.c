@@ -0,0 +1,530 @@
+// Load generator for the file server. Each worker thread drives one
+// connection slot: connect, send "USER <u>\n<command>\n" (+ body), read the
+// reply to EOF, repeat. Closed loop runs the slots back to back; open loop
+// issues requests on a fixed schedule and measures each from its scheduled
+// start, so a stalled server shows up in the percentiles instead of just
+// slowing the generator down (coordinated omission). With -l the slots
+// use shared-memory sessions with a server on this host instead, one
+// session per slot kept for the whole run.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "shm.h"
+
+#define DEFAULT_PORT 9000
+#define MAX_UPLOAD 4095                 // server payload limit per UPLOAD
+#define MAX_REPLY 65536
+#define MAX_THREADS 1024
+
+enum { OP_UPLOAD, OP_DOWNLOAD, OP_LIST, OP_DELETE, OP_PROCESS, NOPS };
+static const char *op_names[NOPS] = { "UPLOAD", "DOWNLOAD", "LIST", "DELETE", "PROCESS" };
+
+typedef enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP } SizeKind;
+
+typedef struct {
+    const char *host;
+    int port;
+    int conns;
+    int duration;
+    double rate;                        // requests/s; 0 = closed loop
+    int users;
+    int files;
+    int mix[NOPS];                      // relative weights
+    SizeKind size_kind;
+    size_t size_a, size_b;
+    int json;
+    const char *local;                  // -l: local socket path
+} BenchConfig;
+
+// Latency samples in microseconds, one array per thread and op.
+typedef struct {
+    uint32_t *v;
+    size_t n, cap;
+} Samples;
+
+typedef struct {
+    int id;
+    uint64_t rng;
+    Samples lat[NOPS];                  // corrected (open loop) or plain
+    Samples svc[NOPS];                  // actual start -> reply
+    uint64_t errors[NOPS];
+    uint64_t failures;                  // connect/IO failures
+} Worker;
+
+static BenchConfig cfg = {
+    .host = "127.0.0.1", .port = DEFAULT_PORT, .conns = 8, .duration = 10,
+    .users = 4, .files = 16, .mix = { 20, 60, 10, 5, 5 },
+    .size_kind = SIZE_UNIFORM, .size_a = 256, .size_b = 4095,
+};
+
+static struct sockaddr_in server_addr;
+static char payload[MAX_UPLOAD];
+static uint64_t start_ns, end_ns;
+static atomic_uint_fast64_t next_ticket;
+static __thread ShmSession session;
+static __thread int session_open;
+
+/* ---------- Helper Functions ---------- */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t) {
+    struct timespec ts = { (time_t)(t / 1000000000ull), (long)(t % 1000000000ull) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static uint64_t xorshift(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+static double uniform01(uint64_t *s) {
+    return (double)(xorshift(s) >> 11) / 9007199254740992.0;
+}
+
+static void push(Samples *s, uint64_t us) {
+    if (s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        uint32_t *grown = realloc(s->v, cap * sizeof(uint32_t));
+        if (!grown) return;
+        s->v = grown;
+        s->cap = cap;
+    }
+    s->v[s->n++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static size_t pick_size(uint64_t *rng) {
+    size_t n;
+    switch (cfg.size_kind) {
+    case SIZE_FIXED:
+        n = cfg.size_a;
+        break;
+    case SIZE_UNIFORM:
+        n = cfg.size_a + (size_t)(uniform01(rng) * (double)(cfg.size_b - cfg.size_a + 1));
+        break;
+    default: {
+        double u = uniform01(rng);
+        n = (size_t)(-(double)cfg.size_a * log1p(-u));
+        break;
+    }
+    }
+    return n > MAX_UPLOAD ? MAX_UPLOAD : n;
+}
+
+static int pick_op(uint64_t *rng) {
+    int total = 0;
+    for (int i = 0; i < NOPS; i++) total += cfg.mix[i];
+    int r = (int)(xorshift(rng) % (uint64_t)total);
+    for (int i = 0; i < NOPS; i++) {
+        if (r < cfg.mix[i]) return i;
+        r -= cfg.mix[i];
+    }
+    return OP_LIST;
+}
+
+static int write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+// One request on this thread's local session, opened on first use.
+static int local_request(const char *head, const char *body, size_t body_len) {
+    if (!session_open) {
+        if (shm_connect(cfg.local, &session) != 0) return -1;
+        session_open = 1;
+    }
+    if (shm_write(&session, head, strlen(head)) != 0 ||
+        (body_len && shm_write(&session, body, body_len) != 0) || shm_end(&session) != 0) {
+        shm_close(&session);
+        session_open = 0;
+        return -1;
+    }
+
+    char reply[MAX_REPLY];
+    size_t got = 0;
+    ssize_t r;
+    while ((r = shm_read(&session, reply + got, sizeof(reply) - got)) > 0) {
+        got += (size_t)r;
+        if (got == sizeof(reply)) got = 16;     // keep the head, discard the rest
+    }
+    if (r < 0) {
+        shm_close(&session);
+        session_open = 0;
+        return -1;
+    }
+    if (got == 0) return -1;
+    return strncmp(reply, "ERR", 3) == 0 ? 1 : 0;
+}
+
+// One request on a fresh connection. Returns 0 on an OK reply, 1 on an
+// "ERR" reply and -1 if the connection failed.
+static int request(const char *head, const char *body, size_t body_len) {
+    if (cfg.local) return local_request(head, body, body_len);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 ||
+        write_all(fd, head, strlen(head)) < 0 ||
+        (body_len && write_all(fd, body, body_len) < 0)) {
+        close(fd);
+        return -1;
+    }
+    shutdown(fd, SHUT_WR);
+
+    char reply[MAX_REPLY];
+    size_t got = 0;
+    ssize_t r;
+    while ((r = read(fd, reply + got, got < sizeof(reply) ? sizeof(reply) - got : 0)) > 0 ||
+           (r < 0 && errno == EINTR)) {
+        if (r > 0) got += (size_t)r;
+        if (got == sizeof(reply)) got = 16;     // keep the head, discard the rest
+    }
+    close(fd);
+    if (r < 0 || got == 0) return -1;
+    return strncmp(reply, "ERR", 3) == 0 ? 1 : 0;
+}
+
+static int run_op(Worker *w, int op) {
+    char head[512];
+    int user = (int)(xorshift(&w->rng) % (uint64_t)cfg.users);
+    int file = (int)(xorshift(&w->rng) % (uint64_t)cfg.files);
+    int n = snprintf(head, sizeof(head), "USER bench%d\n", user);
+    size_t body_len = 0;
+
+    switch (op) {
+    case OP_UPLOAD:
+        body_len = pick_size(&w->rng);
+        snprintf(head + n, sizeof(head) - (size_t)n, "UPLOAD bench-%d.dat\n", file);
+        break;
+    case OP_DOWNLOAD:
+        snprintf(head + n, sizeof(head) - (size_t)n, "DOWNLOAD bench-%d.dat\n", file);
+        break;
+    case OP_LIST:
+        snprintf(head + n, sizeof(head) - (size_t)n, "LIST\n");
+        break;
+    case OP_DELETE:
+        snprintf(head + n, sizeof(head) - (size_t)n, "DELETE bench-%d.dat\n", file);
+        break;
+    default:
+        snprintf(head + n, sizeof(head) - (size_t)n, "PROCESS wc bench-%d.dat\n", file);
+        break;
+    }
+    return request(head, payload, body_len);
+}
+
+/* ---------- Worker Thread ---------- */
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    uint64_t interval = cfg.rate > 0 ? (uint64_t)(1e9 / cfg.rate) : 0;
+
+    for (;;) {
+        uint64_t intended;
+        if (interval) {
+            // Open loop: tickets are slots on a global schedule.
+            uint64_t ticket = atomic_fetch_add(&next_ticket, 1);
+            intended = start_ns + ticket * interval;
+            if (intended >= end_ns) break;
+            if (intended > now_ns()) sleep_until(intended);
+        } else {
+            intended = now_ns();
+            if (intended >= end_ns) break;
+        }
+
+        int op = pick_op(&w->rng);
+        uint64_t began = now_ns();
+        int rc = run_op(w, op);
+        uint64_t done = now_ns();
+
+        if (rc < 0) {
+            w->failures++;
+            continue;
+        }
+        if (rc > 0) w->errors[op]++;
+        push(&w->lat[op], (done - intended) / 1000);
+        push(&w->svc[op], (done - began) / 1000);
+    }
+    if (session_open) shm_close(&session);
+    return NULL;
+}
+
+/* ---------- Report ---------- */
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Merge one op's samples (or all ops with op < 0) from every worker, sorted.
+static Samples merge(Worker *ws, int op, int service) {
+    Samples all = { 0 };
+    for (int i = 0; i < cfg.conns; i++) {
+        for (int o = 0; o < NOPS; o++) {
+            if (op >= 0 && o != op) continue;
+            Samples *s = service ? &ws[i].svc[o] : &ws[i].lat[o];
+            for (size_t k = 0; k < s->n; k++) push(&all, s->v[k]);
+        }
+    }
+    qsort(all.v, all.n, sizeof(uint32_t), cmp_u32);
+    return all;
+}
+
+static uint32_t pct(const Samples *s, double q) {
+    if (s->n == 0) return 0;
+    size_t idx = (size_t)(q * (double)(s->n - 1) + 0.5);
+    return s->v[idx];
+}
+
+static void print_dist(const char *label, const Samples *s) {
+    if (cfg.json) {
+        printf("\"%s\":{\"count\":%zu,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}",
+               label, s->n, pct(s, 0.5), pct(s, 0.9), pct(s, 0.99), pct(s, 0.999),
+               s->n ? s->v[s->n - 1] : 0);
+    } else {
+        printf("  %-10s n=%-8zu p50 %-7u p90 %-7u p99 %-7u p999 %-7u max %-8u", label, s->n,
+               pct(s, 0.5), pct(s, 0.9), pct(s, 0.99), pct(s, 0.999), s->n ? s->v[s->n - 1] : 0);
+    }
+}
+
+static void report(Worker *ws, double elapsed) {
+    uint64_t errors[NOPS] = { 0 }, failures = 0, total_errors = 0;
+    for (int i = 0; i < cfg.conns; i++) {
+        failures += ws[i].failures;
+        for (int o = 0; o < NOPS; o++) {
+            errors[o] += ws[i].errors[o];
+            total_errors += ws[i].errors[o];
+        }
+    }
+    Samples all = merge(ws, -1, 0), svc = merge(ws, -1, 1);
+    double tput = (double)all.n / elapsed;
+    const char *mode = cfg.rate > 0 ? "open" : "closed";
+
+    if (cfg.json) {
+        printf("{\"mode\":\"%s\",\"rate\":%.1f,\"conns\":%d,\"duration_s\":%.3f,\"requests\":%zu,"
+               "\"errors\":%llu,\"failures\":%llu,\"throughput\":%.1f,",
+               mode, cfg.rate, cfg.conns, elapsed, all.n, (unsigned long long)total_errors,
+               (unsigned long long)failures, tput);
+        print_dist("latency_us", &all);
+        printf(",");
+        print_dist("service_us", &svc);
+        printf(",\"ops\":{");
+        int first = 1;
+        for (int o = 0; o < NOPS; o++) {
+            Samples s = merge(ws, o, 0);
+            if (s.n) {
+                printf("%s\"%s\":{\"errors\":%llu,", first ? "" : ",", op_names[o],
+                       (unsigned long long)errors[o]);
+                print_dist("latency_us", &s);
+                printf("}");
+                first = 0;
+            }
+            free(s.v);
+        }
+        printf("}}\n");
+    } else {
+        printf("%s loop, %d connections, %.1f s", mode, cfg.conns, elapsed);
+        if (cfg.rate > 0) printf(", target %.0f req/s", cfg.rate);
+        printf("\nrequests %zu, errors %llu, connection failures %llu, throughput %.1f req/s\n",
+               all.n, (unsigned long long)total_errors, (unsigned long long)failures, tput);
+        printf("latency (us%s):\n", cfg.rate > 0 ? ", from scheduled start" : "");
+        print_dist("all", &all);
+        printf(" err %llu\n", (unsigned long long)total_errors);
+        for (int o = 0; o < NOPS; o++) {
+            Samples s = merge(ws, o, 0);
+            if (s.n) {
+                print_dist(op_names[o], &s);
+                printf(" err %llu\n", (unsigned long long)errors[o]);
+            }
+            free(s.v);
+        }
+        if (cfg.rate > 0) {
+            printf("service time (us, from actual send):\n");
+            print_dist("all", &svc);
+            printf("\n");
+        }
+    }
+    free(all.v);
+    free(svc.v);
+}
+
+/* ---------- Setup ---------- */
+
+// "upload=20,download=60,list=10,delete=5,process=5"
+static int parse_mix(const char *s) {
+    int mix[NOPS] = { 0 };
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", s);
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        int o;
+        for (o = 0; o < NOPS; o++)
+            if (strcasecmp(tok, op_names[o]) == 0) break;
+        if (o == NOPS) return -1;
+        mix[o] = atoi(eq + 1);
+    }
+    int total = 0;
+    for (int o = 0; o < NOPS; o++) total += mix[o];
+    if (total <= 0) return -1;
+    memcpy(cfg.mix, mix, sizeof(mix));
+    return 0;
+}
+
+// "fixed:N", "uniform:A-B" or "exp:MEAN"
+static int parse_size(const char *s) {
+    unsigned long a, b;
+    if (sscanf(s, "fixed:%lu", &a) == 1) {
+        cfg.size_kind = SIZE_FIXED;
+        cfg.size_a = a;
+    } else if (sscanf(s, "uniform:%lu-%lu", &a, &b) == 2 && a <= b) {
+        cfg.size_kind = SIZE_UNIFORM;
+        cfg.size_a = a;
+        cfg.size_b = b;
+    } else if (sscanf(s, "exp:%lu", &a) == 1 && a > 0) {
+        cfg.size_kind = SIZE_EXP;
+        cfg.size_a = a;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Create the users and upload every file once so DOWNLOAD and PROCESS
+// have something to hit.
+static int populate(void) {
+    char head[256];
+    uint64_t rng = 0x9e3779b97f4a7c15ull;
+    for (int u = 0; u < cfg.users; u++) {
+        snprintf(head, sizeof(head), "SIGNUP bench%d bench\n", u);
+        if (request(head, NULL, 0) < 0) return -1;
+        for (int f = 0; f < cfg.files; f++) {
+            snprintf(head, sizeof(head), "USER bench%d\nUPLOAD bench-%d.dat\n", u, f);
+            if (request(head, payload, pick_size(&rng)) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-H host] [-p port | -l local_socket] [-c connections] [-d seconds]\n"
+            "          [-r req_per_sec] [-u users] [-f files_per_user] [-m mix] [-s sizes] [-J]\n"
+            "  -r 0 (default) runs closed loop; -r N runs open loop at N req/s\n"
+            "  -m upload=20,download=60,list=10,delete=5,process=5\n"
+            "  -s fixed:N | uniform:A-B | exp:MEAN   (bytes, at most %d)\n"
+            "  -l PATH uses shared-memory sessions with a server started with -u PATH\n"
+            "  -J one JSON object instead of text\n",
+            prog, MAX_UPLOAD);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "H:p:l:c:d:r:u:f:m:s:J")) != -1) {
+        switch (c) {
+        case 'H': cfg.host = optarg; break;
+        case 'p': cfg.port = atoi(optarg); break;
+        case 'l': cfg.local = optarg; break;
+        case 'c': cfg.conns = atoi(optarg); break;
+        case 'd': cfg.duration = atoi(optarg); break;
+        case 'r': cfg.rate = atof(optarg); break;
+        case 'u': cfg.users = atoi(optarg); break;
+        case 'f': cfg.files = atoi(optarg); break;
+        case 'm':
+            if (parse_mix(optarg) != 0) { usage(argv[0]); return 1; }
+            break;
+        case 's':
+            if (parse_size(optarg) != 0) { usage(argv[0]); return 1; }
+            break;
+        case 'J': cfg.json = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (cfg.conns < 1 || cfg.conns > MAX_THREADS || cfg.duration < 1 || cfg.users < 1 ||
+        cfg.files < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons((uint16_t)cfg.port);
+    if (inet_pton(AF_INET, cfg.host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "bad host address: %s\n", cfg.host);
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(payload); i++) payload[i] = (char)('a' + i * 7 % 26);
+
+    if (populate() != 0) {
+        if (cfg.local)
+            fprintf(stderr, "cannot reach server at %s\n", cfg.local);
+        else
+            fprintf(stderr, "cannot reach server at %s:%d\n", cfg.host, cfg.port);
+        return 1;
+    }
+    // The server takes a bounded number of sessions; free this one.
+    if (session_open) shm_close(&session);
+    session_open = 0;
+
+    Worker *ws = calloc((size_t)cfg.conns, sizeof(Worker));
+    pthread_t *threads = calloc((size_t)cfg.conns, sizeof(pthread_t));
+    if (!ws || !threads) {
+        perror("calloc");
+        return 1;
+    }
+
+    start_ns = now_ns();
+    end_ns = start_ns + (uint64_t)cfg.duration * 1000000000ull;
+    atomic_init(&next_ticket, 0);
+    for (int i = 0; i < cfg.conns; i++) {
+        ws[i].id = i;
+        ws[i].rng = 0x2545f4914f6cdd1dull * (uint64_t)(i + 1);
+        pthread_create(&threads[i], NULL, worker_main, &ws[i]);
+    }
+    for (int i = 0; i < cfg.conns; i++) pthread_join(threads[i], NULL);
+    double elapsed = (double)(now_ns() - start_ns) / 1e9;
+
+    report(ws, elapsed);
+
+    for (int i = 0; i < cfg.conns; i++) {
+        for (int o = 0; o < NOPS; o++) {
+            free(ws[i].lat[o].v);
+            free(ws[i].svc[o].v);
+        }
+    }
+    free(ws);
+    free(threads);
+    return 0;
+}
@@ -1,5 +1,8 @@
 // client/client.c
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,11 +10,19 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include "crc32c.h"
+#include "lz.h"
+#include "shm.h"
+#include "sync.h"
 
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 9000
 #define MAX_BUF 4096
 #define SESSION_FILE ".session_user"
+#define WIRE_BLOCK (64 * 1024)       // -z upload frame size
+#define DOWNLOAD_BLOCK (64 * 1024)
+#define DOWNLOAD_PROBE 256                     // -j: the first request's range
+#define DOWNLOAD_LZ_BLOCK_MAX (16 * 1024 * 1024)  // largest -z block accepted
 
 // --- Helper functions ---
 
@@ -37,6 +48,241 @@ static ssize_t robust_write(int fd, const void *buf, size_t count) {
     return (ssize_t)sent;
 }
 
+// The request goes over TCP, or through a shared-memory session with a
+// server on this host (-u).
+static ShmSession *local;
+
+static ssize_t tx_read(int fd, void *buf, size_t count) {
+    return local ? shm_read(local, buf, count) : robust_read(fd, buf, count);
+}
+
+static ssize_t tx_write(int fd, const void *buf, size_t count) {
+    if (local) return shm_write(local, buf, count) == 0 ? (ssize_t)count : -1;
+    return robust_write(fd, buf, count);
+}
+
+// End of the request: the server reads the body up to here.
+static void tx_end(int fd) {
+    if (local)
+        shm_end(local);
+    else
+        shutdown(fd, SHUT_WR);
+}
+
+// Read exactly count bytes. Returns 0 on success.
+static int tx_read_full(int fd, void *buf, size_t count) {
+    char *p = buf;
+    while (count > 0) {
+        ssize_t r = tx_read(fd, p, count);
+        if (r <= 0) return -1;
+        p += r;
+        count -= (size_t)r;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const char *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t w = pwrite(fd, buf, len, off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        buf += w;
+        len -= (size_t)w;
+        off += w;
+    }
+    return 0;
+}
+
+static int open_tcp(const char *host, int port) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) { perror("socket"); return -1; }
+
+    struct sockaddr_in serv = {0};
+    serv.sin_family = AF_INET;
+    serv.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &serv.sin_addr) != 1) {
+        fprintf(stderr, "Bad server address: %s\n", host);
+        close(sock);
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr *)&serv, sizeof(serv)) < 0) {
+        perror("connect");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* ---------- DOWNLOAD ---------- */
+
+// The body is written to the output file as it arrives, so memory stays
+// bounded whatever the file size. Each returns the bytes written and
+// updates *crc over them.
+
+static size_t download_stream(int sock, int out, size_t filesize, uint32_t *crc) {
+    static char block[DOWNLOAD_BLOCK];
+    size_t received = 0;
+    while (received < filesize) {
+        size_t want = filesize - received < sizeof(block) ? filesize - received : sizeof(block);
+        ssize_t r = tx_read(sock, block, want);
+        if (r <= 0 || robust_write(out, block, (size_t)r) < 0) break;
+        *crc = crc32c(*crc, block, (size_t)r);
+        received += (size_t)r;
+    }
+    return received;
+}
+
+// -z: an lz stream, decoded one frame at a time.
+static size_t download_packed(int sock, int out, size_t filesize, size_t wire_len, uint32_t *crc) {
+    unsigned char hdr[LZ_STREAM_HEADER];
+    if (wire_len < sizeof(hdr) || tx_read_full(sock, hdr, sizeof(hdr)) != 0 ||
+        memcmp(hdr, LZ_MAGIC, 4) != 0)
+        return 0;
+    uint32_t block = hdr[4] | hdr[5] << 8 | (uint32_t)hdr[6] << 16 | (uint32_t)hdr[7] << 24;
+    if (block == 0 || block > DOWNLOAD_LZ_BLOCK_MAX) return 0;
+
+    // Blocks that do not shrink are stored, so a payload is never larger
+    // than its block.
+    char *wire = malloc(block);
+    char *raw = malloc(block);
+    size_t got = sizeof(hdr), received = 0;
+    while (wire && raw && got < wire_len) {
+        unsigned char fh[LZ_FRAME_HEADER];
+        uint32_t raw_len, payload;
+        int stored;
+        if (wire_len - got < sizeof(fh) || tx_read_full(sock, fh, sizeof(fh)) != 0 ||
+            lz_frame_header(fh, &raw_len, &payload, &stored) != 0 || raw_len > block ||
+            payload > block || payload > wire_len - got - sizeof(fh) ||
+            raw_len > filesize - received || tx_read_full(sock, wire, payload) != 0)
+            break;
+        got += sizeof(fh) + payload;
+
+        const char *data = wire;
+        if (!stored) {
+            if (lz_decompress(wire, payload, raw, raw_len) != (long)raw_len) break;
+            data = raw;
+        }
+        if (robust_write(out, data, raw_len) < 0) break;
+        *crc = crc32c(*crc, data, raw_len);
+        received += raw_len;
+    }
+    free(wire);
+    free(raw);
+    return received;
+}
+
+// -j: one byte range of the file over its own connection, written in
+// place. The first segment reuses the connection that learned the size.
+typedef struct {
+    const char *host;
+    int port;
+    const char *user;
+    const char *file;
+    int sock;                   // -1 = connect and ask for the range
+    int out;
+    size_t filesize;
+    uint32_t file_crc;
+    size_t off, len;
+    size_t received;
+    uint32_t crc;
+} Segment;
+
+static void *segment_main(void *arg) {
+    Segment *s = arg;
+    int sock = s->sock;
+    if (sock < 0) {
+        sock = open_tcp(s->host, s->port);
+        if (sock < 0) return NULL;
+        char req[512];
+        int n = snprintf(req, sizeof(req), "%s%s%sDOWNLOAD %s RANGE %zu %zu\n",
+                         s->user[0] ? "USER " : "", s->user, s->user[0] ? "\n" : "",
+                         s->file, s->off, s->len);
+        if (robust_write(sock, req, (size_t)n) < 0) {
+            close(sock);
+            return NULL;
+        }
+        shutdown(sock, SHUT_WR);
+
+        // It must describe the same file as the first reply.
+        char header[128];
+        size_t idx = 0;
+        while (idx < sizeof(header) - 1 && robust_read(sock, header + idx, 1) == 1)
+            if (header[idx++] == '\n') break;
+        header[idx] = '\0';
+        size_t size, off, len;
+        unsigned int crc;
+        if (sscanf(header, "SIZE %zu CRC %x RANGE %zu %zu", &size, &crc, &off, &len) != 4 ||
+            size != s->filesize || crc != s->file_crc || off != s->off || len != s->len) {
+            close(sock);
+            return NULL;
+        }
+    }
+
+    static __thread char block[DOWNLOAD_BLOCK];
+    while (s->received < s->len) {
+        size_t want = s->len - s->received < sizeof(block) ? s->len - s->received : sizeof(block);
+        ssize_t r = robust_read(sock, block, want);
+        if (r <= 0 || pwrite_all(s->out, block, (size_t)r, (off_t)(s->off + s->received)) != 0)
+            break;
+        s->crc = crc32c(s->crc, block, (size_t)r);
+        s->received += (size_t)r;
+    }
+    if (sock != s->sock) close(sock);
+    return NULL;
+}
+
+// The first first_len bytes come over sock; the rest is split evenly over
+// connections - 1 more. *crc is the whole file's, combined from the
+// segments in order.
+static size_t download_segments(Segment *proto, int sock, size_t first_len, int connections,
+                                uint32_t *crc) {
+    size_t rest = proto->filesize - first_len;
+    size_t nsegs = 1 + (rest ? (size_t)connections - 1 : 0);
+    if (nsegs - 1 > rest) nsegs = 1 + rest;
+    Segment *segs = calloc(nsegs, sizeof(Segment));
+    pthread_t *threads = calloc(nsegs, sizeof(pthread_t));
+    int *started = calloc(nsegs, sizeof(int));
+    if (!segs || !threads || !started) {
+        free(segs);
+        free(threads);
+        free(started);
+        return 0;
+    }
+
+    size_t off = first_len;
+    for (size_t i = 0; i < nsegs; i++) {
+        segs[i] = *proto;
+        if (i == 0) {
+            segs[i].sock = sock;
+            segs[i].off = 0;
+            segs[i].len = first_len;
+        } else {
+            size_t len = rest / (nsegs - 1) + (i - 1 < rest % (nsegs - 1));
+            segs[i].sock = -1;
+            segs[i].off = off;
+            segs[i].len = len;
+            off += len;
+            started[i] = pthread_create(&threads[i], NULL, segment_main, &segs[i]) == 0;
+        }
+    }
+    segment_main(&segs[0]);
+    for (size_t i = 1; i < nsegs; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else segment_main(&segs[i]);
+    }
+
+    size_t received = 0;
+    for (size_t i = 0; i < nsegs; i++) {
+        *crc = i == 0 ? segs[i].crc : crc32c_combine(*crc, segs[i].crc, segs[i].received);
+        received += segs[i].received;
+    }
+    free(segs);
+    free(threads);
+    free(started);
+    return received;
+}
+
 /* Read saved session username (if any). */
 static void read_session(char *out, size_t n) {
     if (n == 0) return;
@@ -64,16 +310,71 @@ static void clear_session(void) {
 // --- Main client program ---
 
 int main(int argc, char *argv[]) {
+    // -z: compress UPLOAD/DOWNLOAD bodies on the wire
+    // -p <port>: talk to another server, e.g. a read-only replica
+    // -H <ip>: server or router on another host
+    // -u <path>: shared-memory session with a server on this host
+    // -j <n>: connections for SYNC and DOWNLOAD (0 = the command's default)
+    int wire_z = 0;
+    int connections = 0;
+    const char *local_path = NULL;
+    int port = SERVER_PORT;
+    const char *host = SERVER_IP;
+    for (;;) {
+        if (argc > 1 && strcmp(argv[1], "-z") == 0) {
+            wire_z = 1;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else if (argc > 2 && strcmp(argv[1], "-p") == 0) {
+            port = atoi(argv[2]);
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc > 2 && strcmp(argv[1], "-H") == 0) {
+            host = argv[2];
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+            connections = atoi(argv[2]);
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc > 2 && strcmp(argv[1], "-u") == 0) {
+            local_path = argv[2];
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else {
+            break;
+        }
+    }
+
     if (argc < 2) {
         printf("Usage:\n");
         printf("  %s SIGNUP <username> <password>\n", argv[0]);
         printf("  %s LOGIN <username> <password>\n", argv[0]);
         printf("  %s LOGOUT\n", argv[0]);
-        printf("  %s UPLOAD <file>\n", argv[0]);
+        printf("  %s [-z] UPLOAD <file>\n", argv[0]);
         printf("  %s LIST\n", argv[0]);
-        printf("  %s DOWNLOAD <file>\n", argv[0]);
+        printf("  %s [-z|-j <n>] DOWNLOAD <file>[@<version>]  (-j: over n connections)\n", argv[0]);
         printf("  %s DELETE <file>\n", argv[0]);
         printf("  %s PROCESS <seconds>\n", argv[0]);
+        printf("  %s PROCESS checksum|wc|compress <file>\n", argv[0]);
+        printf("  %s PROCESS grep <file> <pattern>\n", argv[0]);
+        printf("  %s JOB STATUS|WAIT|CANCEL <id> [wait_seconds]\n", argv[0]);
+        printf("  %s USAGE\n", argv[0]);
+        printf("  %s VERSIONS <file>\n", argv[0]);
+        printf("  %s SEARCH <text>|<prefix>*  (quote the * from the shell)\n", argv[0]);
+        printf("  %s [-j <n>] SYNC <dir>     (two-way sync over n connections)\n", argv[0]);
+        printf("  %s STATS [JSON]\n", argv[0]);
+        printf("  %s TRACE\n", argv[0]);
+        printf("  %s WATCH [<seq>]          (follow changes, from after seq)\n", argv[0]);
+        printf("  %s ADDNODE <host:port>     (router only)\n", argv[0]);
+        printf("Options: -p <port> connects to another server (default %d)\n", SERVER_PORT);
+        printf("         -H <ip> connects to another host (default %s)\n", SERVER_IP);
+        printf("         -u <path> uses the local socket of a server on this host\n");
         return 1;
     }
 
@@ -88,6 +389,16 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    // SYNC makes many requests of its own, over TCP
+    if (strcmp(argv[1], "SYNC") == 0 && argc == 3) {
+        if (local_path) {
+            fprintf(stderr, "SYNC runs over TCP; drop -u\n");
+            return 1;
+        }
+        return sync_dir(argv[2], host, port, session_user,
+                        connections ? connections : SYNC_DEFAULT_CONNECTIONS) == 0 ? 0 : 1;
+    }
+
     // Build command line
     char cmdline[1024] = {0};
     if (strcmp(argv[1], "SIGNUP") == 0 && argc == 4) {
@@ -95,33 +406,61 @@ int main(int argc, char *argv[]) {
     } else if (strcmp(argv[1], "LOGIN") == 0 && argc == 4) {
         snprintf(cmdline, sizeof(cmdline), "LOGIN %s %s\n", argv[2], argv[3]);
     } else if (strcmp(argv[1], "UPLOAD") == 0 && argc == 3) {
-        snprintf(cmdline, sizeof(cmdline), "UPLOAD %s\n", argv[2]);
+        snprintf(cmdline, sizeof(cmdline), "UPLOAD %s%s\n", argv[2], wire_z ? " Z" : "");
     } else if (strcmp(argv[1], "LIST") == 0) {
         snprintf(cmdline, sizeof(cmdline), "LIST\n");
     } else if (strcmp(argv[1], "DOWNLOAD") == 0 && argc == 3) {
-        snprintf(cmdline, sizeof(cmdline), "DOWNLOAD %s\n", argv[2]);
+        // -j: a small probe of the start of the file; the reply gives its
+        // size, and the rest is split over the other connections. A fixed
+        // large first range would leave nothing to split for the files the
+        // server accepts (4095 bytes at most).
+        if (connections > 1 && !wire_z && !local_path)
+            snprintf(cmdline, sizeof(cmdline), "DOWNLOAD %s RANGE 0 %d\n", argv[2], DOWNLOAD_PROBE);
+        else
+            snprintf(cmdline, sizeof(cmdline), "DOWNLOAD %s%s\n", argv[2], wire_z ? " Z" : "");
     } else if (strcmp(argv[1], "DELETE") == 0 && argc == 3) {
         snprintf(cmdline, sizeof(cmdline), "DELETE %s\n", argv[2]);
-    } else if (strcmp(argv[1], "PROCESS") == 0 && argc == 3) {
-        snprintf(cmdline, sizeof(cmdline), "PROCESS %s\n", argv[2]);
+    } else if (strcmp(argv[1], "USAGE") == 0) {
+        snprintf(cmdline, sizeof(cmdline), "USAGE\n");
+    } else if (strcmp(argv[1], "VERSIONS") == 0 && argc == 3) {
+        snprintf(cmdline, sizeof(cmdline), "VERSIONS %s\n", argv[2]);
+    } else if (strcmp(argv[1], "SEARCH") == 0 && argc == 3) {
+        snprintf(cmdline, sizeof(cmdline), "SEARCH %s\n", argv[2]);
+    } else if (strcmp(argv[1], "PROCESS") == 0 && argc >= 3 && argc <= 5) {
+        snprintf(cmdline, sizeof(cmdline), "PROCESS %s%s%s%s%s\n", argv[2],
+                 argc > 3 ? " " : "", argc > 3 ? argv[3] : "",
+                 argc > 4 ? " " : "", argc > 4 ? argv[4] : "");
+    } else if (strcmp(argv[1], "STATS") == 0 && argc <= 3) {
+        snprintf(cmdline, sizeof(cmdline), "STATS%s%s\n", argc == 3 ? " " : "",
+                 argc == 3 ? argv[2] : "");
+    } else if (strcmp(argv[1], "TRACE") == 0 && argc == 2) {
+        snprintf(cmdline, sizeof(cmdline), "TRACE\n");
+    } else if (strcmp(argv[1], "WATCH") == 0 && argc <= 3) {
+        snprintf(cmdline, sizeof(cmdline), "WATCH%s%s\n", argc == 3 ? " " : "",
+                 argc == 3 ? argv[2] : "");
+    } else if (strcmp(argv[1], "ADDNODE") == 0 && argc == 3) {
+        snprintf(cmdline, sizeof(cmdline), "ADDNODE %s\n", argv[2]);
+    } else if (strcmp(argv[1], "JOB") == 0 && (argc == 4 || argc == 5)) {
+        snprintf(cmdline, sizeof(cmdline), "JOB %s %s%s%s\n", argv[2], argv[3],
+                 argc == 5 ? " " : "", argc == 5 ? argv[4] : "");
     } else {
         printf("Invalid command or wrong arguments.\n");
         return 1;
     }
 
-    // Create socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) { perror("socket"); return 1; }
-
-    struct sockaddr_in serv = {0};
-    serv.sin_family = AF_INET;
-    serv.sin_port = htons(SERVER_PORT);
-    inet_pton(AF_INET, SERVER_IP, &serv.sin_addr);
-
-    if (connect(sock, (struct sockaddr *)&serv, sizeof(serv)) < 0) {
-        perror("connect");
-        close(sock);
-        return 1;
+    // Local session: the socket only carries the handshake
+    static ShmSession session;
+    int sock;
+    if (local_path) {
+        if (shm_connect(local_path, &session) != 0) {
+            fprintf(stderr, "Cannot open a local session on %s: %s\n", local_path, strerror(errno));
+            return 1;
+        }
+        local = &session;
+        sock = session.sock;
+    } else {
+        sock = open_tcp(host, port);
+        if (sock < 0) return 1;
     }
 
     // Send user header (if logged in and not an auth command)
@@ -129,7 +468,7 @@ int main(int argc, char *argv[]) {
     if (!is_auth_cmd && session_user[0] != '\0') {
         char hdr[128];
         snprintf(hdr, sizeof(hdr), "USER %s\n", session_user);
-        if (robust_write(sock, hdr, strlen(hdr)) < 0) {
+        if (tx_write(sock, hdr, strlen(hdr)) < 0) {
             perror("write");
             close(sock);
             return 1;
@@ -138,12 +477,13 @@ int main(int argc, char *argv[]) {
 
     // --- Authentication commands ---
     if (strncmp(cmdline, "SIGNUP", 6) == 0 || strncmp(cmdline, "LOGIN", 5) == 0) {
-        if (robust_write(sock, cmdline, strlen(cmdline)) < 0) {
+        if (tx_write(sock, cmdline, strlen(cmdline)) < 0) {
             perror("write"); close(sock); return 1;
         }
+        tx_end(sock);
 
         char resp[MAX_BUF];
-        ssize_t r = robust_read(sock, resp, sizeof(resp) - 1);
+        ssize_t r = tx_read(sock, resp, sizeof(resp) - 1);
         if (r > 0) {
             resp[r] = '\0';
             printf("Server response:\n%s\n", resp);
@@ -165,22 +505,40 @@ int main(int argc, char *argv[]) {
         FILE *f = fopen(filename, "rb");
         if (!f) { perror("fopen"); close(sock); return 1; }
 
-        if (robust_write(sock, cmdline, strlen(cmdline)) < 0) {
+        if (tx_write(sock, cmdline, strlen(cmdline)) < 0) {
             perror("write"); fclose(f); close(sock); return 1;
         }
 
-        char filebuf[4096];
-        size_t n;
-        while ((n = fread(filebuf, 1, sizeof(filebuf), f)) > 0) {
-            if (robust_write(sock, filebuf, n) < 0) {
+        if (wire_z) {
+            // lz stream: header, then one frame per WIRE_BLOCK read
+            static char block[WIRE_BLOCK];
+            static char frame[LZ_FRAME_HEADER + WIRE_BLOCK];
+            char hdr[LZ_STREAM_HEADER];
+            lz_stream_header(hdr, WIRE_BLOCK);
+            if (tx_write(sock, hdr, sizeof(hdr)) < 0) {
                 perror("write"); fclose(f); close(sock); return 1;
             }
+            size_t n;
+            while ((n = fread(block, 1, sizeof(block), f)) > 0) {
+                size_t flen = lz_frame_block(block, n, frame);
+                if (tx_write(sock, frame, flen) < 0) {
+                    perror("write"); fclose(f); close(sock); return 1;
+                }
+            }
+        } else {
+            char filebuf[4096];
+            size_t n;
+            while ((n = fread(filebuf, 1, sizeof(filebuf), f)) > 0) {
+                if (tx_write(sock, filebuf, n) < 0) {
+                    perror("write"); fclose(f); close(sock); return 1;
+                }
+            }
         }
         fclose(f);
-        shutdown(sock, SHUT_WR);
+        tx_end(sock);
 
         char resp[MAX_BUF];
-        ssize_t r = robust_read(sock, resp, sizeof(resp) - 1);
+        ssize_t r = tx_read(sock, resp, sizeof(resp) - 1);
         if (r > 0) {
             resp[r] = '\0';
             printf("Server response:\n%s\n", resp);
@@ -193,13 +551,14 @@ int main(int argc, char *argv[]) {
 
     // --- DOWNLOAD ---
     if (strncmp(cmdline, "DOWNLOAD", 8) == 0) {
-        if (robust_write(sock, cmdline, strlen(cmdline)) < 0) { perror("write"); close(sock); return 1; }
+        if (tx_write(sock, cmdline, strlen(cmdline)) < 0) { perror("write"); close(sock); return 1; }
+        tx_end(sock);
 
         char header[64] = {0};
         size_t idx = 0;
         char c;
         while (idx < sizeof(header) - 1) {
-            ssize_t rr = robust_read(sock, &c, 1);
+            ssize_t rr = tx_read(sock, &c, 1);
             if (rr <= 0) break;
             header[idx++] = c;
             if (c == '\n') break;
@@ -208,7 +567,7 @@ int main(int argc, char *argv[]) {
 
         if (strncmp(header, "SIZE", 4) != 0) {
             char rest[MAX_BUF];
-            ssize_t rr = robust_read(sock, rest, sizeof(rest) - 1);
+            ssize_t rr = tx_read(sock, rest, sizeof(rest) - 1);
             if (rr > 0) {
                 rest[rr] = '\0';
                 printf("Server response:\n%s%s\n", header, rest);
@@ -219,45 +578,85 @@ int main(int argc, char *argv[]) {
             return 0;
         }
 
-        size_t filesize = 0;
-        sscanf(header, "SIZE %zu", &filesize);
+        // "SIZE n CRC c", "SIZE n CRC c LZ w" for a compressed body, or
+        // "SIZE n CRC c RANGE 0 f" for the first segment
+        size_t filesize = 0, wire_len = 0, first_off = 0, first_len = 0;
+        unsigned int expected_crc = 0;
+        int fields = sscanf(header, "SIZE %zu CRC %x LZ %zu", &filesize, &expected_crc, &wire_len);
+        int has_crc = fields >= 2;
+        int packed = fields == 3;
+        int ranged = sscanf(header, "SIZE %*u CRC %*x RANGE %zu %zu", &first_off, &first_len) == 2;
         if (filesize == 0) {
             printf("Server reported empty file.\n");
             close(sock);
             return 0;
         }
 
-        char *buffile = malloc(filesize);
-        if (!buffile) { fprintf(stderr, "malloc failed\n"); close(sock); return 1; }
+        // Written beside the output and renamed over it once verified.
+        // The space is reserved up front: segments land out of order, and a
+        // full disk shows up here rather than halfway through.
+        char outname[512], partname[600];
+        snprintf(outname, sizeof(outname), "downloaded_%s", argv[2]);
+        snprintf(partname, sizeof(partname), "%s.part", outname);
+        int out = open(partname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0) { perror("open"); close(sock); return 1; }
+        if (fallocate(out, 0, 0, (off_t)filesize) != 0 &&
+            (errno != EOPNOTSUPP || ftruncate(out, (off_t)filesize) != 0)) {
+            perror("fallocate");
+            close(out);
+            unlink(partname);
+            close(sock);
+            return 1;
+        }
 
-        size_t received = 0;
-        while (received < filesize) {
-            ssize_t rr = robust_read(sock, buffile + received, filesize - received);
-            if (rr <= 0) break;
-            received += (size_t)rr;
+        uint32_t crc = 0;
+        size_t received;
+        if (ranged && first_off == 0) {
+            Segment proto = { host, port, session_user, argv[2], -1, out, filesize,
+                              expected_crc, 0, 0, 0, 0 };
+            received = download_segments(&proto, sock, first_len, connections, &crc);
+        } else if (packed) {
+            received = download_packed(sock, out, filesize, wire_len, &crc);
+        } else {
+            received = download_stream(sock, out, filesize, &crc);
         }
+        close(sock);
 
-        char outname[512];
-        snprintf(outname, sizeof(outname), "downloaded_%s", argv[2]);
-        FILE *of = fopen(outname, "wb");
-        if (!of) { perror("fopen"); free(buffile); close(sock); return 1; }
-        fwrite(buffile, 1, received, of);
-        fclose(of);
-        free(buffile);
+        // Verify end to end before the file takes its name.
+        if (close(out) != 0 || received != filesize || (has_crc && crc != expected_crc)) {
+            fprintf(stderr, "Download corrupted: got %zu/%zu bytes, crc32c %08x (expected %08x)\n",
+                    received, filesize, crc, expected_crc);
+            unlink(partname);
+            return 1;
+        }
+        if (rename(partname, outname) != 0) {
+            perror("rename");
+            unlink(partname);
+            return 1;
+        }
 
-        printf("Downloaded %zu bytes → saved as %s\n", received, outname);
-        close(sock);
+        int used = ranged && filesize > first_len ? connections : 1;
+        if (packed)
+            printf("Downloaded %zu bytes as %zu compressed (crc32c %08x %s) → saved as %s\n",
+                   received, wire_len, crc, has_crc ? "verified" : "not checked", outname);
+        else if (ranged)
+            printf("Downloaded %zu bytes over %d connection%s (crc32c %08x verified) → saved as %s\n",
+                   received, used, used == 1 ? "" : "s", crc, outname);
+        else
+            printf("Downloaded %zu bytes (crc32c %08x %s) → saved as %s\n", received, crc,
+                   has_crc ? "verified" : "not checked", outname);
         return 0;
     }
 
     // --- PROCESS ---
     if (strncmp(cmdline, "PROCESS", 7) == 0) {
-        if (robust_write(sock, cmdline, strlen(cmdline)) < 0) {
+        if (tx_write(sock, cmdline, strlen(cmdline)) < 0) {
             perror("write"); close(sock); return 1;
         }
+        tx_end(sock);
 
         char resp[MAX_BUF];
-        ssize_t r = robust_read(sock, resp, sizeof(resp) - 1);
+        ssize_t r = tx_read(sock, resp, sizeof(resp) - 1);
         if (r > 0) {
             resp[r] = '\0';
             printf("Server response:\n%s\n", resp);
@@ -268,14 +667,53 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    // --- STATS ---
+    // The report can exceed one buffer; copy it through until EOF.
+    if (strncmp(cmdline, "STATS", 5) == 0) {
+        if (tx_write(sock, cmdline, strlen(cmdline)) < 0) {
+            perror("write"); close(sock); return 1;
+        }
+        tx_end(sock);
+
+        char resp[MAX_BUF];
+        ssize_t r;
+        while ((r = tx_read(sock, resp, sizeof(resp))) > 0)
+            fwrite(resp, 1, (size_t)r, stdout);
+        close(sock);
+        return 0;
+    }
+
+    // --- WATCH ---
+    // Prints changes as they arrive until the server goes away. Over TCP
+    // the connection is not half-closed: the server takes that as leaving.
+    if (strncmp(cmdline, "WATCH", 5) == 0) {
+        if (tx_write(sock, cmdline, strlen(cmdline)) < 0) {
+            perror("write"); close(sock); return 1;
+        }
+        if (local) tx_end(sock);
+
+        char resp[MAX_BUF];
+        ssize_t r;
+        while ((r = tx_read(sock, resp, sizeof(resp))) > 0) {
+            fwrite(resp, 1, (size_t)r, stdout);
+            fflush(stdout);
+        }
+        close(sock);
+        return 0;
+    }
+
     // --- LIST / DELETE / others ---
-    if (robust_write(sock, cmdline, strlen(cmdline)) < 0) { perror("write"); close(sock); return 1; }
+    if (tx_write(sock, cmdline, strlen(cmdline)) < 0) { perror("write"); close(sock); return 1; }
+    tx_end(sock);
 
+    // LIST and SEARCH replies can run past one buffer.
     char resp[MAX_BUF];
-    ssize_t r = robust_read(sock, resp, sizeof(resp) - 1);
+    ssize_t r = tx_read(sock, resp, sizeof(resp));
     if (r > 0) {
-        resp[r] = '\0';
-        printf("Server response:\n%s\n", resp);
+        printf("Server response:\n");
+        do fwrite(resp, 1, (size_t)r, stdout);
+        while ((r = tx_read(sock, resp, sizeof(resp))) > 0);
+        printf("\n");
     } else {
         printf("No response.\n");
     }
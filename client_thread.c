@@ -9,8 +9,13 @@
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 #include "server.h"
-#include "auth.h"
+#include "request.h"
+#include "crc32c.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
 #include <stdatomic.h>
 
 extern ClientQueue g_client_queue;
@@ -35,89 +40,131 @@ static ssize_t read_line(int fd, char *buf, size_t maxlen) {
     return (ssize_t)idx;
 }
 
-static CommandType parse_command(const char *buf) {
-    if (strncmp(buf, "UPLOAD", 6) == 0)   return CMD_UPLOAD;
-    if (strncmp(buf, "PROCESS", 7) == 0)  return CMD_PROCESS;
-    if (strncmp(buf, "LIST", 4) == 0)     return CMD_LIST;
-    if (strncmp(buf, "DOWNLOAD", 8) == 0) return CMD_DOWNLOAD;
-    if (strncmp(buf, "DELETE", 6) == 0)   return CMD_DELETE;
-    if (strncmp(buf, "LOGIN", 5) == 0)    return CMD_LOGIN;
-    if (strncmp(buf, "SIGNUP", 6) == 0)   return CMD_SIGNUP;
-    return CMD_UNKNOWN;
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t w = writev(fd, iov, iovcnt);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    return 0;
 }
 
-void *client_thread_main(void *arg) {
-    (void)arg;
-extern atomic_int server_running;
+// Write a reply line and count it toward bytes out.
+static void reply(int fd, const char *msg) {
+    size_t len = strlen(msg);
+    write(fd, msg, len);
+    stats_bytes(0, len);
+}
 
+// Read one request from client_fd, run it and write the reply. The caller
+// closes the connection. Returns the command for stats; *failed is set if
+// the reply was an error.
+static CommandType serve_client(int client_fd, uint32_t trace, int *failed) {
+    char line[1024];
+    char cmdline[1024];
+    Task t = {0};
+    *failed = 1;
+    uint64_t span = trace_begin(trace);
+    // First line may be "USER <username>\n" or it may be the command directly.
+    ssize_t n = read_line(client_fd, line, sizeof(line));
+    if (n <= 0) return CMD_UNKNOWN;
+    stats_bytes((size_t)n, 0);
 
-while (atomic_load(&server_running)) {
-    int client_fd = dequeueClient(&g_client_queue);
-if (client_fd < 0) {
-    /* shutdown requested; exit thread */
-    fprintf(stderr, "[Client %lu] shutting down thread\n", (unsigned long)pthread_self());
-    break;
-}
+    if (strncmp(line, "USER ", 5) == 0) {
+        // extract username (without newline)
+        sscanf(line + 5, "%63s", t.username);
+        // read next line for actual command
+        n = read_line(client_fd, cmdline, sizeof(cmdline));
+        if (n <= 0) return CMD_UNKNOWN;
+        stats_bytes((size_t)n, 0);
+    } else {
+        // no USER header; treat first line as command
+        strncpy(cmdline, line, sizeof(cmdline)-1);
+        // ensure username is guest by default unless overridden by LOGIN later
+        strncpy(t.username, "guest", sizeof(t.username)-1);
+    }
 
-    if (!atomic_load(&server_running)) break;
+    trace_end(trace, TRACE_READ, span);
 
-        if (client_fd < 0) continue;
+    // Remove trailing newline from cmdline for easier parsing
+    if (cmdline[strlen(cmdline)-1] == '\n') cmdline[strlen(cmdline)-1] = '\0';
 
-        char line[1024];
-        char cmdline[1024];
-        Task t = {0};
-        // First line may be "USER <username>\n" or it may be the command directly.
-        ssize_t n = read_line(client_fd, line, sizeof(line));
-        if (n <= 0) { close(client_fd); continue; }
-
-        if (strncmp(line, "USER ", 5) == 0) {
-            // extract username (without newline)
-            sscanf(line + 5, "%63s", t.username);
-            // read next line for actual command
-            n = read_line(client_fd, cmdline, sizeof(cmdline));
-            if (n <= 0) { close(client_fd); continue; }
-        } else {
-            // no USER header; treat first line as command
-            strncpy(cmdline, line, sizeof(cmdline)-1);
-            // ensure username is guest by default unless overridden by LOGIN later
-            strncpy(t.username, "guest", sizeof(t.username)-1);
-        }
+    CommandType cmd = request_command(cmdline);
+    t.trace = trace;
+    *failed = 0;
+    uint64_t service_start = stats_now_us();
+    const char *user = strlen(t.username) ? t.username : "guest";
 
-        // Remove trailing newline from cmdline for easier parsing
-        if (cmdline[strlen(cmdline)-1] == '\n') cmdline[strlen(cmdline)-1] = '\0';
-
-        CommandType cmd = parse_command(cmdline);
-        t.cmd = cmd;
-
-        // ---------- SIGNUP ----------
-        if (cmd == CMD_SIGNUP) {
-            char user[64], pass[64];
-            sscanf(cmdline, "SIGNUP %63s %63s", user, pass);
-            bool ok = auth_signup(user, pass);
-            const char *msg = ok ? "SIGNUP OK\n" : "SIGNUP FAILED (exists)\n";
-            write(client_fd, msg, strlen(msg));
-            close(client_fd);
-            continue;
+    // ---------- WATCH ----------
+    if (cmd == CMD_WATCH) {
+        char *msg = request_watch(client_fd, user, cmdline, failed);
+        if (msg) {
+            reply(client_fd, msg);
+            free(msg);
         }
+        return cmd;
+    }
 
-        // ---------- LOGIN ----------
-        if (cmd == CMD_LOGIN) {
-            char user[64], pass[64];
-            sscanf(cmdline, "LOGIN %63s %63s", user, pass);
-            bool ok = auth_login(user, pass);
-            const char *msg = ok ? "LOGIN OK\n" : "LOGIN FAILED\n";
-            write(client_fd, msg, strlen(msg));
-            // Do NOT persist on server side — client will send USER header next time.
-            close(client_fd);
-            continue;
+    // ---------- JOB ----------
+    if (cmd == CMD_JOB) {
+        char *msg = request_job(client_fd, user, cmdline, failed);
+        if (msg) {
+            reply(client_fd, msg);
+            free(msg);
         }
+        stats_latency(cmd, STATS_SERVICE, stats_now_us() - service_start);
+        return cmd;
+    }
 
-        // ---------- UPLOAD ----------
-        if (cmd == CMD_UPLOAD) {
-            char filename[128];
-            sscanf(cmdline, "UPLOAD %127s", filename);
-            strncpy(t.filename, filename, sizeof(t.filename)-1);
+    // ---------- SIGNUP / LOGIN / PROCESS / STATS / TRACE ----------
+    char *msg = request_inline(cmd, user, cmdline, failed);
+    if (msg) {
+        reply(client_fd, msg);
+        free(msg);
+        stats_latency(cmd, STATS_SERVICE, stats_now_us() - service_start);
+        return cmd;
+    }
 
+    if (request_task(&t, cmd, cmdline) != 0) {
+        reply(client_fd, "ERR: Unknown command\n");
+        *failed = 1;
+        return cmd;
+    }
+
+    // ---------- UPLOAD ----------
+    if (cmd == CMD_UPLOAD) {
+        span = trace_begin(trace);
+        if (request_upload_packed(cmdline)) {
+            char wire[REQUEST_MAX_WIRE];
+            size_t wlen = 0;
+            ssize_t rr;
+            while (wlen < sizeof(wire)) {
+                rr = read(client_fd, wire + wlen, sizeof(wire) - wlen);
+                if (rr < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                if (rr == 0) break;
+                wlen += (size_t)rr;
+            }
+            stats_bytes(wlen, 0);
+            if (request_upload_body(&t, 1, wire, wlen) != 0) {
+                reply(client_fd, "ERR: Corrupt or oversized compressed upload\n");
+                *failed = 1;
+                return cmd;
+            }
+        } else {
             // read the remainder of socket as file content (until EOF / client close) up to MAX_PAYLOAD
             ssize_t total = 0;
             ssize_t rr;
@@ -128,69 +175,88 @@ if (client_fd < 0) {
                     break;
                 }
                 if (rr == 0) break; // client closed
+                // checksum each chunk while it is still hot in cache
+                t.crc = crc32c(t.crc, t.data + total, (size_t)rr);
                 total += rr;
                 // keep reading until client closes
             }
             t.data_len = (int)total;
+            stats_bytes((size_t)total, 0);
         }
+        trace_end(trace, TRACE_BODY, span);
+    }
 
-        // ---------- PROCESS ----------
-        else if (cmd == CMD_PROCESS) {
-            strncpy(t.data, cmdline, sizeof(t.data)-1);
-            t.data_len = (int)strlen(t.data);
-        }
+    // Create TaskResult
+    TaskResult *res = task_result_new();
+    if (!res) {
+        reply(client_fd, "ERR: Out of memory\n");
+        *failed = 1;
+        return cmd;
+    }
+    t.result = res;
 
-        // ---------- LIST / DOWNLOAD / DELETE ----------
-        else if (cmd == CMD_LIST || cmd == CMD_DOWNLOAD || cmd == CMD_DELETE) {
-            strncpy(t.data, cmdline, sizeof(t.data)-1);
-            t.data_len = (int)strlen(t.data);
-            if (cmd == CMD_DOWNLOAD || cmd == CMD_DELETE) {
-                sscanf(cmdline, "%*s %127s", t.filename);
-            }
-        }
+    span = trace_begin(trace);
+    if (enqueueTask(&g_task_queue, t) != 0) {
+        task_result_free(res);
+        reply(client_fd, "ERR: Out of memory\n");
+        *failed = 1;
+        return cmd;
+    }
 
-        else {
-            write(client_fd, "ERR: Unknown command\n", 20);
-            close(client_fd);
-            continue;
-        }
+    // Wait for result
+    pthread_mutex_lock(&res->lock);
+    while (!res->done) pthread_cond_wait(&res->cond, &res->lock);
+    pthread_mutex_unlock(&res->lock);
+    trace_end(trace, TRACE_WAIT, span);
+    stats_latency(cmd, STATS_QUEUE_WAIT, res->dequeued_us - res->enqueued_us);
+    stats_latency(cmd, STATS_SERVICE, stats_now_us() - res->dequeued_us);
 
-        // Ensure username default to guest if empty
-        if (strlen(t.username) == 0) strncpy(t.username, "guest", sizeof(t.username)-1);
-
-        // Create TaskResult
-        TaskResult *res = malloc(sizeof(TaskResult));
-        pthread_mutex_init(&res->lock, NULL);
-        pthread_cond_init(&res->cond, NULL);
-        res->done = 0;
-        res->response = NULL;
-        t.result = res;
-
-        enqueueTask(&g_task_queue, t);
-
-        // Wait for result
-        pthread_mutex_lock(&res->lock);
-        while (!res->done) pthread_cond_wait(&res->cond, &res->lock);
-        pthread_mutex_unlock(&res->lock);
-
-        // write response (may be binary for DOWNLOAD but server bundles header+data)
-        if (res->response) {
-            size_t len = strlen(res->response);
-            // For DOWNLOAD the response is header+binary; write with write()
-            write(client_fd, res->response, len);
-        } else {
-            write(client_fd, "ERR: No response\n", 17);
-        }
+    // write response: optional inline header, text response, then the
+    // file body straight from the cache (binary safe, one syscall)
+    struct iovec iov[3];
+    int iovcnt = task_result_iov(res, iov, failed);
+    size_t out = 0;
+    for (int i = 0; i < iovcnt; i++) out += iov[i].iov_len;
+    span = trace_begin(trace);
+    if (iovcnt > 0) {
+        if (writev_all(client_fd, iov, iovcnt) == 0) stats_bytes(0, out);
+    } else {
+        reply(client_fd, "ERR: No response\n");
+        *failed = 1;
+    }
+    trace_end(trace, TRACE_WRITE, span);
+
+    task_result_free(res);
+    return cmd;
+}
+
+void *client_thread_main(void *arg) {
+    (void)arg;
+    trace_thread_name("client");
 
-fprintf(stderr, "[ClientThread] Exiting...\n");
-return NULL;
+// Connections already accepted are served even once shutdown starts;
+// dequeueClient returns -1 when the queue is empty and the server stopping.
+while (1) {
+    ClientConn conn = dequeueClient(&g_client_queue);
+    int client_fd = conn.fd;
+if (client_fd < 0) {
+    /* shutdown requested; exit thread */
+    log_debug("[Client %lu] shutting down thread", (unsigned long)pthread_self());
+    break;
+}
+
+        if (client_fd < 0) continue;
 
-        // cleanup
-        free(res->response);
-        pthread_cond_destroy(&res->cond);
-        pthread_mutex_destroy(&res->lock);
-        free(res);
+        uint64_t start = stats_now_us();
+        if (conn.trace) trace_record(conn.trace, TRACE_CLIENT_QUEUE, conn.accepted_us, start, 0);
+        int failed;
+        CommandType cmd = serve_client(client_fd, conn.trace, &failed);
         close(client_fd);
+        uint64_t end = stats_now_us();
+        stats_gauge_add(STATS_CONNECTIONS, -1);
+        stats_request(cmd, failed);
+        stats_latency(cmd, STATS_TOTAL, end - start);
+        if (conn.trace) trace_record(conn.trace, TRACE_REQUEST, conn.accepted_us, end, cmd);
     }
     return NULL;
 }
@@ -0,0 +1,147 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/xattr.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78u   // reflected Castagnoli polynomial
+
+static uint32_t crc_table[8][256];
+static uint32_t x2n_table[32];          // x^(2^n) mod P
+static uint32_t (*crc_impl)(uint32_t, const unsigned char *, size_t);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_setup(void);
+
+/* ---------- Scalar (slicing-by-8) ---------- */
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w ^= crc;       // little-endian: low 4 bytes fold in the running crc
+        crc = crc_table[7][w & 0xff] ^
+              crc_table[6][(w >> 8) & 0xff] ^
+              crc_table[5][(w >> 16) & 0xff] ^
+              crc_table[4][(w >> 24) & 0xff] ^
+              crc_table[3][(w >> 32) & 0xff] ^
+              crc_table[2][(w >> 40) & 0xff] ^
+              crc_table[1][(w >> 48) & 0xff] ^
+              crc_table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+/* ---------- Combine ---------- */
+
+// a * b mod P, in the reflected bit order CRCs use.
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(n * 2^k) mod P.
+static uint32_t x2nmodp(size_t n, unsigned k) {
+    uint32_t p = 1u << 31;              // x^0
+    while (n) {
+        if (n & 1) p = multmodp(x2n_table[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b) {
+    pthread_once(&crc_once, crc32c_setup);
+    return multmodp(x2nmodp(len_b, 3), crc_a) ^ crc_b;
+}
+
+/* ---------- SSE4.2 ---------- */
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    while (len && ((uintptr_t)p & 7)) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+#endif
+
+static void crc32c_setup(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (int i = 0; i < 256; i++)
+            crc_table[t][i] = crc_table[0][crc_table[t - 1][i] & 0xff] ^ (crc_table[t - 1][i] >> 8);
+    }
+
+    uint32_t p = 1u << 30;              // x^1
+    x2n_table[0] = p;
+    for (int n = 1; n < 32; n++) x2n_table[n] = p = multmodp(p, p);
+
+    crc_impl = crc32c_sw;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) crc_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc_once, crc32c_setup);
+    return ~crc_impl(~crc, buf, len);
+}
+
+/* ---------- Metadata ---------- */
+
+int crc32c_xattr_get(int fd, uint32_t *crc) {
+    char val[16];
+    ssize_t n = fgetxattr(fd, CRC32C_XATTR, val, sizeof(val) - 1);
+    if (n != 8) return -1;
+    val[n] = '\0';
+
+    char *end;
+    unsigned long v = strtoul(val, &end, 16);
+    if (*end != '\0') return -1;
+    *crc = (uint32_t)v;
+    return 0;
+}
+
+int crc32c_xattr_set(int fd, uint32_t crc) {
+    char val[16];
+    snprintf(val, sizeof(val), "%08x", crc);
+    return fsetxattr(fd, CRC32C_XATTR, val, 8, 0);
+}
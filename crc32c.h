@@ -0,0 +1,22 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC32C_XATTR "user.crc32c"      // 8 hex digits on plain files
+
+// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has
+// it and a slicing-by-8 table otherwise; the choice is made once at first
+// use. Incremental: start with crc = 0 and feed the previous result back in.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// CRC of A followed by B, given crc(A), crc(B) and len(B). Lets chunks of a
+// large buffer be checksummed in parallel.
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b);
+
+// Checksum stored alongside a file. Both return 0 on success.
+int crc32c_xattr_get(int fd, uint32_t *crc);
+int crc32c_xattr_set(int fd, uint32_t crc);
+
+#endif
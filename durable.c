@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "durable.h"
+
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+
+static DurableWrite *pending_head = NULL;
+static DurableWrite *pending_tail = NULL;
+static int pending_count = 0;
+
+static pthread_t commit_thread;
+static int commit_running = 0;
+static int commit_delay_ms = DURABLE_DEFAULT_DELAY_MS;
+static atomic_uint tmp_counter = 0;
+
+/* ---------- Helper Functions ---------- */
+
+static int write_all(int fd, const char *data, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t w = write(fd, data + off, len - off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += (size_t)w;
+    }
+    return 0;
+}
+
+/* temp file lives in the same directory so rename() stays atomic; the
+ * leading dot keeps it out of LIST output */
+static void make_tmp_path(char *out, size_t outlen, const char *path) {
+    char dir[512], base[512];
+    strncpy(dir, path, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    strncpy(base, path, sizeof(base) - 1);
+    base[sizeof(base) - 1] = '\0';
+
+    unsigned n = atomic_fetch_add(&tmp_counter, 1);
+    snprintf(out, outlen, "%s/.%s.tmp.%d.%u", dirname(dir), basename(base), (int)getpid(), n);
+}
+
+static void parent_dir(char *out, size_t outlen, const char *path) {
+    char tmp[512];
+    strncpy(tmp, path, sizeof(tmp) - 1);
+    tmp[sizeof(tmp) - 1] = '\0';
+    snprintf(out, outlen, "%s", dirname(tmp));
+}
+
+static int fsync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+/* ---------- Batch Commit ---------- */
+
+static void commit_batch(DurableWrite *batch) {
+    // Phase 1: start writeback for every file in the batch so the device
+    // sees all of it at once instead of one file per fsync round trip.
+    for (DurableWrite *w = batch; w; w = w->next) {
+        sync_file_range(w->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+
+    // Phase 2: wait for the data to be stable.
+    for (DurableWrite *w = batch; w; w = w->next) {
+        if (fdatasync(w->fd) != 0) {
+            perror("fdatasync");
+            w->status = -1;
+        }
+        close(w->fd);
+        w->fd = -1;
+    }
+
+    // Phase 3: publish in submission order.
+    for (DurableWrite *w = batch; w; w = w->next) {
+        if (w->tmp_path[0] == '\0') continue;   // sync-only
+        if (w->status == 0 && w->before_publish) w->before_publish(w->final_path, w->publish_arg);
+        if (w->status == 0 && rename(w->tmp_path, w->final_path) != 0) {
+            perror("rename");
+            w->status = -1;
+        }
+        if (w->status != 0) unlink(w->tmp_path);
+    }
+
+    // Phase 4: one fsync per distinct directory makes the renames durable.
+    char synced[DURABLE_MAX_BATCH][512];
+    int nsynced = 0;
+    for (DurableWrite *w = batch; w; w = w->next) {
+        if (w->status != 0 || w->tmp_path[0] == '\0') continue;
+
+        char dir[512];
+        parent_dir(dir, sizeof(dir), w->final_path);
+
+        int seen = 0;
+        for (int i = 0; i < nsynced; i++) {
+            if (strcmp(synced[i], dir) == 0) { seen = 1; break; }
+        }
+        if (seen) continue;
+
+        if (fsync_dir(dir) != 0) perror("fsync dir");
+        if (nsynced < DURABLE_MAX_BATCH) {
+            strncpy(synced[nsynced], dir, sizeof(synced[nsynced]) - 1);
+            synced[nsynced][sizeof(synced[nsynced]) - 1] = '\0';
+            nsynced++;
+        }
+    }
+}
+
+static void deadline_after_ms(struct timespec *ts, int ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void *commit_thread_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&commit_lock);
+    while (1) {
+        while (pending_count == 0 && commit_running) {
+            pthread_cond_wait(&commit_work, &commit_lock);
+        }
+        if (pending_count == 0 && !commit_running) break;
+
+        // Give concurrent uploads a short window to join this batch.
+        if (commit_delay_ms > 0 && commit_running) {
+            struct timespec deadline;
+            deadline_after_ms(&deadline, commit_delay_ms);
+            while (pending_count < DURABLE_MAX_BATCH && commit_running) {
+                if (pthread_cond_timedwait(&commit_work, &commit_lock, &deadline) == ETIMEDOUT)
+                    break;
+            }
+        }
+
+        // Take at most DURABLE_MAX_BATCH entries off the front.
+        DurableWrite *batch = pending_head;
+        DurableWrite *last = batch;
+        int n = 1;
+        while (last->next && n < DURABLE_MAX_BATCH) {
+            last = last->next;
+            n++;
+        }
+        pending_head = last->next;
+        if (!pending_head) pending_tail = NULL;
+        pending_count -= n;
+        last->next = NULL;
+        pthread_mutex_unlock(&commit_lock);
+
+        commit_batch(batch);
+
+        pthread_mutex_lock(&commit_lock);
+        for (DurableWrite *w = batch; w; ) {
+            DurableWrite *next = w->next;   // w may be gone once done is set
+            w->done = 1;
+            w = next;
+        }
+        pthread_cond_broadcast(&commit_done);
+    }
+    pthread_mutex_unlock(&commit_lock);
+    return NULL;
+}
+
+static int enqueue_write(DurableWrite *w) {
+    pthread_mutex_lock(&commit_lock);
+    if (!commit_running) {
+        pthread_mutex_unlock(&commit_lock);
+        close(w->fd);
+        if (w->tmp_path[0] != '\0') unlink(w->tmp_path);
+        return -1;
+    }
+    if (pending_tail)
+        pending_tail->next = w;
+    else
+        pending_head = w;
+    pending_tail = w;
+    pending_count++;
+    pthread_cond_signal(&commit_work);
+    pthread_mutex_unlock(&commit_lock);
+    return 0;
+}
+
+/* ---------- Public API ---------- */
+
+void durable_init(int max_delay_ms) {
+    pthread_mutex_lock(&commit_lock);
+    commit_delay_ms = max_delay_ms >= 0 ? max_delay_ms : DURABLE_DEFAULT_DELAY_MS;
+    commit_running = 1;
+    pthread_mutex_unlock(&commit_lock);
+
+    pthread_create(&commit_thread, NULL, commit_thread_main, NULL);
+}
+
+void durable_destroy(void) {
+    pthread_mutex_lock(&commit_lock);
+    if (!commit_running) {
+        pthread_mutex_unlock(&commit_lock);
+        return;
+    }
+    commit_running = 0;
+    pthread_cond_broadcast(&commit_work);
+    pthread_mutex_unlock(&commit_lock);
+
+    // The thread flushes whatever is still pending before it exits.
+    pthread_join(commit_thread, NULL);
+}
+
+int durable_begin(DurableWrite *w, const char *path, const char *data, size_t len) {
+    if (durable_prepare(w, path, data, len) != 0) return -1;
+    return durable_submit(w);
+}
+
+int durable_prepare(DurableWrite *w, const char *path, const char *data, size_t len) {
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+    strncpy(w->final_path, path, sizeof(w->final_path) - 1);
+    make_tmp_path(w->tmp_path, sizeof(w->tmp_path), path);
+
+    w->fd = open(w->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) {
+        perror("open");
+        return -1;
+    }
+    if (write_all(w->fd, data, len) != 0) {
+        perror("write");
+        close(w->fd);
+        unlink(w->tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int durable_submit(DurableWrite *w) {
+    return enqueue_write(w);
+}
+
+int durable_begin_sync(DurableWrite *w, int fd) {
+    memset(w, 0, sizeof(*w));
+    w->fd = dup(fd);
+    if (w->fd < 0) {
+        perror("dup");
+        return -1;
+    }
+    return enqueue_write(w);
+}
+
+int durable_wait(DurableWrite *w) {
+    pthread_mutex_lock(&commit_lock);
+    while (!w->done) pthread_cond_wait(&commit_done, &commit_lock);
+    pthread_mutex_unlock(&commit_lock);
+    return w->status;
+}
+
+int durable_write_file(const char *path, const char *data, size_t len) {
+    DurableWrite w;
+    if (durable_begin(&w, path, data, len) != 0) return -1;
+    return durable_wait(&w);
+}
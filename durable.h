@@ -0,0 +1,56 @@
+#ifndef DURABLE_H
+#define DURABLE_H
+
+#include <stddef.h>
+
+#define DURABLE_DEFAULT_DELAY_MS 2
+#define DURABLE_MAX_BATCH 64
+
+// One pending crash-safe write. The data goes to a hidden temp file next to
+// the target; the group-commit thread fsyncs it, renames it over the target
+// and fsyncs the directory. Sync-only entries (empty tmp_path) just get
+// their data flushed. Lives on the caller's stack between
+// durable_begin() and durable_wait().
+typedef void (*durable_publish_fn)(const char *final_path, void *arg);
+
+typedef struct DurableWrite {
+    int fd;
+    char tmp_path[512];
+    char final_path[512];
+    int status;                 // 0 = committed, -1 = failed
+    int done;
+    durable_publish_fn before_publish;  // optional, see durable_prepare()
+    void *publish_arg;
+    struct DurableWrite *next;
+} DurableWrite;
+
+// Start/stop the group-commit thread. max_delay_ms is how long the thread
+// waits for more writers to join a batch before flushing it.
+void durable_init(int max_delay_ms);
+void durable_destroy(void);
+
+// Write data to a temp file and queue it for commit (returns -1 on error).
+// The caller may drop its locks after this returns: commits are applied in
+// submission order, so later writes to the same path still win.
+int durable_begin(DurableWrite *w, const char *path, const char *data, size_t len);
+
+// durable_begin() in two steps. durable_prepare() writes the temp file and
+// leaves w->fd open, so the caller can attach metadata (xattrs) to it or
+// set w->before_publish; durable_submit() queues it. before_publish is
+// called from the commit thread, in submission order, right before the
+// rename replaces whatever is at final_path (e.g. to keep the old version).
+int durable_prepare(DurableWrite *w, const char *path, const char *data, size_t len);
+int durable_submit(DurableWrite *w);
+
+// Block until the write has been committed. Returns 0 on success.
+int durable_wait(DurableWrite *w);
+
+// Queue an fdatasync of an already-written file (e.g. an append-only
+// segment) in the next batch. The fd is dup'd, so the caller may close
+// its copy at any time.
+int durable_begin_sync(DurableWrite *w, int fd);
+
+// Convenience wrapper: begin + wait.
+int durable_write_file(const char *path, const char *data, size_t len);
+
+#endif
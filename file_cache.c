@@ -0,0 +1,286 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "file_cache.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    CachedFile *buckets[FILE_CACHE_BUCKETS];
+    CachedFile *hand;               // CLOCK hand into the ring
+    size_t bytes, budget, entries;
+    unsigned long generation;       // bumped by every invalidation
+} CacheShard;
+
+static CacheShard shards[FILE_CACHE_SHARDS];
+static int cache_ready = 0;
+
+static atomic_ulong stat_hits = 0;
+static atomic_ulong stat_misses = 0;
+static atomic_ulong stat_evictions = 0;
+static atomic_ulong stat_invalidations = 0;
+
+/* ---------- Helper Functions ---------- */
+
+static uint32_t hash_key(const char *key) {
+    uint32_t h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void make_key(char *out, size_t outlen, const char *user, const char *name) {
+    snprintf(out, outlen, "%s/%s", (user && strlen(user)) ? user : "guest", name);
+}
+
+static void free_entry(CachedFile *f) {
+    if (f->mapped)
+        munmap((void *)f->data, f->len);
+    else
+        free((void *)f->data);
+    free(f->packed);
+    free(f);
+}
+
+// Detach an entry from the table; the table's reference is dropped by the
+// caller after the shard lock is released.
+static void unlink_entry(CacheShard *s, CachedFile *f, uint32_t h) {
+    CachedFile **pp = &s->buckets[(h / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS];
+    while (*pp && *pp != f) pp = &(*pp)->hnext;
+    if (*pp) *pp = f->hnext;
+
+    if (f->cnext == f) {
+        s->hand = NULL;
+    } else {
+        f->cprev->cnext = f->cnext;
+        f->cnext->cprev = f->cprev;
+        if (s->hand == f) s->hand = f->cnext;
+    }
+    f->cnext = f->cprev = NULL;
+    f->cached = 0;
+    s->bytes -= f->len + f->packed_len;
+    s->entries--;
+}
+
+// CLOCK: sweep, clearing reference bits, until 'incoming' more bytes fit.
+// Evicted entries are chained on *victims; their table references are
+// dropped with release_victims() once the shard lock is released.
+static void clock_evict(CacheShard *s, size_t incoming, CachedFile **victims) {
+    while (s->bytes + incoming > s->budget && s->hand) {
+        CachedFile *v = s->hand;
+        if (v->referenced) {
+            v->referenced = 0;
+            s->hand = v->cnext;
+            continue;
+        }
+        unlink_entry(s, v, hash_key(v->key));
+        v->hnext = *victims;
+        *victims = v;
+        atomic_fetch_add(&stat_evictions, 1);
+    }
+}
+
+static void release_victims(CachedFile *victims) {
+    while (victims) {
+        CachedFile *next = victims->hnext;
+        file_cache_release(victims);
+        victims = next;
+    }
+}
+
+/* ---------- Public API ---------- */
+
+void file_cache_init(size_t max_bytes) {
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        memset(&shards[i], 0, sizeof(shards[i]));
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].budget = max_bytes / FILE_CACHE_SHARDS;
+    }
+    cache_ready = 1;
+}
+
+void file_cache_destroy(void) {
+    if (!cache_ready) return;
+    cache_ready = 0;
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        CacheShard *s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        for (int b = 0; b < FILE_CACHE_BUCKETS; b++) {
+            CachedFile *f = s->buckets[b];
+            while (f) {
+                CachedFile *next = f->hnext;
+                free_entry(f);
+                f = next;
+            }
+            s->buckets[b] = NULL;
+        }
+        s->hand = NULL;
+        s->bytes = s->entries = 0;
+        pthread_mutex_unlock(&s->lock);
+        pthread_mutex_destroy(&s->lock);
+    }
+}
+
+CachedFile *file_cache_lookup(const char *user, const char *name, unsigned long *gen) {
+    char key[200];
+    make_key(key, sizeof(key), user, name);
+    uint32_t h = hash_key(key);
+    CacheShard *s = &shards[h % FILE_CACHE_SHARDS];
+
+    pthread_mutex_lock(&s->lock);
+    CachedFile *f = s->buckets[(h / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS];
+    while (f && strcmp(f->key, key) != 0) f = f->hnext;
+    if (f) {
+        atomic_fetch_add(&f->refs, 1);
+        f->referenced = 1;
+    }
+    if (gen) *gen = s->generation;
+    pthread_mutex_unlock(&s->lock);
+
+    atomic_fetch_add(f ? &stat_hits : &stat_misses, 1);
+    return f;
+}
+
+CachedFile *file_cache_insert(const char *user, const char *name, unsigned long gen,
+                              const char *data, size_t len, uint32_t crc, int mapped) {
+    CachedFile *f = calloc(1, sizeof(CachedFile));
+    if (!f) {
+        if (mapped) munmap((void *)data, len);
+        else free((void *)data);
+        return NULL;
+    }
+    make_key(f->key, sizeof(f->key), user, name);
+    f->data = data;
+    f->len = len;
+    f->crc = crc;
+    f->mapped = mapped;
+    atomic_init(&f->refs, 1);   // the caller's reference
+
+    uint32_t h = hash_key(f->key);
+    CacheShard *s = &shards[h % FILE_CACHE_SHARDS];
+    CachedFile *victims = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    // A file changed since our lookup, or too big to share the shard: hand
+    // back an uncached entry that dies with the reader.
+    if (!cache_ready || gen != s->generation || len > s->budget / 4) {
+        pthread_mutex_unlock(&s->lock);
+        return f;
+    }
+
+    // Someone else loaded it first: use theirs.
+    CachedFile *cur = s->buckets[(h / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS];
+    while (cur && strcmp(cur->key, f->key) != 0) cur = cur->hnext;
+    if (cur) {
+        atomic_fetch_add(&cur->refs, 1);
+        pthread_mutex_unlock(&s->lock);
+        free_entry(f);
+        return cur;
+    }
+
+    clock_evict(s, len, &victims);
+
+    size_t b = (h / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS;
+    f->hnext = s->buckets[b];
+    s->buckets[b] = f;
+    if (s->hand) {
+        // insert just behind the hand so it is the last to be swept
+        f->cnext = s->hand;
+        f->cprev = s->hand->cprev;
+        s->hand->cprev->cnext = f;
+        s->hand->cprev = f;
+    } else {
+        f->cnext = f->cprev = f;
+        s->hand = f;
+    }
+    f->cached = 1;
+    atomic_fetch_add(&f->refs, 1);   // the table's reference
+    s->bytes += len;
+    s->entries++;
+    pthread_mutex_unlock(&s->lock);
+
+    release_victims(victims);
+    return f;
+}
+
+void file_cache_release(CachedFile *f) {
+    if (f && atomic_fetch_sub(&f->refs, 1) == 1) free_entry(f);
+}
+
+int file_cache_packed(CachedFile *f, file_cache_pack_fn pack, const char **out, size_t *out_len) {
+    CacheShard *s = &shards[hash_key(f->key) % FILE_CACHE_SHARDS];
+
+    pthread_mutex_lock(&s->lock);
+    char *packed = f->packed;
+    size_t packed_len = f->packed_len;
+    pthread_mutex_unlock(&s->lock);
+
+    if (!packed) {
+        // Compress outside the lock; if another reader beat us to it, keep
+        // theirs.
+        char *mine;
+        size_t mine_len;
+        if (pack(f->data, f->len, &mine, &mine_len) != 0) return -1;
+
+        // The packed copy counts against the budget like the data does.
+        // The caller holds a reference, so f survives being swept itself.
+        CachedFile *victims = NULL;
+        pthread_mutex_lock(&s->lock);
+        if (!f->packed) {
+            f->packed = mine;
+            f->packed_len = mine_len;
+            if (f->cached) {
+                s->bytes += mine_len;
+                clock_evict(s, 0, &victims);
+            }
+            mine = NULL;
+        }
+        packed = f->packed;
+        packed_len = f->packed_len;
+        pthread_mutex_unlock(&s->lock);
+        release_victims(victims);
+        free(mine);
+    }
+
+    *out = packed;
+    *out_len = packed_len;
+    return 0;
+}
+
+void file_cache_invalidate(const char *user, const char *name) {
+    char key[200];
+    make_key(key, sizeof(key), user, name);
+    uint32_t h = hash_key(key);
+    CacheShard *s = &shards[h % FILE_CACHE_SHARDS];
+
+    pthread_mutex_lock(&s->lock);
+    s->generation++;
+    CachedFile *f = s->buckets[(h / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS];
+    while (f && strcmp(f->key, key) != 0) f = f->hnext;
+    if (f) unlink_entry(s, f, h);
+    pthread_mutex_unlock(&s->lock);
+
+    if (f) {
+        atomic_fetch_add(&stat_invalidations, 1);
+        file_cache_release(f);
+    }
+}
+
+void file_cache_stats(FileCacheStats *out) {
+    memset(out, 0, sizeof(*out));
+    out->hits = atomic_load(&stat_hits);
+    out->misses = atomic_load(&stat_misses);
+    out->evictions = atomic_load(&stat_evictions);
+    out->invalidations = atomic_load(&stat_invalidations);
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        out->bytes += shards[i].bytes;
+        out->max_bytes += shards[i].budget;
+        out->entries += shards[i].entries;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_BUCKETS 256          // hash buckets per shard
+#define FILE_CACHE_DEFAULT_MB 256
+
+// One cached file body: an mmap of a plain file or a heap copy of a segment
+// store entry. Readers get a reference from file_cache_lookup()/insert and
+// must hand it back with file_cache_release(); an entry that is evicted or
+// invalidated while in use is freed by its last reader.
+typedef struct CachedFile {
+    char key[200];                      // "user/filename"
+    const char *data;
+    size_t len;
+    uint32_t crc;                       // CRC32C of data
+    char *packed;                       // compressed copy, see file_cache_packed()
+    size_t packed_len;
+    int mapped;                         // 1 = munmap on free, 0 = free()
+    int cached;                         // still owned by the table
+    int referenced;                     // CLOCK bit
+    atomic_int refs;
+    struct CachedFile *hnext;           // hash chain
+    struct CachedFile *cnext, *cprev;   // CLOCK ring
+} CachedFile;
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;
+    size_t bytes;
+    size_t max_bytes;
+    size_t entries;
+} FileCacheStats;
+
+void file_cache_init(size_t max_bytes);
+void file_cache_destroy(void);
+
+// Referenced entry on a hit, NULL on a miss. *gen receives the shard
+// generation to pass to file_cache_insert() after loading the file.
+CachedFile *file_cache_lookup(const char *user, const char *name, unsigned long *gen);
+
+// Wrap a loaded body in an entry (taking ownership of data) and cache it,
+// unless the key was invalidated since the lookup or the body is too big.
+// Always returns a referenced entry (NULL only on allocation failure).
+CachedFile *file_cache_insert(const char *user, const char *name, unsigned long gen,
+                              const char *data, size_t len, uint32_t crc, int mapped);
+
+void file_cache_release(CachedFile *f);
+
+// Compressed copy of an entry's body, made once with pack() and kept for as
+// long as the entry lives (counted against the cache budget), so hot files
+// are not recompressed for every DOWNLOAD. *out stays valid while the
+// caller holds its reference. Returns 0 on success.
+typedef int (*file_cache_pack_fn)(const char *data, size_t len, char **out, size_t *out_len);
+int file_cache_packed(CachedFile *f, file_cache_pack_fn pack, const char **out, size_t *out_len);
+
+// Drop the cached copy after UPLOAD/DELETE changed the file.
+void file_cache_invalidate(const char *user, const char *name);
+
+void file_cache_stats(FileCacheStats *out);
+
+#endif
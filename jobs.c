@@ -0,0 +1,387 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "jobs.h"
+
+#define JOBS_BUCKETS 256
+
+typedef enum { JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_FAILED, JOB_CANCELLED } JobState;
+
+static const char *state_names[] = { "QUEUED", "RUNNING", "DONE", "FAILED", "CANCELLED" };
+
+struct Job {
+    uint64_t id;
+    char user[64];
+    JobState state;
+    int cancel;
+    char result[256];
+    time_t finished;
+    job_fn fn;
+    void *arg;
+    void (*free_arg)(void *);
+    struct Job *hnext;          // id table
+    struct Job *qnext;          // run queue
+};
+
+static Job *job_table[JOBS_BUCKETS];
+static Job *queue_head = NULL, *queue_tail = NULL;
+static int job_count = 0;
+static uint64_t next_id = 1;
+
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_work = PTHREAD_COND_INITIALIZER;      // queue non-empty
+static pthread_cond_t jobs_changed = PTHREAD_COND_INITIALIZER;   // a job finished/cancelled
+
+static pthread_t *executors = NULL;
+static int executor_count = 0;
+static int jobs_running = 0;
+
+// Connections parked by jobs_wait_fd, answered by the waiter thread.
+typedef struct Waiter {
+    int fd;
+    uint64_t id;
+    struct timespec deadline;
+    struct Waiter *next;
+} Waiter;
+
+static Waiter *waiters = NULL;
+static int waiter_count = 0;
+static int waiters_running = 0;
+static pthread_t waiter_thread;
+
+/* ---------- Helper Functions ---------- */
+
+// Caller holds jobs_lock.
+static Job *find_job(uint64_t id) {
+    Job *j = job_table[id % JOBS_BUCKETS];
+    while (j && j->id != id) j = j->hnext;
+    return j;
+}
+
+static void release_arg(Job *j) {
+    if (j->free_arg && j->arg) j->free_arg(j->arg);
+    j->arg = NULL;
+}
+
+// Drop finished jobs past their TTL. Caller holds jobs_lock.
+static void expire_jobs(time_t now) {
+    for (int b = 0; b < JOBS_BUCKETS; b++) {
+        Job **pp = &job_table[b];
+        while (*pp) {
+            Job *j = *pp;
+            if (j->state >= JOB_DONE && now - j->finished > JOBS_RESULT_TTL) {
+                *pp = j->hnext;
+                free(j);
+                job_count--;
+            } else {
+                pp = &j->hnext;
+            }
+        }
+    }
+}
+
+static void deadline_after(struct timespec *ts, int ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int deadline_passed(const struct timespec *ts, const struct timespec *now) {
+    return now->tv_sec > ts->tv_sec || (now->tv_sec == ts->tv_sec && now->tv_nsec >= ts->tv_nsec);
+}
+
+// "JOB <id> <STATE> [result]\n". Caller holds jobs_lock.
+static void status_line(const Job *j, char *buf, size_t len) {
+    snprintf(buf, len, "JOB %llu %s%s%s\n", (unsigned long long)j->id, state_names[j->state],
+             j->result[0] ? " " : "", j->result);
+}
+
+/* ---------- Executor ---------- */
+
+static void *executor_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&jobs_lock);
+    while (1) {
+        while (!queue_head && jobs_running) pthread_cond_wait(&jobs_work, &jobs_lock);
+        if (!queue_head) break;     // shutting down and nothing left
+
+        Job *j = queue_head;
+        queue_head = j->qnext;
+        if (!queue_head) queue_tail = NULL;
+        j->state = JOB_RUNNING;
+        pthread_mutex_unlock(&jobs_lock);
+
+        char result[sizeof(j->result)] = "";
+        int rc = j->fn(j, j->arg, result, sizeof(result));
+        release_arg(j);
+
+        pthread_mutex_lock(&jobs_lock);
+        j->state = j->cancel ? JOB_CANCELLED : (rc == 0 ? JOB_DONE : JOB_FAILED);
+        memcpy(j->result, result, sizeof(j->result));
+        j->finished = time(NULL);
+        pthread_cond_broadcast(&jobs_changed);
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    return NULL;
+}
+
+/* ---------- Waiter ---------- */
+
+// Answers parked waiters once their job finishes or their time is up. The
+// reply is one short line on a socket that has sent nothing yet, so a
+// non-blocking send never comes up short in practice.
+static void *waiter_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&jobs_lock);
+    while (waiters_running || waiters) {
+        struct timespec now, next;
+        clock_gettime(CLOCK_REALTIME, &now);
+        deadline_after(&next, 60 * 1000);
+
+        Waiter *ready = NULL;
+        for (Waiter **pp = &waiters; *pp;) {
+            Waiter *w = *pp;
+            Job *j = find_job(w->id);
+            if (j && j->state < JOB_DONE && waiters_running && !deadline_passed(&w->deadline, &now)) {
+                if (deadline_passed(&w->deadline, &next)) next = w->deadline;
+                pp = &w->next;
+                continue;
+            }
+            *pp = w->next;
+            waiter_count--;
+            char line[400];
+            if (j)
+                status_line(j, line, sizeof(line));
+            else
+                snprintf(line, sizeof(line), "ERR: No such job %llu\n", (unsigned long long)w->id);
+            send(w->fd, line, strlen(line), MSG_NOSIGNAL | MSG_DONTWAIT);
+            w->next = ready;
+            ready = w;
+        }
+        if (!ready && waiters_running)
+            pthread_cond_timedwait(&jobs_changed, &jobs_lock, &next);
+
+        pthread_mutex_unlock(&jobs_lock);
+        while (ready) {
+            Waiter *next_ready = ready->next;
+            close(ready->fd);
+            free(ready);
+            ready = next_ready;
+        }
+        pthread_mutex_lock(&jobs_lock);
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    return NULL;
+}
+
+/* ---------- Public API ---------- */
+
+void jobs_init(int max_running) {
+    if (max_running <= 0) max_running = JOBS_DEFAULT_RUNNING;
+    executors = calloc((size_t)max_running, sizeof(pthread_t));
+    if (!executors) {
+        fprintf(stderr, "Memory alloc failed in jobs_init\n");
+        return;
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    jobs_running = 1;
+    pthread_mutex_unlock(&jobs_lock);
+
+    executor_count = max_running;
+    for (int i = 0; i < executor_count; i++)
+        pthread_create(&executors[i], NULL, executor_main, NULL);
+
+    pthread_mutex_lock(&jobs_lock);
+    waiters_running = pthread_create(&waiter_thread, NULL, waiter_main, NULL) == 0;
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+void jobs_destroy(void) {
+    // Cancel everything: queued jobs never start, running ones stop early.
+    pthread_mutex_lock(&jobs_lock);
+    jobs_running = 0;
+    for (int b = 0; b < JOBS_BUCKETS; b++) {
+        for (Job *j = job_table[b]; j; j = j->hnext) j->cancel = 1;
+    }
+    for (Job *j = queue_head; j; j = j->qnext) j->state = JOB_CANCELLED;
+    Job *queued = queue_head;
+    queue_head = queue_tail = NULL;
+    pthread_cond_broadcast(&jobs_work);
+    pthread_cond_broadcast(&jobs_changed);
+    pthread_mutex_unlock(&jobs_lock);
+
+    for (int i = 0; i < executor_count; i++) pthread_join(executors[i], NULL);
+    free(executors);
+    executors = NULL;
+    executor_count = 0;
+
+    // Every job has stopped by now; waiters get its final state.
+    pthread_mutex_lock(&jobs_lock);
+    int had_waiter = waiters_running;
+    waiters_running = 0;
+    pthread_cond_broadcast(&jobs_changed);
+    pthread_mutex_unlock(&jobs_lock);
+    if (had_waiter) pthread_join(waiter_thread, NULL);
+
+    for (Job *j = queued; j; j = j->qnext) release_arg(j);
+    pthread_mutex_lock(&jobs_lock);
+    for (int b = 0; b < JOBS_BUCKETS; b++) {
+        Job *j = job_table[b];
+        while (j) {
+            Job *next = j->hnext;
+            free(j);
+            j = next;
+        }
+        job_table[b] = NULL;
+    }
+    job_count = 0;
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+uint64_t jobs_submit(const char *user, job_fn fn, void *arg, void (*free_arg)(void *)) {
+    pthread_mutex_lock(&jobs_lock);
+    expire_jobs(time(NULL));
+    Job *j = NULL;
+    if (jobs_running && job_count < JOBS_MAX_PENDING) j = calloc(1, sizeof(Job));
+    if (!j) {
+        pthread_mutex_unlock(&jobs_lock);
+        if (free_arg && arg) free_arg(arg);
+        return 0;
+    }
+
+    j->id = next_id++;
+    strncpy(j->user, user, sizeof(j->user) - 1);
+    j->state = JOB_QUEUED;
+    j->fn = fn;
+    j->arg = arg;
+    j->free_arg = free_arg;
+
+    j->hnext = job_table[j->id % JOBS_BUCKETS];
+    job_table[j->id % JOBS_BUCKETS] = j;
+    job_count++;
+
+    if (queue_tail) queue_tail->qnext = j;
+    else queue_head = j;
+    queue_tail = j;
+    pthread_cond_signal(&jobs_work);
+
+    uint64_t id = j->id;
+    pthread_mutex_unlock(&jobs_lock);
+    return id;
+}
+
+int jobs_cancelled(Job *job) {
+    pthread_mutex_lock(&jobs_lock);
+    int c = job->cancel;
+    pthread_mutex_unlock(&jobs_lock);
+    return c;
+}
+
+int jobs_sleep(Job *job, int ms) {
+    struct timespec deadline;
+    deadline_after(&deadline, ms);
+
+    pthread_mutex_lock(&jobs_lock);
+    while (!job->cancel) {
+        if (pthread_cond_timedwait(&jobs_changed, &jobs_lock, &deadline) == ETIMEDOUT) break;
+    }
+    int ok = !job->cancel;
+    pthread_mutex_unlock(&jobs_lock);
+    return ok;
+}
+
+char *jobs_status(const char *user, uint64_t id, int wait_secs) {
+    if (wait_secs > JOBS_WAIT_MAX) wait_secs = JOBS_WAIT_MAX;
+    struct timespec deadline;
+    deadline_after(&deadline, wait_secs * 1000);
+
+    char buf[400];
+    pthread_mutex_lock(&jobs_lock);
+    expire_jobs(time(NULL));
+    Job *j = find_job(id);
+    if (!j || strcmp(j->user, user) != 0) {
+        pthread_mutex_unlock(&jobs_lock);
+        snprintf(buf, sizeof(buf), "ERR: No such job %llu\n", (unsigned long long)id);
+        return strdup(buf);
+    }
+
+    // The job cannot expire while we wait: expiry only runs under this lock
+    // and needs the job finished for a full TTL.
+    while (wait_secs > 0 && j->state < JOB_DONE) {
+        if (pthread_cond_timedwait(&jobs_changed, &jobs_lock, &deadline) == ETIMEDOUT) break;
+    }
+
+    status_line(j, buf, sizeof(buf));
+    pthread_mutex_unlock(&jobs_lock);
+    return strdup(buf);
+}
+
+int jobs_cancel(const char *user, uint64_t id) {
+    pthread_mutex_lock(&jobs_lock);
+    Job *j = find_job(id);
+    if (!j || strcmp(j->user, user) != 0 || j->state >= JOB_DONE) {
+        pthread_mutex_unlock(&jobs_lock);
+        return -1;
+    }
+
+    j->cancel = 1;
+    Job *unqueued = NULL;
+    if (j->state == JOB_QUEUED) {
+        // Never started: take it off the run queue and finish it here.
+        Job *prev = NULL;
+        for (Job *q = queue_head; q; prev = q, q = q->qnext) {
+            if (q != j) continue;
+            if (prev) prev->qnext = q->qnext;
+            else queue_head = q->qnext;
+            if (queue_tail == q) queue_tail = prev;
+            break;
+        }
+        j->state = JOB_CANCELLED;
+        j->finished = time(NULL);
+        unqueued = j;
+    }
+    pthread_cond_broadcast(&jobs_changed);
+    pthread_mutex_unlock(&jobs_lock);
+
+    // Safe outside the lock: a cancelled queued job is never touched by an
+    // executor, and expiry leaves it alone for a full TTL.
+    if (unqueued) release_arg(unqueued);
+    return 0;
+}
+
+char *jobs_wait_fd(const char *user, uint64_t id, int wait_secs, int fd) {
+    if (wait_secs > JOBS_WAIT_MAX) wait_secs = JOBS_WAIT_MAX;
+
+    pthread_mutex_lock(&jobs_lock);
+    Job *j = find_job(id);
+    Waiter *w = NULL;
+    if (j && strcmp(j->user, user) == 0 && j->state < JOB_DONE && waiters_running &&
+        waiter_count < JOBS_MAX_WAITERS)
+        w = malloc(sizeof(Waiter));
+    if (!w) {
+        // Gone, finished or no room: answer now.
+        pthread_mutex_unlock(&jobs_lock);
+        return jobs_status(user, id, 0);
+    }
+    w->fd = fd;
+    w->id = id;
+    deadline_after(&w->deadline, wait_secs * 1000);
+    w->next = waiters;
+    waiters = w;
+    waiter_count++;
+    pthread_cond_broadcast(&jobs_changed);      // the waiter may need an earlier wakeup
+    pthread_mutex_unlock(&jobs_lock);
+    return NULL;
+}
@@ -0,0 +1,50 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOBS_DEFAULT_RUNNING 4          // executor threads
+#define JOBS_MAX_PENDING 1024           // queued + running + retained, per server
+#define JOBS_RESULT_TTL 600             // seconds a finished job stays queryable
+#define JOBS_WAIT_MAX 30                // longest JOB WAIT, in seconds
+#define JOBS_MAX_WAITERS 1024           // connections parked in JOB WAIT
+
+// Asynchronous jobs for PROCESS. Submitting returns an id at once; the job
+// runs on a small executor pool, so no connection or request thread is tied
+// up while it works. Finished jobs keep their result line for
+// JOBS_RESULT_TTL seconds. Jobs belong to the user that submitted them.
+
+typedef struct Job Job;
+
+// Work function. Writes a one-line result (no newline) into result and
+// returns 0 on success; long-running work should poll jobs_cancelled().
+typedef int (*job_fn)(Job *job, void *arg, char *result, size_t result_len);
+
+void jobs_init(int max_running);
+void jobs_destroy(void);
+
+// Queue a job. arg is released with free_arg (may be NULL) once the job is
+// done or cancelled. Returns the job id, or 0 if too many jobs are pending.
+uint64_t jobs_submit(const char *user, job_fn fn, void *arg, void (*free_arg)(void *));
+
+int jobs_cancelled(Job *job);
+
+// Sleep for ms unless the job is cancelled first. Returns 0 if cancelled.
+int jobs_sleep(Job *job, int ms);
+
+// "JOB <id> <STATE> [result]\n" for the caller's job (malloc'd). wait_secs
+// > 0 blocks until the job finishes or the time is up.
+char *jobs_status(const char *user, uint64_t id, int wait_secs);
+
+// JOB WAIT without holding a request thread: fd (the caller's own copy of
+// the connection) is parked until the job finishes or wait_secs pass, then
+// the waiter thread writes the status line to it and closes it. Returns
+// NULL once parked; otherwise (no such job, already finished, too many
+// waiters) the malloc'd reply to send now, and fd stays the caller's.
+char *jobs_wait_fd(const char *user, uint64_t id, int wait_secs, int fd);
+
+// Returns 0 if the job existed and was queued or running.
+int jobs_cancel(const char *user, uint64_t id);
+
+#endif
@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kernels.h"
+#include "crc32c.h"
+#include "lz.h"
+
+/* ---------- Parallel Runner ---------- */
+
+typedef struct ParallelRun ParallelRun;
+typedef int (*chunk_fn)(ParallelRun *run, size_t idx, size_t start, size_t end);
+
+struct ParallelRun {
+    const char *data;
+    size_t len;
+    size_t nchunks;
+    atomic_size_t next;
+    atomic_int failed;
+    const KernelCtx *ctx;
+    chunk_fn fn;
+    void *state;                // kernel-specific per-chunk results
+};
+
+static void *parallel_worker(void *arg) {
+    ParallelRun *run = arg;
+    size_t idx;
+    while (!atomic_load(&run->failed) &&
+           (idx = atomic_fetch_add(&run->next, 1)) < run->nchunks) {
+        if (run->ctx && run->ctx->cancelled && run->ctx->cancelled(run->ctx->arg)) {
+            atomic_store(&run->failed, 1);
+            break;
+        }
+        size_t start = idx * KERNEL_CHUNK;
+        size_t end = start + KERNEL_CHUNK < run->len ? start + KERNEL_CHUNK : run->len;
+        if (run->fn(run, idx, start, end) != 0) atomic_store(&run->failed, 1);
+    }
+    return NULL;
+}
+
+// Run fn over every chunk on up to one thread per core (the caller's thread
+// included). Returns 0 if every chunk succeeded.
+static int parallel_for(ParallelRun *run) {
+    run->nchunks = (run->len + KERNEL_CHUNK - 1) / KERNEL_CHUNK;
+    atomic_init(&run->next, 0);
+    atomic_init(&run->failed, 0);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = cores > 0 ? (size_t)cores : 1;
+    if (nthreads > KERNEL_MAX_THREADS) nthreads = KERNEL_MAX_THREADS;
+    if (nthreads > run->nchunks) nthreads = run->nchunks;
+
+    pthread_t threads[KERNEL_MAX_THREADS];
+    size_t started = 0;
+    for (size_t i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, parallel_worker, run) != 0) break;
+        started++;
+    }
+    parallel_worker(run);
+    for (size_t i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    return atomic_load(&run->failed) ? -1 : 0;
+}
+
+/* ---------- Checksum ---------- */
+
+static int checksum_chunk(ParallelRun *run, size_t idx, size_t start, size_t end) {
+    uint32_t *crcs = run->state;
+    crcs[idx] = crc32c(0, run->data + start, end - start);
+    return 0;
+}
+
+int kernel_checksum(const char *data, size_t len, const KernelCtx *ctx, uint32_t *crc) {
+    ParallelRun run = { .data = data, .len = len, .ctx = ctx, .fn = checksum_chunk };
+    size_t nchunks = (len + KERNEL_CHUNK - 1) / KERNEL_CHUNK;
+    uint32_t *crcs = calloc(nchunks ? nchunks : 1, sizeof(uint32_t));
+    if (!crcs) return -1;
+    run.state = crcs;
+
+    if (parallel_for(&run) != 0) {
+        free(crcs);
+        return -1;
+    }
+
+    uint32_t c = 0;
+    for (size_t i = 0; i < nchunks; i++) {
+        size_t clen = (i + 1) * KERNEL_CHUNK < len ? KERNEL_CHUNK : len - i * KERNEL_CHUNK;
+        c = crc32c_combine(c, crcs[i], clen);
+    }
+    free(crcs);
+    *crc = c;
+    return 0;
+}
+
+/* ---------- Word Count ---------- */
+
+typedef struct {
+    uint64_t lines;
+    uint64_t words;
+} WcCount;
+
+static const unsigned char wc_space[256] = {
+    [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1,
+};
+
+static int wc_chunk(ParallelRun *run, size_t idx, size_t start, size_t end) {
+    WcCount *counts = run->state;
+    const unsigned char *d = (const unsigned char *)run->data;
+
+    // Newlines via memchr, which glibc vectorizes.
+    uint64_t lines = 0;
+    const char *p = run->data + start, *e = run->data + end;
+    while ((p = memchr(p, '\n', (size_t)(e - p))) != NULL) {
+        lines++;
+        p++;
+    }
+
+    // A word starts at every non-space byte that follows a space; look one
+    // byte back across the chunk boundary.
+    uint64_t words = 0;
+    unsigned prev_space = start == 0 ? 1 : wc_space[d[start - 1]];
+    for (size_t i = start; i < end; i++) {
+        unsigned sp = wc_space[d[i]];
+        words += prev_space & !sp;
+        prev_space = sp;
+    }
+
+    counts[idx].lines = lines;
+    counts[idx].words = words;
+    return 0;
+}
+
+int kernel_wc(const char *data, size_t len, const KernelCtx *ctx,
+              uint64_t *lines, uint64_t *words) {
+    ParallelRun run = { .data = data, .len = len, .ctx = ctx, .fn = wc_chunk };
+    size_t nchunks = (len + KERNEL_CHUNK - 1) / KERNEL_CHUNK;
+    WcCount *counts = calloc(nchunks ? nchunks : 1, sizeof(WcCount));
+    if (!counts) return -1;
+    run.state = counts;
+
+    if (parallel_for(&run) != 0) {
+        free(counts);
+        return -1;
+    }
+
+    *lines = 0;
+    *words = 0;
+    for (size_t i = 0; i < nchunks; i++) {
+        *lines += counts[i].lines;
+        *words += counts[i].words;
+    }
+    free(counts);
+    return 0;
+}
+
+/* ---------- Grep ---------- */
+
+typedef struct {
+    char *buf;
+    size_t len, cap;
+    uint64_t matches;
+} GrepOut;
+
+typedef struct {
+    const char *pattern;
+    size_t patlen;
+    GrepOut *outs;
+} GrepState;
+
+static int grep_append(GrepOut *o, const char *line, size_t n) {
+    if (o->len + n + 1 > o->cap) {
+        size_t cap = o->cap ? o->cap * 2 : 4096;
+        while (cap < o->len + n + 1) cap *= 2;
+        char *grown = realloc(o->buf, cap);
+        if (!grown) return -1;
+        o->buf = grown;
+        o->cap = cap;
+    }
+    memcpy(o->buf + o->len, line, n);
+    o->len += n;
+    if (n == 0 || line[n - 1] != '\n') o->buf[o->len++] = '\n';
+    return 0;
+}
+
+// A chunk owns the lines that start inside it, even if they run past its end.
+static int grep_chunk(ParallelRun *run, size_t idx, size_t start, size_t end) {
+    GrepState *st = run->state;
+    GrepOut *o = &st->outs[idx];
+    const char *d = run->data;
+    size_t len = run->len;
+
+    size_t s = start;
+    if (start > 0) {
+        const char *nl = memchr(d + start - 1, '\n', len - (start - 1));
+        if (!nl) return 0;
+        s = (size_t)(nl - d) + 1;
+    }
+    if (s >= end) return 0;
+
+    // Search up to the end of the line holding the chunk's last byte.
+    const char *last = memchr(d + end - 1, '\n', len - (end - 1));
+    size_t lim = last ? (size_t)(last - d) + 1 : len;
+
+    while (s < lim) {
+        const char *m = memmem(d + s, lim - s, st->pattern, st->patlen);
+        if (!m) break;
+
+        const char *ls = memrchr(d + s, '\n', (size_t)(m - (d + s)));
+        ls = ls ? ls + 1 : d + s;
+        const char *le = memchr(m, '\n', (size_t)(d + lim - m));
+        le = le ? le + 1 : d + lim;
+
+        if (grep_append(o, ls, (size_t)(le - ls)) != 0) return -1;
+        o->matches++;
+        s = (size_t)(le - d);
+    }
+    return 0;
+}
+
+int kernel_grep(const char *data, size_t len, const char *pattern, const KernelCtx *ctx,
+                char **out, size_t *out_len, uint64_t *matches) {
+    GrepState st = { pattern, strlen(pattern), NULL };
+    if (st.patlen == 0) return -1;
+
+    ParallelRun run = { .data = data, .len = len, .ctx = ctx, .fn = grep_chunk, .state = &st };
+    size_t nchunks = (len + KERNEL_CHUNK - 1) / KERNEL_CHUNK;
+    st.outs = calloc(nchunks ? nchunks : 1, sizeof(GrepOut));
+    if (!st.outs) return -1;
+
+    int rc = parallel_for(&run);
+    size_t total = 0;
+    *matches = 0;
+    for (size_t i = 0; i < nchunks; i++) {
+        total += st.outs[i].len;
+        *matches += st.outs[i].matches;
+    }
+
+    char *buf = rc == 0 ? malloc(total ? total : 1) : NULL;
+    if (buf) {
+        size_t off = 0;
+        for (size_t i = 0; i < nchunks; i++) {
+            memcpy(buf + off, st.outs[i].buf, st.outs[i].len);
+            off += st.outs[i].len;
+        }
+        *out = buf;
+        *out_len = total;
+    }
+    for (size_t i = 0; i < nchunks; i++) free(st.outs[i].buf);
+    free(st.outs);
+    return buf ? 0 : -1;
+}
+
+/* ---------- Compress ---------- */
+
+typedef struct {
+    char **frames;
+    size_t *sizes;
+} CompressState;
+
+static int compress_chunk(ParallelRun *run, size_t idx, size_t start, size_t end) {
+    CompressState *st = run->state;
+    char *frame = malloc(lz_frame_bound(end - start));
+    if (!frame) return -1;
+    st->sizes[idx] = lz_frame_block(run->data + start, end - start, frame);
+    st->frames[idx] = frame;
+    return 0;
+}
+
+int kernel_compress(const char *data, size_t len, const KernelCtx *ctx,
+                    char **out, size_t *out_len) {
+    size_t nchunks = (len + KERNEL_CHUNK - 1) / KERNEL_CHUNK;
+    CompressState st;
+    st.frames = calloc(nchunks ? nchunks : 1, sizeof(char *));
+    st.sizes = calloc(nchunks ? nchunks : 1, sizeof(size_t));
+    ParallelRun run = { .data = data, .len = len, .ctx = ctx, .fn = compress_chunk, .state = &st };
+
+    int rc = (st.frames && st.sizes) ? parallel_for(&run) : -1;
+    char *buf = NULL;
+    if (rc == 0) {
+        size_t total = LZ_STREAM_HEADER;
+        for (size_t i = 0; i < nchunks; i++) total += st.sizes[i];
+        buf = malloc(total);
+        if (buf) {
+            lz_stream_header(buf, KERNEL_CHUNK);
+            size_t off = LZ_STREAM_HEADER;
+            for (size_t i = 0; i < nchunks; i++) {
+                memcpy(buf + off, st.frames[i], st.sizes[i]);
+                off += st.sizes[i];
+            }
+            *out = buf;
+            *out_len = total;
+        }
+    }
+
+    for (size_t i = 0; st.frames && i < nchunks; i++) free(st.frames[i]);
+    free(st.frames);
+    free(st.sizes);
+    return buf ? 0 : -1;
+}
@@ -0,0 +1,33 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define KERNEL_CHUNK (4 * 1024 * 1024)  // unit of work per thread
+#define KERNEL_MAX_THREADS 16
+
+// Data-parallel kernels for PROCESS. Each splits its input into
+// KERNEL_CHUNK pieces, processes them on up to one thread per core, and
+// merges the per-chunk results in order. Input is usually an mmap of the
+// stored file. All return 0 on success and -1 if cancelled or out of memory.
+
+typedef struct {
+    int (*cancelled)(void *arg);        // polled between chunks (may be NULL)
+    void *arg;
+} KernelCtx;
+
+int kernel_checksum(const char *data, size_t len, const KernelCtx *ctx, uint32_t *crc);
+
+int kernel_wc(const char *data, size_t len, const KernelCtx *ctx,
+              uint64_t *lines, uint64_t *words);
+
+// Lines containing pattern, in file order, into a malloc'd buffer.
+int kernel_grep(const char *data, size_t len, const char *pattern, const KernelCtx *ctx,
+                char **out, size_t *out_len, uint64_t *matches);
+
+// An lz stream with one frame per chunk (malloc'd), see lz.h.
+int kernel_compress(const char *data, size_t len, const KernelCtx *ctx,
+                    char **out, size_t *out_len);
+
+#endif
@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "layout.h"
+#include "locks.h"
+
+static pthread_t migrate_thread;
+static atomic_int migrate_running = 0;
+
+/* ---------- Helper Functions ---------- */
+
+static const char *user_or_guest(const char *user) {
+    return (user && strlen(user)) ? user : "guest";
+}
+
+static uint32_t fnv1a(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int shard_index(const char *filename) {
+    return (int)(fnv1a(filename) % LAYOUT_FANOUT);
+}
+
+static void shard_name(char *out, size_t outlen, const char *filename) {
+    snprintf(out, outlen, "%02x", shard_index(filename));
+}
+
+static int is_shard_dir(const char *name) {
+    return strlen(name) == 2 && isxdigit((unsigned char)name[0]) && isxdigit((unsigned char)name[1]);
+}
+
+static int path_exists(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static void legacy_path(char *out, size_t outlen, const char *user, const char *filename) {
+    snprintf(out, outlen, LAYOUT_ROOT "/%s/%s", user_or_guest(user), filename);
+}
+
+static int fsync_path(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+/* ---------- Path Mapping ---------- */
+
+void layout_user_dir(char *out, size_t outlen, const char *user) {
+    snprintf(out, outlen, LAYOUT_ROOT "/%s", user_or_guest(user));
+}
+
+void layout_file_path(char *out, size_t outlen, const char *user, const char *filename) {
+    char shard[8];
+    shard_name(shard, sizeof(shard), filename);
+    snprintf(out, outlen, LAYOUT_ROOT "/%s/%s/%s", user_or_guest(user), shard, filename);
+}
+
+int layout_prepare(const char *user, const char *filename, char *out, size_t outlen) {
+    char dir[512], shard[8];
+    mkdir(LAYOUT_ROOT, 0755);
+    layout_user_dir(dir, sizeof(dir), user);
+    mkdir(dir, 0755);
+
+    shard_name(shard, sizeof(shard), filename);
+    size_t n = strlen(dir);
+    snprintf(dir + n, sizeof(dir) - n, "/%s", shard);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+
+    layout_file_path(out, outlen, user, filename);
+    return 0;
+}
+
+int layout_resolve(const char *user, const char *filename, char *out, size_t outlen) {
+    layout_file_path(out, outlen, user, filename);
+    if (path_exists(out)) return 0;
+
+    legacy_path(out, outlen, user, filename);
+    if (path_exists(out)) return 0;
+
+    // The migrator may have moved it between the two checks.
+    layout_file_path(out, outlen, user, filename);
+    return path_exists(out) ? 0 : -1;
+}
+
+int layout_drop_legacy(const char *user, const char *filename) {
+    char path[1024], dir[512];
+    legacy_path(path, sizeof(path), user, filename);
+    if (unlink(path) != 0) return errno == ENOENT ? 0 : -1;
+    layout_user_dir(dir, sizeof(dir), user);
+    fsync_path(dir);
+    return 0;
+}
+
+/* ---------- Listing ---------- */
+
+typedef struct {
+    char **names;
+    size_t count, cap;
+} NameList;
+
+static void namelist_add(NameList *l, const char *name) {
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 64;
+        char **names = realloc(l->names, cap * sizeof(char *));
+        if (!names) return;
+        l->names = names;
+        l->cap = cap;
+    }
+    char *copy = strdup(name);
+    if (copy) l->names[l->count++] = copy;
+}
+
+static int cmp_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void collect_files(NameList *l, const char *dir, int descend) {
+    DIR *d = opendir(dir);
+    if (!d) return;
+
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;   // temp files, markers
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0) continue;
+
+        if (S_ISREG(st.st_mode))
+            namelist_add(l, e->d_name);
+        else if (descend && S_ISDIR(st.st_mode) && is_shard_dir(e->d_name))
+            collect_files(l, path, 0);
+    }
+    closedir(d);
+}
+
+char *layout_list(const char *user) {
+    char dir[512];
+    layout_user_dir(dir, sizeof(dir), user);
+
+    NameList l = {0};
+    collect_files(&l, dir, 1);
+    qsort(l.names, l.count, sizeof(char *), cmp_names);
+
+    size_t total = 1;
+    for (size_t i = 0; i < l.count; i++) total += strlen(l.names[i]) + 1;
+
+    // A name shows up twice while the migrator has it at both paths, and
+    // usage and quota rebuilds count every line, so keep one.
+    char *out = malloc(total);
+    if (out) {
+        char *p = out;
+        for (size_t i = 0; i < l.count; i++) {
+            if (i > 0 && strcmp(l.names[i], l.names[i - 1]) == 0) continue;
+            size_t n = strlen(l.names[i]);
+            memcpy(p, l.names[i], n);
+            p[n] = '\n';
+            p += n + 1;
+        }
+        *p = '\0';
+    }
+
+    for (size_t i = 0; i < l.count; i++) free(l.names[i]);
+    free(l.names);
+    return out;
+}
+
+/* ---------- Online Migration ---------- */
+
+// Move up to LAYOUT_MIGRATE_BATCH flat files under the user lock. Returns
+// the number moved, so the caller can loop until a pass moves nothing.
+static int migrate_batch(const char *user) {
+    char dir[512];
+    layout_user_dir(dir, sizeof(dir), user);
+
+    locks_acquire_user(user);
+    DIR *d = opendir(dir);
+    if (!d) {
+        locks_release_user(user);
+        return 0;
+    }
+
+    int moved = 0;
+    unsigned char touched[LAYOUT_FANOUT] = {0};
+    struct dirent *e;
+    while (moved < LAYOUT_MIGRATE_BATCH && (e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+
+        char from[1024];
+        snprintf(from, sizeof(from), "%s/%s", dir, e->d_name);
+        struct stat st;
+        if (stat(from, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+        // Never replace the sharded path: if it exists, an upload wrote it
+        // after this copy and it wins (or a crash left both, same inode).
+        char to[1024];
+        if (layout_prepare(user, e->d_name, to, sizeof(to)) != 0) continue;
+        if (link(from, to) != 0 && errno != EEXIST) {
+            perror("link");
+            continue;
+        }
+        if (unlink(from) != 0) {
+            perror("unlink");
+            continue;
+        }
+        touched[shard_index(e->d_name)] = 1;
+        moved++;
+    }
+    closedir(d);
+
+    if (moved > 0) {
+        // Make the moves durable before anyone relies on the new location.
+        for (int i = 0; i < LAYOUT_FANOUT; i++) {
+            if (!touched[i]) continue;
+            char shard[1024];
+            snprintf(shard, sizeof(shard), "%s/%02x", dir, i);
+            fsync_path(shard);
+        }
+        fsync_path(dir);
+    }
+    locks_release_user(user);
+    return moved;
+}
+
+int layout_migrate_user(const char *user) {
+    int total = 0, n;
+    while ((n = migrate_batch(user)) > 0) {
+        total += n;
+        if (!atomic_load(&migrate_running)) break;
+    }
+    return total;
+}
+
+static void *migrate_thread_main(void *arg) {
+    (void)arg;
+
+    DIR *d = opendir(LAYOUT_ROOT);
+    if (!d) return NULL;
+
+    struct dirent *e;
+    while (atomic_load(&migrate_running) && (e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+
+        char path[1024];
+        snprintf(path, sizeof(path), LAYOUT_ROOT "/%s", e->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+
+        int moved = layout_migrate_user(e->d_name);
+        if (moved > 0)
+            fprintf(stderr, "[Layout] migrated %d files for user %s\n", moved, e->d_name);
+    }
+    closedir(d);
+    return NULL;
+}
+
+void layout_start_migration(void) {
+    atomic_store(&migrate_running, 1);
+    pthread_create(&migrate_thread, NULL, migrate_thread_main, NULL);
+}
+
+void layout_stop_migration(void) {
+    if (!atomic_exchange(&migrate_running, 0)) return;
+    pthread_join(migrate_thread, NULL);
+}
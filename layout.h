@@ -0,0 +1,36 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stddef.h>
+
+#define LAYOUT_ROOT "storage"
+#define LAYOUT_FANOUT 256          // hash-prefix subdirectories per user
+#define LAYOUT_MIGRATE_BATCH 256   // files moved per user-lock hold
+
+// On-disk layout: storage/<user>/<xx>/<filename>, where <xx> is a hex
+// prefix derived from a hash of the filename. Older trees kept every file
+// directly in storage/<user>/; lookups fall back to that location until the
+// background migration has moved the file.
+
+void layout_user_dir(char *out, size_t outlen, const char *user);
+void layout_file_path(char *out, size_t outlen, const char *user, const char *filename);
+
+// Create the user and shard directories and return the path to write to.
+int layout_prepare(const char *user, const char *filename, char *out, size_t outlen);
+
+// Find an existing file (sharded or legacy flat). Returns 0 if found.
+int layout_resolve(const char *user, const char *filename, char *out, size_t outlen);
+
+// Remove the legacy flat copy of a file, once the sharded path has been
+// written or the file deleted (user lock held). Returns 0 if none is left.
+int layout_drop_legacy(const char *user, const char *filename);
+
+// Sorted, newline-terminated list of the user's files (malloc'd, "" if none).
+char *layout_list(const char *user);
+
+// Online migration of legacy flat trees into the sharded layout.
+int  layout_migrate_user(const char *user);
+void layout_start_migration(void);
+void layout_stop_migration(void);
+
+#endif
@@ -0,0 +1,277 @@
+// src/local.c
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "local.h"
+#include "shm.h"
+#include "server.h"
+#include "request.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+
+#define LOCAL_LINE 1024
+#define LOCAL_MESSAGE (2 * LOCAL_LINE + REQUEST_MAX_WIRE)
+
+static int listen_fd = -1;
+static char sock_path[108];
+static ino_t sock_ino;
+static pthread_t accept_thread;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sessions_done = PTHREAD_COND_INITIALIZER;
+static int session_fd[LOCAL_MAX_SESSIONS];      // under sessions_lock, -1 = free
+static int nsessions;
+
+/* ---------- Helper Functions ---------- */
+
+// One line of msg starting at *pos, without its newline.
+static void take_line(char *msg, size_t len, size_t *pos, char *out) {
+    size_t start = *pos, end = start;
+    while (end < len && msg[end] != '\n') end++;
+    size_t n = end - start < LOCAL_LINE - 1 ? end - start : LOCAL_LINE - 1;
+    memcpy(out, msg + start, n);
+    out[n] = '\0';
+    *pos = end < len ? end + 1 : end;
+}
+
+static int send_reply(ShmSession *s, const char *msg) {
+    size_t len = strlen(msg);
+    stats_bytes(0, len);
+    if (shm_write(s, msg, len) != 0) return -1;
+    return shm_end(s);
+}
+
+/* ---------- Requests ---------- */
+
+// Run the request in msg and send the reply, as serve_client does for a
+// connection. Returns -1 once the client is gone.
+static int serve_message(ShmSession *s, char *msg, size_t len, CommandType *cmd, int *failed) {
+    char line[LOCAL_LINE];
+    char cmdline[LOCAL_LINE];
+    Task t = {0};
+    size_t pos = 0;
+    *cmd = CMD_UNKNOWN;
+    *failed = 1;
+
+    take_line(msg, len, &pos, line);
+    if (strncmp(line, "USER ", 5) == 0) {
+        sscanf(line + 5, "%63s", t.username);
+        take_line(msg, len, &pos, cmdline);
+    } else {
+        strcpy(cmdline, line);
+        strncpy(t.username, "guest", sizeof(t.username) - 1);
+    }
+    stats_bytes(len, 0);
+
+    *cmd = request_command(cmdline);
+    *failed = 0;
+    uint64_t service_start = stats_now_us();
+    const char *user = strlen(t.username) ? t.username : "guest";
+
+    char *reply = request_inline(*cmd, user, cmdline, failed);
+    if (reply) {
+        int rc = send_reply(s, reply);
+        free(reply);
+        stats_latency(*cmd, STATS_SERVICE, stats_now_us() - service_start);
+        return rc;
+    }
+
+    if (request_task(&t, *cmd, cmdline) != 0) {
+        *failed = 1;
+        return send_reply(s, "ERR: Unknown command\n");
+    }
+    if (*cmd == CMD_UPLOAD &&
+        request_upload_body(&t, request_upload_packed(cmdline), msg + pos, len - pos) != 0) {
+        *failed = 1;
+        return send_reply(s, "ERR: Corrupt or oversized compressed upload\n");
+    }
+
+    TaskResult *res = task_result_new();
+    if (!res) {
+        *failed = 1;
+        return send_reply(s, "ERR: Out of memory\n");
+    }
+    t.result = res;
+    t.enqueued_us = t.dequeued_us = stats_now_us();
+    worker_process_task(&t);
+    stats_latency(*cmd, STATS_SERVICE, stats_now_us() - service_start);
+
+    struct iovec iov[3];
+    int iovcnt = task_result_iov(res, iov, failed);
+    int rc = 0;
+    if (iovcnt > 0) {
+        for (int i = 0; i < iovcnt && rc == 0; i++) {
+            rc = shm_write(s, iov[i].iov_base, iov[i].iov_len);
+            stats_bytes(0, iov[i].iov_len);
+        }
+        if (rc == 0) rc = shm_end(s);
+    } else {
+        *failed = 1;
+        rc = send_reply(s, "ERR: No response\n");
+    }
+    task_result_free(res);
+    return rc;
+}
+
+/* ---------- Sessions ---------- */
+
+static void *session_main(void *arg) {
+    int slot = (int)(intptr_t)arg;
+    pthread_mutex_lock(&sessions_lock);
+    int fd = session_fd[slot];
+    pthread_mutex_unlock(&sessions_lock);
+    trace_thread_name("local");
+
+    ShmSession s;
+    char *msg = malloc(LOCAL_MESSAGE);
+    if (msg && shm_accept(fd, &s) == 0) {
+        log_debug("[Local] session %d open", slot);
+        for (;;) {
+            // Whatever does not fit is read and dropped, as a connection
+            // past the payload limit would be.
+            size_t len = 0;
+            ssize_t n;
+            char sink[4096];
+            while ((n = shm_read(&s, len < LOCAL_MESSAGE ? msg + len : sink,
+                                 len < LOCAL_MESSAGE ? LOCAL_MESSAGE - len : sizeof(sink))) > 0)
+                if (len < LOCAL_MESSAGE) len += (size_t)n;
+            if (n < 0) break;
+
+            uint64_t start = stats_now_us();
+            CommandType cmd;
+            int failed;
+            int rc = serve_message(&s, msg, len, &cmd, &failed);
+            stats_request(cmd, failed);
+            stats_latency(cmd, STATS_TOTAL, stats_now_us() - start);
+            if (rc != 0) break;
+        }
+        s.sock = -1;                    // closed below, with the slot
+        shm_close(&s);
+        log_debug("[Local] session %d closed", slot);
+    }
+    free(msg);
+
+    pthread_mutex_lock(&sessions_lock);
+    close(session_fd[slot]);
+    session_fd[slot] = -1;
+    nsessions--;
+    stats_gauge_add(STATS_CONNECTIONS, -1);
+    pthread_cond_broadcast(&sessions_done);
+    pthread_mutex_unlock(&sessions_lock);
+    return NULL;
+}
+
+static void *accept_main(void *arg) {
+    (void)arg;
+    trace_thread_name("local-accept");
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;                      // local_destroy shut the socket down
+        }
+
+        pthread_mutex_lock(&sessions_lock);
+        int slot = -1;
+        for (int i = 0; i < LOCAL_MAX_SESSIONS && slot < 0; i++)
+            if (session_fd[i] < 0) slot = i;
+        if (slot < 0) {
+            pthread_mutex_unlock(&sessions_lock);
+            const char *busy = "ERR: Too many local sessions\n";
+            send(fd, busy, strlen(busy), MSG_NOSIGNAL);
+            close(fd);
+            continue;
+        }
+        session_fd[slot] = fd;
+        nsessions++;
+        stats_gauge_add(STATS_CONNECTIONS, 1);
+        pthread_mutex_unlock(&sessions_lock);
+
+        pthread_t th;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&th, &attr, session_main, (void *)(intptr_t)slot) != 0) {
+            pthread_mutex_lock(&sessions_lock);
+            close(fd);
+            session_fd[slot] = -1;
+            nsessions--;
+            stats_gauge_add(STATS_CONNECTIONS, -1);
+            pthread_mutex_unlock(&sessions_lock);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return NULL;
+}
+
+/* ---------- Lifecycle ---------- */
+
+int local_init(const char *path) {
+    if (!path) return 0;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("[Local] socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    for (int i = 0; i < LOCAL_MAX_SESSIONS; i++) session_fd[i] = -1;
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) goto fail;
+    int rc = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (rc < 0 && errno == EADDRINUSE) {
+        // Left behind by a server that did not shut down cleanly, unless
+        // something still answers on it.
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int live = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) close(probe);
+        if (live) {
+            errno = EADDRINUSE;
+            goto fail;
+        }
+        unlink(path);
+        rc = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    if (rc < 0) goto fail;
+    struct stat st;
+    if (stat(path, &st) != 0 || listen(listen_fd, LOCAL_MAX_SESSIONS) < 0) goto fail;
+    sock_ino = st.st_ino;
+    snprintf(sock_path, sizeof(sock_path), "%s", path);
+
+    pthread_create(&accept_thread, NULL, accept_main, NULL);
+    log_info("[Local] shared-memory sessions on %s", path);
+    return 0;
+
+fail:
+    log_error("[Local] cannot listen on %s: %s", path, strerror(errno));
+    if (listen_fd >= 0) close(listen_fd);
+    listen_fd = -1;
+    return -1;
+}
+
+void local_destroy(void) {
+    if (listen_fd < 0) return;
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(accept_thread, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+
+    // A session between requests sleeps on its socket too: shutting it
+    // down wakes it, and a request in progress is still answered.
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = 0; i < LOCAL_MAX_SESSIONS; i++)
+        if (session_fd[i] >= 0) shutdown(session_fd[i], SHUT_RDWR);
+    while (nsessions > 0) pthread_cond_wait(&sessions_done, &sessions_lock);
+    pthread_mutex_unlock(&sessions_lock);
+
+    // After a hot restart the path may already belong to the new server.
+    struct stat st;
+    if (stat(sock_path, &st) == 0 && st.st_ino == sock_ino) unlink(sock_path);
+}
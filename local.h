@@ -0,0 +1,20 @@
+#ifndef LOCAL_H
+#define LOCAL_H
+
+#define LOCAL_MAX_SESSIONS 16
+
+// Local transport (-u <path>): clients on this host connect to a Unix
+// socket at path and move requests and replies through shared memory
+// (shm.h) instead of loopback TCP. A session is long-lived and carries
+// one request after another in the usual wire format. Each session has
+// its own thread, which runs worker commands itself rather than handing
+// them to the task queue: the client is blocked on the reply anyway, and
+// the handoff costs two context switches per request.
+
+// Start accepting sessions on path (no-op for NULL).
+int local_init(const char *path);
+
+// Stop accepting, end the open sessions and remove the socket.
+void local_destroy(void);
+
+#endif
@@ -0,0 +1,336 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "log.h"
+
+#define LOG_MAX_RINGS 128               // live threads beyond this log synchronously
+#define LOG_SITES 32                    // rate-limited call sites per thread
+#define LOG_LINE 1024
+#define LOG_OUTBUF (64 * 1024)
+
+typedef struct {
+    const char *fmt;
+    uint64_t ts_us;                     // wall clock
+    uint8_t level;
+    uint8_t nargs;
+    LogArg args[LOG_MAX_ARGS];
+    char strbuf[LOG_STRBUF];            // copies of string arguments
+} LogRecord;
+
+typedef struct {
+    const char *fmt;
+    uint64_t second;
+    uint32_t count;
+} LogSite;
+
+// Single-producer (the owning thread) / single-consumer (the writer) ring.
+typedef struct LogRing {
+    LogRecord recs[LOG_RING];
+    atomic_uint_fast64_t head;
+    atomic_uint_fast64_t tail;
+    atomic_uint_fast64_t dropped;       // ring full
+    atomic_uint_fast64_t suppressed;    // over the rate limit
+    LogSite sites[LOG_SITES];           // owner only
+    int orphaned;                       // owner exited: freed once drained (rings_lock)
+    struct LogRing *next;
+} LogRing;
+
+LogLevel log_min_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+static atomic_int log_running;
+static pthread_t writer_thread;
+static LogRing *rings;
+static int nrings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread LogRing *my_ring;
+static __thread int my_ring_failed;
+static pthread_key_t ring_key;          // hands a ring back when its thread exits
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+/* ---------- Helper Functions ---------- */
+
+// Thread exit: the writer frees the ring after its last drain. The ring
+// may already be gone if log_destroy() ran first, hence the lookup.
+static void ring_release(void *arg) {
+    my_ring = NULL;
+    my_ring_failed = 1;                 // a later destructor that logs writes synchronously
+    pthread_mutex_lock(&rings_lock);
+    for (LogRing *r = rings; r; r = r->next) {
+        if (r == arg) {
+            r->orphaned = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void ring_key_create(void) {
+    if (pthread_key_create(&ring_key, ring_release) != 0) perror("pthread_key_create log ring");
+}
+
+static LogRing *ring(void) {
+    if (my_ring || my_ring_failed) return my_ring;
+
+    pthread_once(&ring_key_once, ring_key_create);
+    pthread_mutex_lock(&rings_lock);
+    if (nrings < LOG_MAX_RINGS) {
+        LogRing *r = calloc(1, sizeof(LogRing));
+        if (r && pthread_setspecific(ring_key, r) != 0) {
+            free(r);
+            r = NULL;
+        }
+        if (r) {
+            r->next = rings;
+            rings = r;
+            nrings++;
+        }
+        my_ring = r;
+    }
+    if (!my_ring) my_ring_failed = 1;
+    pthread_mutex_unlock(&rings_lock);
+    return my_ring;
+}
+
+static uint64_t wall_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// printf-style formatting from stored arguments. Each conversion is
+// re-issued with the argument's stored width (ll for integers), so %d, %zu
+// and %lu all work whatever the original type was.
+static size_t format_args(char *out, size_t cap, const char *fmt, int nargs, const LogArg *args) {
+    size_t n = 0;
+    int ai = 0;
+    const char *p = fmt;
+    while (*p && n + 1 < cap) {
+        if (*p != '%') {
+            out[n++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            out[n++] = '%';
+            p += 2;
+            continue;
+        }
+
+        const char *spec = p++;
+        while (*p && strchr("-+ #0", *p)) p++;
+        while (isdigit((unsigned char)*p)) p++;
+        if (*p == '.') {
+            p++;
+            while (isdigit((unsigned char)*p)) p++;
+        }
+        size_t speclen = (size_t)(p - spec);
+        while (*p && strchr("hlLqjzt", *p)) p++;
+        char conv = *p ? *p++ : 's';
+
+        char f[48];
+        if (speclen > sizeof(f) - 4) speclen = sizeof(f) - 4;
+        memcpy(f, spec, speclen);
+        int w;
+        if (ai >= nargs) {
+            w = snprintf(out + n, cap - n, "?");
+        } else {
+            const LogArg *a = &args[ai++];
+            if (strchr("diouxXc", conv)) {
+                if (conv == 'c') {
+                    memcpy(f + speclen, "c", 2);
+                    w = snprintf(out + n, cap - n, f, (int)(a->type == 'f' ? (long long)a->f : a->i));
+                } else {
+                    memcpy(f + speclen, "ll", 2);
+                    f[speclen + 2] = conv;
+                    f[speclen + 3] = '\0';
+                    long long v = a->type == 'f' ? (long long)a->f : a->i;
+                    w = snprintf(out + n, cap - n, f, v);
+                }
+            } else if (strchr("feEgGaA", conv)) {
+                f[speclen] = conv;
+                f[speclen + 1] = '\0';
+                double v = a->type == 'f' ? a->f : a->type == 'u' ? (double)a->u : (double)a->i;
+                w = snprintf(out + n, cap - n, f, v);
+            } else if (conv == 'p') {
+                w = snprintf(out + n, cap - n, "%p", a->p);
+            } else {
+                memcpy(f + speclen, "s", 2);
+                w = snprintf(out + n, cap - n, f, a->type == 's' ? a->s : "?");
+            }
+        }
+        if (w > 0) n += (size_t)w < cap - n ? (size_t)w : cap - n - 1;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static size_t format_line(char *out, size_t cap, const LogRecord *r) {
+    time_t secs = (time_t)(r->ts_us / 1000000);
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    size_t n = strftime(out, cap, "%Y-%m-%d %H:%M:%S", &tm);
+    n += (size_t)snprintf(out + n, cap - n, ".%06u %-5s ", (unsigned)(r->ts_us % 1000000),
+                          level_names[r->level]);
+    n += format_args(out + n, cap - n - 1, r->fmt, r->nargs, r->args);
+    out[n++] = '\n';
+    out[n] = '\0';
+    return n;
+}
+
+// Before log_init, after log_destroy, or on a thread without a ring.
+static void write_sync(LogLevel level, const char *fmt, int nargs, const LogArg *args) {
+    LogRecord r = { .fmt = fmt, .ts_us = wall_us(), .level = (uint8_t)level,
+                    .nargs = (uint8_t)(nargs < LOG_MAX_ARGS ? nargs : LOG_MAX_ARGS) };
+    memcpy(r.args, args, sizeof(LogArg) * r.nargs);
+    char line[LOG_LINE];
+    size_t n = format_line(line, sizeof(line), &r);
+    fwrite(line, 1, n, stderr);
+}
+
+/* ---------- Writer Thread ---------- */
+
+static void drain(void) {
+    static char out[LOG_OUTBUF];
+    size_t used = 0;
+
+    pthread_mutex_lock(&rings_lock);
+    LogRing **pp = &rings;
+    while (*pp) {
+        LogRing *r = *pp;
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        for (; tail < head; tail++) {
+            if (LOG_OUTBUF - used < LOG_LINE) {
+                fwrite(out, 1, used, stderr);
+                used = 0;
+            }
+            used += format_line(out + used, LOG_LINE, &r->recs[tail % LOG_RING]);
+        }
+        atomic_store_explicit(&r->tail, head, memory_order_release);
+
+        uint64_t dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+        uint64_t suppressed = atomic_exchange_explicit(&r->suppressed, 0, memory_order_relaxed);
+        if (dropped || suppressed) {
+            if (LOG_OUTBUF - used < LOG_LINE) {
+                fwrite(out, 1, used, stderr);
+                used = 0;
+            }
+            LogRecord note = { .fmt = "[Log] %llu lines dropped (ring full), %llu suppressed (rate limit)",
+                               .ts_us = wall_us(), .level = LOG_LEVEL_WARN, .nargs = 2 };
+            note.args[0] = log_arg_u(dropped);
+            note.args[1] = log_arg_u(suppressed);
+            used += format_line(out + used, LOG_LINE, &note);
+        }
+
+        // An exited thread wrote its last record before it was orphaned,
+        // and the lock orders the two, so the ring is empty now.
+        if (r->orphaned) {
+            *pp = r->next;
+            nrings--;
+            free(r);
+        } else {
+            pp = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (used) {
+        fwrite(out, 1, used, stderr);
+        fflush(stderr);
+    }
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    struct timespec interval = { 0, LOG_DRAIN_MS * 1000000L };
+    while (atomic_load(&log_running)) {
+        drain();
+        nanosleep(&interval, NULL);
+    }
+    drain();
+    return NULL;
+}
+
+/* ---------- Init / Destroy ---------- */
+
+void log_init(LogLevel min_level) {
+    log_min_level = min_level;
+    atomic_store(&log_running, 1);
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        perror("pthread_create log writer");
+        atomic_store(&log_running, 0);
+    }
+}
+
+void log_destroy(void) {
+    if (!atomic_exchange(&log_running, 0)) return;
+    pthread_join(writer_thread, NULL);
+
+    pthread_mutex_lock(&rings_lock);
+    while (rings) {
+        LogRing *next = rings->next;
+        free(rings);
+        rings = next;
+    }
+    nrings = 0;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+/* ---------- Logging ---------- */
+
+void log_write(LogLevel level, const char *fmt, int nargs, const LogArg *args) {
+    if (nargs > LOG_MAX_ARGS) nargs = LOG_MAX_ARGS;
+    LogRing *r = atomic_load_explicit(&log_running, memory_order_relaxed) ? ring() : NULL;
+    if (!r) {
+        write_sync(level, fmt, nargs, args);
+        return;
+    }
+
+    uint64_t now = wall_us();
+
+    // Per call site rate limit, keyed by the format string's address.
+    LogSite *site = &r->sites[((uintptr_t)fmt >> 3) % LOG_SITES];
+    uint64_t second = now / 1000000;
+    if (site->fmt != fmt || site->second != second) {
+        site->fmt = fmt;
+        site->second = second;
+        site->count = 0;
+    }
+    if (++site->count > LOG_RATE_PER_SEC) {
+        atomic_fetch_add_explicit(&r->suppressed, 1, memory_order_relaxed);
+        return;
+    }
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail >= LOG_RING) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogRecord *rec = &r->recs[head % LOG_RING];
+    rec->fmt = fmt;
+    rec->ts_us = now;
+    rec->level = (uint8_t)level;
+    rec->nargs = (uint8_t)nargs;
+
+    size_t used = 0;
+    for (int i = 0; i < nargs; i++) {
+        rec->args[i] = args[i];
+        if (args[i].type != 's') continue;
+        // Strings may not outlive the call: copy what fits.
+        const char *s = args[i].s ? args[i].s : "(null)";
+        size_t len = strnlen(s, LOG_STRBUF - 1 - used);
+        memcpy(rec->strbuf + used, s, len);
+        rec->strbuf[used + len] = '\0';
+        rec->args[i].s = rec->strbuf + used;
+        used += len + (used + len + 1 < LOG_STRBUF);
+    }
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
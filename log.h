@@ -0,0 +1,91 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_RING 512                    // records per thread between drains
+#define LOG_MAX_ARGS 6
+#define LOG_STRBUF 128                  // bytes of string arguments per record
+#define LOG_RATE_PER_SEC 100            // per call site and thread
+#define LOG_DRAIN_MS 5                  // writer thread poll interval
+
+// Asynchronous logger. A log call stores the format pointer and its raw
+// arguments (strings are copied) in the calling thread's ring and returns;
+// a background thread formats and writes the lines to stderr. Nothing on
+// the request path takes a lock, formats or blocks: a full ring drops the
+// record and a call site logging more than LOG_RATE_PER_SEC lines a second
+// is suppressed. The writer reports how many lines were lost either way.
+//
+// The format must be a string literal. Arguments may be integers, doubles,
+// strings or pointers, with the usual printf conversions.
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+} LogLevel;
+
+typedef struct {
+    char type;                          // 'i', 'u', 'f', 's' or 'p'
+    union {
+        long long i;
+        unsigned long long u;
+        double f;
+        const char *s;
+        const void *p;
+    };
+} LogArg;
+
+void log_init(LogLevel min_level);
+void log_destroy(void);                 // drains every ring, then stops
+
+extern LogLevel log_min_level;
+
+void log_write(LogLevel level, const char *fmt, int nargs, const LogArg *args);
+
+static inline LogArg log_arg_i(long long v) { LogArg a = { .type = 'i', .i = v }; return a; }
+static inline LogArg log_arg_u(unsigned long long v) { LogArg a = { .type = 'u', .u = v }; return a; }
+static inline LogArg log_arg_f(double v) { LogArg a = { .type = 'f', .f = v }; return a; }
+static inline LogArg log_arg_s(const char *v) { LogArg a = { .type = 's', .s = v }; return a; }
+static inline LogArg log_arg_p(const void *v) { LogArg a = { .type = 'p', .p = v }; return a; }
+
+#define LOG_ARG(x) _Generic((x),                                            \
+    char: log_arg_i, signed char: log_arg_i, short: log_arg_i,              \
+    int: log_arg_i, long: log_arg_i, long long: log_arg_i,                  \
+    _Bool: log_arg_u, unsigned char: log_arg_u, unsigned short: log_arg_u,  \
+    unsigned: log_arg_u, unsigned long: log_arg_u,                          \
+    unsigned long long: log_arg_u,                                          \
+    float: log_arg_f, double: log_arg_f,                                    \
+    char *: log_arg_s, const char *: log_arg_s,                             \
+    default: log_arg_p)(x)
+
+#define LOG_COUNT(...) LOG_COUNT_(__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0, _)
+#define LOG_COUNT_(f, a, b, c, d, e, g, n, ...) n
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_CAT_(a, b) a##b
+
+#define LOG_ARGS_0(f) f, 0, NULL
+#define LOG_ARGS_1(f, a) f, 1, (LogArg[]){ LOG_ARG(a) }
+#define LOG_ARGS_2(f, a, b) f, 2, (LogArg[]){ LOG_ARG(a), LOG_ARG(b) }
+#define LOG_ARGS_3(f, a, b, c) f, 3, (LogArg[]){ LOG_ARG(a), LOG_ARG(b), LOG_ARG(c) }
+#define LOG_ARGS_4(f, a, b, c, d) \
+    f, 4, (LogArg[]){ LOG_ARG(a), LOG_ARG(b), LOG_ARG(c), LOG_ARG(d) }
+#define LOG_ARGS_5(f, a, b, c, d, e) \
+    f, 5, (LogArg[]){ LOG_ARG(a), LOG_ARG(b), LOG_ARG(c), LOG_ARG(d), LOG_ARG(e) }
+#define LOG_ARGS_6(f, a, b, c, d, e, g) \
+    f, 6, (LogArg[]){ LOG_ARG(a), LOG_ARG(b), LOG_ARG(c), LOG_ARG(d), LOG_ARG(e), LOG_ARG(g) }
+
+#define LOG_AT(level, ...)                                                  \
+    do {                                                                    \
+        if ((level) >= log_min_level)                                       \
+            log_write(level, LOG_CAT(LOG_ARGS_, LOG_COUNT(__VA_ARGS__))(__VA_ARGS__)); \
+    } while (0)
+
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif
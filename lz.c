@@ -0,0 +1,223 @@
+#include <string.h>
+#include "lz.h"
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5              // LZ4 block format end conditions
+#define LZ_MF_LIMIT 12
+
+/* ---------- Helper Functions ---------- */
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline void put32le(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static inline uint32_t get32le(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Length continuation bytes for a 4-bit field that overflowed (>= 15).
+static unsigned char *put_length(unsigned char *op, const unsigned char *oend, size_t n) {
+    while (n >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        n -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+// One sequence: token, literals, and (if mlen > 0) offset + match length.
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *oend,
+                                   const unsigned char *lit, size_t litlen,
+                                   size_t offset, size_t mlen) {
+    if (op >= oend) return NULL;
+    unsigned char *token = op++;
+    *token = (unsigned char)((litlen >= 15 ? 15 : litlen) << 4);
+    if (litlen >= 15 && !(op = put_length(op, oend, litlen - 15))) return NULL;
+
+    if ((size_t)(oend - op) < litlen) return NULL;
+    memcpy(op, lit, litlen);
+    op += litlen;
+    if (mlen == 0) return op;       // final literals
+
+    if (oend - op < 2) return NULL;
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+
+    size_t m = mlen - LZ_MIN_MATCH;
+    *token |= (unsigned char)(m >= 15 ? 15 : m);
+    if (m >= 15 && !(op = put_length(op, oend, m - 15))) return NULL;
+    return op;
+}
+
+/* ---------- Block Codec ---------- */
+
+size_t lz_compress(const char *src_, size_t len, char *dst_, size_t cap) {
+    const unsigned char *src = (const unsigned char *)src_;
+    const unsigned char *end = src + len;
+    unsigned char *op = (unsigned char *)dst_;
+    const unsigned char *oend = op + cap;
+    const unsigned char *anchor = src;
+
+    if (len > LZ_MF_LIMIT) {
+        uint32_t table[1u << LZ_HASH_BITS];
+        memset(table, 0, sizeof(table));
+
+        const unsigned char *mflimit = end - LZ_MF_LIMIT;
+        const unsigned char *matchlimit = end - LZ_LAST_LITERALS;
+        const unsigned char *ip = src;
+
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const unsigned char *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq) {
+                // Step faster through data that keeps missing.
+                ip += 1 + ((size_t)(ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char *p = ip + LZ_MIN_MATCH, *r = ref + LZ_MIN_MATCH;
+            while (p < matchlimit && *p == *r) {
+                p++;
+                r++;
+            }
+
+            op = put_sequence(op, oend, anchor, (size_t)(ip - anchor),
+                              (size_t)(ip - ref), (size_t)(p - ip));
+            if (!op) return 0;
+            ip = anchor = p;
+            if (ip < mflimit) table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - (unsigned char *)dst_) : 0;
+}
+
+long lz_decompress(const char *src_, size_t len, char *dst_, size_t cap) {
+    const unsigned char *ip = (const unsigned char *)src_;
+    const unsigned char *iend = ip + len;
+    unsigned char *dst = (unsigned char *)dst_;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) break;      // last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > (size_t)(oend - op)) return -1;
+
+        // Byte copy: matches may overlap their own output.
+        const unsigned char *m = op - offset;
+        while (mlen--) *op++ = *m++;
+    }
+    return (long)(op - dst);
+}
+
+/* ---------- Framing ---------- */
+
+size_t lz_frame_block(const char *src, size_t len, char *dst) {
+    unsigned char *hdr = (unsigned char *)dst;
+    // Only keep the compressed form if it is actually smaller.
+    size_t packed = len > 0 ? lz_compress(src, len, dst + LZ_FRAME_HEADER, len - 1) : 0;
+
+    put32le(hdr, (uint32_t)len);
+    if (packed == 0) {
+        put32le(hdr + 4, (uint32_t)len | LZ_STORED);
+        memcpy(dst + LZ_FRAME_HEADER, src, len);
+        return LZ_FRAME_HEADER + len;
+    }
+    put32le(hdr + 4, (uint32_t)packed);
+    return LZ_FRAME_HEADER + packed;
+}
+
+void lz_stream_header(char *dst, uint32_t block) {
+    memcpy(dst, LZ_MAGIC, 4);
+    put32le((unsigned char *)dst + 4, block);
+}
+
+long lz_stream_decode(const char *src, size_t len, char *dst, size_t cap) {
+    if (len < LZ_STREAM_HEADER || memcmp(src, LZ_MAGIC, 4) != 0) return -1;
+
+    size_t off = LZ_STREAM_HEADER, out = 0;
+    while (off < len) {
+        uint32_t raw, payload;
+        int stored;
+        if (len - off < LZ_FRAME_HEADER ||
+            lz_frame_header((const unsigned char *)src + off, &raw, &payload, &stored) != 0)
+            return -1;
+        off += LZ_FRAME_HEADER;
+        if (payload > len - off || raw > cap - out) return -1;
+
+        if (stored) {
+            memcpy(dst + out, src + off, raw);
+        } else if (lz_decompress(src + off, payload, dst + out, raw) != (long)raw) {
+            return -1;
+        }
+        off += payload;
+        out += raw;
+    }
+    return (long)out;
+}
+
+int lz_frame_header(const unsigned char *hdr, uint32_t *raw_len, uint32_t *payload_len,
+                    int *stored) {
+    uint32_t v = get32le(hdr + 4);
+    *raw_len = get32le(hdr);
+    *stored = (v & LZ_STORED) != 0;
+    *payload_len = v & ~LZ_STORED;
+    if (*stored && *payload_len != *raw_len) return -1;
+    return 0;
+}
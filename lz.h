@@ -0,0 +1,44 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_FRAME_HEADER 8
+#define LZ_STORED 0x80000000u           // frame flag: payload is uncompressed
+#define LZ_MAGIC "LZB1"                 // file header of .lz outputs
+
+// Fast LZ77 codec using the LZ4 block format (greedy matching, 64 KiB
+// window, hash of 4-byte prefixes). Blocks are independent, so large inputs
+// can be compressed in parallel.
+
+// Compress into dst. Returns the compressed size, or 0 if the result would
+// not fit in cap (pass cap < len to give up on incompressible data early).
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap);
+
+// Returns the decompressed size, or -1 if src is corrupt or exceeds cap.
+long lz_decompress(const char *src, size_t len, char *dst, size_t cap);
+
+// Framed block: {uint32 raw_len, uint32 payload_len | LZ_STORED} (little
+// endian) followed by the payload. Blocks that do not shrink are stored, so
+// a frame never exceeds lz_frame_bound(len). Returns the frame size.
+static inline size_t lz_frame_bound(size_t len) { return LZ_FRAME_HEADER + len; }
+size_t lz_frame_block(const char *src, size_t len, char *dst);
+
+// Parse a frame header. Returns 0 and fills raw_len/payload_len/stored.
+int lz_frame_header(const unsigned char *hdr, uint32_t *raw_len, uint32_t *payload_len,
+                    int *stored);
+
+// Stream: LZ_MAGIC, uint32 block size, then one frame per block. This is
+// the format of .lz files and of compressed UPLOAD/DOWNLOAD bodies.
+#define LZ_STREAM_HEADER 8
+void lz_stream_header(char *dst, uint32_t block);
+static inline size_t lz_stream_bound(size_t len, size_t block) {
+    return LZ_STREAM_HEADER + (len + block - 1) / block * LZ_FRAME_HEADER + len;
+}
+
+// Decode a whole stream into dst. Returns the raw size, or -1 if src is
+// corrupt or does not fit in cap.
+long lz_stream_decode(const char *src, size_t len, char *dst, size_t cap);
+
+#endif
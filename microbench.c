@@ -0,0 +1,513 @@
+// Microbenchmarks for the server's concurrency primitives, linked against
+// the real queues.c, task_queue.c, locks.c and auth.c. Each case runs a
+// fixed wall-clock interval per thread count and reports throughput, mean
+// TSC cycles per operation as seen by the calling thread (blocking
+// included) and latency percentiles. Output is one line per case, or one
+// JSON object per line with -J, so results can be diffed between commits.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "server.h"
+#include "locks.h"
+#include "auth.h"
+#include "stats.h"
+
+#define MAX_THREADS 256
+#define MAX_LIST 16
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS 1024
+#define CLIENT_QUEUE_CAP 10             // as in server.c
+#define TASK_QUEUE_CAP 100
+
+// queues.c and task_queue.c stop blocking when this drops to 0.
+atomic_int server_running = 1;
+
+typedef struct {
+    int list[MAX_LIST];
+    int n;
+} IntList;
+
+static struct {
+    int duration_ms;
+    int budget_s;                       // per-case setup limit
+    int json;
+    const char *only;                   // comma-separated benchmark names
+    IntList threads, keys, users;
+} cfg = {
+    .duration_ms = 500, .budget_s = 10,
+    .threads = { { 1, 2, 4, 8 }, 4 },
+    .keys = { { 10, 1000, 100000, 1000000 }, 4 },
+    .users = { { 1000, 10000, 100000, 1000000 }, 4 },
+};
+
+// Per-thread result: log-linear histogram of op latency in TSC ticks.
+typedef struct {
+    uint64_t ops;
+    uint64_t cycles;
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t max;
+} ThreadResult;
+
+typedef struct Bench Bench;
+
+typedef struct {
+    Bench *bench;
+    int id;
+    int nthreads;
+    uint64_t rng;
+    ThreadResult res;
+} ThreadCtx;
+
+struct Bench {
+    const char *name;
+    long param;                         // keys or users; 0 if none
+    void *(*run)(void *);               // thread body
+    void (*before)(Bench *, int nthreads);
+    void (*after)(Bench *, int nthreads, pthread_t *threads);
+};
+
+static atomic_int stop;
+static double tsc_per_ns = 1.0;
+static ClientQueue bench_cq;
+static TaskQueue bench_tq;
+static char (*keys)[16];
+static long nkeys;
+
+/* ---------- Helper Functions ---------- */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+static void calibrate_tsc(void) {
+    uint64_t t0 = now_ns(), c0 = ticks();
+    struct timespec pause = { 0, 100 * 1000000L };
+    nanosleep(&pause, NULL);
+    uint64_t t1 = now_ns(), c1 = ticks();
+    tsc_per_ns = (double)(c1 - c0) / (double)(t1 - t0);
+}
+
+static uint64_t xorshift(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+static int hist_bucket(uint64_t v) {
+    if (v < (1u << HIST_SUB_BITS)) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    int sub = (int)(v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    return (1 << HIST_SUB_BITS) + ((e - HIST_SUB_BITS) << HIST_SUB_BITS) + sub;
+}
+
+static uint64_t hist_value(int b) {
+    if (b < (1 << HIST_SUB_BITS)) return (uint64_t)b;
+    int e = (b >> HIST_SUB_BITS) - 1 + HIST_SUB_BITS;
+    uint64_t sub = (uint64_t)(b & ((1 << HIST_SUB_BITS) - 1));
+    uint64_t lo = ((1ull << HIST_SUB_BITS) + sub) << (e - HIST_SUB_BITS);
+    return lo + (1ull << (e - HIST_SUB_BITS)) / 2;
+}
+
+static inline void record(ThreadResult *r, uint64_t start, uint64_t end) {
+    uint64_t d = end - start;
+    r->ops++;
+    r->cycles += d;
+    r->hist[hist_bucket(d)]++;
+    if (d > r->max) r->max = d;
+}
+
+static int parse_list(const char *s, IntList *out) {
+    IntList l = { { 0 }, 0 };
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", s);
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        if (l.n == MAX_LIST) return -1;
+        l.list[l.n] = atoi(tok);
+        if (l.list[l.n] <= 0) return -1;
+        l.n++;
+    }
+    if (l.n == 0) return -1;
+    *out = l;
+    return 0;
+}
+
+static int selected(const char *name) {
+    if (!cfg.only) return 1;
+    size_t len = strlen(name);
+    for (const char *p = cfg.only; (p = strstr(p, name)); p += len) {
+        if ((p == cfg.only || p[-1] == ',') && (p[len] == '\0' || p[len] == ','))
+            return 1;
+    }
+    return 0;
+}
+
+/* ---------- ClientQueue ---------- */
+
+// One thread alternates enqueue and dequeue; with more, half produce and
+// half consume, and consumers block on an empty queue as in the server.
+static void *client_queue_thread(void *arg) {
+    ThreadCtx *c = arg;
+    ClientConn conn = { .fd = c->id };
+    if (c->nthreads == 1) {
+        while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+            uint64_t t0 = ticks();
+            enqueueClient(&bench_cq, conn);
+            uint64_t t1 = ticks();
+            dequeueClient(&bench_cq);
+            uint64_t t2 = ticks();
+            record(&c->res, t0, t1);
+            record(&c->res, t1, t2);
+        }
+    } else if (c->id < c->nthreads / 2) {
+        while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+            uint64_t t0 = ticks();
+            enqueueClient(&bench_cq, conn);
+            record(&c->res, t0, ticks());
+        }
+    } else {
+        for (;;) {
+            uint64_t t0 = ticks();
+            ClientConn got = dequeueClient(&bench_cq);
+            if (got.fd < 0) break;
+            record(&c->res, t0, ticks());
+        }
+    }
+    return NULL;
+}
+
+static void client_queue_before(Bench *b, int nthreads) {
+    (void)b;
+    (void)nthreads;
+    atomic_store(&server_running, 1);
+    initClientQueue(&bench_cq, CLIENT_QUEUE_CAP);
+}
+
+static void client_queue_after(Bench *b, int nthreads, pthread_t *threads) {
+    (void)b;
+    // Producers stop on their own; consumers drain, then see shutdown.
+    for (int i = 0; i < nthreads / 2; i++) pthread_join(threads[i], NULL);
+    atomic_store(&server_running, 0);
+    pthread_mutex_lock(&bench_cq.lock);
+    pthread_cond_broadcast(&bench_cq.not_empty);
+    pthread_mutex_unlock(&bench_cq.lock);
+    for (int i = nthreads / 2; i < nthreads; i++) pthread_join(threads[i], NULL);
+    destroyClientQueue(&bench_cq);
+}
+
+/* ---------- TaskQueue ---------- */
+
+static void *task_queue_thread(void *arg) {
+    ThreadCtx *c = arg;
+    Task t;
+    memset(&t, 0, sizeof(t));
+    t.cmd = CMD_LIST;
+    snprintf(t.username, sizeof(t.username), "user%d", c->id);
+    if (c->nthreads == 1) {
+        while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+            uint64_t t0 = ticks();
+            enqueueTask(&bench_tq, t);
+            uint64_t t1 = ticks();
+            dequeueTask(&bench_tq);
+            uint64_t t2 = ticks();
+            record(&c->res, t0, t1);
+            record(&c->res, t1, t2);
+        }
+    } else if (c->id < c->nthreads / 2) {
+        while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+            uint64_t t0 = ticks();
+            enqueueTask(&bench_tq, t);
+            record(&c->res, t0, ticks());
+        }
+    } else {
+        for (;;) {
+            uint64_t t0 = ticks();
+            Task got = dequeueTask(&bench_tq);
+            if (got.cmd == CMD_UNKNOWN) break;
+            record(&c->res, t0, ticks());
+        }
+    }
+    return NULL;
+}
+
+static void task_queue_before(Bench *b, int nthreads) {
+    (void)b;
+    (void)nthreads;
+    atomic_store(&server_running, 1);
+    initTaskQueue(&bench_tq, TASK_QUEUE_CAP);
+}
+
+static void task_queue_after(Bench *b, int nthreads, pthread_t *threads) {
+    (void)b;
+    for (int i = 0; i < nthreads / 2; i++) pthread_join(threads[i], NULL);
+    atomic_store(&server_running, 0);
+    pthread_mutex_lock(&bench_tq.mutex);
+    pthread_cond_broadcast(&bench_tq.cond);
+    pthread_mutex_unlock(&bench_tq.mutex);
+    for (int i = nthreads / 2; i < nthreads; i++) pthread_join(threads[i], NULL);
+    // Anything the consumers left behind (1 thread never leaves any).
+    while (bench_tq.count > 0) dequeueTask(&bench_tq);
+    pthread_mutex_destroy(&bench_tq.mutex);
+    pthread_cond_destroy(&bench_tq.cond);
+}
+
+/* ---------- Locks ---------- */
+
+// Acquire + release of a random key out of nkeys, all pre-registered.
+static void *locks_thread(void *arg) {
+    ThreadCtx *c = arg;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        const char *k = keys[xorshift(&c->rng) % (uint64_t)nkeys];
+        uint64_t t0 = ticks();
+        locks_acquire_user(k);
+        locks_release_user(k);
+        record(&c->res, t0, ticks());
+    }
+    return NULL;
+}
+
+static void join_all(Bench *b, int nthreads, pthread_t *threads) {
+    (void)b;
+    for (int i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+}
+
+// Registers every key through the public API. Returns -1 if that takes
+// longer than the setup budget.
+static int locks_setup(long n) {
+    free(keys);
+    keys = malloc((size_t)n * sizeof(*keys));
+    if (!keys) return -1;
+    nkeys = n;
+    locks_destroy();
+    locks_init();
+    uint64_t deadline = now_ns() + (uint64_t)cfg.budget_s * 1000000000ull;
+    for (long i = 0; i < n; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "key%07ld", i);
+        locks_acquire_user(keys[i]);
+        locks_release_user(keys[i]);
+        if ((i & 1023) == 0 && now_ns() > deadline) return -1;
+    }
+    return 0;
+}
+
+/* ---------- Auth ---------- */
+
+static void *auth_thread(void *arg) {
+    ThreadCtx *c = arg;
+    char user[16], pass[16];
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        long i = (long)(xorshift(&c->rng) % (uint64_t)nkeys);
+        snprintf(user, sizeof(user), "user%07ld", i);
+        snprintf(pass, sizeof(pass), "pw%07ld", i);
+        uint64_t t0 = ticks();
+        int ok = auth_login(user, pass);
+        record(&c->res, t0, ticks());
+        if (!ok) {
+            fprintf(stderr, "auth_login failed for %s\n", user);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Writes users.txt directly: signing up n users one by one rescans the
+// file each time.
+static int auth_setup(long n) {
+    FILE *f = fopen("users.txt", "w");
+    if (!f) return -1;
+    for (long i = 0; i < n; i++) fprintf(f, "user%07ld pw%07ld\n", i, i);
+    if (fclose(f) != 0) return -1;
+    nkeys = n;
+    auth_init();
+    return 0;
+}
+
+/* ---------- Runner ---------- */
+
+static void report(const Bench *b, int nthreads, ThreadCtx *ctx, double secs) {
+    static uint64_t hist[HIST_BUCKETS];
+    memset(hist, 0, sizeof(hist));
+    uint64_t ops = 0, cycles = 0, max = 0;
+    for (int i = 0; i < nthreads; i++) {
+        ops += ctx[i].res.ops;
+        cycles += ctx[i].res.cycles;
+        if (ctx[i].res.max > max) max = ctx[i].res.max;
+        for (int k = 0; k < HIST_BUCKETS; k++) hist[k] += ctx[i].res.hist[k];
+    }
+
+    const double qs[] = { 0.5, 0.99, 0.999 };
+    double pns[3] = { 0 };
+    uint64_t seen = 0;
+    int qi = 0;
+    for (int k = 0; k < HIST_BUCKETS && qi < 3; k++) {
+        seen += hist[k];
+        while (qi < 3 && ops && seen >= (uint64_t)(qs[qi] * (double)ops + 0.5)) {
+            uint64_t v = hist_value(k);
+            pns[qi++] = (double)(v < max ? v : max) / tsc_per_ns;
+        }
+    }
+    double ops_sec = (double)ops / secs;
+    double cpo = ops ? (double)cycles / (double)ops : 0;
+    double max_ns = (double)max / tsc_per_ns;
+
+    if (cfg.json) {
+        printf("{\"bench\":\"%s\",\"param\":%ld,\"threads\":%d,\"ops\":%llu,\"secs\":%.3f,"
+               "\"ops_per_sec\":%.0f,\"cycles_per_op\":%.1f,\"p50_ns\":%.0f,\"p99_ns\":%.0f,"
+               "\"p999_ns\":%.0f,\"max_ns\":%.0f}\n",
+               b->name, b->param, nthreads, (unsigned long long)ops, secs, ops_sec, cpo,
+               pns[0], pns[1], pns[2], max_ns);
+    } else {
+        printf("%-12s %8ld %3d %12.0f %12.1f %10.0f %10.0f %10.0f %12.0f\n", b->name, b->param,
+               nthreads, ops_sec, cpo, pns[0], pns[1], pns[2], max_ns);
+    }
+    fflush(stdout);
+}
+
+static void skipped(const Bench *b, const char *why) {
+    if (cfg.json)
+        printf("{\"bench\":\"%s\",\"param\":%ld,\"skipped\":\"%s\"}\n", b->name, b->param, why);
+    else
+        printf("%-12s %8ld  skipped: %s\n", b->name, b->param, why);
+    fflush(stdout);
+}
+
+static void run_case(Bench *b, int nthreads) {
+    static ThreadCtx ctx[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+    memset(ctx, 0, sizeof(ThreadCtx) * (size_t)nthreads);
+
+    if (b->before) b->before(b, nthreads);
+    atomic_store(&stop, 0);
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+        ctx[i].bench = b;
+        ctx[i].id = i;
+        ctx[i].nthreads = nthreads;
+        ctx[i].rng = 0x9e3779b97f4a7c15ull * (uint64_t)(i + 1);
+        pthread_create(&threads[i], NULL, b->run, &ctx[i]);
+    }
+    struct timespec pause = { cfg.duration_ms / 1000, (cfg.duration_ms % 1000) * 1000000L };
+    while (nanosleep(&pause, &pause) != 0 && errno == EINTR)
+        ;
+    atomic_store(&stop, 1);
+    b->after(b, nthreads, threads);
+    double secs = (double)(now_ns() - t0) / 1e9;
+
+    report(b, nthreads, ctx, secs);
+}
+
+static void run_threads(Bench *b) {
+    for (int i = 0; i < cfg.threads.n; i++) {
+        int n = cfg.threads.list[i];
+        // Producer/consumer cases need both sides.
+        if (b->after != join_all && n > 1 && n % 2) n++;
+        run_case(b, n);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-b benches] [-t threads] [-k lock_keys] [-n users] [-d ms] [-B secs] [-J]\n"
+            "  -b client_queue,task_queue,locks,auth   (default: all)\n"
+            "  -t 1,2,4,8          thread counts\n"
+            "  -k 10,1000,100000,1000000   distinct lock keys\n"
+            "  -n 1000,10000,100000,1000000  registered users\n"
+            "  -d 500              milliseconds per case\n"
+            "  -B 10               seconds allowed to set up a case before it is skipped\n"
+            "  -J                  one JSON object per line\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "b:t:k:n:d:B:J")) != -1) {
+        switch (c) {
+        case 'b': cfg.only = optarg; break;
+        case 't': if (parse_list(optarg, &cfg.threads) != 0) { usage(argv[0]); return 1; } break;
+        case 'k': if (parse_list(optarg, &cfg.keys) != 0) { usage(argv[0]); return 1; } break;
+        case 'n': if (parse_list(optarg, &cfg.users) != 0) { usage(argv[0]); return 1; } break;
+        case 'd': cfg.duration_ms = atoi(optarg); break;
+        case 'B': cfg.budget_s = atoi(optarg); break;
+        case 'J': cfg.json = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (cfg.duration_ms <= 0 || cfg.budget_s <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // auth.c keeps users.txt in the working directory: use a scratch one.
+    char dir[] = "/tmp/microbench-XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) != 0) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    stats_init();
+    locks_init();
+    calibrate_tsc();
+    if (!cfg.json) {
+        printf("# tsc %.3f ticks/ns, %d ms per case; latency in ns\n", tsc_per_ns, cfg.duration_ms);
+        printf("%-12s %8s %3s %12s %12s %10s %10s %10s %12s\n", "bench", "param", "thr", "ops/s",
+               "cycles/op", "p50", "p99", "p999", "max");
+    }
+
+    Bench cq = { "client_queue", 0, client_queue_thread, client_queue_before, client_queue_after };
+    Bench tq = { "task_queue", 0, task_queue_thread, task_queue_before, task_queue_after };
+    if (selected(cq.name)) run_threads(&cq);
+    if (selected(tq.name)) run_threads(&tq);
+
+    if (selected("locks")) {
+        for (int i = 0; i < cfg.keys.n; i++) {
+            Bench b = { "locks", cfg.keys.list[i], locks_thread, NULL, join_all };
+            if (locks_setup(b.param) != 0) {
+                skipped(&b, "setup over budget");
+                continue;
+            }
+            run_threads(&b);
+        }
+    }
+
+    if (selected("auth")) {
+        for (int i = 0; i < cfg.users.n; i++) {
+            Bench b = { "auth", cfg.users.list[i], auth_thread, NULL, join_all };
+            if (auth_setup(b.param) != 0) {
+                skipped(&b, "cannot write users.txt");
+                continue;
+            }
+            run_threads(&b);
+        }
+        unlink("users.txt");
+    }
+
+    locks_destroy();
+    free(keys);
+    stats_destroy();
+    if (chdir("/") == 0) rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "process.h"
+#include "crc32c.h"
+#include "jobs.h"
+#include "kernels.h"
+#include "locks.h"
+#include "storage.h"
+
+#define PROCESS_USAGE \
+    "ERR: Usage: PROCESS <seconds> | PROCESS checksum|wc|compress <file> | PROCESS grep <file> <pattern>\n"
+
+typedef struct {
+    char user[64];
+    char op[16];
+    char file[128];
+    char pattern[256];          // grep only
+} FileJob;
+
+/* ---------- Jobs ---------- */
+
+// PROCESS <seconds>: simulated work, cancellable at any point.
+static int sleep_job(Job *job, void *arg, char *result, size_t result_len) {
+    int secs = *(int *)arg;
+    if (!jobs_sleep(job, secs * 1000)) return -1;
+    snprintf(result, result_len, "slept %d seconds", secs);
+    return 0;
+}
+
+static int job_cancelled(void *arg) {
+    return jobs_cancelled(arg);
+}
+
+// Store a derived output next to its source, like an UPLOAD would.
+static int store_output(const char *user, const char *name, const char *data, size_t len) {
+    StoragePut put;
+    locks_acquire_user(user);
+    int rc = storage_put_begin(&put, user, name, data, len, crc32c(0, data, len));
+    locks_release_user(user);
+    if (rc == 0) rc = storage_put_finish(&put);
+    return rc;
+}
+
+// PROCESS <op> <file>: run a kernel over the stored file (an mmap for
+// plain files) and write the result back as <file>.<op suffix>.
+static int file_job(Job *job, void *arg, char *result, size_t result_len) {
+    FileJob *fj = arg;
+
+    char filekey[256];
+    snprintf(filekey, sizeof(filekey), "%s/%s", fj->user, fj->file);
+    CachedFile *in = NULL;
+    locks_acquire(filekey);
+    int found = storage_open(fj->user, fj->file, &in) == 0;
+    locks_release(filekey);
+    if (!found) {
+        snprintf(result, result_len, "file not found");
+        return -1;
+    }
+
+    KernelCtx ctx = { job_cancelled, job };
+    char outname[160];
+    char *out = NULL;
+    size_t out_len = 0;
+    int rc = -1;
+
+    if (strcmp(fj->op, "checksum") == 0) {
+        uint32_t crc;
+        if ((rc = kernel_checksum(in->data, in->len, &ctx, &crc)) == 0) {
+            char line[200];
+            out_len = (size_t)snprintf(line, sizeof(line), "%08x  %s\n", crc, fj->file);
+            out = strdup(line);
+            snprintf(outname, sizeof(outname), "%s.crc32c", fj->file);
+            snprintf(result, result_len, "crc32c %08x", crc);
+        }
+    } else if (strcmp(fj->op, "wc") == 0) {
+        uint64_t lines, words;
+        if ((rc = kernel_wc(in->data, in->len, &ctx, &lines, &words)) == 0) {
+            char line[256];
+            out_len = (size_t)snprintf(line, sizeof(line), "%llu %llu %zu %s\n",
+                                       (unsigned long long)lines, (unsigned long long)words,
+                                       in->len, fj->file);
+            out = strdup(line);
+            snprintf(outname, sizeof(outname), "%s.wc", fj->file);
+            snprintf(result, result_len, "%llu lines %llu words %zu bytes",
+                     (unsigned long long)lines, (unsigned long long)words, in->len);
+        }
+    } else if (strcmp(fj->op, "grep") == 0) {
+        uint64_t matches;
+        if ((rc = kernel_grep(in->data, in->len, fj->pattern, &ctx, &out, &out_len, &matches)) == 0) {
+            snprintf(outname, sizeof(outname), "%s.grep", fj->file);
+            snprintf(result, result_len, "%llu matching lines", (unsigned long long)matches);
+        }
+    } else if (strcmp(fj->op, "compress") == 0) {
+        if ((rc = kernel_compress(in->data, in->len, &ctx, &out, &out_len)) == 0) {
+            snprintf(outname, sizeof(outname), "%s.lz", fj->file);
+            snprintf(result, result_len, "%zu -> %zu bytes", in->len, out_len);
+        }
+    }
+    file_cache_release(in);
+
+    if (rc != 0 || !out) {
+        free(out);
+        if (!jobs_cancelled(job)) snprintf(result, result_len, "processing failed");
+        return -1;
+    }
+
+    size_t used = strlen(result);
+    rc = store_output(fj->user, outname, out, out_len);
+    free(out);
+    if (rc == STORAGE_EQUOTA) {
+        snprintf(result, result_len, "quota exceeded writing %s", outname);
+        return -1;
+    }
+    if (rc != 0) {
+        snprintf(result, result_len, "could not write %s", outname);
+        return -1;
+    }
+    snprintf(result + used, result_len - used, " -> %s", outname);
+    return 0;
+}
+
+/* ---------- Commands ---------- */
+
+static char *submit_file_job(const char *user, const char *cmdline) {
+    FileJob *fj = calloc(1, sizeof(FileJob));
+    if (!fj) return strdup("ERR: Out of memory\n");
+    strncpy(fj->user, user, sizeof(fj->user) - 1);
+
+    int consumed = 0;
+    if (sscanf(cmdline, "PROCESS %15s %127s %n", fj->op, fj->file, &consumed) < 2) {
+        free(fj);
+        return strdup(PROCESS_USAGE);
+    }
+    if (strcmp(fj->op, "grep") == 0)
+        strncpy(fj->pattern, cmdline + consumed, sizeof(fj->pattern) - 1);
+
+    int known = strcmp(fj->op, "checksum") == 0 || strcmp(fj->op, "wc") == 0 ||
+                strcmp(fj->op, "compress") == 0 ||
+                (strcmp(fj->op, "grep") == 0 && fj->pattern[0]);
+    if (!known) {
+        free(fj);
+        return strdup(PROCESS_USAGE);
+    }
+
+    uint64_t id = jobs_submit(user, file_job, fj, free);
+    if (id == 0) return strdup("ERR: Too many jobs\n");
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "JOB %llu\n", (unsigned long long)id);
+    return strdup(buf);
+}
+
+char *process_submit(const char *user, const char *cmdline) {
+    int secs = 1;
+    char word[16] = "";
+    if (sscanf(cmdline, "PROCESS %15s", word) == 1 && (word[0] < '0' || word[0] > '9'))
+        return submit_file_job(user, cmdline);
+    sscanf(cmdline, "PROCESS %d", &secs);
+    if (secs < 0) secs = 0;
+
+    int *arg = malloc(sizeof(int));
+    if (!arg) return strdup("ERR: Out of memory\n");
+    *arg = secs;
+
+    uint64_t id = jobs_submit(user, sleep_job, arg, free);
+    if (id == 0) return strdup("ERR: Too many jobs\n");
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "JOB %llu\n", (unsigned long long)id);
+    return strdup(buf);
+}
+
+char *process_job_command(const char *user, const char *cmdline, int fd) {
+    char verb[16] = "";
+    unsigned long long id = 0;
+    int secs = JOBS_WAIT_MAX;
+    if (sscanf(cmdline, "JOB %15s %llu %d", verb, &id, &secs) < 2)
+        return strdup("ERR: Usage: JOB STATUS|WAIT|CANCEL <id>\n");
+
+    if (secs <= 0) secs = 1;
+    if (strcmp(verb, "STATUS") == 0) return jobs_status(user, id, 0);
+    if (strcmp(verb, "WAIT") == 0)
+        return fd >= 0 ? jobs_wait_fd(user, id, secs, fd) : jobs_status(user, id, secs);
+    if (strcmp(verb, "CANCEL") == 0) {
+        if (jobs_cancel(user, id) != 0) return strdup("ERR: No such running job\n");
+        // Usually long enough to see it stop.
+        return fd >= 0 ? jobs_wait_fd(user, id, 1, fd) : jobs_status(user, id, 1);
+    }
+    return strdup("ERR: Usage: JOB STATUS|WAIT|CANCEL <id>\n");
+}
@@ -0,0 +1,20 @@
+#ifndef PROCESS_H
+#define PROCESS_H
+
+// PROCESS and JOB commands. PROCESS queues a job and answers "JOB <id>"
+// right away; JOB STATUS|WAIT|CANCEL <id> query it. Both return a malloc'd
+// response line.
+//
+//   PROCESS <seconds>                  simulated work
+//   PROCESS checksum|wc|compress <file>
+//   PROCESS grep <file> <pattern>
+//
+// File jobs write their output back to the user's storage as
+// <file>.crc32c, .wc, .lz or .grep.
+char *process_submit(const char *user, const char *cmdline);
+
+// With fd >= 0, WAIT and CANCEL park fd with the job waiter instead of
+// blocking (see jobs_wait_fd) and return NULL once it owns fd.
+char *process_job_command(const char *user, const char *cmdline, int fd);
+
+#endif
@@ -4,6 +4,7 @@
 #include <signal.h>
 #include <stdatomic.h>
 #include "server.h"
+#include "stats.h"
 
 // Use the atomic version declared in server.h
 extern atomic_int server_running;
@@ -11,7 +12,7 @@ extern atomic_int server_running;
 // Initialize client queue
 void initClientQueue(ClientQueue *q, int capacity) {
     q->capacity = capacity;
-    q->buffer = malloc(sizeof(int) * capacity);
+    q->buffer = malloc(sizeof(ClientConn) * capacity);
     if (!q->buffer) {
         fprintf(stderr, "Error: malloc failed in initClientQueue\n");
         exit(EXIT_FAILURE);
@@ -24,24 +25,25 @@ void initClientQueue(ClientQueue *q, int capacity) {
     pthread_cond_init(&q->not_empty, NULL);
 }
 
-// Enqueue a client file descriptor
-void enqueueClient(ClientQueue *q, int client_fd) {
+// Enqueue an accepted connection
+void enqueueClient(ClientQueue *q, ClientConn conn) {
     pthread_mutex_lock(&q->lock);
 
     while (q->count == q->capacity) {
         pthread_cond_wait(&q->not_full, &q->lock);
     }
 
-    q->buffer[q->rear] = client_fd;
+    q->buffer[q->rear] = conn;
     q->rear = (q->rear + 1) % q->capacity;
     q->count++;
+    stats_gauge_set(STATS_CLIENT_QUEUE, q->count);
 
     pthread_cond_signal(&q->not_empty);
     pthread_mutex_unlock(&q->lock);
 }
 
-// Dequeue a client file descriptor (blocking)
-int dequeueClient(ClientQueue *q) {
+// Dequeue an accepted connection (blocking)
+ClientConn dequeueClient(ClientQueue *q) {
     pthread_mutex_lock(&q->lock);
 
     while (q->count == 0 && atomic_load(&server_running)) {
@@ -51,16 +53,18 @@ int dequeueClient(ClientQueue *q) {
     if (q->count == 0 && !atomic_load(&server_running)) {
         // Shutdown in progress — nothing to serve
         pthread_mutex_unlock(&q->lock);
-        return -1;
+        ClientConn none = { .fd = -1 };
+        return none;
     }
 
-    int fd = q->buffer[q->front];
+    ClientConn conn = q->buffer[q->front];
     q->front = (q->front + 1) % q->capacity;
     q->count--;
+    stats_gauge_set(STATS_CLIENT_QUEUE, q->count);
 
     pthread_cond_signal(&q->not_full);
     pthread_mutex_unlock(&q->lock);
-    return fd;
+    return conn;
 }
 
 // Destroy and free queue resources
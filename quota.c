@@ -0,0 +1,277 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "quota.h"
+#include "layout.h"
+
+#define USAGE_MAGIC 0x45474155u   // "UAGE"
+
+// Sidecar format. 'clean' is set only by quota_destroy(); a sidecar left
+// dirty by a crash is not trusted and gets rebuilt. The counters are only
+// written on shutdown: while running, the sidecar just has to say dirty.
+typedef struct {
+    uint32_t magic;
+    uint32_t clean;
+    int64_t bytes;
+    int64_t files;
+} UsageSidecar;
+
+typedef struct QuotaUser {
+    char username[64];
+    QuotaUsage usage;
+    int fd;                     // sidecar, opened lazily
+    int dirty;                  // the sidecar on disk says dirty
+    struct QuotaUser *next;
+} QuotaUser;
+
+typedef struct {
+    pthread_mutex_t lock;       // the chain and its users' counters
+    QuotaUser *users;
+} QuotaBucket;
+
+static QuotaBucket quota_buckets[QUOTA_BUCKETS];
+static uint64_t quota_limit = (uint64_t)QUOTA_DEFAULT_MB * 1024 * 1024;
+
+/* ---------- Sidecar ---------- */
+
+static void sidecar_path(char *out, size_t outlen, const char *user) {
+    char dir[512];
+    layout_user_dir(dir, sizeof(dir), user);
+    snprintf(out, outlen, "%s/.usage", dir);
+}
+
+static int sidecar_load(const char *user, QuotaUsage *out) {
+    char path[600];
+    sidecar_path(path, sizeof(path), user);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    UsageSidecar sc;
+    ssize_t r = pread(fd, &sc, sizeof(sc), 0);
+    close(fd);
+    if (r != (ssize_t)sizeof(sc) || sc.magic != USAGE_MAGIC || !sc.clean) return -1;
+
+    out->bytes = sc.bytes;
+    out->files = sc.files;
+    return 0;
+}
+
+// Caller holds the user's bucket lock.
+static int sidecar_store(QuotaUser *u, int clean) {
+    if (u->fd < 0) {
+        char dir[512], path[600];
+        mkdir(LAYOUT_ROOT, 0755);
+        layout_user_dir(dir, sizeof(dir), u->username);
+        mkdir(dir, 0755);
+        sidecar_path(path, sizeof(path), u->username);
+        u->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (u->fd < 0) {
+            perror("open usage sidecar");
+            return -1;
+        }
+    }
+
+    UsageSidecar sc = { USAGE_MAGIC, (uint32_t)clean, u->usage.bytes, u->usage.files };
+    if (pwrite(u->fd, &sc, sizeof(sc), 0) != (ssize_t)sizeof(sc)) {
+        perror("pwrite usage sidecar");
+        return -1;
+    }
+    return 0;
+}
+
+// The first charge after a clean start: from here on a crash must leave a
+// sidecar that is rebuilt, so the marker reaches the disk before the
+// charge is applied. If it cannot be written, removing the sidecar forces
+// the rebuild just as well. Returns -1 if neither worked. Caller holds the
+// user's bucket lock.
+static int sidecar_mark_dirty(QuotaUser *u) {
+    if (sidecar_store(u, 0) == 0 && fdatasync(u->fd) == 0) {
+        u->dirty = 1;
+        return 0;
+    }
+    perror("mark usage sidecar dirty");
+
+    char dir[512], path[600];
+    layout_user_dir(dir, sizeof(dir), u->username);
+    sidecar_path(path, sizeof(path), u->username);
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int ok = (unlink(path) == 0 || errno == ENOENT) && dfd >= 0 && fsync(dfd) == 0;
+    if (dfd >= 0) close(dfd);
+    if (!ok) {
+        perror("remove usage sidecar");
+        return -1;
+    }
+    if (u->fd >= 0) close(u->fd);
+    u->fd = -1;                         // recreated by quota_destroy()
+    u->dirty = 1;
+    return 0;
+}
+
+/* ---------- User Table ---------- */
+
+static const char *user_or_guest(const char *user) {
+    return (user && strlen(user)) ? user : "guest";
+}
+
+static QuotaBucket *bucket_of(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) h = (h ^ *p) * 16777619u;
+    return &quota_buckets[h % QUOTA_BUCKETS];
+}
+
+// Caller holds bucket_of(name)->lock.
+static QuotaUser *find_user(const char *name, int create) {
+    QuotaBucket *b = bucket_of(name);
+    QuotaUser *u = b->users;
+    while (u && strcmp(u->username, name) != 0) u = u->next;
+    if (u || !create) return u;
+
+    u = calloc(1, sizeof(QuotaUser));
+    if (!u) {
+        fprintf(stderr, "Memory alloc failed in quota find_user\n");
+        return NULL;
+    }
+    strncpy(u->username, name, sizeof(u->username) - 1);
+    u->fd = -1;
+    u->next = b->users;
+    b->users = u;
+    return u;
+}
+
+/* ---------- Startup Scan ---------- */
+
+typedef struct {
+    QuotaUser **users;
+    int count;
+    atomic_int next;
+    quota_scan_fn scan;
+} ScanJob;
+
+static void *scan_thread_main(void *arg) {
+    ScanJob *job = arg;
+    int i;
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+        QuotaUser *u = job->users[i];
+        QuotaUsage usage = {0, 0};
+        job->scan(u->username, &usage);
+
+        QuotaBucket *b = bucket_of(u->username);
+        pthread_mutex_lock(&b->lock);
+        u->usage = usage;
+        pthread_mutex_unlock(&b->lock);
+    }
+    return NULL;
+}
+
+void quota_init(uint64_t limit_bytes, quota_scan_fn scan) {
+    quota_limit = limit_bytes;
+    for (int b = 0; b < QUOTA_BUCKETS; b++) {
+        pthread_mutex_init(&quota_buckets[b].lock, NULL);
+        quota_buckets[b].users = NULL;
+    }
+
+    DIR *d = opendir(LAYOUT_ROOT);
+    if (!d) return;
+
+    ScanJob job = { NULL, 0, 0, scan };
+    int cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+
+        char path[1024];
+        snprintf(path, sizeof(path), LAYOUT_ROOT "/%s", e->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+
+        QuotaBucket *b = bucket_of(e->d_name);
+        pthread_mutex_lock(&b->lock);
+        QuotaUser *u = find_user(e->d_name, 1);
+        pthread_mutex_unlock(&b->lock);
+        if (!u || sidecar_load(u->username, &u->usage) == 0) continue;
+
+        if (job.count == cap) {
+            cap = cap ? cap * 2 : 16;
+            QuotaUser **n = realloc(job.users, (size_t)cap * sizeof(QuotaUser *));
+            if (!n) break;
+            job.users = n;
+        }
+        job.users[job.count++] = u;
+    }
+    closedir(d);
+
+    if (job.count > 0 && scan) {
+        pthread_t threads[QUOTA_SCAN_THREADS];
+        int n = job.count < QUOTA_SCAN_THREADS ? job.count : QUOTA_SCAN_THREADS;
+        for (int i = 0; i < n; i++) pthread_create(&threads[i], NULL, scan_thread_main, &job);
+        for (int i = 0; i < n; i++) pthread_join(threads[i], NULL);
+        fprintf(stderr, "[Quota] rebuilt usage for %d users\n", job.count);
+    }
+    free(job.users);
+}
+
+void quota_destroy(void) {
+    for (int b = 0; b < QUOTA_BUCKETS; b++) {
+        pthread_mutex_lock(&quota_buckets[b].lock);
+        QuotaUser *u = quota_buckets[b].users;
+        while (u) {
+            QuotaUser *next = u->next;
+            sidecar_store(u, 1);
+            if (u->fd >= 0) {
+                fsync(u->fd);
+                close(u->fd);
+            }
+            free(u);
+            u = next;
+        }
+        quota_buckets[b].users = NULL;
+        pthread_mutex_unlock(&quota_buckets[b].lock);
+    }
+}
+
+/* ---------- Accounting ---------- */
+
+int quota_charge(const char *user, int64_t delta_bytes, int64_t delta_files) {
+    const char *name = user_or_guest(user);
+    QuotaBucket *b = bucket_of(name);
+    pthread_mutex_lock(&b->lock);
+    QuotaUser *u = find_user(name, 1);
+    if (!u) {
+        pthread_mutex_unlock(&b->lock);
+        return -1;
+    }
+
+    if (delta_bytes > 0 && (uint64_t)(u->usage.bytes + delta_bytes) > quota_limit) {
+        pthread_mutex_unlock(&b->lock);
+        return -1;
+    }
+    if (!u->dirty && sidecar_mark_dirty(u) != 0) {
+        pthread_mutex_unlock(&b->lock);
+        return QUOTA_EIO;
+    }
+
+    u->usage.bytes += delta_bytes;
+    u->usage.files += delta_files;
+    if (u->usage.bytes < 0) u->usage.bytes = 0;
+    if (u->usage.files < 0) u->usage.files = 0;
+    pthread_mutex_unlock(&b->lock);
+    return 0;
+}
+
+void quota_get(const char *user, QuotaUsage *out, uint64_t *limit) {
+    const char *name = user_or_guest(user);
+    QuotaBucket *b = bucket_of(name);
+    pthread_mutex_lock(&b->lock);
+    QuotaUser *u = find_user(name, 0);
+    out->bytes = u ? u->usage.bytes : 0;
+    out->files = u ? u->usage.files : 0;
+    if (limit) *limit = quota_limit;
+    pthread_mutex_unlock(&b->lock);
+}
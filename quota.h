@@ -0,0 +1,33 @@
+#ifndef QUOTA_H
+#define QUOTA_H
+
+#include <stdint.h>
+
+#define QUOTA_DEFAULT_MB 1024          // per-user limit
+#define QUOTA_SCAN_THREADS 4
+#define QUOTA_BUCKETS 256               // users hashed by name, one lock each
+
+typedef struct {
+    int64_t bytes;
+    int64_t files;
+} QuotaUsage;
+
+// Computes a user's usage from scratch (used to rebuild missing sidecars).
+typedef void (*quota_scan_fn)(const char *user, QuotaUsage *out);
+
+// Per-user usage counters, maintained incrementally by UPLOAD/DELETE and
+// persisted in storage/<user>/.usage. At startup, users whose sidecar is
+// missing or was not closed cleanly are rescanned in parallel.
+void quota_init(uint64_t limit_bytes, quota_scan_fn scan);
+void quota_destroy(void);
+
+#define QUOTA_EIO (-2)
+
+// Apply a change to a user's usage. A change that grows usage past the
+// limit is refused (returns -1) and nothing is applied. Returns QUOTA_EIO,
+// also applying nothing, if the sidecar could not be marked dirty first.
+int quota_charge(const char *user, int64_t delta_bytes, int64_t delta_files);
+
+void quota_get(const char *user, QuotaUsage *out, uint64_t *limit);
+
+#endif
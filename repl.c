@@ -0,0 +1,814 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "repl.h"
+#include "storage.h"
+#include "layout.h"
+#include "locks.h"
+#include "crc32c.h"
+#include "stats.h"
+#include "log.h"
+
+#define REPL_LINE 512
+#define REPL_READ_BUF (64 * 1024)
+
+typedef struct {
+    uint64_t seq;
+    StorageEvent ev;
+    char user[64];
+    char name[128];
+} ReplRecord;
+
+static ReplRole role;
+
+// ===== Primary =====
+static ReplRecord *ring;                // record seq lives at seq % REPL_LOG_RECORDS
+static uint64_t log_head;               // last seq handed out
+static uint64_t epoch;                  // changes with every primary start
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t senders_done = PTHREAD_COND_INITIALIZER;
+static int primary_fd = -1;
+static pthread_t accept_thread;
+static int sender_fd[REPL_MAX_REPLICAS];        // under log_lock, -1 = free
+static uint64_t sender_next[REPL_MAX_REPLICAS];
+static int nsenders;
+static int stopping;
+
+// ===== Replica =====
+static char primary_host[256];
+static char primary_port[16];
+static int max_lag_ms;
+static pthread_t replica_thread;
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t retry_cond = PTHREAD_COND_INITIALIZER;
+static int replica_fd = -1;             // under conn_lock
+static int replica_stop;                // under conn_lock
+static uint64_t replica_epoch;
+static _Atomic uint64_t applied;
+static _Atomic uint64_t head_seen;
+static _Atomic uint64_t synced_at;      // primary's clock when applied last matched its head
+
+// Puts begun but not finished, so consecutive PUTs share a group commit
+// instead of waiting for an fsync each.
+static StoragePut pending[REPL_APPLY_BATCH];
+static int npending;
+static uint64_t pending_seq;
+static uint64_t head_seq, head_at;      // a HEAD that arrived behind the batch
+static uint64_t saved_seq;              // applied as of the last save_state
+static atomic_int connected;
+
+static void report(FILE *out, int json);
+
+/* ---------- Helper Functions ---------- */
+
+static int send_all(int fd, const void *buf, size_t len, int more) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t w = send(fd, p, len, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+static int send_line(int fd, int more, const char *fmt, ...) {
+    char line[REPL_LINE];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= sizeof(line)) return -1;
+    return send_all(fd, line, (size_t)n, more);
+}
+
+// Is name one of the lines of a newline-terminated list?
+static int list_has(const char *list, const char *name) {
+    size_t n = strlen(name);
+    for (const char *p = list; *p;) {
+        const char *e = strchr(p, '\n');
+        size_t len = e ? (size_t)(e - p) : strlen(p);
+        if (len == n && memcmp(p, name, n) == 0) return 1;
+        if (!e) break;
+        p = e + 1;
+    }
+    return 0;
+}
+
+static uint64_t wall_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void wait_ms(pthread_cond_t *cond, pthread_mutex_t *lock, int ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long)ms * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(cond, lock, &ts);
+}
+
+/* ---------- Primary: Mutation Log ---------- */
+
+static void log_mutation(StorageEvent ev, const char *user, const char *name) {
+    pthread_mutex_lock(&log_lock);
+    ReplRecord *r = &ring[++log_head % REPL_LOG_RECORDS];
+    r->seq = log_head;
+    r->ev = ev;
+    strncpy(r->user, user, sizeof(r->user) - 1);
+    r->user[sizeof(r->user) - 1] = '\0';
+    strncpy(r->name, name, sizeof(r->name) - 1);
+    r->name[sizeof(r->name) - 1] = '\0';
+    pthread_cond_broadcast(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+}
+
+/* ---------- Primary: Shipping ---------- */
+
+// Send the file as it is now: its contents, or a delete if it is gone.
+static int ship(int fd, uint64_t seq, const char *user, const char *name) {
+    char key[256];
+    snprintf(key, sizeof(key), "%s/%s", user, name);
+    size_t len;
+    CachedFile *f = NULL;
+    locks_acquire(key);
+    // storage_stat first: storage_open would fall back to "name@n" versions.
+    int rc = storage_stat(user, name, &len) == 0 ? storage_open(user, name, &f) : -1;
+    locks_release(key);
+
+    if (rc != 0) return send_line(fd, 0, "DEL %llu %s %s\n", (unsigned long long)seq, user, name);
+    rc = send_line(fd, 1, "PUT %llu %s %s %zu %08x\n", (unsigned long long)seq, user, name,
+                   f->len, f->crc);
+    if (rc == 0) rc = send_all(fd, f->data, f->len, 0);
+    file_cache_release(f);
+    return rc;
+}
+
+// Every user's file list and every file, as of now.
+static int snapshot(int fd, uint64_t seq) {
+    if (send_line(fd, 0, "SNAPSHOT %llu\n", (unsigned long long)seq) != 0) return -1;
+    DIR *d = opendir(LAYOUT_ROOT);
+    int rc = 0;
+    struct dirent *e;
+    while (d && rc == 0 && (e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        char path[1024];
+        struct stat st;
+        snprintf(path, sizeof(path), LAYOUT_ROOT "/%s", e->d_name);
+        if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+
+        const char *user = e->d_name;
+        locks_acquire_user(user);
+        char *names = storage_list(user);
+        locks_release_user(user);
+        if (!names) continue;
+        size_t len = strlen(names);
+        rc = send_line(fd, 1, "FILES %s %zu\n", user, len);
+        if (rc == 0) rc = send_all(fd, names, len, 0);
+        for (char *p = names; rc == 0 && *p;) {
+            char *nl = strchr(p, '\n');
+            if (nl) *nl = '\0';
+            if (*p) rc = ship(fd, 0, user, p);
+            if (!nl) break;
+            p = nl + 1;
+        }
+        free(names);
+    }
+    if (d) closedir(d);
+    if (rc == 0) rc = send_line(fd, 0, "SNAPSHOT END\n");
+    return rc;
+}
+
+static int read_handshake(int fd, char *line, size_t n) {
+    size_t len = 0;
+    while (len + 1 < n) {
+        ssize_t r = read(fd, line + len, 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        if (line[len] == '\n') break;
+        len++;
+    }
+    line[len] = '\0';
+    return 0;
+}
+
+static void *sender_main(void *arg) {
+    int slot = (int)(intptr_t)arg;
+    pthread_mutex_lock(&log_lock);
+    int fd = sender_fd[slot];
+    pthread_mutex_unlock(&log_lock);
+
+    char line[REPL_LINE];
+    unsigned long long their_epoch = 0, their_seq = 0;
+    if (read_handshake(fd, line, sizeof(line)) != 0 ||
+        sscanf(line, "REPL %llu %llu", &their_epoch, &their_seq) != 2 ||
+        send_line(fd, 0, "EPOCH %llu\n", (unsigned long long)epoch) != 0)
+        goto out;
+
+    // Resume from the log if it still holds what the replica is missing.
+    pthread_mutex_lock(&log_lock);
+    uint64_t next = their_seq + 1;
+    int resync = their_epoch != epoch || their_seq > log_head ||
+                 log_head - their_seq > REPL_LOG_RECORDS;
+    int head_sent = 0;
+    pthread_mutex_unlock(&log_lock);
+    log_info("[Repl] replica connected (slot %d, from seq %llu%s)", slot, their_seq,
+             resync ? ", snapshot" : "");
+
+    for (;;) {
+        if (resync) {
+            pthread_mutex_lock(&log_lock);
+            uint64_t seq = log_head;
+            pthread_mutex_unlock(&log_lock);
+            if (snapshot(fd, seq) != 0) break;
+            next = seq + 1;
+            resync = 0;
+            head_sent = 0;
+        }
+
+        pthread_mutex_lock(&log_lock);
+        sender_next[slot] = next;
+        while (!stopping && next > log_head) {
+            if (!head_sent) {
+                uint64_t head = log_head;
+                pthread_mutex_unlock(&log_lock);
+                if (send_line(fd, 0, "HEAD %llu %llu\n", (unsigned long long)head,
+                              (unsigned long long)wall_us()) != 0)
+                    goto out;
+                pthread_mutex_lock(&log_lock);
+                head_sent = 1;
+                continue;
+            }
+            uint64_t before = log_head;
+            wait_ms(&log_cond, &log_lock, REPL_HEARTBEAT_MS);
+            if (log_head == before) head_sent = 0;      // idle: heartbeat
+        }
+        if (stopping) {
+            pthread_mutex_unlock(&log_lock);
+            break;
+        }
+        if (log_head - next >= REPL_LOG_RECORDS) {
+            // Overwritten before we got to it.
+            pthread_mutex_unlock(&log_lock);
+            log_warn("[Repl] replica in slot %d fell behind the log; resending a snapshot", slot);
+            resync = 1;
+            continue;
+        }
+        ReplRecord rec = ring[next % REPL_LOG_RECORDS];
+        pthread_mutex_unlock(&log_lock);
+
+        if (ship(fd, rec.seq, rec.user, rec.name) != 0) break;
+        next++;
+        head_sent = 0;
+    }
+
+out:
+    close(fd);
+    pthread_mutex_lock(&log_lock);
+    sender_fd[slot] = -1;
+    nsenders--;
+    pthread_cond_broadcast(&senders_done);
+    pthread_mutex_unlock(&log_lock);
+    log_info("[Repl] replica in slot %d disconnected", slot);
+    return NULL;
+}
+
+static void *accept_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        int fd = accept4(primary_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;                      // repl_destroy shut the socket down
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        pthread_mutex_lock(&log_lock);
+        int slot = -1;
+        for (int i = 0; i < REPL_MAX_REPLICAS && !stopping; i++) {
+            if (sender_fd[i] < 0) {
+                slot = i;
+                break;
+            }
+        }
+        if (slot >= 0) {
+            sender_fd[slot] = fd;
+            sender_next[slot] = 0;
+            nsenders++;
+        }
+        pthread_mutex_unlock(&log_lock);
+        if (slot < 0) {
+            log_warn("[Repl] too many replicas; refusing one");
+            close(fd);
+            continue;
+        }
+
+        pthread_t t;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&t, &attr, sender_main, (void *)(intptr_t)slot) != 0) {
+            pthread_mutex_lock(&log_lock);
+            sender_fd[slot] = -1;
+            nsenders--;
+            pthread_mutex_unlock(&log_lock);
+            close(fd);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return NULL;
+}
+
+int repl_primary_init(int port) {
+    ring = calloc(REPL_LOG_RECORDS, sizeof(ReplRecord));
+    if (!ring) return -1;
+    for (int i = 0; i < REPL_MAX_REPLICAS; i++) sender_fd[i] = -1;
+    epoch = wall_us();
+
+    primary_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (primary_fd < 0) goto fail;
+    int opt = 1;
+    setsockopt(primary_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(primary_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(primary_fd, REPL_MAX_REPLICAS) < 0)
+        goto fail;
+
+    storage_add_hook(log_mutation);
+    stats_add_section(report);
+    role = REPL_PRIMARY;
+    pthread_create(&accept_thread, NULL, accept_main, NULL);
+    log_info("[Repl] serving the mutation log to replicas on port %d", port);
+    return 0;
+
+fail:
+    log_error("[Repl] cannot listen on port %d: %s", port, strerror(errno));
+    if (primary_fd >= 0) close(primary_fd);
+    primary_fd = -1;
+    free(ring);
+    ring = NULL;
+    return -1;
+}
+
+/* ---------- Replica: Reading ---------- */
+
+static void finish_puts(void);
+
+typedef struct {
+    int fd;
+    char buf[REPL_READ_BUF];
+    size_t pos, len;
+} Reader;
+
+static int reader_fill(Reader *r) {
+    if (r->pos > 0) {
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+    }
+    int flags = MSG_DONTWAIT;
+    for (;;) {
+        ssize_t n = recv(r->fd, r->buf + r->len, sizeof(r->buf) - r->len, flags);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN && flags) {
+            // Nothing more queued: finish the batch before waiting for more.
+            finish_puts();
+            flags = 0;
+            continue;
+        }
+        if (n <= 0) return -1;
+        r->len += (size_t)n;
+        return 0;
+    }
+}
+
+static int reader_line(Reader *r, char *out, size_t n) {
+    for (;;) {
+        char *nl = memchr(r->buf + r->pos, '\n', r->len - r->pos);
+        if (nl) {
+            size_t len = (size_t)(nl - (r->buf + r->pos));
+            if (len >= n) return -1;
+            memcpy(out, r->buf + r->pos, len);
+            out[len] = '\0';
+            r->pos += len + 1;
+            return 0;
+        }
+        if (r->len - r->pos >= n) return -1;
+        if (reader_fill(r) != 0) return -1;
+    }
+}
+
+static int reader_exact(Reader *r, char *out, size_t n) {
+    while (n > 0) {
+        if (r->pos == r->len && reader_fill(r) != 0) return -1;
+        size_t take = r->len - r->pos < n ? r->len - r->pos : n;
+        memcpy(out, r->buf + r->pos, take);
+        r->pos += take;
+        out += take;
+        n -= take;
+    }
+    return 0;
+}
+
+/* ---------- Replica: Applying ---------- */
+
+static void load_state(void) {
+    FILE *f = fopen(REPL_STATE_FILE, "r");
+    if (!f) return;
+    unsigned long long e, s;
+    if (fscanf(f, "%llu %llu", &e, &s) == 2) {
+        replica_epoch = e;
+        atomic_store(&applied, s);
+    }
+    fclose(f);
+}
+
+static void save_state(void) {
+    FILE *f = fopen(REPL_STATE_FILE ".tmp", "w");
+    if (!f) return;
+    fprintf(f, "%llu %llu\n", (unsigned long long)replica_epoch,
+            (unsigned long long)atomic_load(&applied));
+    if (fclose(f) == 0) rename(REPL_STATE_FILE ".tmp", REPL_STATE_FILE);
+}
+
+static void finish_puts(void) {
+    for (int i = 0; i < npending; i++) {
+        if (storage_put_finish(&pending[i]) != 0)
+            log_warn("[Replica] cannot apply %s/%s: write failed", pending[i].user, pending[i].name);
+    }
+    npending = 0;
+    if (pending_seq) atomic_store(&applied, pending_seq);
+    pending_seq = 0;
+
+    // The primary was at head_seq when it sent the HEAD; if we are too, we
+    // were in sync as of head_at. Persist the position once per HEAD.
+    if (head_at) {
+        if (atomic_load(&applied) >= head_seq) atomic_store(&synced_at, head_at);
+        head_at = 0;
+        if (atomic_load(&applied) != saved_seq) {
+            save_state();
+            saved_seq = atomic_load(&applied);
+        }
+    }
+}
+
+static void apply_put(const char *user, const char *name, const char *data, size_t len,
+                      uint32_t crc, uint64_t seq) {
+    locks_acquire_user(user);
+    int rc = storage_put_begin(&pending[npending], user, name, data, len, crc);
+    locks_release_user(user);
+    if (rc == 0)
+        npending++;
+    else
+        log_warn("[Replica] cannot apply %s/%s: %s", user, name,
+                 rc == STORAGE_EQUOTA ? "over quota" : "write failed");
+    if (seq) pending_seq = seq;
+    if (npending == REPL_APPLY_BATCH) finish_puts();
+}
+
+static void apply_delete(const char *user, const char *name) {
+    locks_acquire_user(user);
+    storage_delete(user, name);
+    locks_release_user(user);
+}
+
+// Delete the user's files that are not in keep.
+static void prune_user(const char *user, const char *keep) {
+    locks_acquire_user(user);
+    char *names = storage_list(user);
+    locks_release_user(user);
+    if (!names) return;
+    for (char *p = names; *p;) {
+        char *nl = strchr(p, '\n');
+        if (nl) *nl = '\0';
+        if (*p && !list_has(keep, p)) apply_delete(user, p);
+        if (!nl) break;
+        p = nl + 1;
+    }
+    free(names);
+}
+
+// End of a snapshot: users the primary no longer has lose their files.
+static void prune_users(const char *seen) {
+    DIR *d = opendir(LAYOUT_ROOT);
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.' || list_has(seen, e->d_name)) continue;
+        char path[1024];
+        struct stat st;
+        snprintf(path, sizeof(path), LAYOUT_ROOT "/%s", e->d_name);
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) prune_user(e->d_name, "");
+    }
+    closedir(d);
+}
+
+static int connect_primary(void) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(primary_host, primary_port, &hints, &res) != 0) return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Follow one connection until it drops. Returns -1 on a protocol error.
+static int follow(Reader *r) {
+    char line[REPL_LINE];
+    if (send_line(r->fd, 0, "REPL %llu %llu\n", (unsigned long long)replica_epoch,
+                  (unsigned long long)atomic_load(&applied)) != 0)
+        return 0;
+
+    char *seen = NULL;                  // users listed by the current snapshot
+    size_t seen_len = 0;
+    uint64_t snap_seq = 0;
+    saved_seq = atomic_load(&applied);
+    char *body = NULL;
+    int rc = 0;
+
+    while (reader_line(r, line, sizeof(line)) == 0) {
+        char user[64], name[128];
+        unsigned long long seq, e, at;
+        size_t len;
+        unsigned crc;
+
+        if (sscanf(line, "PUT %llu %63s %127s %zu %x", &seq, user, name, &len, &crc) == 5) {
+            if (len > REPL_MAX_FILE || !(body = malloc(len ? len : 1))) {
+                rc = -1;
+                break;
+            }
+            if (reader_exact(r, body, len) != 0) break;
+            if (crc32c(0, body, len) != crc) {
+                log_error("[Replica] checksum mismatch on %s/%s; reconnecting", user, name);
+                rc = -1;
+                break;
+            }
+            apply_put(user, name, body, len, crc, seq);
+            free(body);
+            body = NULL;
+            continue;
+        }
+        if (sscanf(line, "HEAD %llu %llu", &seq, &at) == 2) {
+            // Sent after every record once caught up, so it must not cut
+            // the batch short: it takes effect when the batch finishes.
+            atomic_store(&head_seen, seq);
+            head_seq = seq;
+            head_at = at;
+            if (!npending) finish_puts();
+            continue;
+        }
+
+        // Everything else sees the puts before it applied.
+        finish_puts();
+        if (sscanf(line, "EPOCH %llu", &e) == 1) {
+            if (e != replica_epoch) log_info("[Replica] following primary epoch %llu", e);
+            replica_epoch = e;
+            atomic_store(&connected, 1);
+        } else if (sscanf(line, "DEL %llu %63s %127s", &seq, user, name) == 3) {
+            apply_delete(user, name);
+            if (seq) atomic_store(&applied, seq);
+        } else if (strcmp(line, "SNAPSHOT END") == 0) {
+            prune_users(seen ? seen : "");
+            free(seen);
+            seen = NULL;
+            seen_len = 0;
+            atomic_store(&applied, snap_seq);
+            save_state();
+            saved_seq = atomic_load(&applied);
+            log_info("[Replica] snapshot applied up to seq %llu",
+                     (unsigned long long)atomic_load(&applied));
+        } else if (sscanf(line, "SNAPSHOT %llu", &seq) == 1) {
+            log_info("[Replica] receiving a snapshot at seq %llu", seq);
+            // Records inside carry seq 0; applied moves when it is complete.
+            snap_seq = seq;
+            free(seen);
+            seen = NULL;
+            seen_len = 0;
+        } else if (sscanf(line, "FILES %63s %zu", user, &len) == 2) {
+            char *names = len <= REPL_MAX_FILE ? malloc(len + 1) : NULL;
+            char *grown = realloc(seen, seen_len + strlen(user) + 2);
+            if (!names || !grown) {
+                free(names);
+                if (grown) seen = grown;
+                rc = -1;
+                break;
+            }
+            seen = grown;
+            seen_len += (size_t)sprintf(seen + seen_len, "%s\n", user);
+            if (reader_exact(r, names, len) != 0) {
+                free(names);
+                break;
+            }
+            names[len] = '\0';
+            prune_user(user, names);
+            free(names);
+        } else {
+            log_error("[Replica] unexpected line from primary: %s", line);
+            rc = -1;
+            break;
+        }
+    }
+    finish_puts();
+    free(body);
+    free(seen);
+    return rc;
+}
+
+static void *replica_main(void *arg) {
+    (void)arg;
+    static Reader reader;
+    for (;;) {
+        pthread_mutex_lock(&conn_lock);
+        int stop = replica_stop;
+        pthread_mutex_unlock(&conn_lock);
+        if (stop) break;
+
+        int fd = connect_primary();
+        if (fd >= 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            pthread_mutex_lock(&conn_lock);
+            replica_fd = replica_stop ? -1 : fd;
+            int follow_it = replica_fd >= 0;
+            pthread_mutex_unlock(&conn_lock);
+            if (follow_it) {
+                reader.fd = fd;
+                reader.pos = reader.len = 0;
+                follow(&reader);
+                atomic_store(&connected, 0);
+                save_state();
+                log_warn("[Replica] lost the primary at %s:%s; reconnecting", primary_host, primary_port);
+            }
+            pthread_mutex_lock(&conn_lock);
+            replica_fd = -1;
+            pthread_mutex_unlock(&conn_lock);
+            close(fd);
+        }
+
+        pthread_mutex_lock(&conn_lock);
+        if (!replica_stop) wait_ms(&retry_cond, &conn_lock, REPL_RETRY_MS);
+        pthread_mutex_unlock(&conn_lock);
+    }
+    return NULL;
+}
+
+int repl_replica_init(const char *primary, int lag_ms) {
+    const char *colon = strrchr(primary, ':');
+    if (!colon || colon == primary || (size_t)(colon - primary) >= sizeof(primary_host) ||
+        strlen(colon + 1) >= sizeof(primary_port)) {
+        log_error("[Replica] expected <host>:<port>, got %s", primary);
+        return -1;
+    }
+    memcpy(primary_host, primary, (size_t)(colon - primary));
+    primary_host[colon - primary] = '\0';
+    strcpy(primary_port, colon + 1);
+    max_lag_ms = lag_ms > 0 ? lag_ms : REPL_DEFAULT_MAX_LAG_MS;
+    load_state();
+
+    role = REPL_REPLICA;
+    stats_add_section(report);
+    pthread_create(&replica_thread, NULL, replica_main, NULL);
+    log_info("[Replica] following %s:%s from seq %llu", primary_host, primary_port,
+             (unsigned long long)atomic_load(&applied));
+    return 0;
+}
+
+/* ---------- Lifecycle ---------- */
+
+void repl_destroy(void) {
+    if (role == REPL_PRIMARY) {
+        pthread_mutex_lock(&log_lock);
+        stopping = 1;
+        pthread_cond_broadcast(&log_cond);
+        for (int i = 0; i < REPL_MAX_REPLICAS; i++)
+            if (sender_fd[i] >= 0) shutdown(sender_fd[i], SHUT_RDWR);
+        pthread_mutex_unlock(&log_lock);
+
+        shutdown(primary_fd, SHUT_RDWR);
+        pthread_join(accept_thread, NULL);
+        close(primary_fd);
+        primary_fd = -1;
+
+        pthread_mutex_lock(&log_lock);
+        while (nsenders > 0) pthread_cond_wait(&senders_done, &log_lock);
+        pthread_mutex_unlock(&log_lock);
+        free(ring);
+        ring = NULL;
+    } else if (role == REPL_REPLICA) {
+        pthread_mutex_lock(&conn_lock);
+        replica_stop = 1;
+        if (replica_fd >= 0) shutdown(replica_fd, SHUT_RDWR);
+        pthread_cond_broadcast(&retry_cond);
+        pthread_mutex_unlock(&conn_lock);
+        pthread_join(replica_thread, NULL);
+    }
+    role = REPL_NONE;
+}
+
+/* ---------- Requests ---------- */
+
+static uint64_t lag_ms(void) {
+    uint64_t synced = atomic_load(&synced_at);
+    if (!synced) return UINT64_MAX;
+    uint64_t now = wall_us();
+    return now > synced ? (now - synced) / 1000 : 0;
+}
+
+char *repl_refuse(CommandType cmd) {
+    if (role != REPL_REPLICA) return NULL;
+    switch (cmd) {
+    case CMD_UPLOAD:
+    case CMD_DELETE:
+    case CMD_SIGNUP:
+    case CMD_PROCESS:
+        return strdup("ERR: Read-only replica\n");
+    case CMD_LIST:
+    case CMD_DOWNLOAD:
+    case CMD_USAGE:
+    case CMD_VERSIONS:
+    case CMD_SEARCH: {
+        uint64_t lag = lag_ms();
+        if (lag <= (uint64_t)max_lag_ms) return NULL;
+        if (lag == UINT64_MAX) return strdup("ERR: Replica not in sync with the primary yet\n");
+        char buf[96];
+        snprintf(buf, sizeof(buf), "ERR: Replica is %llu ms behind the primary\n",
+                 (unsigned long long)lag);
+        return strdup(buf);
+    }
+    default:
+        return NULL;
+    }
+}
+
+// Replication lines for STATS.
+static void report(FILE *out, int json) {
+    ReplStatus rs;
+    repl_status(&rs);
+    long long lag = rs.lag_ms == UINT64_MAX ? -1 : (long long)rs.lag_ms;
+    if (rs.role == REPL_PRIMARY && json)
+        fprintf(out, ",\"replication\":{\"role\":\"primary\",\"seq\":%llu,\"replicas\":%d,\"behind\":%llu}",
+                (unsigned long long)rs.seq, rs.replicas, (unsigned long long)rs.behind);
+    else if (rs.role == REPL_PRIMARY)
+        fprintf(out, "replication primary seq %llu replicas %d behind %llu\n",
+                (unsigned long long)rs.seq, rs.replicas, (unsigned long long)rs.behind);
+    else if (rs.role == REPL_REPLICA && json)
+        fprintf(out, ",\"replication\":{\"role\":\"replica\",\"applied\":%llu,\"head\":%llu,\"lag_ms\":%lld,\"connected\":%d}",
+                (unsigned long long)rs.seq, (unsigned long long)rs.head, lag, rs.connected);
+    else if (rs.role == REPL_REPLICA)
+        fprintf(out, "replication replica applied %llu head %llu lag %lldms connected %d\n",
+                (unsigned long long)rs.seq, (unsigned long long)rs.head, lag, rs.connected);
+}
+
+void repl_status(ReplStatus *out) {
+    memset(out, 0, sizeof(*out));
+    out->role = role;
+    if (role == REPL_PRIMARY) {
+        pthread_mutex_lock(&log_lock);
+        out->seq = log_head;
+        out->replicas = nsenders;
+        for (int i = 0; i < REPL_MAX_REPLICAS; i++) {
+            if (sender_fd[i] < 0 || !sender_next[i]) continue;
+            uint64_t behind = log_head + 1 - sender_next[i];
+            if (behind > out->behind) out->behind = behind;
+        }
+        pthread_mutex_unlock(&log_lock);
+    } else if (role == REPL_REPLICA) {
+        out->seq = atomic_load(&applied);
+        out->head = atomic_load(&head_seen);
+        out->lag_ms = lag_ms();
+        out->connected = atomic_load(&connected);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include <stdint.h>
+#include "server.h"
+
+#define REPL_LOG_RECORDS 16384          // mutations a replica can catch up from
+#define REPL_MAX_REPLICAS 16
+#define REPL_HEARTBEAT_MS 200           // HEAD interval while the log is idle
+#define REPL_RETRY_MS 500               // replica reconnect interval
+#define REPL_APPLY_BATCH 64             // replica puts sharing a group commit
+#define REPL_DEFAULT_MAX_LAG_MS 5000
+#define REPL_MAX_FILE (64 * 1024 * 1024)
+#define REPL_STATE_FILE "replica.state"
+
+// Primary/replica log shipping. The primary (-L <port>) appends every
+// successful put and delete to an in-memory mutation log (user and name
+// only, under one short lock) and serves it to replicas over TCP, one
+// sender thread per replica, so a slow replica never holds up a write.
+// Senders ship the file as it is when the record goes out, so records
+// replay idempotently and a replica converges on the primary's state.
+// A replica that is new, restarted across a primary restart or fell more
+// than REPL_LOG_RECORDS behind gets a snapshot first.
+//
+// A replica (-D <host:port>) applies the stream through the storage layer
+// and serves LIST, DOWNLOAD, USAGE and VERSIONS. It refuses writes, and
+// refuses reads while its lag exceeds max_lag_ms. Lag is how old the
+// primary state the replica last fully matched is: the time since the
+// primary sent the last HEAD the replica had applied everything up to, by
+// the primary's clock, so hosts should share a synchronized clock.
+//
+// Wire format, primary to replica, after the replica's
+// "REPL <epoch> <seq>\n":
+//   EPOCH <epoch>\n
+//   SNAPSHOT <seq>\n ... SNAPSHOT END\n    full resync; records inside
+//   FILES <user> <len>\n<names>              have seq 0
+//   PUT <seq> <user> <name> <len> <crc>\n<body>
+//   DEL <seq> <user> <name>\n
+//   HEAD <seq> <wall_us>\n                   log head, when caught up
+
+typedef enum {
+    REPL_NONE,
+    REPL_PRIMARY,
+    REPL_REPLICA
+} ReplRole;
+
+typedef struct {
+    ReplRole role;
+    uint64_t seq;                       // primary: log head; replica: applied
+    uint64_t head;                      // replica: primary's head as last heard
+    uint64_t lag_ms;                    // replica: time since in sync
+    uint64_t behind;                    // primary: most records a replica is behind
+    int replicas;                       // primary: connected replicas
+    int connected;                      // replica: connected to the primary
+} ReplStatus;
+
+// Start serving the mutation log on port. Call after storage_init.
+int repl_primary_init(int port);
+
+// Start following the primary at "host:port". Call after storage_init.
+int repl_replica_init(const char *primary, int max_lag_ms);
+
+// Stop shipping or applying. Call before storage_destroy.
+void repl_destroy(void);
+
+// Response for a command this node must not serve (malloc'd), or NULL.
+char *repl_refuse(CommandType cmd);
+
+void repl_status(ReplStatus *out);
+
+#endif
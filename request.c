@@ -0,0 +1,197 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "request.h"
+#include "auth.h"
+#include "crc32c.h"
+#include "file_cache.h"
+#include "process.h"
+#include "repl.h"
+#include "stats.h"
+#include "trace.h"
+#include "watch.h"
+
+char *request_inline(CommandType cmd, const char *user, const char *cmdline, int *failed) {
+    char name[64], pass[64];
+    *failed = 0;
+
+    // ---------- Replica ----------
+    // Writes belong to the primary; reads wait until the replica is close
+    // enough behind it.
+    char *refused = repl_refuse(cmd);
+    if (refused) {
+        *failed = 1;
+        return refused;
+    }
+
+    // ---------- SIGNUP ----------
+    if (cmd == CMD_SIGNUP) {
+        sscanf(cmdline, "SIGNUP %63s %63s", name, pass);
+        bool ok = auth_signup(name, pass);
+        *failed = !ok;
+        return strdup(ok ? "SIGNUP OK\n" : "SIGNUP FAILED (exists)\n");
+    }
+
+    // ---------- LOGIN ----------
+    if (cmd == CMD_LOGIN) {
+        sscanf(cmdline, "LOGIN %63s %63s", name, pass);
+        bool ok = auth_login(name, pass);
+        *failed = !ok;
+        // Do NOT persist on server side — client will send USER header next time.
+        return strdup(ok ? "LOGIN OK\n" : "LOGIN FAILED\n");
+    }
+
+    // ---------- PROCESS / JOB / STATS / TRACE ----------
+    // Jobs run on the job executor; answer here without a worker so
+    // the connection is released as soon as the job is queued. STATS
+    // and TRACE are answered here too, so they work while the workers
+    // are busy.
+    if (cmd == CMD_PROCESS || cmd == CMD_JOB || cmd == CMD_STATS || cmd == CMD_TRACE) {
+        char *msg;
+        if (cmd == CMD_PROCESS)
+            msg = process_submit(user, cmdline);
+        else if (cmd == CMD_JOB)
+            msg = process_job_command(user, cmdline, -1);
+        else if (cmd == CMD_STATS)
+            msg = stats_report(strcmp(cmdline, "STATS JSON") == 0);
+        else
+            msg = trace_flush();
+        if (!msg) msg = strdup("ERR: Out of memory\n");
+        *failed = !msg || strncmp(msg, "ERR", 3) == 0;
+        return msg;
+    }
+
+    // ---------- WATCH ----------
+    // Only reaches here on a transport without a socket to hand over.
+    if (cmd == CMD_WATCH) {
+        *failed = 1;
+        return strdup("ERR: WATCH needs a TCP connection\n");
+    }
+
+    return NULL;
+}
+
+char *request_watch(int fd, const char *user, const char *cmdline, int *failed) {
+    *failed = 0;
+    int own = dup(fd);
+    char *msg = own >= 0 ? watch_subscribe(own, user, cmdline) : strdup("ERR: Out of file descriptors\n");
+    if (!msg) return NULL;
+    if (own >= 0) close(own);
+    *failed = 1;
+    return msg;
+}
+
+char *request_job(int fd, const char *user, const char *cmdline, int *failed) {
+    *failed = 0;
+    int own = dup(fd);
+    if (own < 0) {
+        *failed = 1;
+        return strdup("ERR: Out of file descriptors\n");
+    }
+    char *msg = process_job_command(user, cmdline, own);
+    if (!msg) return NULL;
+    close(own);
+    *failed = strncmp(msg, "ERR", 3) == 0;
+    return msg;
+}
+
+int request_task(Task *t, CommandType cmd, const char *cmdline) {
+    t->cmd = cmd;
+    if (cmd == CMD_UPLOAD) {
+        sscanf(cmdline, "UPLOAD %127s", t->filename);
+    } else if (cmd == CMD_LIST || cmd == CMD_DOWNLOAD || cmd == CMD_DELETE ||
+               cmd == CMD_USAGE || cmd == CMD_VERSIONS || cmd == CMD_SEARCH ||
+               request_blocking(cmd)) {
+        strncpy(t->data, cmdline, sizeof(t->data) - 1);
+        t->data_len = (int)strlen(t->data);
+        if (cmd == CMD_DOWNLOAD || cmd == CMD_DELETE || cmd == CMD_VERSIONS || cmd == CMD_SEARCH)
+            sscanf(cmdline, "%*s %127s", t->filename);
+    } else {
+        return -1;
+    }
+
+    // Ensure username default to guest if empty
+    if (strlen(t->username) == 0) strncpy(t->username, "guest", sizeof(t->username) - 1);
+    return 0;
+}
+
+int request_upload_packed(const char *cmdline) {
+    char filename[128];
+    char flag[4] = "";
+    sscanf(cmdline, "UPLOAD %127s %3s", filename, flag);
+    return strcmp(flag, "Z") == 0;
+}
+
+int request_upload_body(Task *t, int packed, const char *wire, size_t len) {
+    if (packed) {
+        long raw = lz_stream_decode(wire, len, t->data, MAX_PAYLOAD - 1);
+        if (raw < 0) return -1;
+        t->data_len = (int)raw;
+    } else {
+        if (len > MAX_PAYLOAD - 1) len = MAX_PAYLOAD - 1;
+        memcpy(t->data, wire, len);
+        t->data_len = (int)len;
+    }
+    t->crc = crc32c(0, t->data, (size_t)t->data_len);
+    return 0;
+}
+
+/* ---------- Task Results ---------- */
+
+TaskResult *task_result_new(void) {
+    TaskResult *res = calloc(1, sizeof(TaskResult));
+    if (!res) return NULL;
+    pthread_mutex_init(&res->lock, NULL);
+    pthread_cond_init(&res->cond, NULL);
+    return res;
+}
+
+void task_result_free(TaskResult *res) {
+    if (!res) return;
+    file_cache_release(res->body);
+    free(res->response);
+    pthread_cond_destroy(&res->cond);
+    pthread_mutex_destroy(&res->lock);
+    free(res);
+}
+
+void task_result_complete(TaskResult *res) {
+    if (res->complete) {
+        // Nobody waits on the condition: the callback takes it from here.
+        res->done = 1;
+        res->complete(res);
+        return;
+    }
+    pthread_mutex_lock(&res->lock);
+    res->done = 1;
+    pthread_cond_signal(&res->cond);
+    pthread_mutex_unlock(&res->lock);
+}
+
+int task_result_iov(TaskResult *res, struct iovec *iov, int *failed) {
+    int iovcnt = 0;
+    if (res->header[0]) {
+        iov[iovcnt].iov_base = res->header;
+        iov[iovcnt++].iov_len = strlen(res->header);
+    }
+    if (res->response) {
+        iov[iovcnt].iov_base = res->response;
+        iov[iovcnt++].iov_len = strlen(res->response);
+        *failed = res->failed || strncmp(res->response, "ERR", 3) == 0;
+    }
+    if (res->body && res->body_packed) {
+        iov[iovcnt].iov_base = res->body->packed;
+        iov[iovcnt++].iov_len = res->body->packed_len;
+    } else if (res->body && res->body_ranged) {
+        if (res->range_len > 0) {
+            iov[iovcnt].iov_base = (char *)res->body->data + res->range_off;
+            iov[iovcnt++].iov_len = res->range_len;
+        }
+    } else if (res->body && res->body->len > 0) {
+        iov[iovcnt].iov_base = (void *)res->body->data;
+        iov[iovcnt++].iov_len = res->body->len;
+    }
+    return iovcnt;
+}
@@ -0,0 +1,83 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "server.h"
+#include "lz.h"
+
+// Largest UPLOAD body read off the wire: a raw payload, or one stored
+// lz frame's worth of slack over it for "UPLOAD <file> Z".
+#define REQUEST_MAX_WIRE (LZ_STREAM_HEADER + LZ_FRAME_HEADER + MAX_PAYLOAD)
+
+// Request handling shared by the client thread pool (client_thread.c) and
+// the sharded event loops (shard.c). Both read "USER <name>\n<command>\n"
+// and an optional body their own way, then go through these.
+
+// Inline so the router can classify requests without the request layer.
+static inline CommandType request_command(const char *buf) {
+    if (strncmp(buf, "UPLOAD", 6) == 0)   return CMD_UPLOAD;
+    if (strncmp(buf, "PROCESS", 7) == 0)  return CMD_PROCESS;
+    if (strncmp(buf, "LIST", 4) == 0)     return CMD_LIST;
+    if (strncmp(buf, "DOWNLOAD", 8) == 0) return CMD_DOWNLOAD;
+    if (strncmp(buf, "DELETE", 6) == 0)   return CMD_DELETE;
+    if (strncmp(buf, "LOGIN", 5) == 0)    return CMD_LOGIN;
+    if (strncmp(buf, "SIGNUP", 6) == 0)   return CMD_SIGNUP;
+    if (strncmp(buf, "USAGE", 5) == 0)    return CMD_USAGE;
+    if (strncmp(buf, "VERSIONS", 8) == 0) return CMD_VERSIONS;
+    if (strncmp(buf, "JOB", 3) == 0)      return CMD_JOB;
+    if (strncmp(buf, "STATS", 5) == 0)    return CMD_STATS;
+    if (strncmp(buf, "TRACE", 5) == 0)    return CMD_TRACE;
+    if (strncmp(buf, "WATCH", 5) == 0)    return CMD_WATCH;
+    if (strncmp(buf, "SEARCH", 6) == 0)   return CMD_SEARCH;
+    return CMD_UNKNOWN;
+}
+
+// SIGNUP, LOGIN, PROCESS, JOB, STATS and TRACE are answered by the thread
+// that read the request; the event loops pass the request_blocking ones to
+// a worker and JOB to request_job. Returns the malloc'd reply, or NULL if
+// cmd runs on a worker.
+char *request_inline(CommandType cmd, const char *user, const char *cmdline, int *failed);
+
+// The inline commands that wait on file I/O: SIGNUP and LOGIN (the
+// password file) and TRACE (writes the trace file). The event loops hand
+// them to a worker (request_task) instead, which answers them with
+// request_inline.
+static inline int request_blocking(CommandType cmd) {
+    return cmd == CMD_SIGNUP || cmd == CMD_LOGIN || cmd == CMD_TRACE;
+}
+
+// WATCH: hands a copy of the connection to the watcher thread, which
+// answers and keeps it; the caller closes fd as usual. Returns NULL, or
+// the malloc'd reply if the watch could not start.
+char *request_watch(int fd, const char *user, const char *cmdline, int *failed);
+
+// JOB: WAIT and CANCEL hand a copy of the connection to the job waiter,
+// which answers it when the job is done, so no request thread is held for
+// the wait. Returns NULL if it did, else the malloc'd reply.
+char *request_job(int fd, const char *user, const char *cmdline, int *failed);
+
+// Fills in t for a worker command, apart from the UPLOAD body. Returns -1
+// for an unknown command.
+int request_task(Task *t, CommandType cmd, const char *cmdline);
+
+// "UPLOAD <file> Z": the body is an lz stream.
+int request_upload_packed(const char *cmdline);
+
+// Sets the UPLOAD body from what was read off the wire. Returns -1 for a
+// corrupt or oversized compressed body.
+int request_upload_body(Task *t, int packed, const char *wire, size_t len);
+
+TaskResult *task_result_new(void);
+void task_result_free(TaskResult *res);
+
+// Marks res done: wakes the client thread waiting on it, or hands it to
+// res->complete.
+void task_result_complete(TaskResult *res);
+
+// Reply for a finished task as up to 3 iovecs (header, text, file body).
+// Returns the count; *failed is set for an error reply.
+int task_result_iov(TaskResult *res, struct iovec *iov, int *failed);
+
+#endif
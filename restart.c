@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "restart.h"
+#include "server.h"
+#include "stats.h"
+#include "log.h"
+
+#define HANDOFF_REQUEST "HANDOFF\n"
+
+static char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int enabled;
+
+// New side: the sockets passed over and the connection to the old server,
+// which reaches EOF when it exits.
+static int inherited[RESTART_MAX_LISTENERS];
+static int ninherited;
+static int old_fd = -1;
+
+// Old side: our listeners and the handoff socket.
+static int listeners[RESTART_MAX_LISTENERS];
+static int nlisteners;
+static pthread_mutex_t listeners_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ctl_fd = -1;
+static int handed_off;
+static pthread_t ctl_thread;
+static int wake_fd = -1;
+
+/* ---------- Helper Functions ---------- */
+
+static void unix_addr(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, sock_path, sizeof(addr->sun_path));
+}
+
+/* ---------- New Server ---------- */
+
+int restart_init(const char *path) {
+    if (!path) return 0;
+    if (strlen(path) >= sizeof(sock_path)) {
+        log_error("[Restart] socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(sock_path, path);
+    enabled = 1;
+
+    struct sockaddr_un addr;
+    unix_addr(&addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        // Nothing running there (or a stale path): a cold start.
+        close(fd);
+        return 0;
+    }
+    if (write(fd, HANDOFF_REQUEST, strlen(HANDOFF_REQUEST)) < 0) {
+        close(fd);
+        return 0;
+    }
+
+    char line[64] = "";
+    char cbuf[CMSG_SPACE(sizeof(int) * RESTART_MAX_LISTENERS)];
+    struct iovec iov = { line, sizeof(line) - 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+    ssize_t r;
+    while ((r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (r <= 0) {
+        // The old server is already shutting down: wait for it, then
+        // start cold.
+        old_fd = fd;
+        return 0;
+    }
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(inherited, CMSG_DATA(cm), n * sizeof(int));
+        ninherited = (int)n;
+    }
+    if (msg.msg_flags & MSG_CTRUNC) log_warn("[Restart] some listeners were not passed over");
+    old_fd = fd;
+    log_info("[Restart] took over %d listener(s) from the running server", ninherited);
+    return ninherited;
+}
+
+void restart_wait(void) {
+    if (old_fd < 0) return;
+    uint64_t start = stats_now_us();
+    char c;
+    for (;;) {
+        struct pollfd pfd = { .fd = old_fd, .events = POLLIN };
+        int left = RESTART_WAIT_MS - (int)((stats_now_us() - start) / 1000);
+        if (left <= 0) {
+            log_warn("[Restart] previous server still running after %d ms; starting anyway",
+                     RESTART_WAIT_MS);
+            break;
+        }
+        int n = poll(&pfd, 1, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) continue;
+        ssize_t r = read(old_fd, &c, 1);
+        if (r == 0 || (r < 0 && errno != EINTR && errno != EAGAIN)) {
+            log_info("[Restart] previous server exited after %llu ms",
+                     (unsigned long long)((stats_now_us() - start) / 1000));
+            break;
+        }
+    }
+    close(old_fd);
+    old_fd = -1;
+}
+
+int restart_listener(int i) {
+    if (i < 0 || i >= ninherited) return -1;
+    int fd = inherited[i];
+    inherited[i] = -1;
+    return fd;
+}
+
+/* ---------- Old Server ---------- */
+
+void restart_register(int fd) {
+    pthread_mutex_lock(&listeners_lock);
+    if (nlisteners < RESTART_MAX_LISTENERS) listeners[nlisteners++] = fd;
+    pthread_mutex_unlock(&listeners_lock);
+}
+
+// Pass the listeners to the new server and shut down. The connection stays
+// open until this process exits, which is how the new server knows the
+// store is free.
+static void handoff(int fd) {
+    char req[sizeof(HANDOFF_REQUEST)];
+    ssize_t r = read(fd, req, sizeof(req) - 1);
+    if (r != (ssize_t)strlen(HANDOFF_REQUEST) || memcmp(req, HANDOFF_REQUEST, (size_t)r) != 0) {
+        close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&listeners_lock);
+    int n = atomic_load(&server_running) ? nlisteners : 0;
+    char line[64];
+    int len = snprintf(line, sizeof(line), "LISTENERS %d\n", n);
+    char cbuf[CMSG_SPACE(sizeof(int) * RESTART_MAX_LISTENERS)];
+    memset(cbuf, 0, sizeof(cbuf));
+    struct iovec iov = { line, (size_t)len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (n > 0) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)n);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)n);
+        memcpy(CMSG_DATA(cm), listeners, sizeof(int) * (size_t)n);
+    }
+    ssize_t w;
+    while ((w = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    pthread_mutex_unlock(&listeners_lock);
+    if (w < 0) {
+        log_error("[Restart] handoff failed: %s", strerror(errno));
+        close(fd);
+        return;
+    }
+
+    log_info("[Restart] passed %d listener(s) to the new server; draining", n);
+    handed_off = 1;
+    atomic_store(&server_running, 0);
+    if (wake_fd >= 0) write(wake_fd, "x", 1);
+}
+
+static void *ctl_thread_main(void *arg) {
+    (void)arg;
+    while (!handed_off) {
+        int fd = accept4(ctl_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;                      // restart_destroy shut the socket down
+        }
+        handoff(fd);
+    }
+    return NULL;
+}
+
+int restart_serve(int wake) {
+    if (!enabled) return 0;
+
+    // Leave out inherited sockets nobody claimed (the old server ran more
+    // shards); their queued connections are lost.
+    int unused = 0;
+    for (int i = 0; i < ninherited; i++) {
+        if (inherited[i] >= 0) {
+            close(inherited[i]);
+            inherited[i] = -1;
+            unused++;
+        }
+    }
+    if (unused) log_warn("[Restart] closed %d inherited listener(s) this server does not use", unused);
+
+    wake_fd = wake;
+
+    struct sockaddr_un addr;
+    unix_addr(&addr);
+    ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ctl_fd < 0) return -1;
+    unlink(sock_path);
+    if (bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(ctl_fd, 1) < 0) {
+        log_error("[Restart] cannot listen on %s: %s", sock_path, strerror(errno));
+        close(ctl_fd);
+        ctl_fd = -1;
+        return -1;
+    }
+    pthread_create(&ctl_thread, NULL, ctl_thread_main, NULL);
+    log_info("[Restart] accepting handoff requests on %s", sock_path);
+    return 0;
+}
+
+void restart_destroy(void) {
+    if (ctl_fd < 0) return;
+    // Wakes the blocked accept; after a handoff the path belongs to the
+    // new server.
+    shutdown(ctl_fd, SHUT_RDWR);
+    pthread_join(ctl_thread, NULL);
+    close(ctl_fd);
+    ctl_fd = -1;
+    if (!handed_off) unlink(sock_path);
+}
@@ -0,0 +1,34 @@
+#ifndef RESTART_H
+#define RESTART_H
+
+#define RESTART_MAX_LISTENERS 256       // as many as there can be shards
+#define RESTART_WAIT_MS 30000           // longest wait for the old server to drain
+
+// Hot restart (-R <path>). A server started with -R listens on a Unix
+// socket at path. A new server started with the same path connects to it
+// first; the old one passes its listening sockets over with SCM_RIGHTS,
+// stops accepting and drains. The new server waits for the old one to exit
+// before it opens storage, so the two never write the store at once, then
+// accepts on the inherited sockets. Connections that arrive in between
+// wait in the listen backlog instead of being refused.
+
+// Ask the server at path (may be NULL) for its listeners. Returns how
+// many were inherited; 0 if no server was running there.
+int restart_init(const char *path);
+
+// Wait until the previous server has exited (no-op if there was none).
+void restart_wait(void);
+
+// Inherited listener i, or -1. The caller takes ownership.
+int restart_listener(int i);
+
+// A listener to pass on to the next server.
+void restart_register(int fd);
+
+// Start taking handoff requests on path. After a handoff, server_running
+// drops to 0 and a byte is written to wake (if >= 0), as on SIGINT.
+int restart_serve(int wake);
+
+void restart_destroy(void);
+
+#endif
@@ -0,0 +1,999 @@
+// Request router: one endpoint in front of several servers. Each user lives
+// on one node, picked by a consistent-hash ring with virtual nodes, so adding
+// a node moves only the users whose ring points it takes over. The router
+// speaks the client protocol: it reads "USER <name>\n<command>\n", connects
+// to the owner (from a small pool of ready connections), replays those lines
+// and then copies bytes both ways until the node closes.
+//
+// ADDNODE <host:port> grows the ring online. The users that change owner
+// keep going to their old node until their files have been copied over;
+// while one user is copied, only that user's requests wait. It is only
+// taken from the router's own host.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "server.h"
+#include "request.h"
+#include "crc32c.h"
+#include "stats.h"
+#include "log.h"
+
+#define ROUTER_PORT 9000
+#define ROUTER_THREADS 32
+#define ROUTER_QUEUE 256
+#define ROUTER_MAX_NODES 32
+#define ROUTER_VNODES 160               // ring points per node
+// Each pooled connection holds a client thread on a classic node, which
+// has only MAX_CLIENTS (10), so the pool stays well below that and drains
+// when a node goes quiet.
+#define ROUTER_POOL 2                   // ready connections per node
+#define ROUTER_POOL_MAX 4
+#define ROUTER_POOL_IDLE_MS 2000        // pooled connections unused this long are closed
+#define ROUTER_HEAD 2048                // request lines read before routing
+#define ROUTER_BUF (64 * 1024)
+#define ROUTER_USER_BUCKETS 4096
+#define ROUTER_RETRY_MS 1000            // pool refill and migration retry
+#define ROUTER_USERS_FILE "router.users"
+#define ROUTER_NODES_FILE "router.nodes"
+
+typedef struct {
+    char addr[64];                      // "host:port"
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    pthread_mutex_t lock;
+    int idle[ROUTER_POOL_MAX];          // connected, nothing sent yet; oldest first
+    uint64_t idle_since[ROUTER_POOL_MAX];
+    int nidle;
+    uint64_t last_used_us;              // the pool is only refilled for busy nodes
+    atomic_ulong requests, errors, pool_hits, connects;
+} Node;
+
+typedef struct {
+    uint64_t point;
+    int node;
+} VNode;
+
+typedef struct {
+    VNode *v;
+    int n;
+} Ring;
+
+enum { USER_SETTLED, USER_PENDING, USER_MOVING };
+
+typedef struct User {
+    char name[MAX_NAME];
+    int inflight;                       // requests being forwarded
+    int state;                          // USER_PENDING: still on the old owner
+    struct User *next;
+} User;
+
+// ========== GLOBAL VARIABLES ==========
+atomic_int server_running = 1;
+static int listen_fd = -1;
+static ClientQueue g_client_queue;
+static int vnodes = ROUTER_VNODES;
+static int pool_size = ROUTER_POOL;
+
+static Node nodes[ROUTER_MAX_NODES];
+static atomic_int nnodes;
+
+// Routing state, under route_lock. While a rebalance runs, next_ring is
+// the grown ring: settled users route by it, pending ones by ring.
+static pthread_mutex_t route_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t route_cond = PTHREAD_COND_INITIALIZER;
+static Ring *ring, *next_ring;
+static User *users[ROUTER_USER_BUCKETS];
+static int nusers;
+static FILE *users_file;
+static User **moving;                   // users the rebalance still has to copy
+static int nmoving;
+static pthread_t migrate_thread;
+static int migrating;
+static pthread_cond_t retry_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_thread;
+
+/* ---------- Helper Functions ---------- */
+
+// FNV-1a, then a 64-bit finalizer so nearby names spread over the ring.
+static uint64_t hash_str(const char *s) {
+    uint64_t h = 1469598103934665603ull;
+    for (; *s; s++) h = (h ^ (unsigned char)*s) * 1099511628211ull;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+static int send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t w = send(fd, p, len, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+static void wait_ms(pthread_cond_t *cond, pthread_mutex_t *lock, int ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(cond, lock, &ts);
+}
+
+/* ---------- Ring ---------- */
+
+static int cmp_vnode(const void *a, const void *b) {
+    const VNode *x = a, *y = b;
+    if (x->point != y->point) return x->point < y->point ? -1 : 1;
+    return x->node - y->node;
+}
+
+// Ring over the first count nodes. A node's points depend only on its
+// address, so growing the ring leaves every other point where it was.
+static Ring *ring_build(int count) {
+    Ring *r = malloc(sizeof(Ring));
+    if (!r) return NULL;
+    r->n = count * vnodes;
+    r->v = malloc(sizeof(VNode) * (size_t)(r->n ? r->n : 1));
+    if (!r->v) {
+        free(r);
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < vnodes; j++) {
+            char key[96];
+            snprintf(key, sizeof(key), "%s#%d", nodes[i].addr, j);
+            r->v[i * vnodes + j] = (VNode){ hash_str(key), i };
+        }
+    }
+    qsort(r->v, (size_t)r->n, sizeof(VNode), cmp_vnode);
+    return r;
+}
+
+static void ring_free(Ring *r) {
+    if (r) free(r->v);
+    free(r);
+}
+
+// First point at or after the name's hash, wrapping around.
+static int ring_owner(const Ring *r, const char *name) {
+    uint64_t h = hash_str(name);
+    int lo = 0, hi = r->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (r->v[mid].point < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return r->v[lo == r->n ? 0 : lo].node;
+}
+
+/* ---------- Users ---------- */
+
+// The users the router has seen, so a rebalance knows whose files to move.
+// Persisted one name per line. Call with route_lock held.
+static User *user_get(const char *name, int record) {
+    uint64_t b = hash_str(name) % ROUTER_USER_BUCKETS;
+    for (User *u = users[b]; u; u = u->next)
+        if (strcmp(u->name, name) == 0) return u;
+
+    User *u = calloc(1, sizeof(User));
+    if (!u) return NULL;
+    strncpy(u->name, name, sizeof(u->name) - 1);
+    u->next = users[b];
+    users[b] = u;
+    nusers++;
+    if (record && users_file) {
+        fprintf(users_file, "%s\n", name);
+        fflush(users_file);
+    }
+    return u;
+}
+
+static void users_load(void) {
+    FILE *f = fopen(ROUTER_USERS_FILE, "r");
+    char name[MAX_NAME];
+    while (f && fscanf(f, "%63s", name) == 1) user_get(name, 0);
+    if (f) fclose(f);
+    users_file = fopen(ROUTER_USERS_FILE, "a");
+    if (!users_file) log_warn("[Router] cannot open %s: %s", ROUTER_USERS_FILE, strerror(errno));
+}
+
+// Node for name's next request; counts it in flight so a rebalance waits
+// for it. Waits while the user's files are being moved.
+static int route_begin(const char *name, User **out) {
+    pthread_mutex_lock(&route_lock);
+    User *u = user_get(name, 1);
+    while (u && u->state == USER_MOVING) pthread_cond_wait(&route_cond, &route_lock);
+    const Ring *r = next_ring && (!u || u->state == USER_SETTLED) ? next_ring : ring;
+    int node = ring_owner(r, name);
+    if (u) u->inflight++;
+    pthread_mutex_unlock(&route_lock);
+    *out = u;
+    return node;
+}
+
+static void route_end(User *u) {
+    if (!u) return;
+    pthread_mutex_lock(&route_lock);
+    if (--u->inflight == 0) pthread_cond_broadcast(&route_cond);
+    pthread_mutex_unlock(&route_lock);
+}
+
+/* ---------- Nodes ---------- */
+
+static int node_resolve(const char *addr, struct sockaddr_storage *sa, socklen_t *salen) {
+    char host[64];
+    const char *colon = strrchr(addr, ':');
+    if (!colon || colon == addr || (size_t)(colon - addr) >= sizeof(host) ||
+        strlen(addr) >= sizeof(((Node *)0)->addr))
+        return -1;
+    memcpy(host, addr, (size_t)(colon - addr));
+    host[colon - addr] = '\0';
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) return -1;
+    memcpy(sa, res->ai_addr, res->ai_addrlen);
+    *salen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int node_find(const char *addr) {
+    int count = atomic_load(&nnodes);
+    for (int i = 0; i < count; i++)
+        if (strcmp(nodes[i].addr, addr) == 0) return i;
+    return -1;
+}
+
+static int node_connect(Node *n) {
+    int fd = socket(n->sa.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&n->sa, n->salen) != 0) {
+        close(fd);
+        return -1;
+    }
+    atomic_fetch_add(&n->connects, 1);
+    return fd;
+}
+
+// A connection to n: a pooled one if any is still open, else a new one.
+// *pooled tells the caller a failure may just mean the node closed it.
+static int node_get(Node *n, int *pooled) {
+    pthread_mutex_lock(&n->lock);
+    n->last_used_us = stats_now_us();
+    while (n->nidle > 0) {
+        int fd = n->idle[--n->nidle];
+        char c;
+        ssize_t r = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pthread_mutex_unlock(&n->lock);
+            pthread_cond_signal(&pool_cond);
+            atomic_fetch_add(&n->pool_hits, 1);
+            *pooled = 1;
+            return fd;
+        }
+        close(fd);                      // closed by the node (restart, drain)
+    }
+    pthread_mutex_unlock(&n->lock);
+    pthread_cond_signal(&pool_cond);
+    *pooled = 0;
+    return node_connect(n);
+}
+
+// Close pooled connections that have sat unused too long, so a quiet
+// router does not keep the nodes' client threads.
+static void pool_expire(Node *n, uint64_t now) {
+    pthread_mutex_lock(&n->lock);
+    int old = 0;
+    while (old < n->nidle && now - n->idle_since[old] > ROUTER_POOL_IDLE_MS * 1000ull) old++;
+    for (int i = 0; i < old; i++) close(n->idle[i]);
+    n->nidle -= old;
+    memmove(n->idle, n->idle + old, sizeof(int) * (size_t)n->nidle);
+    memmove(n->idle_since, n->idle_since + old, sizeof(uint64_t) * (size_t)n->nidle);
+    pthread_mutex_unlock(&n->lock);
+}
+
+// Keeps the pools of nodes in use topped up, so a request skips the
+// handshake.
+static void *pool_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&pool_lock);
+    while (atomic_load(&server_running)) {
+        int failed = 0;
+        int count = atomic_load(&nnodes);
+        for (int i = 0; i < count && atomic_load(&server_running); i++) {
+            Node *n = &nodes[i];
+            pool_expire(n, stats_now_us());
+            for (;;) {
+                pthread_mutex_lock(&n->lock);
+                int want = n->nidle < pool_size &&
+                           stats_now_us() - n->last_used_us < ROUTER_POOL_IDLE_MS * 1000ull;
+                pthread_mutex_unlock(&n->lock);
+                if (!want) break;
+
+                pthread_mutex_unlock(&pool_lock);
+                int fd = node_connect(n);
+                pthread_mutex_lock(&pool_lock);
+                if (fd < 0) {
+                    failed = 1;
+                    break;
+                }
+                pthread_mutex_lock(&n->lock);
+                if (n->nidle < pool_size) {
+                    n->idle_since[n->nidle] = stats_now_us();
+                    n->idle[n->nidle++] = fd;
+                    fd = -1;
+                }
+                pthread_mutex_unlock(&n->lock);
+                if (fd >= 0) close(fd);
+            }
+        }
+        if (!atomic_load(&server_running)) break;
+        wait_ms(&pool_cond, &pool_lock, failed ? ROUTER_RETRY_MS : ROUTER_POOL_IDLE_MS / 2);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+// Membership survives restarts: one address per line, and a node added by
+// an unfinished rebalance marked with '+', so it is finished on startup.
+static void nodes_save(void) {
+    FILE *f = fopen(ROUTER_NODES_FILE ".tmp", "w");
+    if (!f) return;
+    int count = atomic_load(&nnodes);
+    for (int i = 0; i < count; i++)
+        fprintf(f, "%s%s\n", next_ring && i == count - 1 ? "+" : "", nodes[i].addr);
+    if (fclose(f) == 0) rename(ROUTER_NODES_FILE ".tmp", ROUTER_NODES_FILE);
+}
+
+/* ---------- Forwarding ---------- */
+
+// Sends the request lines already read, then copies the rest of the request
+// to the node and its reply back until the node closes. *client_done is set
+// once the client has finished sending; *streamed counts body bytes passed
+// on after head. Returns reply bytes, or -1 if the node failed before
+// replying.
+static long pump(int cfd, int bfd, const char *head, size_t head_len, int *client_done,
+                 size_t *streamed, char first[4]) {
+    char buf[ROUTER_BUF];
+    long out = 0;
+    if (send_all(bfd, head, head_len) != 0) return -1;
+    if (*client_done) shutdown(bfd, SHUT_WR);
+
+    for (;;) {
+        struct pollfd p[2] = { { *client_done ? -1 : cfd, POLLIN, 0 }, { bfd, POLLIN, 0 } };
+        if (poll(p, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return out ? out : -1;
+        }
+        if (p[1].revents) {
+            ssize_t n = recv(bfd, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return n < 0 && out == 0 ? -1 : out;
+            if (out < 4) memcpy(first + out, buf, (size_t)(n < 4 - out ? n : 4 - out));
+            if (send_all(cfd, buf, (size_t)n) != 0) return out;   // client gone
+            out += n;
+        }
+        if (p[0].revents) {
+            ssize_t n = recv(cfd, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                *client_done = 1;
+                shutdown(bfd, SHUT_WR);
+            } else if (send_all(bfd, buf, (size_t)n) != 0) {
+                return out ? out : -1;
+            } else {
+                *streamed += (size_t)n;
+            }
+        }
+    }
+}
+
+// Forwards one request to node i. A pooled connection the node closed in
+// the meantime fails before anything was consumed, so it is retried once on
+// a new connection, unless body bytes already went to it.
+static int forward(int cfd, int i, const char *head, size_t head_len) {
+    Node *n = &nodes[i];
+    int client_done = 0;
+    size_t streamed = 0;
+    char first[4] = "";
+    atomic_fetch_add(&n->requests, 1);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int pooled;
+        int bfd = node_get(n, &pooled);
+        if (bfd < 0) break;
+        long out = pump(cfd, bfd, head, head_len, &client_done, &streamed, first);
+        close(bfd);
+        if (out >= 0) {
+            stats_bytes(head_len + streamed, (size_t)out);
+            return out == 0 || strncmp(first, "ERR", 3) == 0;
+        }
+        if (!pooled || streamed > 0) break;
+    }
+    atomic_fetch_add(&n->errors, 1);
+    send_all(cfd, "ERR: Node unavailable\n", 22);
+    return 1;
+}
+
+// Sends a whole request to node i and reads the reply (malloc'd, NUL
+// terminated). Returns its length, or -1.
+static long exchange(int i, const char *req, size_t len, char **reply) {
+    Node *n = &nodes[i];
+    *reply = NULL;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int pooled;
+        int fd = node_get(n, &pooled);
+        if (fd < 0) return -1;
+        size_t cap = 4096, got = 0;
+        char *buf = malloc(cap);
+        int rc = buf && send_all(fd, req, len) == 0 ? 0 : -1;
+        if (rc == 0) shutdown(fd, SHUT_WR);
+        while (rc == 0) {
+            if (got + 1 == cap) {
+                char *grown = realloc(buf, cap * 2);
+                if (!grown) {
+                    rc = -1;
+                    break;
+                }
+                buf = grown;
+                cap *= 2;
+            }
+            ssize_t r = recv(fd, buf + got, cap - got - 1, 0);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) rc = -1;
+            if (r <= 0) break;
+            got += (size_t)r;
+        }
+        close(fd);
+        if (rc == 0 && got > 0) {
+            buf[got] = '\0';
+            *reply = buf;
+            return (long)got;
+        }
+        free(buf);
+        if (!pooled) break;
+    }
+    return -1;
+}
+
+/* ---------- Accounts ---------- */
+
+// Accounts are only checked by LOGIN, on whichever node answers it. SIGNUP
+// goes to every node, so a user who later moves can still log in; the
+// owner's answer is the one returned.
+static char *signup(const char *name, const char *head, size_t len) {
+    User *u;
+    int owner = route_begin(name, &u);
+    route_end(u);
+    char *answer = NULL;
+    int count = atomic_load(&nnodes);
+    for (int i = 0; i < count; i++) {
+        char *reply;
+        if (exchange(i, head, len, &reply) < 0) continue;
+        if (i == owner) {
+            answer = reply;
+        } else {
+            free(reply);
+        }
+    }
+    return answer ? answer : strdup("ERR: Node unavailable\n");
+}
+
+// Tries the owner, then the other nodes: a node added after the SIGNUP
+// does not know the account.
+static char *login(const char *name, const char *head, size_t len) {
+    User *u;
+    int owner = route_begin(name, &u);
+    route_end(u);
+    char *answer = NULL;
+    if (exchange(owner, head, len, &answer) >= 0 && strncmp(answer, "LOGIN OK", 8) == 0)
+        return answer;
+    int count = atomic_load(&nnodes);
+    for (int i = 0; i < count; i++) {
+        char *reply;
+        if (i == owner || exchange(i, head, len, &reply) < 0) continue;
+        if (strncmp(reply, "LOGIN OK", 8) == 0) {
+            free(answer);
+            return reply;
+        }
+        free(reply);
+    }
+    return answer ? answer : strdup("ERR: Node unavailable\n");
+}
+
+/* ---------- Rebalancing ---------- */
+
+// Copies one file by downloading it from node from and uploading it to
+// node to, checking the size and checksum in between.
+static int copy_file(const char *user, const char *file, int from, int to) {
+    char req[512], *body, *reply;
+    size_t size;
+    unsigned crc;
+    int off = 0;
+    snprintf(req, sizeof(req), "USER %s\nDOWNLOAD %s\n", user, file);
+    long got = exchange(from, req, strlen(req), &body);
+    if (got < 0) return -1;
+    if (sscanf(body, "SIZE %zu CRC %x\n%n", &size, &crc, &off) != 2 || off == 0 ||
+        (size_t)got - (size_t)off != size || crc32c(0, body + off, size) != crc) {
+        free(body);
+        return -1;
+    }
+
+    // The upload request goes right before the body, in the same buffer.
+    int hl = snprintf(req, sizeof(req), "USER %s\nUPLOAD %s\n", user, file);
+    if (off < hl) {
+        char *grown = realloc(body, (size_t)hl + size + 1);
+        if (!grown) {
+            free(body);
+            return -1;
+        }
+        body = grown;
+        memmove(body + hl, body + off, size);
+        off = hl;
+    }
+    memcpy(body + off - hl, req, (size_t)hl);
+    int rc = exchange(to, body + off - hl, (size_t)hl + size, &reply) < 0 ? -1 : 0;
+    if (rc == 0 && strncmp(reply, "UPLOAD OK", 9) != 0) rc = -1;
+    if (reply) free(reply);
+    free(body);
+    return rc;
+}
+
+// Copies one user's files from node from to node to, then deletes the old
+// copies. Versions stay behind on the old node.
+static int move_user(const char *user, int from, int to) {
+    char req[512], *list, *reply;
+    snprintf(req, sizeof(req), "USER %s\nLIST\n", user);
+    if (exchange(from, req, strlen(req), &list) < 0) return -1;
+    if (strncmp(list, "ERR", 3) == 0) {
+        free(list);
+        return -1;
+    }
+    if (strcmp(list, "No files found\n") == 0) list[0] = '\0';
+
+    char *names = strdup(list), *save;
+    int rc = names ? 0 : -1;
+    for (char *p = strtok_r(list, "\n", &save); p && rc == 0; p = strtok_r(NULL, "\n", &save))
+        rc = copy_file(user, p, from, to);
+
+    // The new node has everything: delete the old copies.
+    for (char *p = rc == 0 ? strtok_r(names, "\n", &save) : NULL; p; p = strtok_r(NULL, "\n", &save)) {
+        snprintf(req, sizeof(req), "USER %s\nDELETE %s\n", user, p);
+        if (exchange(from, req, strlen(req), &reply) >= 0) free(reply);
+    }
+    free(names);
+    free(list);
+    if (rc != 0) return -1;
+    log_info("[Router] moved %s from %s to %s", user, nodes[from].addr, nodes[to].addr);
+    return 0;
+}
+
+// Moves every pending user, one at a time. Requests for a user wait only
+// while that user is copied. Failures are retried until the copy succeeds.
+static void *migrate_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&route_lock);
+    int left = nmoving;
+    while (left > 0 && atomic_load(&server_running)) {
+        left = 0;
+        for (int i = 0; i < nmoving && atomic_load(&server_running); i++) {
+            User *u = moving[i];
+            if (u->state != USER_PENDING) continue;
+            u->state = USER_MOVING;
+            while (u->inflight > 0) pthread_cond_wait(&route_cond, &route_lock);
+            int from = ring_owner(ring, u->name), to = ring_owner(next_ring, u->name);
+            pthread_mutex_unlock(&route_lock);
+
+            int rc = move_user(u->name, from, to);
+            if (rc != 0) log_warn("[Router] cannot move %s yet; will retry", u->name);
+
+            pthread_mutex_lock(&route_lock);
+            u->state = rc == 0 ? USER_SETTLED : USER_PENDING;
+            if (rc != 0) left++;
+            pthread_cond_broadcast(&route_cond);
+        }
+        if (left > 0) wait_ms(&retry_cond, &route_lock, ROUTER_RETRY_MS);
+    }
+    if (left == 0) {
+        ring_free(ring);
+        ring = next_ring;
+        next_ring = NULL;
+        free(moving);
+        moving = NULL;
+        nmoving = 0;
+        nodes_save();
+        log_info("[Router] rebalance done: %d nodes", atomic_load(&nnodes));
+    }
+    pthread_mutex_unlock(&route_lock);
+    return NULL;
+}
+
+// Grows the ring by addr. With move, the users it takes over are moved to
+// it in the background; without, it is a member already (startup).
+static char *add_node(const char *addr, int move) {
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    if (node_resolve(addr, &sa, &salen) != 0) return strdup("ERR: Bad node address\n");
+
+    pthread_mutex_lock(&route_lock);
+    char *err = NULL;
+    int count = atomic_load(&nnodes);
+    if (next_ring)
+        err = "ERR: Rebalance in progress\n";
+    else if (node_find(addr) >= 0)
+        err = "ERR: Node already in the ring\n";
+    else if (count == ROUTER_MAX_NODES)
+        err = "ERR: Too many nodes\n";
+    if (err) {
+        pthread_mutex_unlock(&route_lock);
+        return strdup(err);
+    }
+
+    // The slot is not visible to readers until nnodes grows, so it is
+    // filled in (and its mutex initialized) in place.
+    Node *n = &nodes[count];
+    memset(n, 0, sizeof(*n));
+    strcpy(n->addr, addr);
+    n->sa = sa;
+    n->salen = salen;
+    pthread_mutex_init(&n->lock, NULL);
+    Ring *grown = ring_build(count + 1);
+    moving = malloc(sizeof(User *) * (size_t)(nusers ? nusers : 1));
+    if (!grown || !moving) {
+        ring_free(grown);
+        free(moving);
+        moving = NULL;
+        pthread_mutex_destroy(&n->lock);
+        pthread_mutex_unlock(&route_lock);
+        return strdup("ERR: Out of memory\n");
+    }
+    nmoving = 0;
+    for (int b = 0; move && ring && b < ROUTER_USER_BUCKETS; b++) {
+        for (User *u = users[b]; u; u = u->next) {
+            if (ring_owner(ring, u->name) == ring_owner(grown, u->name)) continue;
+            u->state = USER_PENDING;
+            moving[nmoving++] = u;
+        }
+    }
+
+    atomic_store(&nnodes, count + 1);
+    int moved = nmoving;
+    if (nmoving == 0) {
+        ring_free(ring);
+        ring = grown;
+        free(moving);
+        moving = NULL;
+    } else {
+        // The previous rebalance has finished: it cleared next_ring.
+        next_ring = grown;
+        if (migrating) pthread_join(migrate_thread, NULL);
+        migrating = pthread_create(&migrate_thread, NULL, migrate_main, NULL) == 0;
+    }
+    if (move) nodes_save();
+    pthread_mutex_unlock(&route_lock);
+    pthread_cond_signal(&pool_cond);
+
+    if (move) log_info("[Router] added node %s; %d of %d users move to it", addr, moved, nusers);
+    char msg[128];
+    snprintf(msg, sizeof(msg), "ADDNODE OK: %d users to move\n", moved);
+    return strdup(msg);
+}
+
+/* ---------- Stats ---------- */
+
+static void report(FILE *out, int json) {
+    pthread_mutex_lock(&route_lock);
+    int count = atomic_load(&nnodes);
+    int users_on[ROUTER_MAX_NODES] = { 0 };
+    int pending = 0;
+    for (int b = 0; b < ROUTER_USER_BUCKETS; b++) {
+        for (User *u = users[b]; u; u = u->next) {
+            const Ring *r = next_ring && u->state == USER_SETTLED ? next_ring : ring;
+            if (r) users_on[ring_owner(r, u->name)]++;
+            pending += u->state != USER_SETTLED;
+        }
+    }
+    if (json)
+        fprintf(out, ",\"router\":{\"users\":%d,\"moving\":%d,\"nodes\":[", nusers, pending);
+    else
+        fprintf(out, "router nodes %d users %d moving %d\n", count, nusers, pending);
+    for (int i = 0; i < count; i++) {
+        Node *n = &nodes[i];
+        pthread_mutex_lock(&n->lock);
+        int idle = n->nidle;
+        pthread_mutex_unlock(&n->lock);
+        if (json)
+            fprintf(out, "%s{\"addr\":\"%s\",\"users\":%d,\"requests\":%lu,\"errors\":%lu,"
+                    "\"pool_idle\":%d,\"pool_hits\":%lu,\"connects\":%lu}",
+                    i ? "," : "", n->addr, users_on[i], atomic_load(&n->requests),
+                    atomic_load(&n->errors), idle, atomic_load(&n->pool_hits),
+                    atomic_load(&n->connects));
+        else
+            fprintf(out, "node %s users %d requests %lu errors %lu pool idle %d hits %lu connects %lu\n",
+                    n->addr, users_on[i], atomic_load(&n->requests), atomic_load(&n->errors),
+                    idle, atomic_load(&n->pool_hits), atomic_load(&n->connects));
+    }
+    if (json) fprintf(out, "]}");
+    pthread_mutex_unlock(&route_lock);
+}
+
+/* ---------- Connections ---------- */
+
+// ADDNODE decides where users' files go, so only the router's own host
+// may send it.
+static int peer_is_local(int fd) {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    if (getpeername(fd, (struct sockaddr *)&sa, &len) != 0 || sa.sin_family != AF_INET) return 0;
+    return (ntohl(sa.sin_addr.s_addr) >> 24) == 127;
+}
+
+static void reply_text(int fd, char *msg) {
+    if (!msg) msg = strdup("ERR: Out of memory\n");
+    if (msg) {
+        send_all(fd, msg, strlen(msg));
+        stats_bytes(0, strlen(msg));
+    }
+    free(msg);
+}
+
+// Reads until the request lines are in head: an optional "USER <name>\n"
+// and the command line. Body bytes read with them stay in head too.
+// Returns bytes read, or -1; *cmd_off is where the command line starts.
+static long read_head(int fd, char *head, size_t cap, size_t *cmd_off) {
+    size_t len = 0;
+    for (;;) {
+        char *nl = memchr(head, '\n', len);
+        *cmd_off = 0;
+        if (nl && strncmp(head, "USER ", 5) == 0) {
+            *cmd_off = (size_t)(nl + 1 - head);
+            nl = memchr(head + *cmd_off, '\n', len - *cmd_off);
+        }
+        if (nl) return (long)len;
+        if (len == cap - 1) return -1;
+        ssize_t r = recv(fd, head + len, cap - 1 - len, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        len += (size_t)r;
+        head[len] = '\0';
+    }
+}
+
+static int serve(int fd) {
+    char head[ROUTER_HEAD];
+    size_t cmd_off;
+    long len = read_head(fd, head, sizeof(head), &cmd_off);
+    if (len < 0) return CMD_UNKNOWN;
+
+    char user[MAX_NAME] = "guest", line[256], name[MAX_NAME] = "";
+    if (cmd_off) sscanf(head + 5, "%63s", user);
+    sscanf(head + cmd_off, "%255[^\n]", line);
+    CommandType cmd = request_command(line);
+    int failed = 0;
+
+    if (cmd == CMD_STATS) {
+        reply_text(fd, stats_report(strcmp(line, "STATS JSON") == 0));
+    } else if (strncmp(line, "ADDNODE ", 8) == 0 && !peer_is_local(fd)) {
+        reply_text(fd, strdup("ERR: ADDNODE is only accepted from the router's host\n"));
+        failed = 1;
+    } else if (strncmp(line, "ADDNODE ", 8) == 0) {
+        char addr[64] = "";
+        sscanf(line, "ADDNODE %63s", addr);
+        char *msg = add_node(addr, 1);
+        failed = strncmp(msg, "ERR", 3) == 0;
+        reply_text(fd, msg);
+    } else if (cmd == CMD_WATCH) {
+        // A watch would pin the user to its node and stall a move.
+        reply_text(fd, strdup("ERR: WATCH is not supported through the router\n"));
+        failed = 1;
+    } else if ((cmd == CMD_SIGNUP || cmd == CMD_LOGIN) &&
+               sscanf(line, "%*s %63s", name) == 1) {
+        char *msg = cmd == CMD_SIGNUP ? signup(name, head, (size_t)len)
+                                      : login(name, head, (size_t)len);
+        failed = strncmp(msg, cmd == CMD_SIGNUP ? "SIGNUP OK" : "LOGIN OK", 8) != 0;
+        reply_text(fd, msg);
+    } else {
+        User *u;
+        int node = route_begin(user, &u);
+        failed = forward(fd, node, head, (size_t)len);
+        route_end(u);
+    }
+    stats_request(cmd, failed);
+    return cmd;
+}
+
+static void *router_thread_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        ClientConn conn = dequeueClient(&g_client_queue);
+        if (conn.fd < 0) break;
+        int cmd = serve(conn.fd);
+        close(conn.fd);
+        stats_gauge_add(STATS_CONNECTIONS, -1);
+        stats_latency(cmd, STATS_TOTAL, stats_now_us() - conn.accepted_us);
+    }
+    return NULL;
+}
+
+/* ---------- Main ---------- */
+
+static void handle_sigint(int sig) {
+    (void)sig;
+    const char msg[] = "\n[Router] Caught SIGINT — shutting down...\n";
+    write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    atomic_store(&server_running, 0);
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int port = ROUTER_PORT;
+    int threads = ROUTER_THREADS;
+    int verbose = 0;
+    const char *seeds[ROUTER_MAX_NODES];
+    int nseeds = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:V:P:t:v")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            if (nseeds < ROUTER_MAX_NODES) seeds[nseeds++] = optarg;
+            break;
+        case 'V':
+            vnodes = atoi(optarg);
+            break;
+        case 'P':
+            pool_size = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s -n host:port [-n host:port ...] [-p port] [-V vnodes] [-P pool] [-t threads] [-v]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (vnodes < 1) vnodes = 1;
+    if (pool_size < 0) pool_size = 0;
+    if (pool_size > ROUTER_POOL_MAX) pool_size = ROUTER_POOL_MAX;
+    if (threads < 1) threads = 1;
+
+    log_init(verbose ? LOG_LEVEL_DEBUG : LOG_LEVEL_INFO);
+    signal(SIGINT, handle_sigint);
+    signal(SIGPIPE, SIG_IGN);
+    stats_init();
+    stats_add_section(report);
+    initClientQueue(&g_client_queue, ROUTER_QUEUE);
+    users_load();
+
+    // The saved membership wins over -n, which only seeds the first start;
+    // a node whose rebalance was interrupted ('+') resumes it.
+    char resume[64] = "";
+    int saved = 0;
+    FILE *f = fopen(ROUTER_NODES_FILE, "r");
+    char addr[80];
+    while (f && fscanf(f, "%79s", addr) == 1) {
+        saved = 1;
+        if (addr[0] == '+')
+            strncpy(resume, addr + 1, sizeof(resume) - 1);
+        else
+            free(add_node(addr, 0));
+    }
+    if (f) fclose(f);
+    for (int i = 0; i < nseeds; i++) {
+        if (!saved)
+            free(add_node(seeds[i], 0));
+        else if (node_find(seeds[i]) < 0 && strcmp(seeds[i], resume) != 0)
+            log_warn("[Router] %s is not in %s; add it with ADDNODE", seeds[i], ROUTER_NODES_FILE);
+    }
+    if (!saved) {
+        pthread_mutex_lock(&route_lock);
+        nodes_save();
+        pthread_mutex_unlock(&route_lock);
+    }
+    if (resume[0]) {
+        log_info("[Router] resuming the rebalance onto %s", resume);
+        free(add_node(resume, 1));
+    }
+    if (atomic_load(&nnodes) == 0) {
+        fprintf(stderr, "No nodes: give at least one -n host:port\n");
+        exit(EXIT_FAILURE);
+    }
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons((uint16_t)port),
+                              .sin_addr.s_addr = INADDR_ANY };
+    if (bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(listen_fd, 128) < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+    log_info("[Router] listening on port %d, %d nodes", port, atomic_load(&nnodes));
+
+    pthread_t *workers = malloc(sizeof(pthread_t) * (size_t)threads);
+    if (!workers) exit(EXIT_FAILURE);
+    for (int i = 0; i < threads; i++) pthread_create(&workers[i], NULL, router_thread_main, NULL);
+    pthread_create(&pool_thread, NULL, pool_main, NULL);
+
+    while (atomic_load(&server_running)) {
+        int fd = accept(listen_fd, NULL, NULL);
+        uint64_t accepted_us = stats_now_us();
+        if (!atomic_load(&server_running)) {
+            if (fd >= 0) close(fd);
+            break;
+        }
+        if (fd < 0) {
+            if (errno != EINTR) log_error("accept: %s", strerror(errno));
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        stats_gauge_add(STATS_CONNECTIONS, 1);
+        ClientConn conn = { fd, accepted_us, 0 };
+        enqueueClient(&g_client_queue, conn);
+    }
+
+    // Serve what was accepted, then stop the pool and any rebalance; an
+    // unfinished one resumes on the next start.
+    pthread_mutex_lock(&g_client_queue.lock);
+    pthread_cond_broadcast(&g_client_queue.not_empty);
+    pthread_mutex_unlock(&g_client_queue.lock);
+    for (int i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_mutex_lock(&pool_lock);
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    pthread_join(pool_thread, NULL);
+    pthread_mutex_lock(&route_lock);
+    pthread_cond_broadcast(&retry_cond);
+    pthread_mutex_unlock(&route_lock);
+    if (migrating) pthread_join(migrate_thread, NULL);
+
+    for (int i = 0; i < atomic_load(&nnodes); i++)
+        for (int j = 0; j < nodes[i].nidle; j++) close(nodes[i].idle[j]);
+    if (users_file) fclose(users_file);
+    destroyClientQueue(&g_client_queue);
+    stats_destroy();
+    log_info("[Router] Shutdown complete.");
+    log_destroy();
+    return 0;
+}
@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "scrub.h"
+#include "crc32c.h"
+#include "layout.h"
+#include "segstore.h"
+
+static pthread_t scrub_thread;
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_cond = PTHREAD_COND_INITIALIZER;
+static int scrub_running = 0;
+static int scrub_rate = SCRUB_DEFAULT_MB_PER_SEC;
+
+typedef struct {
+    struct timespec started;
+    unsigned long long bytes;
+    unsigned long files;
+    unsigned long mismatches;
+    char *buf;
+} ScrubPass;
+
+/* ---------- Helper Functions ---------- */
+
+static int still_running(void) {
+    pthread_mutex_lock(&scrub_lock);
+    int running = scrub_running;
+    pthread_mutex_unlock(&scrub_lock);
+    return running;
+}
+
+// Sleep until 'at' or until scrub_stop(). Returns 0 if stopped.
+static int sleep_until(const struct timespec *at) {
+    pthread_mutex_lock(&scrub_lock);
+    while (scrub_running) {
+        if (pthread_cond_timedwait(&scrub_cond, &scrub_lock, at) == ETIMEDOUT) break;
+    }
+    int running = scrub_running;
+    pthread_mutex_unlock(&scrub_lock);
+    return running;
+}
+
+// Token bucket with no burst: after each chunk, wait until the pass is no
+// further along than the rate allows.
+static int pace(ScrubPass *p) {
+    double secs = (double)p->bytes / ((double)scrub_rate * 1024 * 1024);
+    struct timespec at = p->started;
+    at.tv_sec += (time_t)secs;
+    at.tv_nsec += (long)((secs - (double)(time_t)secs) * 1e9);
+    if (at.tv_nsec >= 1000000000L) {
+        at.tv_sec++;
+        at.tv_nsec -= 1000000000L;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec > at.tv_sec || (now.tv_sec == at.tv_sec && now.tv_nsec >= at.tv_nsec))
+        return still_running();
+    return sleep_until(&at);
+}
+
+/* ---------- Verification ---------- */
+
+static int scrub_file(ScrubPass *p, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+    if (fd < 0) fd = open(path, O_RDONLY | O_CLOEXEC);   // O_NOATIME needs ownership
+    if (fd < 0) return still_running();
+
+    // Uploads replace files by rename, so the xattr and the data read
+    // through this fd always belong to the same version.
+    uint32_t stored;
+    if (crc32c_xattr_get(fd, &stored) != 0) {
+        close(fd);
+        return still_running();
+    }
+
+    uint32_t crc = 0;
+    off_t off = 0;
+    int ok = 1;
+    while (1) {
+        ssize_t r = pread(fd, p->buf, SCRUB_CHUNK, off);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "[Scrub] read error on %s: %s\n", path, strerror(errno));
+            ok = 0;
+            break;
+        }
+        if (r == 0) break;
+        crc = crc32c(crc, p->buf, (size_t)r);
+        off += r;
+        p->bytes += (unsigned long long)r;
+        if (!pace(p)) {
+            close(fd);
+            return 0;
+        }
+    }
+    // Don't leave cold files in the page cache on the scrubber's account.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+
+    p->files++;
+    if (ok && crc != stored) {
+        p->mismatches++;
+        fprintf(stderr, "[Scrub] CHECKSUM MISMATCH %s (stored %08x, read %08x)\n",
+                path, stored, crc);
+    }
+    return still_running();
+}
+
+static int pace_segment(void *arg, size_t bytes) {
+    ScrubPass *p = arg;
+    p->bytes += bytes;
+    return pace(p);
+}
+
+// Segment files carry a checksum per record instead of an xattr.
+static int scrub_segments(ScrubPass *p, const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return still_running();
+
+    int running = 1;
+    struct dirent *e;
+    while (running && (e = readdir(d)) != NULL) {
+        size_t n = strlen(e->d_name);
+        if (n < 5 || strcmp(e->d_name + n - 4, ".seg") != 0) continue;
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        running = segstore_scrub(path, pace_segment, p, &p->mismatches) && still_running();
+        p->files++;
+    }
+    closedir(d);
+    return running;
+}
+
+// Walk a user tree: shard directories, legacy flat files, kept versions and
+// segments. Other dot entries (temp files, sidecars) are skipped.
+static int scrub_dir(ScrubPass *p, const char *dir, int depth) {
+    DIR *d = opendir(dir);
+    if (!d) return still_running();
+
+    int running = 1;
+    struct dirent *e;
+    while (running && (e = readdir(d)) != NULL) {
+        int segments = depth == 0 && strcmp(e->d_name, ".seg") == 0;
+        if (e->d_name[0] == '.' && !segments &&
+            !(depth == 0 && strcmp(e->d_name, ".versions") == 0))
+            continue;
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (segments) {
+            running = scrub_segments(p, path);
+            continue;
+        }
+        struct stat st;
+        if (lstat(path, &st) != 0) continue;
+
+        if (S_ISDIR(st.st_mode) && depth < 2)
+            running = scrub_dir(p, path, depth + 1);
+        else if (S_ISREG(st.st_mode))
+            running = scrub_file(p, path);
+    }
+    closedir(d);
+    return running;
+}
+
+static void *scrub_thread_main(void *arg) {
+    (void)arg;
+
+    ScrubPass p;
+    p.buf = malloc(SCRUB_CHUNK);
+    if (!p.buf) {
+        fprintf(stderr, "Memory alloc failed in scrub thread\n");
+        return NULL;
+    }
+
+    while (still_running()) {
+        clock_gettime(CLOCK_REALTIME, &p.started);
+        p.bytes = 0;
+        p.files = 0;
+        p.mismatches = 0;
+
+        int running = 1;
+        DIR *d = opendir(LAYOUT_ROOT);
+        if (d) {
+            struct dirent *e;
+            while (running && (e = readdir(d)) != NULL) {
+                if (e->d_name[0] == '.') continue;
+                char udir[512];
+                layout_user_dir(udir, sizeof(udir), e->d_name);
+                running = scrub_dir(&p, udir, 0);
+            }
+            closedir(d);
+        }
+        if (!running) break;
+
+        if (p.files > 0)
+            fprintf(stderr, "[Scrub] pass done: %lu files, %llu bytes, %lu mismatches\n",
+                    p.files, p.bytes, p.mismatches);
+
+        struct timespec next;
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_sec += SCRUB_INTERVAL;
+        if (!sleep_until(&next)) break;
+    }
+
+    free(p.buf);
+    return NULL;
+}
+
+/* ---------- Lifecycle ---------- */
+
+void scrub_start(int mb_per_sec) {
+    if (mb_per_sec <= 0) return;
+
+    pthread_mutex_lock(&scrub_lock);
+    scrub_rate = mb_per_sec;
+    scrub_running = 1;
+    pthread_mutex_unlock(&scrub_lock);
+    pthread_create(&scrub_thread, NULL, scrub_thread_main, NULL);
+}
+
+void scrub_stop(void) {
+    pthread_mutex_lock(&scrub_lock);
+    int was_running = scrub_running;
+    scrub_running = 0;
+    pthread_cond_broadcast(&scrub_cond);
+    pthread_mutex_unlock(&scrub_lock);
+    if (was_running) pthread_join(scrub_thread, NULL);
+}
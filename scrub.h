@@ -0,0 +1,15 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+#define SCRUB_DEFAULT_MB_PER_SEC 8      // read rate, 0 disables the scrubber
+#define SCRUB_INTERVAL 3600             // seconds between full passes
+#define SCRUB_CHUNK (256 * 1024)
+
+// Background scrubber: re-reads every plain file (and kept version) that
+// carries a CRC32C xattr, and every segment record, and reports data that
+// no longer matches its checksum. Reads are paced to mb_per_sec so
+// scrubbing never competes with clients.
+void scrub_start(int mb_per_sec);
+void scrub_stop(void);
+
+#endif
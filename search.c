@@ -0,0 +1,513 @@
+// src/search.c
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "search.h"
+#include "layout.h"
+#include "storage.h"
+#include "stats.h"
+#include "log.h"
+
+#define INDEX_MAGIC 0x58444e49u   // "INDX"
+
+// Sidecar format: the header, then 'count' NUL-terminated names in sorted
+// order ('bytes' in all). 'clean' is cleared by the first change after the
+// index is loaded and set again only by search_destroy().
+typedef struct {
+    uint32_t magic;
+    uint32_t clean;
+    uint32_t count;
+    uint32_t bytes;
+} IndexSidecar;
+
+// The files whose names contain one bigram or trigram, as ascending ids.
+typedef struct {
+    uint32_t gram;              // 0 = free slot (names never contain NUL)
+    uint32_t count, cap;
+    uint32_t *ids;
+} Posting;
+
+typedef struct SearchUser {
+    char username[64];
+    pthread_rwlock_t lock;      // everything below
+    atomic_int loaded;
+    int dirty;                  // differs from the sidecar on disk
+    char **names;               // by id, NULL = free
+    uint32_t *free_ids;
+    uint32_t *order;            // ids sorted by name
+    uint32_t nids, nfree, count, ids_cap;
+    Posting *grams;             // open addressing, power-of-two size
+    uint32_t ngrams, grams_cap;
+    struct SearchUser *next;
+} SearchUser;
+
+static SearchUser *users[SEARCH_BUCKETS];
+static pthread_mutex_t users_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int loaded_users;         // for STATS
+static atomic_ullong indexed_names;
+
+static void report(FILE *out, int json);
+
+/* ---------- Helper Functions ---------- */
+
+static unsigned bucket_of(const char *user) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)user; *p; p++) h = (h ^ *p) * 16777619u;
+    return h % SEARCH_BUCKETS;
+}
+
+// Bigrams and trigrams share one table: a trigram's first byte is never
+// NUL, so its key is always above any bigram's.
+static uint32_t gram_at(const char *s, int n) {
+    const unsigned char *p = (const unsigned char *)s;
+    return n == 2 ? (uint32_t)p[0] << 8 | p[1] : (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+static int cmp_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void sidecar_path(char *out, size_t outlen, const char *user, const char *suffix) {
+    char dir[512];
+    layout_user_dir(dir, sizeof(dir), user);
+    snprintf(out, outlen, "%s/.index%s", dir, suffix);
+}
+
+/* ---------- Trigrams ---------- */
+
+static uint32_t gram_slot(uint32_t gram, uint32_t cap) {
+    uint32_t h = gram * 0x9e3779b1u;
+    return (h ^ h >> 15) & (cap - 1);
+}
+
+static int grams_grow(SearchUser *u) {
+    uint32_t cap = u->grams_cap ? u->grams_cap * 2 : 1024;
+    Posting *grams = calloc(cap, sizeof(Posting));
+    if (!grams) return -1;
+    for (uint32_t i = 0; i < u->grams_cap; i++) {
+        if (!u->grams[i].gram) continue;
+        uint32_t j = gram_slot(u->grams[i].gram, cap);
+        while (grams[j].gram) j = (j + 1) & (cap - 1);
+        grams[j] = u->grams[i];
+    }
+    free(u->grams);
+    u->grams = grams;
+    u->grams_cap = cap;
+    return 0;
+}
+
+// Posting for gram, added (empty) if create is set. Postings are never
+// removed: an emptied one is kept for the next name that needs it.
+static Posting *gram_find(SearchUser *u, uint32_t gram, int create) {
+    if (create && (u->ngrams + 1) * 10 > u->grams_cap * 7 && grams_grow(u) != 0) return NULL;
+    if (!u->grams_cap) return NULL;
+    for (uint32_t i = gram_slot(gram, u->grams_cap);; i = (i + 1) & (u->grams_cap - 1)) {
+        Posting *p = &u->grams[i];
+        if (p->gram == gram) return p;
+        if (p->gram) continue;
+        if (!create) return NULL;
+        p->gram = gram;
+        u->ngrams++;
+        return p;
+    }
+}
+
+static uint32_t posting_lower(const Posting *p, uint32_t id) {
+    uint32_t lo = 0, hi = p->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (p->ids[mid] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// A name can hold the same trigram twice, so both are idempotent.
+static int posting_add(Posting *p, uint32_t id) {
+    uint32_t i = posting_lower(p, id);
+    if (i < p->count && p->ids[i] == id) return 0;
+    if (p->count == p->cap) {
+        uint32_t cap = p->cap ? p->cap * 2 : 4;
+        uint32_t *ids = realloc(p->ids, cap * sizeof(uint32_t));
+        if (!ids) return -1;
+        p->ids = ids;
+        p->cap = cap;
+    }
+    memmove(p->ids + i + 1, p->ids + i, (p->count - i) * sizeof(uint32_t));
+    p->ids[i] = id;
+    p->count++;
+    return 0;
+}
+
+static void posting_remove(Posting *p, uint32_t id) {
+    uint32_t i = posting_lower(p, id);
+    if (i == p->count || p->ids[i] != id) return;
+    memmove(p->ids + i, p->ids + i + 1, (p->count - i - 1) * sizeof(uint32_t));
+    p->count--;
+}
+
+/* ---------- Index ---------- */
+
+// First position in the sorted order whose name is >= key.
+static uint32_t order_lower(const SearchUser *u, const char *key) {
+    uint32_t lo = 0, hi = u->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(u->names[u->order[mid]], key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int ids_grow(SearchUser *u) {
+    uint32_t cap = u->ids_cap ? u->ids_cap * 2 : 64;
+    char **names = realloc(u->names, cap * sizeof(char *));
+    if (names) u->names = names;
+    uint32_t *free_ids = realloc(u->free_ids, cap * sizeof(uint32_t));
+    if (free_ids) u->free_ids = free_ids;
+    uint32_t *order = realloc(u->order, cap * sizeof(uint32_t));
+    if (order) u->order = order;
+    if (!names || !free_ids || !order) return -1;
+    u->ids_cap = cap;
+    return 0;
+}
+
+// Returns 1 if name was added, 0 if it was already there.
+static int index_add(SearchUser *u, const char *name) {
+    uint32_t pos = order_lower(u, name);
+    if (pos < u->count && strcmp(u->names[u->order[pos]], name) == 0) return 0;
+    if (!u->nfree && u->nids == u->ids_cap && ids_grow(u) != 0) return -1;
+    char *copy = strdup(name);
+    if (!copy) return -1;
+
+    uint32_t id = u->nfree ? u->free_ids[--u->nfree] : u->nids++;
+    u->names[id] = copy;
+    memmove(u->order + pos + 1, u->order + pos, (u->count - pos) * sizeof(uint32_t));
+    u->order[pos] = id;
+    u->count++;
+    atomic_fetch_add(&indexed_names, 1);
+
+    for (size_t i = 0; name[i] && name[i + 1]; i++) {
+        for (int n = 2; n <= 3 && name[i + n - 1]; n++) {
+            Posting *p = gram_find(u, gram_at(name + i, n), 1);
+            if (!p || posting_add(p, id) != 0) {
+                log_error("[Search] out of memory indexing %s/%s", u->username, name);
+                return 1;
+            }
+        }
+    }
+    return 1;
+}
+
+// Returns 1 if name was removed, 0 if it was not there.
+static int index_remove(SearchUser *u, const char *name) {
+    uint32_t pos = order_lower(u, name);
+    if (pos == u->count || strcmp(u->names[u->order[pos]], name) != 0) return 0;
+
+    uint32_t id = u->order[pos];
+    for (size_t i = 0; name[i] && name[i + 1]; i++) {
+        for (int n = 2; n <= 3 && name[i + n - 1]; n++) {
+            Posting *p = gram_find(u, gram_at(name + i, n), 0);
+            if (p) posting_remove(p, id);
+        }
+    }
+    memmove(u->order + pos, u->order + pos + 1, (u->count - pos - 1) * sizeof(uint32_t));
+    u->count--;
+    atomic_fetch_sub(&indexed_names, 1);
+    free(u->names[id]);
+    u->names[id] = NULL;
+    u->free_ids[u->nfree++] = id;
+    return 1;
+}
+
+static void index_clear(SearchUser *u) {
+    atomic_fetch_sub(&indexed_names, u->count);
+    for (uint32_t i = 0; i < u->nids; i++) free(u->names[i]);
+    for (uint32_t i = 0; i < u->grams_cap; i++) free(u->grams[i].ids);
+    free(u->names);
+    free(u->free_ids);
+    free(u->order);
+    free(u->grams);
+    u->names = NULL;
+    u->free_ids = u->order = NULL;
+    u->grams = NULL;
+    u->nids = u->nfree = u->count = u->ids_cap = 0;
+    u->ngrams = u->grams_cap = 0;
+}
+
+/* ---------- Sidecar ---------- */
+
+static int sidecar_load(SearchUser *u) {
+    char path[600];
+    sidecar_path(path, sizeof(path), u->username, "");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    IndexSidecar sc;
+    struct stat st;
+    char *buf = NULL;
+    int rc = -1;
+    if (pread(fd, &sc, sizeof(sc), 0) != (ssize_t)sizeof(sc) || sc.magic != INDEX_MAGIC ||
+        !sc.clean || fstat(fd, &st) != 0 || (uint64_t)st.st_size != sizeof(sc) + (uint64_t)sc.bytes)
+        goto out;
+    buf = malloc(sc.bytes + 1);
+    if (!buf || pread(fd, buf, sc.bytes, sizeof(sc)) != (ssize_t)sc.bytes) goto out;
+    buf[sc.bytes] = '\0';
+
+    // Names come in order, so each lands at the end of the sorted order.
+    uint32_t n = 0;
+    for (char *p = buf; p < buf + sc.bytes; p += strlen(p) + 1, n++)
+        if (!*p || index_add(u, p) < 0) goto out;
+    rc = n == sc.count && u->count == sc.count ? 0 : -1;
+
+out:
+    free(buf);
+    close(fd);
+    return rc;
+}
+
+// Rebuild from what is on disk, when the sidecar is missing or stale.
+static int index_build(SearchUser *u) {
+    char *names = storage_list(u->username);
+    if (!names) return -1;
+
+    char *save = NULL;
+    for (char *name = strtok_r(names, "\n", &save); name; name = strtok_r(NULL, "\n", &save)) {
+        if (index_add(u, name) < 0) {
+            free(names);
+            return -1;
+        }
+    }
+    free(names);
+    log_debug("[Search] rebuilt index for %s (%u files)", u->username, u->count);
+    return 0;
+}
+
+// The first change after loading: a crash from here on must not leave a
+// sidecar that looks clean, so the marker is synced before the change is
+// indexed. Nothing to do if there is none.
+static void sidecar_mark_dirty(SearchUser *u) {
+    char path[600];
+    sidecar_path(path, sizeof(path), u->username, "");
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    uint32_t clean = 0;
+    if (pwrite(fd, &clean, sizeof(clean), offsetof(IndexSidecar, clean)) != (ssize_t)sizeof(clean) ||
+        fdatasync(fd) != 0)
+        perror("mark index sidecar dirty");
+    close(fd);
+}
+
+// Write the whole index out and rename it into place.
+static void sidecar_store(SearchUser *u) {
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < u->count; i++) bytes += strlen(u->names[u->order[i]]) + 1;
+    char *buf = malloc(sizeof(IndexSidecar) + bytes);
+    if (!buf) return;
+
+    IndexSidecar sc = { INDEX_MAGIC, 1, u->count, (uint32_t)bytes };
+    memcpy(buf, &sc, sizeof(sc));
+    char *p = buf + sizeof(sc);
+    for (uint32_t i = 0; i < u->count; i++) {
+        size_t n = strlen(u->names[u->order[i]]) + 1;
+        memcpy(p, u->names[u->order[i]], n);
+        p += n;
+    }
+
+    char dir[512], tmp[600], path[600];
+    mkdir(LAYOUT_ROOT, 0755);
+    layout_user_dir(dir, sizeof(dir), u->username);
+    mkdir(dir, 0755);
+    sidecar_path(tmp, sizeof(tmp), u->username, ".tmp");
+    sidecar_path(path, sizeof(path), u->username, "");
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    size_t total = sizeof(sc) + bytes;
+    if (fd < 0 || write(fd, buf, total) != (ssize_t)total || fsync(fd) != 0 ||
+        rename(tmp, path) != 0) {
+        perror("write index sidecar");
+        unlink(tmp);
+    }
+    if (fd >= 0) close(fd);
+    free(buf);
+}
+
+/* ---------- Users ---------- */
+
+// The user's index, loaded on first use: from the sidecar if it was closed
+// cleanly, else from a listing.
+static SearchUser *user_get(const char *username) {
+    unsigned b = bucket_of(username);
+    pthread_mutex_lock(&users_lock);
+    SearchUser *u = users[b];
+    while (u && strcmp(u->username, username) != 0) u = u->next;
+    if (!u) {
+        u = calloc(1, sizeof(SearchUser));
+        if (!u) {
+            pthread_mutex_unlock(&users_lock);
+            return NULL;
+        }
+        strncpy(u->username, username, sizeof(u->username) - 1);
+        pthread_rwlock_init(&u->lock, NULL);
+        u->next = users[b];
+        users[b] = u;
+    }
+    pthread_mutex_unlock(&users_lock);
+
+    if (atomic_load(&u->loaded)) return u;
+    pthread_rwlock_wrlock(&u->lock);
+    int ok = 1;
+    if (!atomic_load(&u->loaded)) {
+        if (sidecar_load(u) != 0) {
+            index_clear(u);
+            ok = index_build(u) == 0;
+            if (!ok) index_clear(u);
+            u->dirty = 1;
+        }
+        if (ok) {
+            atomic_store(&u->loaded, 1);
+            atomic_fetch_add(&loaded_users, 1);
+        }
+    }
+    pthread_rwlock_unlock(&u->lock);
+    return ok ? u : NULL;
+}
+
+// Storage hook. An upload's hook runs after it drops the user lock, so
+// hooks for one name can arrive out of order: rather than trust the
+// event, look at what storage holds now. A later change's hook waits for
+// the index lock, so it always runs after this look.
+static void on_change(StorageEvent ev, const char *user, const char *name) {
+    (void)ev;
+    SearchUser *u = user_get(user);
+    if (!u) return;
+
+    size_t len;
+    pthread_rwlock_wrlock(&u->lock);
+    int changed = storage_stat(user, name, &len) == 0 ? index_add(u, name) : index_remove(u, name);
+    if (changed > 0 && !u->dirty) {
+        sidecar_mark_dirty(u);
+        u->dirty = 1;
+    }
+    pthread_rwlock_unlock(&u->lock);
+}
+
+/* ---------- Lifecycle ---------- */
+
+void search_init(void) {
+    storage_add_hook(on_change);
+    stats_add_section(report);
+}
+
+void search_destroy(void) {
+    pthread_mutex_lock(&users_lock);
+    for (int b = 0; b < SEARCH_BUCKETS; b++) {
+        SearchUser *u = users[b];
+        while (u) {
+            SearchUser *next = u->next;
+            if (atomic_load(&u->loaded)) {
+                if (u->dirty) sidecar_store(u);
+                atomic_fetch_sub(&loaded_users, 1);
+            }
+            index_clear(u);
+            pthread_rwlock_destroy(&u->lock);
+            free(u);
+            u = next;
+        }
+        users[b] = NULL;
+    }
+    pthread_mutex_unlock(&users_lock);
+}
+
+/* ---------- SEARCH ---------- */
+
+char *search_query(const char *user, const char *pattern) {
+    SearchUser *u = user_get(user);
+    if (!u) return NULL;
+
+    size_t plen = strlen(pattern);
+    int prefix = plen > 0 && pattern[plen - 1] == '*';
+    char key[128];
+    snprintf(key, sizeof(key), "%.*s", (int)(prefix ? plen - 1 : plen), pattern);
+    plen = strlen(key);
+
+    pthread_rwlock_rdlock(&u->lock);
+    const char **hits = NULL;
+    uint32_t nhits = 0;
+
+    if (prefix) {
+        // Names with the prefix sort together, starting at the prefix.
+        hits = malloc(SEARCH_MAX_RESULTS * sizeof(char *));
+        for (uint32_t pos = order_lower(u, key);
+             hits && pos < u->count && nhits < SEARCH_MAX_RESULTS; pos++) {
+            const char *name = u->names[u->order[pos]];
+            if (strncmp(name, key, plen) != 0) break;
+            hits[nhits++] = name;
+        }
+    } else {
+        // Every match holds all of the key's trigrams (or its bigram): the
+        // shortest posting list bounds the candidates.
+        Posting *best = NULL;
+        int empty = 0;
+        int n = plen >= 3 ? 3 : 2;
+        for (size_t i = 0; plen >= 2 && i + n <= plen && !empty; i++) {
+            Posting *p = gram_find(u, gram_at(key + i, n), 0);
+            if (!p || !p->count) empty = 1;
+            else if (!best || p->count < best->count) best = p;
+        }
+
+        // Check the candidates and sort the matches, unless they are so
+        // dense that walking the names in order finds the first
+        // SEARCH_MAX_RESULTS sooner. A single byte has no posting list and
+        // always takes the walk.
+        if (best && (uint64_t)best->count * best->count <= (uint64_t)SEARCH_MAX_RESULTS * u->count) {
+            hits = malloc(best->count * sizeof(char *));
+            for (uint32_t i = 0; hits && i < best->count; i++) {
+                const char *name = u->names[best->ids[i]];
+                if (strstr(name, key)) hits[nhits++] = name;
+            }
+            if (hits) qsort(hits, nhits, sizeof(char *), cmp_names);
+            if (nhits > SEARCH_MAX_RESULTS) nhits = SEARCH_MAX_RESULTS;
+        } else if (!empty) {
+            hits = malloc(SEARCH_MAX_RESULTS * sizeof(char *));
+            for (uint32_t pos = 0; hits && pos < u->count && nhits < SEARCH_MAX_RESULTS; pos++) {
+                const char *name = u->names[u->order[pos]];
+                if (strstr(name, key)) hits[nhits++] = name;
+            }
+        }
+    }
+
+    size_t total = 1;
+    for (uint32_t i = 0; i < nhits; i++) total += strlen(hits[i]) + 1;
+    char *out = malloc(total);
+    if (out) {
+        char *p = out;
+        for (uint32_t i = 0; i < nhits; i++) {
+            size_t n = strlen(hits[i]);
+            memcpy(p, hits[i], n);
+            p[n] = '\n';
+            p += n + 1;
+        }
+        *p = '\0';
+    }
+    pthread_rwlock_unlock(&u->lock);
+    free(hits);
+    return out;
+}
+
+// Search lines for STATS: indexes loaded and the names in them.
+static void report(FILE *out, int json) {
+    int users_n = atomic_load(&loaded_users);
+    unsigned long long names = atomic_load(&indexed_names);
+    if (json)
+        fprintf(out, ",\"search\":{\"users\":%d,\"names\":%llu}", users_n, names);
+    else
+        fprintf(out, "search users %d names %llu\n", users_n, names);
+}
@@ -0,0 +1,31 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#define SEARCH_MAX_RESULTS 1000
+#define SEARCH_BUCKETS 256              // users hashed by name
+
+// Filename search (SEARCH). Each user has an in-memory index of their
+// file names: the names in sorted order, for prefix queries, and a
+// bigram/trigram index (every 2- and 3-byte substring -> the files
+// containing it), for substring queries. It is kept up to date by a
+// storage hook and persisted in storage/<user>/.index on shutdown; like
+// the quota sidecar, one not closed cleanly is not trusted and gets
+// rebuilt from a listing. A user's index is loaded the first time it is
+// searched or changed.
+//
+//   SEARCH <text>      names containing text
+//   SEARCH <prefix>*   names starting with prefix
+//
+// Matching is case-sensitive. A single byte of text is matched by
+// scanning the names.
+
+void search_init(void);
+
+// Call after the request threads are gone, before storage_destroy.
+void search_destroy(void);
+
+// Sorted, newline-terminated list of the first SEARCH_MAX_RESULTS matching
+// names (malloc'd, "" for none), or NULL if the index cannot be loaded.
+char *search_query(const char *user, const char *pattern);
+
+#endif
@@ -0,0 +1,961 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "segstore.h"
+#include "crc32c.h"
+#include "layout.h"
+
+#define SEG_MAGIC 0x32474553u   // "SEG2"
+#define SEG_MAGIC_V1 0x31474553u   // "SEG1": no crc, still replayed
+#define SEG_PUT 0
+#define SEG_DELETE 1
+
+// On-disk record: header, name bytes, data bytes.
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;
+    uint32_t name_len;
+    uint32_t data_len;
+    uint32_t checksum;      // FNV-1a over header (checksum = 0), name, data
+    uint32_t crc;           // CRC32C of data as uploaded (SEG1: unused)
+} SegRecord;
+
+typedef struct SegEntry {
+    char name[128];
+    uint32_t segment;       // segment id
+    uint64_t offset;        // offset of the record header
+    uint32_t length;        // data length
+    uint64_t seq;
+    uint32_t crc;           // CRC32C of the data
+    int deleted;            // tombstone, only kept while replaying
+    struct SegEntry *next;
+} SegEntry;
+
+typedef struct {
+    uint32_t id;
+    int fd;
+    uint64_t size;
+    uint64_t live;          // bytes of records still referenced by the index
+} Segment;
+
+typedef struct SegUser {
+    char username[64];
+    pthread_rwlock_t lock;
+    SegEntry **buckets;
+    size_t nbuckets, nentries;
+    Segment *segments;      // sorted by id; the last one is the active segment
+    int nsegments, capsegments;
+    uint64_t next_seq;
+    struct SegUser *next;
+} SegUser;
+
+static SegUser *seg_users = NULL;
+static pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t compact_thread;
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+static int compact_running = 0;
+
+/* ---------- Helper Functions ---------- */
+
+static uint32_t fnv1a_update(uint32_t h, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t record_checksum(const SegRecord *hdr, const char *name, const char *data) {
+    SegRecord tmp = *hdr;
+    tmp.checksum = 0;
+    uint32_t h = fnv1a_update(2166136261u, &tmp, sizeof(tmp));
+    h = fnv1a_update(h, name, hdr->name_len);
+    return fnv1a_update(h, data, hdr->data_len);
+}
+
+static uint64_t record_size(size_t name_len, size_t data_len) {
+    return sizeof(SegRecord) + name_len + data_len;
+}
+
+static uint32_t hash_name(const char *name) {
+    return fnv1a_update(2166136261u, name, strlen(name));
+}
+
+static void seg_dir(char *out, size_t outlen, const char *user) {
+    char dir[512];
+    layout_user_dir(dir, sizeof(dir), user);
+    snprintf(out, outlen, "%s/.seg", dir);
+}
+
+static void seg_path(char *out, size_t outlen, const char *user, uint32_t id) {
+    char dir[600];
+    seg_dir(dir, sizeof(dir), user);
+    snprintf(out, outlen, "%s/%08u.seg", dir, id);
+}
+
+static void fsync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+static int pread_all(int fd, void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = pread(fd, (char *)buf + done, len - done, off + (off_t)done);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) return -1;
+        done += (size_t)r;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = pwrite(fd, (const char *)buf + done, len - done, off + (off_t)done);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += (size_t)w;
+    }
+    return 0;
+}
+
+/* ---------- Index ---------- */
+
+static SegEntry *index_find(SegUser *u, const char *name) {
+    SegEntry *e = u->buckets[hash_name(name) % u->nbuckets];
+    while (e && strcmp(e->name, name) != 0) e = e->next;
+    return e;
+}
+
+static void index_grow(SegUser *u) {
+    size_t nb = u->nbuckets * 2;
+    SegEntry **buckets = calloc(nb, sizeof(SegEntry *));
+    if (!buckets) return;   // keep the old table, chains just get longer
+
+    for (size_t i = 0; i < u->nbuckets; i++) {
+        SegEntry *e = u->buckets[i];
+        while (e) {
+            SegEntry *next = e->next;
+            size_t b = hash_name(e->name) % nb;
+            e->next = buckets[b];
+            buckets[b] = e;
+            e = next;
+        }
+    }
+    free(u->buckets);
+    u->buckets = buckets;
+    u->nbuckets = nb;
+}
+
+static SegEntry *index_insert(SegUser *u, const char *name) {
+    if (u->nentries >= u->nbuckets * 2) index_grow(u);
+
+    SegEntry *e = calloc(1, sizeof(SegEntry));
+    if (!e) return NULL;
+    strncpy(e->name, name, sizeof(e->name) - 1);
+    size_t b = hash_name(name) % u->nbuckets;
+    e->next = u->buckets[b];
+    u->buckets[b] = e;
+    u->nentries++;
+    return e;
+}
+
+static void index_remove(SegUser *u, const char *name) {
+    SegEntry **pp = &u->buckets[hash_name(name) % u->nbuckets];
+    while (*pp) {
+        if (strcmp((*pp)->name, name) == 0) {
+            SegEntry *dead = *pp;
+            *pp = dead->next;
+            free(dead);
+            u->nentries--;
+            return;
+        }
+        pp = &(*pp)->next;
+    }
+}
+
+static Segment *find_segment(SegUser *u, uint32_t id) {
+    for (int i = 0; i < u->nsegments; i++) {
+        if (u->segments[i].id == id) return &u->segments[i];
+    }
+    return NULL;
+}
+
+// Drop the live-byte accounting for whatever the entry currently points at.
+static void entry_unaccount(SegUser *u, SegEntry *e) {
+    if (e->deleted) return;
+    Segment *s = find_segment(u, e->segment);
+    if (s) s->live -= record_size(strlen(e->name), e->length);
+}
+
+/* ---------- Segments ---------- */
+
+static Segment *add_segment(SegUser *u, uint32_t id, int fd, uint64_t size) {
+    if (u->nsegments == u->capsegments) {
+        int cap = u->capsegments ? u->capsegments * 2 : 8;
+        Segment *segs = realloc(u->segments, (size_t)cap * sizeof(Segment));
+        if (!segs) return NULL;
+        u->segments = segs;
+        u->capsegments = cap;
+    }
+    Segment *s = &u->segments[u->nsegments++];
+    s->id = id;
+    s->fd = fd;
+    s->size = size;
+    s->live = 0;
+    return s;
+}
+
+static Segment *open_new_segment(SegUser *u) {
+    char dir[600], path[700];
+    uint32_t id = u->nsegments ? u->segments[u->nsegments - 1].id + 1 : 1;
+
+    char userdir[512];
+    mkdir(LAYOUT_ROOT, 0755);
+    layout_user_dir(userdir, sizeof(userdir), u->username);
+    mkdir(userdir, 0755);
+    seg_dir(dir, sizeof(dir), u->username);
+    mkdir(dir, 0755);
+
+    seg_path(path, sizeof(path), u->username, id);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open segment");
+        return NULL;
+    }
+    // New segments are rare; make the directory entry durable right away so
+    // later group commits only need to flush segment data.
+    fsync_dir(dir);
+    return add_segment(u, id, fd, 0);
+}
+
+static Segment *active_segment(SegUser *u, uint64_t need) {
+    if (u->nsegments > 0) {
+        Segment *s = &u->segments[u->nsegments - 1];
+        if (s->size == 0 || s->size + need <= SEGSTORE_SEGMENT_MAX) return s;
+    }
+    return open_new_segment(u);
+}
+
+// Append one record to the active segment. Caller holds the write lock.
+static int append_record(SegUser *u, uint32_t type, uint64_t seq, const char *name,
+                         const char *data, size_t len, uint32_t crc, uint32_t *seg_id,
+                         uint64_t *offset, int *fd_out) {
+    size_t name_len = strlen(name);
+    uint64_t rsize = record_size(name_len, len);
+    Segment *s = active_segment(u, rsize);
+    if (!s) return -1;
+
+    char *buf = malloc(rsize);
+    if (!buf) return -1;
+
+    SegRecord hdr = {0};
+    hdr.magic = SEG_MAGIC;
+    hdr.type = type;
+    hdr.seq = seq;
+    hdr.name_len = (uint32_t)name_len;
+    hdr.data_len = (uint32_t)len;
+    hdr.crc = crc;
+    hdr.checksum = record_checksum(&hdr, name, data);
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), name, name_len);
+    if (len) memcpy(buf + sizeof(hdr) + name_len, data, len);
+
+    int rc = pwrite_all(s->fd, buf, rsize, (off_t)s->size);
+    free(buf);
+    if (rc != 0) {
+        perror("pwrite segment");
+        if (ftruncate(s->fd, (off_t)s->size) != 0) perror("ftruncate");
+        return -1;
+    }
+
+    if (seg_id) *seg_id = s->id;
+    if (offset) *offset = s->size;
+    if (fd_out) *fd_out = s->fd;
+    s->size += rsize;
+    return 0;
+}
+
+/* ---------- Replay ---------- */
+
+static void apply_record(SegUser *u, const SegRecord *hdr, const char *name,
+                         const char *data, uint32_t seg_id, uint64_t offset) {
+    SegEntry *e = index_find(u, name);
+    if (e && hdr->seq <= e->seq) return;   // superseded by something newer
+
+    if (!e) {
+        e = index_insert(u, name);
+        if (!e) return;
+    } else {
+        entry_unaccount(u, e);
+    }
+
+    e->seq = hdr->seq;
+    if (hdr->type == SEG_DELETE) {
+        e->deleted = 1;
+        return;
+    }
+    e->deleted = 0;
+    e->segment = seg_id;
+    e->offset = offset;
+    e->length = hdr->data_len;
+    e->crc = hdr->magic == SEG_MAGIC ? hdr->crc : crc32c(0, data, hdr->data_len);
+    Segment *s = find_segment(u, seg_id);
+    if (s) s->live += record_size(hdr->name_len, hdr->data_len);
+}
+
+// Whether a header can frame a record at all; its lengths are only
+// trusted after this.
+static int header_sane(const SegRecord *hdr) {
+    return (hdr->magic == SEG_MAGIC || hdr->magic == SEG_MAGIC_V1) && hdr->name_len > 0 &&
+           hdr->name_len < 128 && hdr->data_len <= SEGSTORE_SMALL_MAX;
+}
+
+// Read and check the record at off. Its body (name, then data) lands in
+// *buf. Returns -1 for anything that is not a whole, valid record.
+static int read_record(Segment *s, uint64_t off, uint64_t end, SegRecord *hdr,
+                       char **buf, size_t *bufcap, char name[128]) {
+    if (pread_all(s->fd, hdr, sizeof(*hdr), (off_t)off) != 0) return -1;
+    if (!header_sane(hdr) || off + record_size(hdr->name_len, hdr->data_len) > end) return -1;
+
+    size_t body = hdr->name_len + hdr->data_len;
+    if (body > *bufcap) {
+        char *nb = realloc(*buf, body);
+        if (!nb) return -1;
+        *buf = nb;
+        *bufcap = body;
+    }
+    if (pread_all(s->fd, *buf, body, (off_t)(off + sizeof(*hdr))) != 0) return -1;
+
+    memcpy(name, *buf, hdr->name_len);
+    name[hdr->name_len] = '\0';
+    return record_checksum(hdr, name, *buf + hdr->name_len) == hdr->checksum ? 0 : -1;
+}
+
+// The offset of the next record magic after a bad record, or end.
+static uint64_t next_magic(int fd, uint64_t off, uint64_t end) {
+    static __thread char chunk[64 * 1024];
+    while (off + sizeof(uint32_t) <= end) {
+        size_t want = end - off < sizeof(chunk) ? (size_t)(end - off) : sizeof(chunk);
+        if (pread_all(fd, chunk, want, (off_t)off) != 0) return end;
+        for (size_t i = 0; i + sizeof(uint32_t) <= want; i++) {
+            uint32_t m;
+            memcpy(&m, chunk + i, sizeof(m));
+            if (m == SEG_MAGIC || m == SEG_MAGIC_V1) return off + i;
+        }
+        off += want - (sizeof(uint32_t) - 1);   // a magic may straddle chunks
+    }
+    return end;
+}
+
+// A bad record in the middle (bit rot, a bad sector) is skipped: the scan
+// resumes at the next record that checks out, so later uploads survive.
+// Only a bad tail with nothing valid after it is a torn write from a
+// crash, and that is cut off.
+static void replay_segment(SegUser *u, Segment *s) {
+    struct stat st;
+    if (fstat(s->fd, &st) != 0) return;
+
+    uint64_t off = 0, good_end = 0, end = (uint64_t)st.st_size;
+    uint64_t skipped = 0;
+    char *buf = NULL;
+    size_t bufcap = 0;
+
+    while (off + sizeof(SegRecord) <= end) {
+        SegRecord hdr;
+        char name[128];
+        if (read_record(s, off, end, &hdr, &buf, &bufcap, name) != 0) {
+            uint64_t next = next_magic(s->fd, off + 1, end);
+            if (good_end == off) skipped = 0;
+            skipped += next - off;
+            off = next;
+            continue;
+        }
+        if (good_end < off)
+            fprintf(stderr, "[SegStore] skipped %llu unreadable bytes in %s segment %u at %llu\n",
+                    (unsigned long long)skipped, u->username, s->id, (unsigned long long)good_end);
+
+        apply_record(u, &hdr, name, buf + hdr.name_len, s->id, off);
+        if (hdr.seq >= u->next_seq) u->next_seq = hdr.seq + 1;
+        off += record_size(hdr.name_len, hdr.data_len);
+        good_end = off;
+    }
+    free(buf);
+
+    if (good_end < end) {
+        fprintf(stderr, "[SegStore] truncating %s segment %u at %llu (was %llu)\n",
+                u->username, s->id, (unsigned long long)good_end, (unsigned long long)end);
+        if (ftruncate(s->fd, (off_t)good_end) != 0) perror("ftruncate");
+    }
+    s->size = good_end;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void load_user(SegUser *u) {
+    char dir[600];
+    seg_dir(dir, sizeof(dir), u->username);
+
+    DIR *d = opendir(dir);
+    if (!d) return;
+
+    uint32_t *ids = NULL;
+    int nids = 0, capids = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        unsigned id;
+        char tail[8];
+        if (sscanf(e->d_name, "%u.%7s", &id, tail) != 2 || strcmp(tail, "seg") != 0) continue;
+        if (nids == capids) {
+            capids = capids ? capids * 2 : 16;
+            uint32_t *n = realloc(ids, (size_t)capids * sizeof(uint32_t));
+            if (!n) break;
+            ids = n;
+        }
+        ids[nids++] = id;
+    }
+    closedir(d);
+    qsort(ids, (size_t)nids, sizeof(uint32_t), cmp_u32);
+
+    for (int i = 0; i < nids; i++) {
+        char path[700];
+        seg_path(path, sizeof(path), u->username, ids[i]);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0) continue;
+        Segment *s = add_segment(u, ids[i], fd, 0);
+        if (s) replay_segment(u, s);
+    }
+    free(ids);
+
+    // Tombstones were only needed to order the replay.
+    for (size_t b = 0; b < u->nbuckets; b++) {
+        SegEntry **pp = &u->buckets[b];
+        while (*pp) {
+            if ((*pp)->deleted) {
+                SegEntry *dead = *pp;
+                *pp = dead->next;
+                free(dead);
+                u->nentries--;
+            } else {
+                pp = &(*pp)->next;
+            }
+        }
+    }
+}
+
+/* ---------- User Table ---------- */
+
+static SegUser *get_user(const char *username) {
+    const char *name = (username && strlen(username)) ? username : "guest";
+
+    pthread_mutex_lock(&users_mutex);
+    SegUser *u = seg_users;
+    while (u && strcmp(u->username, name) != 0) u = u->next;
+    if (u) {
+        pthread_mutex_unlock(&users_mutex);
+        return u;
+    }
+
+    u = calloc(1, sizeof(SegUser));
+    if (!u) {
+        pthread_mutex_unlock(&users_mutex);
+        fprintf(stderr, "Memory alloc failed in segstore get_user\n");
+        return NULL;
+    }
+    u->nbuckets = SEGSTORE_BUCKETS;
+    u->buckets = calloc(u->nbuckets, sizeof(SegEntry *));
+    if (!u->buckets) {
+        pthread_mutex_unlock(&users_mutex);
+        free(u);
+        fprintf(stderr, "Memory alloc failed in segstore get_user\n");
+        return NULL;
+    }
+    strncpy(u->username, name, sizeof(u->username) - 1);
+    pthread_rwlock_init(&u->lock, NULL);
+    u->next_seq = 1;
+
+    // Publish the user with its write lock held so other threads block on
+    // the rwlock, not on the global table, while the segments replay.
+    pthread_rwlock_wrlock(&u->lock);
+    u->next = seg_users;
+    seg_users = u;
+    pthread_mutex_unlock(&users_mutex);
+
+    load_user(u);
+    pthread_rwlock_unlock(&u->lock);
+    return u;
+}
+
+/* ---------- Public API ---------- */
+
+int segstore_put(const char *user, const char *name, const char *data, size_t len,
+                 uint32_t crc, DurableWrite *sync) {
+    if (len > SEGSTORE_SMALL_MAX || strlen(name) >= sizeof(((SegEntry *)0)->name)) return -1;
+
+    SegUser *u = get_user(user);
+    if (!u) return -1;
+
+    pthread_rwlock_wrlock(&u->lock);
+    uint64_t seq = u->next_seq++;
+    uint32_t seg_id;
+    uint64_t offset;
+    int fd;
+    if (append_record(u, SEG_PUT, seq, name, data, len, crc, &seg_id, &offset, &fd) != 0) {
+        pthread_rwlock_unlock(&u->lock);
+        return -1;
+    }
+
+    SegEntry *e = index_find(u, name);
+    if (e)
+        entry_unaccount(u, e);
+    else
+        e = index_insert(u, name);
+    if (e) {
+        e->segment = seg_id;
+        e->offset = offset;
+        e->length = (uint32_t)len;
+        e->seq = seq;
+        e->crc = crc;
+        e->deleted = 0;
+        find_segment(u, seg_id)->live += record_size(strlen(name), len);
+    }
+
+    int rc = 0;
+    if (sync && durable_begin_sync(sync, fd) != 0) rc = -1;
+    pthread_rwlock_unlock(&u->lock);
+    return rc;
+}
+
+int segstore_get(const char *user, const char *name, char **data, size_t *len,
+                 uint32_t *crc) {
+    SegUser *u = get_user(user);
+    if (!u) return -1;
+
+    pthread_rwlock_rdlock(&u->lock);
+    SegEntry *e = index_find(u, name);
+    Segment *s = e ? find_segment(u, e->segment) : NULL;
+    if (!s) {
+        pthread_rwlock_unlock(&u->lock);
+        return -1;
+    }
+
+    // Read the whole record, so the header is checked along with the data.
+    size_t name_len = strlen(e->name);
+    uint64_t rsize = record_size(name_len, e->length);
+    char *buf = malloc(rsize);
+    if (!buf || pread_all(s->fd, buf, rsize, (off_t)e->offset) != 0) {
+        pthread_rwlock_unlock(&u->lock);
+        free(buf);
+        return -1;
+    }
+
+    SegRecord hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    const char *body = buf + sizeof(hdr) + name_len;
+    if ((hdr.magic != SEG_MAGIC && hdr.magic != SEG_MAGIC_V1) || hdr.seq != e->seq ||
+        hdr.name_len != name_len || hdr.data_len != e->length ||
+        memcmp(buf + sizeof(hdr), e->name, name_len) != 0 ||
+        crc32c(0, body, e->length) != e->crc) {
+        fprintf(stderr, "[SegStore] CHECKSUM MISMATCH %s/%s in segment %u at %llu\n",
+                u->username, e->name, e->segment, (unsigned long long)e->offset);
+        pthread_rwlock_unlock(&u->lock);
+        free(buf);
+        return SEGSTORE_ECORRUPT;
+    }
+
+    memmove(buf, body, e->length);
+    *data = buf;
+    *len = e->length;
+    if (crc) *crc = e->crc;
+    pthread_rwlock_unlock(&u->lock);
+    return 0;
+}
+
+int segstore_size(const char *user, const char *name, size_t *len) {
+    SegUser *u = get_user(user);
+    if (!u) return -1;
+
+    pthread_rwlock_rdlock(&u->lock);
+    SegEntry *e = index_find(u, name);
+    if (e) *len = e->length;
+    pthread_rwlock_unlock(&u->lock);
+    return e ? 0 : -1;
+}
+
+static int delete_locked(SegUser *u, const char *name) {
+    SegEntry *e = index_find(u, name);
+    if (!e) return -1;
+
+    if (append_record(u, SEG_DELETE, u->next_seq++, name, NULL, 0, 0, NULL, NULL, NULL) != 0)
+        return -1;
+    entry_unaccount(u, e);
+    index_remove(u, name);
+    return 0;
+}
+
+int segstore_delete(const char *user, const char *name) {
+    SegUser *u = get_user(user);
+    if (!u) return -1;
+
+    pthread_rwlock_wrlock(&u->lock);
+    int rc = delete_locked(u, name);
+    pthread_rwlock_unlock(&u->lock);
+    return rc;
+}
+
+uint64_t segstore_version(const char *user, const char *name) {
+    SegUser *u = get_user(user);
+    if (!u) return 0;
+
+    pthread_rwlock_rdlock(&u->lock);
+    SegEntry *e = index_find(u, name);
+    uint64_t seq = e ? e->seq : 0;
+    pthread_rwlock_unlock(&u->lock);
+    return seq;
+}
+
+int segstore_delete_if_version(const char *user, const char *name, uint64_t version) {
+    SegUser *u = get_user(user);
+    if (!u) return -1;
+
+    pthread_rwlock_wrlock(&u->lock);
+    SegEntry *e = index_find(u, name);
+    int rc = (e && e->seq == version) ? delete_locked(u, name) : -1;
+    pthread_rwlock_unlock(&u->lock);
+    return rc;
+}
+
+static int cmp_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+char *segstore_list(const char *user) {
+    SegUser *u = get_user(user);
+    if (!u) return strdup("");
+
+    pthread_rwlock_rdlock(&u->lock);
+    const char **names = malloc((u->nentries ? u->nentries : 1) * sizeof(char *));
+    size_t n = 0, total = 1;
+    if (names) {
+        for (size_t b = 0; b < u->nbuckets; b++) {
+            for (SegEntry *e = u->buckets[b]; e; e = e->next) {
+                names[n++] = e->name;
+                total += strlen(e->name) + 1;
+            }
+        }
+    }
+    qsort(names, n, sizeof(char *), cmp_names);
+
+    char *out = malloc(total);
+    if (out) {
+        char *p = out;
+        for (size_t i = 0; i < n; i++) {
+            size_t len = strlen(names[i]);
+            memcpy(p, names[i], len);
+            p[len] = '\n';
+            p += len + 1;
+        }
+        *p = '\0';
+    }
+    pthread_rwlock_unlock(&u->lock);
+    free(names);
+    return out;
+}
+
+/* ---------- Scrubbing ---------- */
+
+// Check one record read at off. Returns its size, 0 at the end of what has
+// been written, or -1 (and *bad) if it is damaged.
+static int64_t scrub_record(int fd, uint64_t off, uint64_t end, char *buf, int *bad) {
+    SegRecord hdr;
+    *bad = 0;
+    if (off + sizeof(hdr) > end || pread_all(fd, &hdr, sizeof(hdr), (off_t)off) != 0) return 0;
+    if (!header_sane(&hdr)) {
+        *bad = 1;
+        return -1;
+    }
+    uint64_t rsize = record_size(hdr.name_len, hdr.data_len);
+    if (off + rsize > end) return 0;
+    if (pread_all(fd, buf, rsize - sizeof(hdr), (off_t)(off + sizeof(hdr))) != 0) return 0;
+
+    char name[128];
+    memcpy(name, buf, hdr.name_len);
+    name[hdr.name_len] = '\0';
+    const char *data = buf + hdr.name_len;
+    if (record_checksum(&hdr, name, data) != hdr.checksum ||
+        (hdr.magic == SEG_MAGIC && hdr.type == SEG_PUT &&
+         crc32c(0, data, hdr.data_len) != hdr.crc)) {
+        *bad = 1;
+        return -1;
+    }
+    return (int64_t)rsize;
+}
+
+int segstore_scrub(const char *path, int (*pace)(void *arg, size_t bytes), void *arg,
+                   unsigned long *bad) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+    if (fd < 0) fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 1;
+    struct stat st;
+    char *buf = malloc(128 + SEGSTORE_SMALL_MAX);
+    if (!buf || fstat(fd, &st) != 0) {
+        free(buf);
+        close(fd);
+        return 1;
+    }
+
+    // The active segment may be appended to meanwhile: a record cut off by
+    // the size seen at open is simply not there yet, and a damaged one is
+    // read again before it is reported, in case it was still being written.
+    // Past a damaged record the scan resyncs on the next record magic, as
+    // replay does, so the records after it are still checked.
+    int running = 1;
+    uint64_t off = 0, end = (uint64_t)st.st_size;
+    while (running) {
+        int damaged;
+        int64_t rsize = scrub_record(fd, off, end, buf, &damaged);
+        if (damaged) rsize = scrub_record(fd, off, end, buf, &damaged);
+        if (damaged) {
+            (*bad)++;
+            fprintf(stderr, "[Scrub] CHECKSUM MISMATCH %s: record at %llu\n", path,
+                    (unsigned long long)off);
+            rsize = (int64_t)(next_magic(fd, off + 1, end) - off);
+        }
+        if (rsize == 0) break;
+        off += (uint64_t)rsize;
+        running = pace(arg, (size_t)rsize);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    free(buf);
+    close(fd);
+    return running;
+}
+
+/* ---------- Compaction ---------- */
+
+// The record at off in a segment read into memory, if it is whole and its
+// checksum holds.
+static int check_record(const char *buf, uint64_t off, uint64_t size, SegRecord *hdr,
+                        char name[128]) {
+    memcpy(hdr, buf + off, sizeof(*hdr));
+    if (!header_sane(hdr) || off + record_size(hdr->name_len, hdr->data_len) > size) return -1;
+    memcpy(name, buf + off + sizeof(*hdr), hdr->name_len);
+    name[hdr->name_len] = '\0';
+    const char *data = buf + off + sizeof(*hdr) + hdr->name_len;
+    return record_checksum(hdr, name, data) == hdr->checksum ? 0 : -1;
+}
+
+// Caller holds the lock.
+static int entries_in_segment(SegUser *u, uint32_t id) {
+    int n = 0;
+    for (size_t b = 0; b < u->nbuckets; b++)
+        for (SegEntry *e = u->buckets[b]; e; e = e->next) n += e->segment == id;
+    return n;
+}
+
+// Copy the live records of a sealed segment into the active one, then drop
+// it (returns 0 once dropped). The segment is immutable, so it is read without the lock; each record
+// is re-checked against the index under the write lock before copying.
+// Damaged bytes that replay skipped are skipped here the same way, and the
+// segment is only dropped once no index entry points into it.
+static int compact_segment(SegUser *u, uint32_t id) {
+    pthread_rwlock_rdlock(&u->lock);
+    Segment *s = find_segment(u, id);
+    int fd = s ? s->fd : -1;
+    uint64_t size = s ? s->size : 0;
+    pthread_rwlock_unlock(&u->lock);
+    if (fd < 0) return -1;
+
+    char *buf = malloc(size ? size : 1);
+    if (!buf || pread_all(fd, buf, size, 0) != 0) {
+        free(buf);
+        return -1;
+    }
+
+    int copied = 0, failed = 0;
+    uint64_t off = 0;
+    while (off + sizeof(SegRecord) <= size) {
+        SegRecord hdr;
+        char name[128];
+        if (check_record(buf, off, size, &hdr, name) != 0) {
+            for (off++; off + sizeof(uint32_t) <= size; off++) {
+                uint32_t m;
+                memcpy(&m, buf + off, sizeof(m));
+                if (m == SEG_MAGIC || m == SEG_MAGIC_V1) break;
+            }
+            continue;
+        }
+        uint64_t rsize = record_size(hdr.name_len, hdr.data_len);
+        const char *data = buf + off + sizeof(hdr) + hdr.name_len;
+
+        pthread_rwlock_wrlock(&u->lock);
+        SegEntry *e = index_find(u, name);
+        if (hdr.type == SEG_PUT && e && e->segment == id && e->offset == off) {
+            uint32_t new_seg;
+            uint64_t new_off;
+            if (append_record(u, SEG_PUT, hdr.seq, name, data, hdr.data_len, e->crc,
+                              &new_seg, &new_off, NULL) == 0) {
+                entry_unaccount(u, e);
+                e->segment = new_seg;
+                e->offset = new_off;
+                find_segment(u, new_seg)->live += rsize;
+                copied++;
+            } else {
+                failed = 1;
+            }
+        } else if (hdr.type == SEG_DELETE && !e && u->segments[0].id < id) {
+            // An older segment may still hold a put this tombstone hides.
+            if (append_record(u, SEG_DELETE, hdr.seq, name, NULL, 0, 0, NULL, NULL, NULL) != 0)
+                failed = 1;
+        }
+        pthread_rwlock_unlock(&u->lock);
+
+        if (failed) break;
+        off += rsize;
+    }
+    free(buf);
+    if (failed) return -1;
+
+    pthread_rwlock_wrlock(&u->lock);
+    int left = entries_in_segment(u, id);
+    if (left > 0) {
+        fprintf(stderr, "[SegStore] not compacting %s segment %u: %d live records not moved\n",
+                u->username, id, left);
+        pthread_rwlock_unlock(&u->lock);
+        return -1;
+    }
+    Segment *active = &u->segments[u->nsegments - 1];
+    if (fdatasync(active->fd) != 0) {
+        perror("fdatasync");
+        pthread_rwlock_unlock(&u->lock);
+        return -1;
+    }
+    for (int i = 0; i < u->nsegments; i++) {
+        if (u->segments[i].id != id) continue;
+        char path[700];
+        seg_path(path, sizeof(path), u->username, id);
+        close(u->segments[i].fd);
+        unlink(path);
+        memmove(&u->segments[i], &u->segments[i + 1],
+                (size_t)(u->nsegments - i - 1) * sizeof(Segment));
+        u->nsegments--;
+        break;
+    }
+    pthread_rwlock_unlock(&u->lock);
+
+    char dir[600];
+    seg_dir(dir, sizeof(dir), u->username);
+    fsync_dir(dir);
+    fprintf(stderr, "[SegStore] compacted %s segment %u (%d live records moved)\n",
+            u->username, id, copied);
+    return 0;
+}
+
+static void compact_user(SegUser *u) {
+    while (1) {
+        uint32_t victim = 0;
+        pthread_rwlock_rdlock(&u->lock);
+        for (int i = 0; i + 1 < u->nsegments; i++) {   // never the active one
+            Segment *s = &u->segments[i];
+            if (s->live * 2 < s->size) {
+                victim = s->id;
+                break;
+            }
+        }
+        pthread_rwlock_unlock(&u->lock);
+        // A segment that could not be dropped would be picked again.
+        if (!victim || compact_segment(u, victim) != 0) return;
+
+        pthread_mutex_lock(&compact_lock);
+        int running = compact_running;
+        pthread_mutex_unlock(&compact_lock);
+        if (!running) return;
+    }
+}
+
+static void *compact_thread_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&compact_lock);
+    while (compact_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SEGSTORE_COMPACT_INTERVAL;
+        pthread_cond_timedwait(&compact_cond, &compact_lock, &deadline);
+        if (!compact_running) break;
+        pthread_mutex_unlock(&compact_lock);
+
+        // Users are never freed before segstore_destroy, so walking the list
+        // outside users_mutex is safe once we have the head.
+        pthread_mutex_lock(&users_mutex);
+        SegUser *u = seg_users;
+        pthread_mutex_unlock(&users_mutex);
+        for (; u; u = u->next) compact_user(u);
+
+        pthread_mutex_lock(&compact_lock);
+    }
+    pthread_mutex_unlock(&compact_lock);
+    return NULL;
+}
+
+void segstore_init(void) {
+    pthread_mutex_lock(&compact_lock);
+    compact_running = 1;
+    pthread_mutex_unlock(&compact_lock);
+    pthread_create(&compact_thread, NULL, compact_thread_main, NULL);
+}
+
+void segstore_destroy(void) {
+    pthread_mutex_lock(&compact_lock);
+    int was_running = compact_running;
+    compact_running = 0;
+    pthread_cond_broadcast(&compact_cond);
+    pthread_mutex_unlock(&compact_lock);
+    if (was_running) pthread_join(compact_thread, NULL);
+
+    pthread_mutex_lock(&users_mutex);
+    SegUser *u = seg_users;
+    while (u) {
+        SegUser *next = u->next;
+        for (size_t b = 0; b < u->nbuckets; b++) {
+            SegEntry *e = u->buckets[b];
+            while (e) {
+                SegEntry *en = e->next;
+                free(e);
+                e = en;
+            }
+        }
+        for (int i = 0; i < u->nsegments; i++) close(u->segments[i].fd);
+        free(u->segments);
+        free(u->buckets);
+        pthread_rwlock_destroy(&u->lock);
+        free(u);
+        u = next;
+    }
+    seg_users = NULL;
+    pthread_mutex_unlock(&users_mutex);
+}
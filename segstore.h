@@ -0,0 +1,62 @@
+#ifndef SEGSTORE_H
+#define SEGSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "durable.h"
+
+#define SEGSTORE_SMALL_MAX (16 * 1024)            // larger files stay plain files
+#define SEGSTORE_SEGMENT_MAX (16 * 1024 * 1024)   // roll to a new segment past this
+#define SEGSTORE_COMPACT_INTERVAL 5               // seconds between compactor passes
+#define SEGSTORE_BUCKETS 1024
+#define SEGSTORE_ECORRUPT -2
+
+// Log-structured store for small files. Each user has append-only segment
+// files under storage/<user>/.seg/; every UPLOAD or DELETE appends a record
+// and an in-memory index maps names to (segment, offset, length). The index
+// is rebuilt by replaying segments the first time a user is touched.
+// A background compactor copies live records out of mostly-dead sealed
+// segments and removes them.
+//
+// Each record carries the CRC32C the data had on upload, and every read
+// checks the data against it.
+//
+// Callers serialize writes per user (the user lock); reads may run
+// concurrently with writes.
+
+void segstore_init(void);
+void segstore_destroy(void);
+
+// Append a record and update the index. crc is the CRC32C of data. If sync
+// is non-NULL an fdatasync of the segment is queued on it; the caller must
+// durable_wait() before acking.
+int segstore_put(const char *user, const char *name, const char *data, size_t len,
+                 uint32_t crc, DurableWrite *sync);
+
+// Copy a file's contents into a malloc'd buffer, with its CRC32C (crc may
+// be NULL). Returns 0 if found, SEGSTORE_ECORRUPT if the data no longer
+// matches its CRC.
+int segstore_get(const char *user, const char *name, char **data, size_t *len,
+                 uint32_t *crc);
+
+// Size of a stored file. Returns 0 if found.
+int segstore_size(const char *user, const char *name, size_t *len);
+
+// Append a tombstone. Returns 0 if the name was present.
+int segstore_delete(const char *user, const char *name);
+
+// Sequence number of the current entry for name (0 if absent), and a
+// delete that only applies if the entry has not changed since.
+uint64_t segstore_version(const char *user, const char *name);
+int segstore_delete_if_version(const char *user, const char *name, uint64_t version);
+
+// Sorted, newline-terminated list of names in the store (malloc'd).
+char *segstore_list(const char *user);
+
+// Check every record of the segment file at path against its checksums,
+// calling pace(arg, bytes) after each one; damaged records are logged and
+// counted in *bad. Returns 0 if pace returned 0 (stop), else 1.
+int segstore_scrub(const char *path, int (*pace)(void *arg, size_t bytes), void *arg,
+                   unsigned long *bad);
+
+#endif
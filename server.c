@@ -1,15 +1,30 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 
 #include "server.h"
 #include "locks.h"
 #include "auth.h"
+#include "storage.h"
+#include "jobs.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+#include "shard.h"
+#include "restart.h"
+#include "repl.h"
+#include "local.h"
+#include "watch.h"
+#include "search.h"
 
 #define PORT 9000
 #define MAX_CLIENTS 10
@@ -18,6 +33,7 @@
 // ========== GLOBAL VARIABLES ==========
 atomic_int server_running = 1;
 int listen_fd = -1;
+int wake_pipe[2] = { -1, -1 };      // wakes the accept loop: SIGINT, hot restart
 
 ClientQueue g_client_queue;
 TaskQueue g_task_queue;
@@ -37,11 +53,8 @@ void handle_sigint(int sig) {
     write(STDERR_FILENO, msg, sizeof(msg) - 1);
     atomic_store(&server_running, 0);
 
-    // Close listening socket (async-signal-safe)
-    if (listen_fd >= 0) {
-        close(listen_fd);
-        listen_fd = -1;
-    }
+    // Wake the accept loop (async-signal-safe)
+    if (wake_pipe[1] >= 0) write(wake_pipe[1], "x", 1);
 }
 
 // ========== WAKE THREADS ==========
@@ -60,52 +73,171 @@ void wake_all_threads(void) {
 
 // ========== SERVER MAIN ==========
 int main(int argc, char *argv[]) {
-    (void)argc;
-    (void)argv;
-
     struct sockaddr_in addr;
     int opt = 1;
+    int commit_delay_ms = DURABLE_DEFAULT_DELAY_MS;
+    size_t cache_mb = FILE_CACHE_DEFAULT_MB;
+    uint64_t quota_mb = QUOTA_DEFAULT_MB;
+    int scrub_mb = SCRUB_DEFAULT_MB_PER_SEC;
+    int max_jobs = JOBS_DEFAULT_RUNNING;
+    int trace_every = TRACE_DEFAULT_SAMPLE;
+    LogLevel log_level = LOG_LEVEL_INFO;
+    int nshards = 0;
+    int use_uring = 0;
+    const char *restart_path = NULL;
+    int port = PORT;
+    int repl_port = 0;
+    const char *primary = NULL;
+    int max_lag_ms = REPL_DEFAULT_MAX_LAG_MS;
+    const char *local_path = NULL;
+
+    int c;
+    while ((c = getopt(argc, argv, "c:m:q:s:j:t:vS:UR:p:L:D:l:u:")) != -1) {
+        switch (c) {
+        case 'c':
+            commit_delay_ms = atoi(optarg);
+            break;
+        case 'm':
+            cache_mb = (size_t)atol(optarg);
+            break;
+        case 'q':
+            quota_mb = (uint64_t)atoll(optarg);
+            break;
+        case 's':
+            scrub_mb = atoi(optarg);
+            break;
+        case 'j':
+            max_jobs = atoi(optarg);
+            break;
+        case 't':
+            trace_every = atoi(optarg);
+            break;
+        case 'v':
+            log_level = LOG_LEVEL_DEBUG;
+            break;
+        case 'S':
+            nshards = atoi(optarg);
+            break;
+        case 'U':
+            use_uring = 1;
+            break;
+        case 'R':
+            restart_path = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'L':
+            repl_port = atoi(optarg);
+            break;
+        case 'D':
+            primary = optarg;
+            break;
+        case 'l':
+            max_lag_ms = atoi(optarg);
+            break;
+        case 'u':
+            local_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c commit_delay_ms] [-m cache_mb] [-q quota_mb] [-s scrub_mb_per_sec] [-j max_jobs] [-t trace_one_in_n] [-v] [-S shards] [-U] [-R restart_socket] [-p port] [-L repl_port | -D primary_host:port [-l max_lag_ms]] [-u local_socket]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
+    if (pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("pipe2");
+        exit(EXIT_FAILURE);
+    }
     signal(SIGINT, handle_sigint);
-    printf("Starting server initialization...\n");
+    log_init(log_level);
+    log_info("Starting server initialization...");
 
     // Initialize subsystems
+    stats_init();
+    trace_init(trace_every);
+
+    // Hot restart: take the listeners of a running server, then let it
+    // drain and exit before touching the store it is still writing.
+    if (restart_init(restart_path) < 0) exit(EXIT_FAILURE);
+    restart_wait();
+
     initClientQueue(&g_client_queue, MAX_CLIENTS);
     initTaskQueue(&g_task_queue, 100);
+    // Client threads finish the connections they hold at shutdown, so the
+    // workers must outlive them: only the sentinels stop a worker.
+    g_task_queue.running = NULL;
     locks_init();
     auth_init();
+    storage_init(commit_delay_ms, cache_mb * 1024 * 1024, quota_mb * 1024 * 1024, scrub_mb);
+    jobs_init(max_jobs);
+    watch_init();
+    search_init();
+
+    // Replication: a primary ships its mutation log, a replica applies it.
+    if (repl_port > 0 && primary) {
+        log_error("-L and -D are exclusive: a node is a primary or a replica");
+        exit(EXIT_FAILURE);
+    }
+    if (repl_port > 0 && repl_primary_init(repl_port) != 0) exit(EXIT_FAILURE);
+    if (primary && repl_replica_init(primary, max_lag_ms) != 0) exit(EXIT_FAILURE);
 
-    // Create socket
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) {
-        perror("socket");
+    // Local clients: shared-memory sessions, in either server mode.
+    if (local_init(local_path) != 0) {
+        log_destroy();                  // flush the reason before exiting
         exit(EXIT_FAILURE);
     }
 
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    // Sharded mode: the shards own the listeners and all request threads.
+    // The io_uring loop is only built into the shards.
+    if (use_uring && nshards <= 0) nshards = 1;
+    if (nshards > 0) {
+        if (shard_run(nshards, port, use_uring) != 0) {
+            log_error("Cannot start %d shards on port %d", nshards, port);
+            atomic_store(&server_running, 0);
+        }
+        shutdown_server(NULL, NULL);
+        return 0;
+    }
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(PORT);
-    addr.sin_addr.s_addr = INADDR_ANY;
+    // Create socket, or reuse the one handed over by the previous server
+    listen_fd = restart_listener(0);
+    if (listen_fd >= 0) {
+        // A sharded server's listener is non-blocking.
+        fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) & ~O_NONBLOCK);
+    } else {
+        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd < 0) {
+            perror("socket");
+            exit(EXIT_FAILURE);
+        }
 
-    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        close(listen_fd);
-        exit(EXIT_FAILURE);
-    }
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
-    if (listen(listen_fd, 10) < 0) {
-        perror("listen");
-        close(listen_fd);
-        exit(EXIT_FAILURE);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = INADDR_ANY;
+
+        if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("bind");
+            close(listen_fd);
+            exit(EXIT_FAILURE);
+        }
+
+        if (listen(listen_fd, 10) < 0) {
+            perror("listen");
+            close(listen_fd);
+            exit(EXIT_FAILURE);
+        }
     }
+    restart_register(listen_fd);
 
-    printf("Server listening on port %d...\n", PORT);
+    log_info("Server listening on port %d...", port);
 
     // Spawn worker threads
     for (int i = 0; i < MAX_WORKERS; i++) {
-        pthread_create(&worker_threads[i], NULL, worker_thread_main, NULL);
+        pthread_create(&worker_threads[i], NULL, worker_thread_main, &g_task_queue);
     }
 
     // Spawn client threads
@@ -113,26 +245,41 @@ int main(int argc, char *argv[]) {
         pthread_create(&client_threads[i], NULL, client_thread_main, NULL);
     }
 
-    // Main accept loop
+    restart_serve(wake_pipe[1]);
+
+    // Main accept loop. It only blocks in poll, which a stop (SIGINT or a
+    // hot restart) wakes through wake_pipe whenever it comes, and anything
+    // accept() returns is served: after a handoff the connections still in
+    // the backlog are the new server's.
+    trace_thread_name("accept");
+    struct pollfd pfd[2] = { { listen_fd, POLLIN, 0 }, { wake_pipe[0], POLLIN, 0 } };
     while (atomic_load(&server_running)) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            log_error("poll: %s", strerror(errno));
+            break;
+        }
+        if (!(pfd[0].revents & POLLIN)) continue;
+
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
-        int client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_len);
-
-        if (!atomic_load(&server_running))
-            break;
+        int client_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &client_len, SOCK_CLOEXEC);
+        uint64_t accepted_us = stats_now_us();
 
         if (client_fd < 0) {
-            if (atomic_load(&server_running))
-                perror("accept");
+            if (errno != EINTR && errno != ECONNABORTED) log_error("accept: %s", strerror(errno));
             continue;
         }
 
-        printf("Accepted new client connection.\n");
-        enqueueClient(&g_client_queue, client_fd);
+        log_info("Accepted new client connection.");
+        stats_gauge_add(STATS_CONNECTIONS, 1);
+        ClientConn conn = { client_fd, accepted_us, trace_sample() };
+        enqueueClient(&g_client_queue, conn);
     }
 
-    // If accept() unblocked due to SIGINT or error
+    // Stopped by SIGINT, a handoff or an error
+    close(listen_fd);
+    listen_fd = -1;
     wake_all_threads();
     shutdown_server(client_threads, worker_threads);
     return 0;
@@ -140,36 +287,59 @@ int main(int argc, char *argv[]) {
 
 // ========== SHUTDOWN SERVER ==========
 void shutdown_server(pthread_t *client_threads, pthread_t *worker_threads) {
-    fprintf(stderr, "[Server] Initiating shutdown sequence...\n");
+    log_info("[Server] Initiating shutdown sequence...");
 
     // Step 1: Stop accepting new clients
     atomic_store(&server_running, 0);
+    restart_destroy();
+    local_destroy();
     wake_all_threads();
 
-    // Step 2: Enqueue sentinel EXIT tasks for workers
-    Task sentinel = {0};
-    sentinel.cmd = CMD_UNKNOWN;
-    strncpy(sentinel.data, "EXIT_WORKER", sizeof(sentinel.data) - 1);
-    sentinel.result = NULL;
+    // Steps 2-3 apply to the thread pools; shard_run has already stopped
+    // its own threads when it returns.
+    if (client_threads && worker_threads) {
+        // Step 2: Let the client threads serve the connections already
+        // accepted; their tasks still need the workers
+        log_info("[Server] Waiting for threads to finish...");
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            pthread_join(client_threads[i], NULL);
+        }
 
-    for (int i = 0; i < MAX_WORKERS; i++) {
-        enqueueTask(&g_task_queue, sentinel);
-    }
+        // Step 3: Enqueue sentinel EXIT tasks for workers and wait for them
+        Task sentinel = {0};
+        sentinel.cmd = CMD_UNKNOWN;
+        strncpy(sentinel.data, "EXIT_WORKER", sizeof(sentinel.data) - 1);
+        sentinel.result = NULL;
 
-    // Step 3: Wait for threads to exit
-    fprintf(stderr, "[Server] Waiting for threads to finish...\n");
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        pthread_join(client_threads[i], NULL);
-    }
-    for (int i = 0; i < MAX_WORKERS; i++) {
-        pthread_join(worker_threads[i], NULL);
+        for (int i = 0; i < MAX_WORKERS; i++) {
+            enqueueTask(&g_task_queue, sentinel);
+        }
+        for (int i = 0; i < MAX_WORKERS; i++) {
+            pthread_join(worker_threads[i], NULL);
+        }
     }
 
-    // Step 4: Destroy all queues & locks safely
+    FileCacheStats cs;
+    file_cache_stats(&cs);
+    unsigned long lookups = cs.hits + cs.misses;
+    log_info("[Server] File cache: %lu hits, %lu misses (%.1f%% hit rate), %lu evictions, %lu invalidations",
+             cs.hits, cs.misses, lookups ? 100.0 * (double)cs.hits / (double)lookups : 0.0,
+             cs.evictions, cs.invalidations);
+
+    // Step 4: Stop jobs, flush pending uploads, then destroy all queues &
+    // locks safely
+    jobs_destroy();
+    repl_destroy();
+    watch_destroy();
+    search_destroy();
+    storage_destroy();
     destroyClientQueue(&g_client_queue);
     destroyTaskQueue(&g_task_queue);
     locks_destroy_all();
     auth_destroy();
+    stats_destroy();
+    trace_destroy();
 
-    fprintf(stderr, "[Server] Shutdown complete.\n");
+    log_info("[Server] Shutdown complete.");
+    log_destroy();
 }
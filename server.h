@@ -4,9 +4,11 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdatomic.h>
+#include <stdint.h>
 
 #define MAX_NAME 64
 #define MAX_PAYLOAD 4096
+#define WIRE_COMPRESS_MIN 256   // smaller DOWNLOAD bodies are always sent raw
 
 // Global atomic flag for server status
 extern atomic_int server_running;
@@ -20,12 +22,26 @@ typedef enum {
     CMD_DELETE,
     CMD_PROCESS,
     CMD_LOGIN,
-    CMD_SIGNUP
+    CMD_SIGNUP,
+    CMD_USAGE,
+    CMD_VERSIONS,
+    CMD_JOB,
+    CMD_STATS,
+    CMD_TRACE,
+    CMD_WATCH,
+    CMD_SEARCH
 } CommandType;
 
 // ===== Client Queue =====
+// An accepted connection waiting for a client thread.
 typedef struct {
-    int *buffer;
+    int fd;
+    uint64_t accepted_us;       // stats_now_us() at accept
+    uint32_t trace;             // trace id, 0 if not sampled
+} ClientConn;
+
+typedef struct {
+    ClientConn *buffer;
     int capacity;
     int front, rear, count;
     pthread_mutex_t lock;
@@ -34,16 +50,30 @@ typedef struct {
 } ClientQueue;
 
 void initClientQueue(ClientQueue *q, int capacity);
-void enqueueClient(ClientQueue *q, int client_fd);
-int  dequeueClient(ClientQueue *q);
+void enqueueClient(ClientQueue *q, ClientConn conn);
+ClientConn dequeueClient(ClientQueue *q);   // fd -1 on shutdown
 void destroyClientQueue(ClientQueue *q);
 
 // ===== Task Result =====
+struct CachedFile;
+
 typedef struct TaskResult {
     pthread_mutex_t lock;
     pthread_cond_t cond;
     int done;
     char *response;
+    int failed;                 // response is an error without "ERR"
+    char header[96];            // inline header sent before body (DOWNLOAD)
+    struct CachedFile *body;    // referenced file body, released after send
+    int body_packed;            // send body->packed instead of body->data
+    int body_ranged;            // send only body->data[range_off, +range_len)
+    size_t range_off, range_len;
+    uint64_t enqueued_us;       // copied from the Task by the worker (stats)
+    uint64_t dequeued_us;
+    // Called by the worker instead of signalling cond, for callers that do
+    // not block on the result (the sharded event loops).
+    void (*complete)(struct TaskResult *res);
+    void *complete_arg;
 } TaskResult;
 
 // ===== Task =====
@@ -53,6 +83,10 @@ typedef struct Task {
     char filename[128];
     char data[4096];
     int data_len;
+    uint32_t crc;               // CRC32C of data (UPLOAD)
+    uint64_t enqueued_us;       // stamped by enqueueTask/dequeueTask (stats)
+    uint64_t dequeued_us;
+    uint32_t trace;             // trace id of the connection, 0 if not sampled
     TaskResult *result;
 } Task;
 
@@ -70,17 +104,20 @@ typedef struct TaskQueue {
     pthread_cond_t cond;
     int count;
     int capacity;
+    atomic_int *running;        // dequeueTask stops waiting once 0; NULL: only
+                                // sentinel tasks stop the workers
 } TaskQueue;
 
 // ===== Task Queue Functions =====
 void initTaskQueue(TaskQueue *q, int capacity);
-void enqueueTask(TaskQueue *q, Task t);
+int enqueueTask(TaskQueue *q, Task t);       // -1 if out of memory
 Task dequeueTask(TaskQueue *q);
 void destroyTaskQueue(TaskQueue *q);
 void task_queue_destroy(TaskQueue *q);
 
 // ===== Thread Routines =====
 void *client_thread_main(void *arg);
-void *worker_thread_main(void *arg);
+void *worker_thread_main(void *arg);      // arg: TaskQueue, NULL for g_task_queue
+void worker_process_task(Task *t);
 
 #endif
@@ -0,0 +1,876 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "shard.h"
+#include "server.h"
+#include "request.h"
+#include "uring.h"
+#include "restart.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+
+#define SHARD_EVENTS 64
+#define SHARD_POLL_MS 100               // how often a loop checks for shutdown
+#define SHARD_DRAIN_MS 1000             // how long a stopping shard waits for requests still being read
+#define SHARD_LINE 1024                 // as read_line in client_thread.c
+#define SHARD_BUF (2 * SHARD_LINE + REQUEST_MAX_WIRE)
+#define SHARD_RING_ENTRIES 512
+
+typedef enum { CONN_READING, CONN_WAITING, CONN_WRITING } ConnState;
+
+// io_uring user_data: a Conn or Shard pointer with the operation in the
+// low bits.
+enum { OP_ACCEPT = 1, OP_EVENT, OP_TIMEOUT, OP_READ, OP_SEND, OP_IGNORE };
+#define OP_MASK 7u
+
+typedef struct Shard Shard;
+
+typedef struct Conn {
+    int fd;
+    Shard *shard;                       // the shard that accepted it
+    ConnState state;
+    int registered;                     // in the shard's epoll set
+    int cancelled;                      // read cancelled at shutdown (io_uring)
+    uint64_t accepted_us;
+    uint64_t service_us;
+    uint32_t trace;
+    CommandType cmd;
+    int failed;
+
+    // Request: "USER <name>\n" (optional), the command line, then the
+    // UPLOAD body from body_off up to EOF.
+    char buf[SHARD_BUF];
+    size_t len;
+    size_t body_off;                    // 0 until the command line is in
+    int eof;
+    char user[64];
+    char cmdline[SHARD_LINE];
+
+    // Reply
+    char *reply;
+    TaskResult *res;
+    struct iovec iov[3];
+    int iovcnt;
+    struct msghdr msg;                  // for IORING_OP_SENDMSG
+
+    struct Conn *prev, *next;           // the shard's connections
+    struct Conn *next_done;             // completion mailbox
+} Conn;
+
+struct Shard {
+    int id;
+    int cpu;
+    int listen_fd;
+    int epoll_fd;
+    int event_fd;                       // completions pending
+    pthread_t thread;
+    pthread_t workers[SHARD_WORKERS];
+    TaskQueue tasks;
+    Conn *conns;
+    int nconns;
+    pthread_mutex_t done_lock;
+    Conn *done;                         // results from any shard's workers
+    int stopping;
+    uint64_t stop_us;
+    int dropped;                        // gave up on requests still being read
+
+    // io_uring engine: connections come from a fixed slab that is
+    // registered with the ring, so socket reads go into pinned buffers.
+    int use_uring;
+    Uring ring;
+    Conn *slab;
+    Conn *free_conns;
+    int fixed;                          // slab registered as buffer 0
+    int accepting;                      // an accept is in flight
+    uint64_t event_val;
+    struct __kernel_timespec tick;
+};
+
+static Shard *shards;
+static int nshards;
+
+/* ---------- Helper Functions ---------- */
+
+// FNV-1a of the user name: which shard's workers run the user's tasks.
+static Shard *shard_of(const char *user) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)user; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return &shards[h % (uint32_t)nshards];
+}
+
+static void pin_attr(pthread_attr_t *attr, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_init(attr);
+    if (pthread_attr_setaffinity_np(attr, sizeof(set), &set) != 0)
+        log_warn("[Shard] cannot pin to cpu %d", cpu);
+}
+
+// Shard i's listener: the one handed over by the previous server if there
+// is one, else a new SO_REUSEPORT socket.
+static int open_listener(int i, int port) {
+    int fd = restart_listener(i);
+    if (fd >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        return fd;
+    }
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        close(fd);
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SHARD_BACKLOG) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void conn_watch(Conn *c, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    if (epoll_ctl(c->shard->epoll_fd, c->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev) == 0)
+        c->registered = 1;
+}
+
+static void conn_unwatch(Conn *c) {
+    if (c->registered) epoll_ctl(c->shard->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    c->registered = 0;
+}
+
+// Next SQE, flushing the submission queue if it is full.
+static struct io_uring_sqe *shard_sqe(Shard *s, int op, void *ptr) {
+    struct io_uring_sqe *sqe = uring_sqe(&s->ring);
+    if (!sqe) {
+        uring_enter(&s->ring, 0);
+        sqe = uring_sqe(&s->ring);
+    }
+    if (sqe) sqe->user_data = (uint64_t)(uintptr_t)ptr | (uint64_t)op;
+    return sqe;
+}
+
+static Conn *conn_new(Shard *s, int fd) {
+    Conn *c;
+    if (s->use_uring) {
+        c = s->free_conns;
+        if (!c) return NULL;
+        s->free_conns = c->next;
+        memset(c, 0, sizeof(*c));
+    } else {
+        c = calloc(1, sizeof(Conn));
+        if (!c) return NULL;
+    }
+    c->fd = fd;
+    c->shard = s;
+    c->accepted_us = stats_now_us();
+    c->trace = trace_sample();
+    c->next = s->conns;
+    if (s->conns) s->conns->prev = c;
+    s->conns = c;
+    s->nconns++;
+    stats_gauge_add(STATS_CONNECTIONS, 1);
+    return c;
+}
+
+static void arm_accept(Shard *s);
+
+// Close the connection and account for the request, as client_thread_main
+// does after serve_client.
+static void conn_close(Conn *c) {
+    Shard *s = c->shard;
+    if (s->use_uring) {
+        struct io_uring_sqe *sqe = shard_sqe(s, OP_IGNORE, NULL);
+        if (sqe) {
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = c->fd;
+        } else {
+            close(c->fd);
+        }
+    } else {
+        close(c->fd);
+    }
+    uint64_t end = stats_now_us();
+    stats_gauge_add(STATS_CONNECTIONS, -1);
+    stats_request(c->cmd, c->failed);
+    stats_latency(c->cmd, STATS_TOTAL, end - c->accepted_us);
+    if (c->trace) trace_record(c->trace, TRACE_REQUEST, c->accepted_us, end, c->cmd);
+
+    if (c->prev) c->prev->next = c->next;
+    else s->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    s->nconns--;
+
+    free(c->reply);
+    task_result_free(c->res);
+    if (s->use_uring) {
+        c->next = s->free_conns;
+        s->free_conns = c;
+        if (!s->accepting && !s->stopping) arm_accept(s);
+    } else {
+        free(c);
+    }
+}
+
+/* ---------- Writing ---------- */
+
+// Drop the first w bytes of the pending reply.
+static void conn_advance(Conn *c, size_t w) {
+    struct iovec *iov = c->iov;
+    while (c->iovcnt > 0 && w >= iov->iov_len) {
+        w -= iov->iov_len;
+        iov++;
+        c->iovcnt--;
+    }
+    if (c->iovcnt > 0) {
+        iov->iov_base = (char *)iov->iov_base + w;
+        iov->iov_len -= w;
+    }
+    memmove(c->iov, iov, sizeof(struct iovec) * (size_t)c->iovcnt);
+}
+
+static void conn_sent(Conn *c) {
+    if (c->trace) trace_record(c->trace, TRACE_WRITE, c->service_us, stats_now_us(), 0);
+    conn_close(c);
+}
+
+// Write as much of the reply as the socket takes; close when it is all out.
+static void conn_flush(Conn *c) {
+    Shard *s = c->shard;
+    // A client that went away must not take the process down with SIGPIPE.
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = (size_t)c->iovcnt;
+
+    if (s->use_uring) {
+        struct io_uring_sqe *sqe = shard_sqe(s, OP_SEND, c);
+        if (!sqe) {
+            c->failed = 1;
+            conn_close(c);
+            return;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = c->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&c->msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        return;
+    }
+
+    while (c->iovcnt > 0) {
+        ssize_t w = sendmsg(c->fd, &c->msg, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_watch(c, EPOLLOUT);
+                return;
+            }
+            c->failed = 1;
+            break;
+        }
+        stats_bytes(0, (size_t)w);
+        conn_advance(c, (size_t)w);
+        c->msg.msg_iovlen = (size_t)c->iovcnt;
+    }
+    conn_sent(c);
+}
+
+static void conn_reply(Conn *c, char *msg, int failed) {
+    c->state = CONN_WRITING;
+    c->reply = msg;
+    c->failed = failed;
+    c->iov[0].iov_base = msg;
+    c->iov[0].iov_len = strlen(msg);
+    c->iovcnt = 1;
+    c->service_us = stats_now_us();
+    conn_flush(c);
+}
+
+/* ---------- Dispatch ---------- */
+
+// Worker side: queue the connection on its shard's mailbox and wake the loop.
+static void task_done(TaskResult *res) {
+    Conn *c = res->complete_arg;
+    Shard *s = c->shard;
+    pthread_mutex_lock(&s->done_lock);
+    c->next_done = s->done;
+    s->done = c;
+    pthread_mutex_unlock(&s->done_lock);
+    uint64_t one = 1;
+    while (write(s->event_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+static void conn_dispatch(Conn *c) {
+    const char *user = c->user[0] ? c->user : "guest";
+    CommandType cmd = request_command(c->cmdline);
+    c->cmd = cmd;
+    stats_bytes(c->len, 0);
+    uint64_t service_start = stats_now_us();
+
+    int failed;
+    char *msg;
+    if (cmd == CMD_WATCH) {
+        // The watcher thread keeps a copy of the socket, which stays
+        // registered with epoll until this one is removed.
+        conn_unwatch(c);
+        msg = request_watch(c->fd, user, c->cmdline, &failed);
+        if (msg) {
+            conn_reply(c, msg, failed);
+            return;
+        }
+        c->failed = 0;
+        conn_close(c);
+        return;
+    }
+    if (cmd == CMD_JOB) {
+        // JOB WAIT parks a copy of the socket with the job waiter.
+        conn_unwatch(c);
+        msg = request_job(c->fd, user, c->cmdline, &failed);
+        stats_latency(cmd, STATS_SERVICE, stats_now_us() - service_start);
+        if (msg) {
+            conn_reply(c, msg, failed);
+            return;
+        }
+        c->failed = 0;
+        conn_close(c);
+        return;
+    }
+    msg = request_blocking(cmd) ? NULL : request_inline(cmd, user, c->cmdline, &failed);
+    if (msg) {
+        stats_latency(cmd, STATS_SERVICE, stats_now_us() - service_start);
+        conn_reply(c, msg, failed);
+        return;
+    }
+
+    Task t;
+    memset(&t, 0, sizeof(t));
+    strncpy(t.username, user, sizeof(t.username) - 1);
+    t.trace = c->trace;
+    if (request_task(&t, cmd, c->cmdline) != 0) {
+        conn_reply(c, strdup("ERR: Unknown command\n"), 1);
+        return;
+    }
+    if (cmd == CMD_UPLOAD &&
+        request_upload_body(&t, request_upload_packed(c->cmdline), c->buf + c->body_off,
+                            c->len - c->body_off) != 0) {
+        conn_reply(c, strdup("ERR: Corrupt or oversized compressed upload\n"), 1);
+        return;
+    }
+
+    c->res = task_result_new();
+    if (!c->res) {
+        conn_reply(c, strdup("ERR: Out of memory\n"), 1);
+        return;
+    }
+    c->res->complete = task_done;
+    c->res->complete_arg = c;
+    t.result = c->res;
+
+    // Nothing to read until the reply is ready.
+    conn_unwatch(c);
+    c->state = CONN_WAITING;
+    Shard *owner = shard_of(t.username);
+    if (owner != c->shard)
+        log_debug("[Shard %d] forwarding %s for %s to shard %d", c->shard->id,
+                  stats_command_name(cmd), t.username, owner->id);
+    if (enqueueTask(&owner->tasks, t) != 0)
+        conn_reply(c, strdup("ERR: Out of memory\n"), 1);
+}
+
+// Loop side: send the replies of finished tasks. The eventfd has already
+// been read.
+static void drain_done(Shard *s) {
+    pthread_mutex_lock(&s->done_lock);
+    Conn *c = s->done;
+    s->done = NULL;
+    pthread_mutex_unlock(&s->done_lock);
+
+    while (c) {
+        Conn *next = c->next_done;
+        TaskResult *res = c->res;
+        uint64_t now = stats_now_us();
+        stats_latency(c->cmd, STATS_QUEUE_WAIT, res->dequeued_us - res->enqueued_us);
+        stats_latency(c->cmd, STATS_SERVICE, now - res->dequeued_us);
+        if (c->trace) trace_record(c->trace, TRACE_WAIT, res->enqueued_us, now, 0);
+
+        c->state = CONN_WRITING;
+        c->service_us = now;
+        c->iovcnt = task_result_iov(res, c->iov, &c->failed);
+        if (c->iovcnt == 0)
+            conn_reply(c, strdup("ERR: No response\n"), 1);
+        else
+            conn_flush(c);
+        c = next;
+    }
+}
+
+/* ---------- Reading ---------- */
+
+// Next line of the request head starting at off: up to and including '\n',
+// or SHARD_LINE - 1 bytes, or whatever is left at EOF (as read_line).
+// Returns its length, 0 if it is not complete yet.
+static size_t head_line(const Conn *c, size_t off) {
+    size_t avail = c->len - off;
+    size_t max = avail < SHARD_LINE - 1 ? avail : SHARD_LINE - 1;
+    const char *nl = memchr(c->buf + off, '\n', max);
+    if (nl) return (size_t)(nl - (c->buf + off)) + 1;
+    if (avail >= SHARD_LINE - 1) return SHARD_LINE - 1;
+    return c->eof ? avail : 0;
+}
+
+// Parse "USER <name>\n<command>\n" once it is in. Returns 1 when the
+// command line is complete.
+static int parse_head(Conn *c) {
+    size_t n = head_line(c, 0);
+    if (n == 0) return 0;
+    size_t off = n;
+    const char *line = c->buf;
+    if (n > 5 && strncmp(c->buf, "USER ", 5) == 0) {
+        char name[SHARD_LINE];
+        memcpy(name, c->buf + 5, n - 5);
+        name[n - 5] = '\0';
+        sscanf(name, "%63s", c->user);
+        size_t m = head_line(c, off);
+        if (m == 0) return 0;
+        line = c->buf + off;
+        n = m;
+        off += m;
+    } else {
+        strncpy(c->user, "guest", sizeof(c->user) - 1);
+    }
+    if (n > 0 && line[n - 1] == '\n') n--;
+    memcpy(c->cmdline, line, n);
+    c->cmdline[n] = '\0';
+    c->body_off = off;
+    c->cmd = request_command(c->cmdline);
+    return 1;
+}
+
+// How many more bytes this request may take: the head, then for UPLOAD a
+// body up to the payload limit.
+static size_t read_room(const Conn *c) {
+    if (!c->body_off) return SHARD_BUF - c->len;
+    if (c->cmd != CMD_UPLOAD) return 0;
+    size_t limit = request_upload_packed(c->cmdline) ? REQUEST_MAX_WIRE : MAX_PAYLOAD - 1;
+    size_t body = c->len - c->body_off;
+    return body < limit ? limit - body : 0;
+}
+
+// Account for r bytes read (0 at EOF) and dispatch once the request is
+// all in. Returns 0 if more input is needed.
+static int conn_received(Conn *c, size_t r) {
+    if (r > 0) {
+        c->len += r;
+        if (!c->body_off) parse_head(c);
+    } else {
+        c->eof = 1;
+    }
+    if (!c->body_off && c->eof && !parse_head(c)) {
+        // Closed before sending a command.
+        c->failed = 1;
+        conn_close(c);
+        return 1;
+    }
+    if (!c->body_off) return 0;
+    if (c->cmd == CMD_UPLOAD && !c->eof && read_room(c) > 0) return 0;
+    if (c->trace) trace_record(c->trace, TRACE_READ, c->accepted_us, stats_now_us(), 0);
+    conn_dispatch(c);
+    return 1;
+}
+
+/* ---------- Event Loop (epoll) ---------- */
+
+static void conn_readable(Conn *c) {
+    for (;;) {
+        ssize_t r = read(c->fd, c->buf + c->len, read_room(c));
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            c->failed = 1;
+            conn_close(c);
+            return;
+        }
+        if (conn_received(c, (size_t)r)) return;
+    }
+}
+
+static void accept_all(Shard *s) {
+    for (;;) {
+        int fd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_error("[Shard %d] accept: %s", s->id, strerror(errno));
+            return;
+        }
+        Conn *c = conn_new(s, fd);
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        conn_watch(c, EPOLLIN);
+    }
+}
+
+// Stop accepting. Requests already accepted still finish, so a hot
+// restart loses none; those still being read after SHARD_DRAIN_MS are
+// dropped (see drain_expired).
+static void epoll_stop(Shard *s) {
+    // After a hot restart the new process holds the same socket, so closing
+    // our fd alone leaves it in the epoll set, ready with every pending
+    // connection the new process has not accepted yet.
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, s->listen_fd, NULL);
+    close(s->listen_fd);
+    s->listen_fd = -1;
+    s->stopping = 1;
+    s->stop_us = stats_now_us();
+}
+
+static int drain_expired(Shard *s) {
+    if (!s->stopping || s->dropped) return 0;
+    if (stats_now_us() - s->stop_us < SHARD_DRAIN_MS * 1000ull) return 0;
+    s->dropped = 1;
+    return 1;
+}
+
+static void epoll_drop_readers(Shard *s) {
+    Conn *c = s->conns;
+    while (c) {
+        Conn *next = c->next;
+        if (c->state == CONN_READING) {
+            c->failed = 1;
+            conn_close(c);
+        }
+        c = next;
+    }
+}
+
+static void epoll_loop(Shard *s) {
+    struct epoll_event events[SHARD_EVENTS];
+    while (s->listen_fd >= 0 || s->nconns > 0) {
+        if (s->listen_fd >= 0 && !atomic_load(&server_running)) epoll_stop(s);
+        if (drain_expired(s)) epoll_drop_readers(s);
+
+        int n = epoll_wait(s->epoll_fd, events, SHARD_EVENTS, SHARD_POLL_MS);
+        if (n < 0 && errno != EINTR) {
+            log_error("[Shard %d] epoll_wait: %s", s->id, strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *p = events[i].data.ptr;
+            if (p == &s->listen_fd) {
+                if (s->listen_fd >= 0) accept_all(s);
+            } else if (p == &s->event_fd) {
+                uint64_t v;
+                while (read(s->event_fd, &v, sizeof(v)) < 0 && errno == EINTR)
+                    ;
+                drain_done(s);
+            } else {
+                Conn *c = p;
+                if (c->state == CONN_READING)
+                    conn_readable(c);
+                else if (c->state == CONN_WRITING)
+                    conn_flush(c);
+            }
+        }
+    }
+}
+
+/* ---------- Event Loop (io_uring) ---------- */
+
+// Accept, read, send and close are SQEs; each loop iteration submits
+// everything queued and reaps completions with a single io_uring_enter.
+
+static void arm_accept(Shard *s) {
+    if (!s->free_conns) return;         // resumes when a connection closes
+    struct io_uring_sqe *sqe = shard_sqe(s, OP_ACCEPT, s);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = s->listen_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    s->accepting = 1;
+}
+
+static void arm_event(Shard *s) {
+    struct io_uring_sqe *sqe = shard_sqe(s, OP_EVENT, s);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = s->event_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&s->event_val;
+    sqe->len = sizeof(s->event_val);
+}
+
+static void arm_tick(Shard *s) {
+    struct io_uring_sqe *sqe = shard_sqe(s, OP_TIMEOUT, s);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&s->tick;
+    sqe->len = 1;
+}
+
+static void arm_read(Conn *c) {
+    Shard *s = c->shard;
+    struct io_uring_sqe *sqe = shard_sqe(s, OP_READ, c);
+    if (!sqe) {
+        c->failed = 1;
+        conn_close(c);
+        return;
+    }
+    sqe->opcode = s->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(c->buf + c->len);
+    sqe->len = (unsigned)read_room(c);
+    sqe->buf_index = 0;
+}
+
+static void cancel(Shard *s, uint64_t user_data) {
+    struct io_uring_sqe *sqe = shard_sqe(s, OP_IGNORE, NULL);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = user_data;
+}
+
+static void uring_stop(Shard *s) {
+    s->stopping = 1;
+    s->stop_us = stats_now_us();
+    if (s->accepting) cancel(s, (uint64_t)(uintptr_t)s | OP_ACCEPT);
+}
+
+static void uring_drop_readers(Shard *s) {
+    for (Conn *c = s->conns; c; c = c->next) {
+        if (c->state == CONN_READING) {
+            c->cancelled = 1;
+            cancel(s, (uint64_t)(uintptr_t)c | OP_READ);
+        }
+    }
+}
+
+static void uring_complete(Shard *s, uint64_t user_data, int res) {
+    int op = (int)(user_data & OP_MASK);
+    void *p = (void *)(uintptr_t)(user_data & ~(uint64_t)OP_MASK);
+    Conn *c = p;
+
+    switch (op) {
+    case OP_ACCEPT:
+        s->accepting = 0;
+        if (res >= 0) {
+            c = conn_new(s, res);
+            if (c) arm_read(c);
+            else close(res);
+        } else if (res != -ECANCELED && res != -EINTR) {
+            log_error("[Shard %d] accept: %s", s->id, strerror(-res));
+        }
+        if (!s->stopping) arm_accept(s);
+        break;
+    case OP_EVENT:
+        drain_done(s);
+        arm_event(s);
+        break;
+    case OP_TIMEOUT:
+        if (!s->stopping && !atomic_load(&server_running)) uring_stop(s);
+        if (drain_expired(s)) uring_drop_readers(s);
+        arm_tick(s);
+        break;
+    case OP_READ:
+        if (res < 0 || c->cancelled) {
+            c->failed = 1;
+            conn_close(c);
+        } else if (!conn_received(c, (size_t)res)) {
+            arm_read(c);
+        }
+        break;
+    case OP_SEND:
+        if (res < 0) {
+            c->failed = 1;
+            conn_close(c);
+            break;
+        }
+        stats_bytes(0, (size_t)res);
+        conn_advance(c, (size_t)res);
+        if (c->iovcnt > 0)
+            conn_flush(c);
+        else
+            conn_sent(c);
+        break;
+    default:
+        break;
+    }
+}
+
+// io_uring waits for readiness itself, but returns -EAGAIN at once on
+// descriptors opened non-blocking.
+static void set_blocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0) fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+static int uring_setup(Shard *s) {
+    if (uring_init(&s->ring, SHARD_RING_ENTRIES) != 0) return -1;
+    s->slab = calloc(SHARD_URING_CONNS, sizeof(Conn));
+    if (!s->slab) {
+        uring_destroy(&s->ring);
+        return -1;
+    }
+    for (int i = SHARD_URING_CONNS - 1; i >= 0; i--) {
+        s->slab[i].next = s->free_conns;
+        s->free_conns = &s->slab[i];
+    }
+    // Pinned memory is limited (RLIMIT_MEMLOCK): plain reads still work
+    // without it.
+    struct iovec iov = { s->slab, SHARD_URING_CONNS * sizeof(Conn) };
+    s->fixed = uring_register_buffers(&s->ring, &iov, 1) == 0;
+    if (!s->fixed) log_debug("[Shard %d] buffers not registered: %s", s->id, strerror(errno));
+    s->tick.tv_nsec = SHARD_POLL_MS * 1000000L;
+    set_blocking(s->listen_fd);
+    set_blocking(s->event_fd);
+    s->use_uring = 1;
+    return 0;
+}
+
+static void uring_loop(Shard *s) {
+    arm_accept(s);
+    arm_event(s);
+    arm_tick(s);
+    while (!s->stopping || s->accepting || s->nconns > 0) {
+        if (uring_enter(&s->ring, 1) < 0) {
+            log_error("[Shard %d] io_uring_enter: %s", s->id, strerror(errno));
+            break;
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_cqe(&s->ring))) {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            uring_cqe_seen(&s->ring);
+            uring_complete(s, user_data, res);
+        }
+    }
+    close(s->listen_fd);
+    s->listen_fd = -1;
+    uring_destroy(&s->ring);
+    free(s->slab);
+    s->slab = NULL;
+}
+
+/* ---------- Shard Thread ---------- */
+
+static void *shard_main(void *arg) {
+    Shard *s = arg;
+    trace_thread_name("shard");
+    log_debug("[Shard %d] running on cpu %d (%s)", s->id, s->cpu, s->use_uring ? "io_uring" : "epoll");
+    if (s->use_uring)
+        uring_loop(s);
+    else
+        epoll_loop(s);
+    return NULL;
+}
+
+/* ---------- Run ---------- */
+
+int shard_run(int count, int port, int use_uring) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+    if (count > SHARD_MAX) count = SHARD_MAX;
+    shards = calloc((size_t)count, sizeof(Shard));
+    if (!shards) return -1;
+    nshards = count;
+
+    int engine_warned = 0;
+    for (int i = 0; i < count; i++) {
+        Shard *s = &shards[i];
+        s->id = i;
+        s->cpu = (int)(i % ncpu);
+        s->listen_fd = open_listener(i, port);
+        s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        s->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (s->listen_fd < 0 || s->epoll_fd < 0 || s->event_fd < 0) {
+            log_error("[Shard] cannot set up shard %d on port %d: %s", i, port, strerror(errno));
+            for (int k = 0; k <= i; k++) {
+                if (shards[k].listen_fd >= 0) close(shards[k].listen_fd);
+                if (shards[k].epoll_fd >= 0) close(shards[k].epoll_fd);
+                if (shards[k].event_fd >= 0) close(shards[k].event_fd);
+                if (shards[k].use_uring) {
+                    uring_destroy(&shards[k].ring);
+                    free(shards[k].slab);
+                }
+            }
+            free(shards);
+            shards = NULL;
+            return -1;
+        }
+        if (use_uring && uring_setup(s) != 0 && !engine_warned) {
+            log_warn("[Shard] io_uring unavailable (%s), using epoll", strerror(errno));
+            engine_warned = 1;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &s->listen_fd };
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev);
+        ev.data.ptr = &s->event_fd;
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->event_fd, &ev);
+
+        // Any shard's loop may forward to this queue until every loop has
+        // stopped, so only the sentinels below end these workers.
+        restart_register(s->listen_fd);
+        initTaskQueue(&s->tasks, 100);
+        s->tasks.running = NULL;
+        pthread_mutex_init(&s->done_lock, NULL);
+    }
+
+    // Workers first: a loop may forward to any shard as soon as it runs.
+    pthread_attr_t attr;
+    for (int i = 0; i < count; i++) {
+        pin_attr(&attr, shards[i].cpu);
+        for (int w = 0; w < SHARD_WORKERS; w++)
+            pthread_create(&shards[i].workers[w], &attr, worker_thread_main, &shards[i].tasks);
+        pthread_attr_destroy(&attr);
+    }
+    for (int i = 0; i < count; i++) {
+        pin_attr(&attr, shards[i].cpu);
+        pthread_create(&shards[i].thread, &attr, shard_main, &shards[i]);
+        pthread_attr_destroy(&attr);
+    }
+    log_info("Server listening on port %d with %d shards (%s)...", port, count,
+             shards[0].use_uring ? "io_uring" : "epoll");
+    restart_serve(-1);                  // the loops poll server_running
+
+    for (int i = 0; i < count; i++) pthread_join(shards[i].thread, NULL);
+
+    Task sentinel = {0};
+    sentinel.cmd = CMD_UNKNOWN;
+    strncpy(sentinel.data, "EXIT_WORKER", sizeof(sentinel.data) - 1);
+    for (int i = 0; i < count; i++) {
+        for (int w = 0; w < SHARD_WORKERS; w++) enqueueTask(&shards[i].tasks, sentinel);
+    }
+    for (int i = 0; i < count; i++) {
+        Shard *s = &shards[i];
+        for (int w = 0; w < SHARD_WORKERS; w++) pthread_join(s->workers[w], NULL);
+        destroyTaskQueue(&s->tasks);
+        pthread_mutex_destroy(&s->done_lock);
+        close(s->epoll_fd);
+        close(s->event_fd);
+    }
+    free(shards);
+    shards = NULL;
+    return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#define SHARD_MAX 256
+#define SHARD_WORKERS 2                 // task threads per shard
+#define SHARD_BACKLOG 128
+#define SHARD_URING_CONNS 256           // connection slots per io_uring shard
+
+// Sharded server mode (-S N). Each shard owns a SO_REUSEPORT listener on
+// the server port, an epoll loop on its own thread and a task queue with
+// SHARD_WORKERS worker threads, all pinned to one core, so accepting,
+// parsing and dispatching never touch another shard's locks. Users are
+// partitioned by a hash of their name: a request that lands on another
+// shard's listener is passed to the owning shard's task queue, and the
+// result comes back through the accepting shard's completion mailbox.
+//
+// With use_uring each shard runs an io_uring loop instead of epoll:
+// accepts, socket reads (into registered buffers where the memlock limit
+// allows), sends and closes are queued as SQEs and submitted in one
+// io_uring_enter per loop iteration. Shards whose ring cannot be set up
+// fall back to epoll.
+//
+// Runs until server_running drops to 0, then finishes the requests in
+// flight and returns. Returns -1 if the listeners could not be set up.
+int shard_run(int nshards, int port, int use_uring);
+
+#endif
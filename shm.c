@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "shm.h"
+
+#define SHM_HELLO "SHM\n"
+
+/* ---------- Helper Functions ---------- */
+
+static ShmRing *tx_ring(ShmSession *s) { return &s->area->ring[s->side]; }
+static ShmRing *rx_ring(ShmSession *s) { return &s->area->ring[!s->side]; }
+
+// Bytes waiting in r, or -1 if the peer left head/tail inconsistent.
+static int64_t ring_used(ShmRing *r) {
+    uint64_t used = atomic_load(&r->head) - atomic_load(&r->tail);
+    return used > SHM_RING_BYTES ? -1 : (int64_t)used;
+}
+
+static void wake_peer(ShmSession *s) {
+    if (atomic_load(&s->area->asleep[!s->side].flag)) {
+        uint64_t one = 1;
+        ssize_t w = write(s->wake_peer, &one, sizeof(one));
+        (void)w;                        // EAGAIN: a wakeup is pending anyway
+    }
+}
+
+// Sleep until the receive ring has data (want_data) or the send ring has
+// room. The flag is raised before the last check and the peer checks it
+// after publishing, so one of the two always sees the other.
+static int wait_ring(ShmSession *s, int want_data) {
+    _Atomic uint32_t *asleep = &s->area->asleep[s->side].flag;
+    int gone = 0;
+    for (;;) {
+        int64_t used = ring_used(want_data ? rx_ring(s) : tx_ring(s));
+        if (used < 0) return -1;
+        if (want_data ? used > 0 : used < SHM_RING_BYTES) return 0;
+        if (gone) return -1;
+
+        atomic_store(asleep, 1);
+        used = ring_used(want_data ? rx_ring(s) : tx_ring(s));
+        if (used >= 0 && (want_data ? used > 0 : used < SHM_RING_BYTES)) {
+            atomic_store(asleep, 0);
+            return 0;
+        }
+        struct pollfd p[2] = { { s->wake_self, POLLIN, 0 }, { s->sock, POLLIN, 0 } };
+        int n = poll(p, 2, -1);
+        atomic_store(asleep, 0);
+        if (n < 0 && errno != EINTR) return -1;
+        if (p[0].revents & POLLIN) {
+            uint64_t v;
+            ssize_t r = read(s->wake_self, &v, sizeof(v));
+            (void)r;
+        }
+        // Nothing else is sent on the socket: readable means hung up.
+        // Whatever the peer put in the ring before that is still taken.
+        if (p[1].revents) gone = 1;
+    }
+}
+
+static int ring_put(ShmSession *s, const char *p, size_t len) {
+    ShmRing *r = tx_ring(s);
+    while (len > 0) {
+        int64_t used = ring_used(r);
+        if (used < 0) return -1;
+        if (used == SHM_RING_BYTES) {
+            wake_peer(s);
+            if (wait_ring(s, 0) != 0) return -1;
+            continue;
+        }
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        size_t off = head % SHM_RING_BYTES;
+        size_t n = SHM_RING_BYTES - (size_t)used;
+        if (n > SHM_RING_BYTES - off) n = SHM_RING_BYTES - off;
+        if (n > len) n = len;
+        memcpy(r->data + off, p, n);
+        atomic_store(&r->head, head + n);
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// At least one byte, at most len. Returns the count or -1.
+static ssize_t ring_get(ShmSession *s, char *p, size_t len) {
+    ShmRing *r = rx_ring(s);
+    if (wait_ring(s, 1) != 0) return -1;
+    int64_t used = ring_used(r);
+    if (used < 0) return -1;
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t off = tail % SHM_RING_BYTES;
+    size_t n = (size_t)used < len ? (size_t)used : len;
+    size_t first = n < SHM_RING_BYTES - off ? n : SHM_RING_BYTES - off;
+    memcpy(p, r->data + off, first);
+    memcpy(p + first, r->data, n - first);
+    atomic_store(&r->tail, tail + n);
+    wake_peer(s);
+    return (ssize_t)n;
+}
+
+static int ring_get_all(ShmSession *s, char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = ring_get(s, p, len);
+        if (n < 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* ---------- Messages ---------- */
+
+int shm_write(ShmSession *s, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        uint32_t n = len > UINT32_MAX ? UINT32_MAX : (uint32_t)len;
+        if (ring_put(s, (const char *)&n, sizeof(n)) != 0 || ring_put(s, p, n) != 0) return -1;
+        p += n;
+        len -= n;
+    }
+    wake_peer(s);
+    return 0;
+}
+
+int shm_end(ShmSession *s) {
+    uint32_t zero = 0;
+    if (ring_put(s, (const char *)&zero, sizeof(zero)) != 0) return -1;
+    wake_peer(s);
+    return 0;
+}
+
+ssize_t shm_read(ShmSession *s, void *buf, size_t len) {
+    if (s->in_chunk == 0) {
+        uint32_t n;
+        if (ring_get_all(s, (char *)&n, sizeof(n)) != 0) return -1;
+        if (n == 0) return 0;
+        s->in_chunk = n;
+    }
+    if (len > s->in_chunk) len = s->in_chunk;
+    ssize_t n = ring_get(s, buf, len);
+    if (n > 0) s->in_chunk -= (uint32_t)n;
+    return n;
+}
+
+/* ---------- Sessions ---------- */
+
+int shm_connect(const char *path, ShmSession *s) {
+    memset(s, 0, sizeof(*s));
+    s->sock = s->wake_self = s->wake_peer = -1;
+    int mfd = -1;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+    s->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s->sock < 0 || connect(s->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) goto fail;
+
+    // Sealed at its size, so the server can map it without fearing SIGBUS.
+    mfd = memfd_create("shm-session", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (mfd < 0 || ftruncate(mfd, sizeof(ShmArea)) != 0 ||
+        fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+        goto fail;
+    s->area = mmap(NULL, sizeof(ShmArea), PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    if (s->area == MAP_FAILED) {
+        s->area = NULL;
+        goto fail;
+    }
+    s->area->version = SHM_VERSION;
+    s->area->ring_bytes = SHM_RING_BYTES;
+    s->side = SHM_CLIENT;
+    s->wake_self = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    s->wake_peer = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->wake_self < 0 || s->wake_peer < 0) goto fail;
+
+    // The fds go in the server's order: area, its eventfd, ours.
+    int fds[3] = { mfd, s->wake_peer, s->wake_self };
+    char ctl[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { SHM_HELLO, sizeof(SHM_HELLO) - 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = ctl, .msg_controllen = sizeof(ctl) };
+    memset(ctl, 0, sizeof(ctl));
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    if (sendmsg(s->sock, &msg, MSG_NOSIGNAL) < 0) goto fail;
+    close(mfd);
+    mfd = -1;
+
+    char reply[64];
+    size_t got = 0;
+    while (got < sizeof(reply) - 1) {
+        ssize_t r = read(s->sock, reply + got, 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        if (reply[got++] == '\n') break;
+    }
+    reply[got] = '\0';
+    if (strcmp(reply, "OK\n") != 0) {
+        // The server turns a session away when it has too many.
+        errno = strncmp(reply, "ERR: Too many", 13) == 0 ? EBUSY : EPROTO;
+        goto fail;
+    }
+    return 0;
+
+fail:;
+    int err = errno;
+    if (mfd >= 0) close(mfd);
+    shm_close(s);
+    errno = err;
+    return -1;
+}
+
+int shm_accept(int sock, ShmSession *s) {
+    memset(s, 0, sizeof(*s));
+    s->sock = sock;
+    s->wake_self = s->wake_peer = -1;
+
+    char hello[sizeof(SHM_HELLO)] = "";
+    int fds[3] = { -1, -1, -1 };
+    char ctl[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { hello, sizeof(hello) - 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = ctl, .msg_controllen = sizeof(ctl) };
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    struct cmsghdr *cm = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        size_t nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cm), (nfds < 3 ? nfds : 3) * sizeof(int));
+    }
+    s->wake_self = fds[1];
+    s->wake_peer = fds[2];
+
+    struct stat st;
+    int seals = fds[0] >= 0 ? fcntl(fds[0], F_GET_SEALS) : -1;
+    int ok = n == (ssize_t)sizeof(SHM_HELLO) - 1 && memcmp(hello, SHM_HELLO, (size_t)n) == 0 &&
+             fds[1] >= 0 && fds[2] >= 0 && seals >= 0 && (seals & F_SEAL_SHRINK) &&
+             fstat(fds[0], &st) == 0 && st.st_size == (off_t)sizeof(ShmArea);
+    if (ok) {
+        s->area = mmap(NULL, sizeof(ShmArea), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+        if (s->area == MAP_FAILED) s->area = NULL;
+        ok = s->area && s->area->version == SHM_VERSION && s->area->ring_bytes == SHM_RING_BYTES;
+    }
+    if (fds[0] >= 0) close(fds[0]);
+    s->side = SHM_SERVER;
+
+    const char *reply = ok ? "OK\n" : "ERR: Bad local session\n";
+    if (send(sock, reply, strlen(reply), MSG_NOSIGNAL) < 0) ok = 0;
+    if (!ok) {
+        s->sock = -1;                   // the caller closes it
+        shm_close(s);
+        return -1;
+    }
+    return 0;
+}
+
+void shm_close(ShmSession *s) {
+    if (s->area) munmap(s->area, sizeof(ShmArea));
+    if (s->sock >= 0) close(s->sock);
+    if (s->wake_self >= 0) close(s->wake_self);
+    if (s->wake_peer >= 0) close(s->wake_peer);
+    s->area = NULL;
+    s->sock = s->wake_self = s->wake_peer = -1;
+}
@@ -0,0 +1,72 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SHM_RING_BYTES (1024 * 1024)    // per direction
+#define SHM_VERSION 1
+
+// Shared-memory transport for clients on the same host. The client
+// connects to the server's Unix socket and passes it a memfd holding two
+// single-producer, single-consumer byte rings (one per direction) and two
+// eventfds, one per side, with SCM_RIGHTS. Requests and replies then go
+// through the rings without touching socket buffers; a side only makes a
+// syscall to sleep on its eventfd when its ring is empty (or full), and
+// the other side only writes that eventfd when the sleeper has said so.
+// The socket stays open for the life of the session: it hanging up tells
+// a sleeping side that the peer is gone.
+//
+// Each ring carries messages as chunks, "<u32 len><bytes>", ended by a
+// zero-length chunk; a message is what one TCP connection would carry in
+// that direction, so a session runs one request after another.
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t head; // bytes ever written, by the producer
+    _Alignas(64) _Atomic uint64_t tail; // bytes ever consumed, by the consumer
+    _Alignas(64) char data[SHM_RING_BYTES];
+} ShmRing;
+
+typedef struct {
+    _Alignas(64) _Atomic uint32_t flag;
+} ShmAsleep;
+
+typedef struct {
+    uint32_t version;
+    uint32_t ring_bytes;
+    ShmAsleep asleep[2];                // side blocked on its eventfd
+    ShmRing ring[2];                    // ring[i] is written by side i
+} ShmArea;
+
+enum { SHM_CLIENT, SHM_SERVER };
+
+typedef struct {
+    ShmArea *area;
+    int side;
+    int sock;                           // Unix socket of the session
+    int wake_self, wake_peer;           // eventfds
+    uint32_t in_chunk;                  // bytes left in the chunk being read
+} ShmSession;
+
+// Client: connect to the server's socket at path and set up a session.
+int shm_connect(const char *path, ShmSession *s);
+
+// Server: take the session offered on an accepted socket. Checks the
+// shared area before mapping it, since the client controls it.
+int shm_accept(int sock, ShmSession *s);
+
+void shm_close(ShmSession *s);
+
+// Append to the message being sent. Returns -1 if the peer is gone.
+int shm_write(ShmSession *s, const void *buf, size_t len);
+
+// End the message being sent (as shutdown(SHUT_WR) would).
+int shm_end(ShmSession *s);
+
+// Read from the message being received: bytes read, 0 at its end (the
+// next call starts the next message), -1 if the peer is gone.
+ssize_t shm_read(ShmSession *s, void *buf, size_t len);
+
+#endif
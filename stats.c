@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+#include "server.h"
+#include "file_cache.h"
+
+#define STATS_SUB (1u << STATS_SUB_BITS)
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_SUB_BITS + 2) * STATS_SUB)
+#define STATS_NCMDS (CMD_SEARCH + 1)
+
+typedef struct {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+    atomic_uint_fast64_t buckets[STATS_BUCKETS];
+} Histogram;
+
+typedef struct {
+    atomic_uint_fast64_t requests[STATS_NCMDS];
+    atomic_uint_fast64_t errors[STATS_NCMDS];
+    atomic_uint_fast64_t bytes_in;
+    atomic_uint_fast64_t bytes_out;
+    Histogram latency[STATS_NCMDS][STATS_NLATENCY];
+} StatsShard;
+
+typedef struct {
+    atomic_int_fast64_t value;
+    atomic_int_fast64_t peak;
+} Gauge;
+
+static const char *cmd_names[STATS_NCMDS] = {
+    [CMD_UNKNOWN] = "UNKNOWN", [CMD_UPLOAD] = "UPLOAD", [CMD_LIST] = "LIST",
+    [CMD_DOWNLOAD] = "DOWNLOAD", [CMD_DELETE] = "DELETE", [CMD_PROCESS] = "PROCESS",
+    [CMD_LOGIN] = "LOGIN", [CMD_SIGNUP] = "SIGNUP", [CMD_USAGE] = "USAGE",
+    [CMD_VERSIONS] = "VERSIONS", [CMD_JOB] = "JOB", [CMD_STATS] = "STATS",
+    [CMD_TRACE] = "TRACE", [CMD_WATCH] = "WATCH", [CMD_SEARCH] = "SEARCH",
+};
+
+static const char *latency_names[STATS_NLATENCY] = {
+    "queue_wait_us", "service_us", "total_us",
+};
+
+static const char *gauge_names[STATS_NGAUGES] = {
+    "connections", "client_queue", "task_queue",
+};
+
+// Shards are registered once per thread and live until stats_destroy(), so
+// counts from threads that have exited are still reported.
+static StatsShard *shards[STATS_MAX_THREADS];
+static StatsShard *shared_shard;        // for threads beyond STATS_MAX_THREADS
+static int nshards;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread StatsShard *my_shard;
+
+static Gauge gauges[STATS_NGAUGES];
+static uint64_t start_us;
+
+static stats_section_fn sections[STATS_MAX_SECTIONS];
+static int nsections;
+
+int stats_add_section(stats_section_fn fn) {
+    if (nsections == STATS_MAX_SECTIONS) return -1;
+    sections[nsections++] = fn;
+    return 0;
+}
+
+/* ---------- Helper Functions ---------- */
+
+static StatsShard *shard(void) {
+    if (my_shard) return my_shard;
+
+    pthread_mutex_lock(&shards_lock);
+    if (nshards < STATS_MAX_THREADS) {
+        StatsShard *s = calloc(1, sizeof(StatsShard));
+        if (s) shards[nshards++] = s;
+        my_shard = s;
+    }
+    if (!my_shard) {
+        if (!shared_shard) shared_shard = calloc(1, sizeof(StatsShard));
+        my_shard = shared_shard;
+    }
+    pthread_mutex_unlock(&shards_lock);
+    return my_shard;
+}
+
+static inline void add(atomic_uint_fast64_t *c, uint64_t v) {
+    atomic_fetch_add_explicit(c, v, memory_order_relaxed);
+}
+
+static inline unsigned bucket_of(uint64_t v) {
+    if (v < STATS_SUB) return (unsigned)v;
+    unsigned exp = 63 - (unsigned)__builtin_clzll(v);
+    unsigned idx = (exp - STATS_SUB_BITS + 1) * STATS_SUB +
+                   (unsigned)((v >> (exp - STATS_SUB_BITS)) & (STATS_SUB - 1));
+    return idx < STATS_BUCKETS ? idx : STATS_BUCKETS - 1;
+}
+
+// Largest value that lands in bucket i.
+static uint64_t bucket_high(unsigned i) {
+    if (i < STATS_SUB) return i;
+    unsigned exp = i / STATS_SUB + STATS_SUB_BITS - 1;
+    uint64_t sub = i % STATS_SUB;
+    return ((STATS_SUB + sub + 1) << (exp - STATS_SUB_BITS)) - 1;
+}
+
+/* ---------- Init / Destroy ---------- */
+
+void stats_init(void) {
+    start_us = stats_now_us();
+}
+
+void stats_destroy(void) {
+    pthread_mutex_lock(&shards_lock);
+    for (int i = 0; i < nshards; i++) {
+        free(shards[i]);
+        shards[i] = NULL;
+    }
+    nshards = 0;
+    free(shared_shard);
+    shared_shard = NULL;
+    pthread_mutex_unlock(&shards_lock);
+}
+
+/* ---------- Recording ---------- */
+
+void stats_request(int cmd, int failed) {
+    StatsShard *s = shard();
+    if (!s || cmd < 0 || cmd >= STATS_NCMDS) return;
+    add(&s->requests[cmd], 1);
+    if (failed) add(&s->errors[cmd], 1);
+}
+
+void stats_latency(int cmd, StatsLatency which, uint64_t us) {
+    StatsShard *s = shard();
+    if (!s || cmd < 0 || cmd >= STATS_NCMDS) return;
+    Histogram *h = &s->latency[cmd][which];
+    add(&h->count, 1);
+    add(&h->sum, us);
+    add(&h->buckets[bucket_of(us)], 1);
+    uint64_t m = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (us > m && !atomic_compare_exchange_weak_explicit(&h->max, &m, us,
+                                                            memory_order_relaxed,
+                                                            memory_order_relaxed))
+        ;
+}
+
+void stats_bytes(size_t in, size_t out) {
+    StatsShard *s = shard();
+    if (!s) return;
+    if (in) add(&s->bytes_in, in);
+    if (out) add(&s->bytes_out, out);
+}
+
+void stats_gauge_set(StatsGauge g, int64_t value) {
+    atomic_store_explicit(&gauges[g].value, value, memory_order_relaxed);
+    int64_t p = atomic_load_explicit(&gauges[g].peak, memory_order_relaxed);
+    while (value > p && !atomic_compare_exchange_weak_explicit(&gauges[g].peak, &p, value,
+                                                               memory_order_relaxed,
+                                                               memory_order_relaxed))
+        ;
+}
+
+void stats_gauge_add(StatsGauge g, int64_t delta) {
+    int64_t v = atomic_fetch_add_explicit(&gauges[g].value, delta, memory_order_relaxed) + delta;
+    int64_t p = atomic_load_explicit(&gauges[g].peak, memory_order_relaxed);
+    while (v > p && !atomic_compare_exchange_weak_explicit(&gauges[g].peak, &p, v,
+                                                           memory_order_relaxed,
+                                                           memory_order_relaxed))
+        ;
+}
+
+/* ---------- Report ---------- */
+
+const char *stats_command_name(int cmd) {
+    return cmd >= 0 && cmd < STATS_NCMDS && cmd_names[cmd] ? cmd_names[cmd] : "UNKNOWN";
+}
+
+typedef struct {
+    uint64_t count, sum, max;
+    uint64_t buckets[STATS_BUCKETS];
+} HistSnapshot;
+
+typedef struct {
+    uint64_t requests[STATS_NCMDS];
+    uint64_t errors[STATS_NCMDS];
+    uint64_t bytes_in, bytes_out;
+    HistSnapshot latency[STATS_NCMDS][STATS_NLATENCY];
+} Snapshot;
+
+static void merge_shard(Snapshot *snap, StatsShard *s) {
+    snap->bytes_in += atomic_load_explicit(&s->bytes_in, memory_order_relaxed);
+    snap->bytes_out += atomic_load_explicit(&s->bytes_out, memory_order_relaxed);
+    for (int c = 0; c < STATS_NCMDS; c++) {
+        snap->requests[c] += atomic_load_explicit(&s->requests[c], memory_order_relaxed);
+        snap->errors[c] += atomic_load_explicit(&s->errors[c], memory_order_relaxed);
+        for (int l = 0; l < STATS_NLATENCY; l++) {
+            Histogram *h = &s->latency[c][l];
+            HistSnapshot *o = &snap->latency[c][l];
+            uint64_t n = atomic_load_explicit(&h->count, memory_order_relaxed);
+            if (n == 0) continue;
+            o->count += n;
+            o->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+            uint64_t m = atomic_load_explicit(&h->max, memory_order_relaxed);
+            if (m > o->max) o->max = m;
+            for (unsigned b = 0; b < STATS_BUCKETS; b++)
+                o->buckets[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        }
+    }
+}
+
+// Value at quantile q. Counters are read without a lock, so the bucket sum
+// can run slightly ahead of count; fall back to max.
+static uint64_t percentile(const HistSnapshot *h, double q) {
+    uint64_t target = (uint64_t)(q * (double)h->count + 0.999999);
+    if (target == 0) target = 1;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= target) {
+            uint64_t v = bucket_high(b);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static void print_hist(FILE *out, const HistSnapshot *h, int json) {
+    double mean = h->count ? (double)h->sum / (double)h->count : 0.0;
+    unsigned long long p50 = percentile(h, 0.50), p99 = percentile(h, 0.99),
+                       p999 = percentile(h, 0.999);
+    if (json)
+        fprintf(out, "{\"count\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+                (unsigned long long)h->count, mean, p50, p99, p999, (unsigned long long)h->max);
+    else
+        fprintf(out, "count %llu mean %.1f p50 %llu p99 %llu p999 %llu max %llu\n",
+                (unsigned long long)h->count, mean, p50, p99, p999, (unsigned long long)h->max);
+}
+
+char *stats_report(int json) {
+    Snapshot *snap = calloc(1, sizeof(Snapshot));
+    if (!snap) return strdup("ERR: Out of memory\n");
+
+    pthread_mutex_lock(&shards_lock);
+    for (int i = 0; i < nshards; i++) merge_shard(snap, shards[i]);
+    if (shared_shard) merge_shard(snap, shared_shard);
+    pthread_mutex_unlock(&shards_lock);
+
+    FileCacheStats cs;
+    file_cache_stats(&cs);
+    unsigned long long uptime = (stats_now_us() - start_us) / 1000000;
+
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    if (!out) {
+        free(snap);
+        return strdup("ERR: Out of memory\n");
+    }
+
+    if (json) {
+        fprintf(out, "{\"uptime_s\":%llu", uptime);
+        for (int g = 0; g < STATS_NGAUGES; g++)
+            fprintf(out, ",\"%s\":{\"value\":%lld,\"peak\":%lld}", gauge_names[g],
+                    (long long)atomic_load(&gauges[g].value), (long long)atomic_load(&gauges[g].peak));
+        fprintf(out, ",\"bytes\":{\"in\":%llu,\"out\":%llu}",
+                (unsigned long long)snap->bytes_in, (unsigned long long)snap->bytes_out);
+        fprintf(out, ",\"cache\":{\"hits\":%lu,\"misses\":%lu,\"evictions\":%lu,\"bytes\":%zu,\"entries\":%zu}",
+                cs.hits, cs.misses, cs.evictions, cs.bytes, cs.entries);
+        for (int i = 0; i < nsections; i++) sections[i](out, 1);
+        fprintf(out, ",\"commands\":{");
+        int first = 1;
+        for (int c = 0; c < STATS_NCMDS; c++) {
+            if (snap->requests[c] == 0) continue;
+            fprintf(out, "%s\"%s\":{\"requests\":%llu,\"errors\":%llu", first ? "" : ",",
+                    cmd_names[c], (unsigned long long)snap->requests[c],
+                    (unsigned long long)snap->errors[c]);
+            for (int l = 0; l < STATS_NLATENCY; l++) {
+                fprintf(out, ",\"%s\":", latency_names[l]);
+                print_hist(out, &snap->latency[c][l], 1);
+            }
+            fprintf(out, "}");
+            first = 0;
+        }
+        fprintf(out, "}}\n");
+    } else {
+        fprintf(out, "uptime %llus\n", uptime);
+        for (int g = 0; g < STATS_NGAUGES; g++)
+            fprintf(out, "%s %lld (peak %lld)\n", gauge_names[g],
+                    (long long)atomic_load(&gauges[g].value), (long long)atomic_load(&gauges[g].peak));
+        fprintf(out, "bytes in %llu out %llu\n",
+                (unsigned long long)snap->bytes_in, (unsigned long long)snap->bytes_out);
+        fprintf(out, "cache hits %lu misses %lu evictions %lu bytes %zu entries %zu\n",
+                cs.hits, cs.misses, cs.evictions, cs.bytes, cs.entries);
+        for (int i = 0; i < nsections; i++) sections[i](out, 0);
+        for (int c = 0; c < STATS_NCMDS; c++) {
+            if (snap->requests[c] == 0) continue;
+            fprintf(out, "%s requests %llu errors %llu\n", cmd_names[c],
+                    (unsigned long long)snap->requests[c], (unsigned long long)snap->errors[c]);
+            for (int l = 0; l < STATS_NLATENCY; l++) {
+                if (snap->latency[c][l].count == 0) continue;
+                fprintf(out, "  %-13s ", latency_names[l]);
+                print_hist(out, &snap->latency[c][l], 0);
+            }
+        }
+    }
+
+    fclose(out);
+    free(snap);
+    return buf;
+}
@@ -0,0 +1,62 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define STATS_MAX_THREADS 64            // private shards; later threads share one
+#define STATS_SUB_BITS 4                // 16 sub-buckets per power of two (~6%)
+#define STATS_MAX_EXP 39                // largest tracked latency ~2^40 us
+#define STATS_MAX_SECTIONS 4            // see stats_add_section
+
+// Always-on server metrics. Request counters and latency histograms are kept
+// per thread (each thread writes only its own shard) and summed when STATS
+// is read, so recording never contends. Histograms are log-linear like
+// HdrHistogram: exact below 16 us, then 16 buckets per power of two.
+
+typedef enum {
+    STATS_QUEUE_WAIT,                   // enqueueTask -> dequeueTask
+    STATS_SERVICE,                      // handling, on a worker or inline
+    STATS_TOTAL,                        // connection dequeued -> reply sent
+    STATS_NLATENCY
+} StatsLatency;
+
+typedef enum {
+    STATS_CONNECTIONS,                  // accepted and not yet closed
+    STATS_CLIENT_QUEUE,                 // ClientQueue depth
+    STATS_TASK_QUEUE,                   // TaskQueue depth
+    STATS_NGAUGES
+} StatsGauge;
+
+void stats_init(void);
+void stats_destroy(void);
+
+static inline uint64_t stats_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// One finished request of type cmd (a CommandType).
+void stats_request(int cmd, int failed);
+void stats_latency(int cmd, StatsLatency which, uint64_t us);
+void stats_bytes(size_t in, size_t out);
+
+void stats_gauge_set(StatsGauge g, int64_t value);
+void stats_gauge_add(StatsGauge g, int64_t delta);
+
+// Name of a CommandType ("UPLOAD", ...).
+const char *stats_command_name(int cmd);
+
+// Snapshot of every metric as text or JSON (malloc'd).
+char *stats_report(int json);
+
+// Extra report lines from another module, printed after the cache line:
+// whole lines of text, or ",\"key\":{...}" members for JSON. Register
+// before serving requests.
+typedef void (*stats_section_fn)(FILE *out, int json);
+int stats_add_section(stats_section_fn fn);
+
+#endif
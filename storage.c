@@ -0,0 +1,507 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "storage.h"
+#include "crc32c.h"
+#include "kernels.h"
+#include "layout.h"
+#include "locks.h"
+#include "segstore.h"
+
+// Plain uploads that have been charged but not yet renamed into place.
+// There are at most as many as worker threads, so a list is enough.
+typedef struct InFlight {
+    StoragePut *op;
+    size_t len;
+    struct InFlight *next;
+} InFlight;
+
+static InFlight *inflight = NULL;
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static storage_hook_fn hooks[STORAGE_MAX_HOOKS];
+static int nhooks;
+
+/* ---------- Lifecycle ---------- */
+
+void storage_init(int commit_delay_ms, size_t cache_bytes, uint64_t quota_bytes,
+                  int scrub_mb_per_sec) {
+    file_cache_init(cache_bytes);
+    durable_init(commit_delay_ms);
+    segstore_init();
+    // Scan before the migrator starts moving files around.
+    quota_init(quota_bytes, storage_usage);
+    layout_start_migration();
+    versions_init();
+    scrub_start(scrub_mb_per_sec);
+}
+
+void storage_destroy(void) {
+    scrub_stop();
+    versions_destroy();
+    layout_stop_migration();
+    segstore_destroy();
+    durable_destroy();
+    quota_destroy();
+    file_cache_destroy();
+}
+
+int storage_add_hook(storage_hook_fn fn) {
+    if (nhooks == STORAGE_MAX_HOOKS) return -1;
+    hooks[nhooks++] = fn;
+    return 0;
+}
+
+/* ---------- Helper Functions ---------- */
+
+static void run_hooks(StorageEvent ev, const char *user, const char *name) {
+    for (int i = 0; i < nhooks; i++) hooks[i](ev, user, name);
+}
+
+static int unlink_plain(const char *user, const char *name) {
+    char path[512];
+    if (layout_resolve(user, name, path, sizeof(path)) != 0) return -1;
+    int rc = unlink(path);
+    // Lost a race with the migrator: look it up again.
+    if (rc != 0 && layout_resolve(user, name, path, sizeof(path)) == 0) rc = unlink(path);
+    // A stale flat copy left beside the sharded file must not resurface.
+    if (layout_drop_legacy(user, name) != 0) perror("unlink legacy copy");
+    return rc;
+}
+
+static int read_plain(const char *path, char **data, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+
+    fseek(f, 0, SEEK_END);
+    long filesize = ftell(f);
+    rewind(f);
+
+    char *buf = malloc(filesize > 0 ? (size_t)filesize : 1);
+    if (!buf) {
+        fclose(f);
+        return -1;
+    }
+    *len = fread(buf, 1, filesize > 0 ? (size_t)filesize : 0, f);
+    *data = buf;
+    fclose(f);
+    return 0;
+}
+
+// Keep what is visible under name now as a new version (user lock held).
+static void keep_visible(const char *user, const char *name) {
+    VersionSlot slot;
+    char *data = NULL;
+    size_t len = 0;
+    char path[512];
+
+    int rc = segstore_get(user, name, &data, &len, NULL);
+    if (rc == 0) {
+        if (versions_reserve(user, name, &slot) == 0) versions_fill_from_data(&slot, data, len);
+        free(data);
+    } else if (rc != SEGSTORE_ECORRUPT && layout_resolve(user, name, path, sizeof(path)) == 0) {
+        if (versions_reserve(user, name, &slot) == 0) versions_fill_from_file(&slot, path);
+    }
+}
+
+// Commit-thread hook for plain uploads: keep the file about to be replaced.
+// It may still sit at its legacy flat path, so look it up by name.
+static void keep_replaced(const char *final_path, void *arg) {
+    StoragePut *op = arg;
+    char path[512];
+    (void)final_path;
+    if (layout_resolve(op->user, op->name, path, sizeof(path)) == 0)
+        versions_fill_from_file(&op->version, path);
+    else
+        versions_release(&op->version);
+}
+
+static void inflight_add(StoragePut *op, InFlight *node, size_t len) {
+    node->op = op;
+    node->len = len;
+    pthread_mutex_lock(&inflight_lock);
+    node->next = inflight;
+    inflight = node;
+    pthread_mutex_unlock(&inflight_lock);
+}
+
+static void inflight_remove(StoragePut *op) {
+    pthread_mutex_lock(&inflight_lock);
+    for (InFlight **pp = &inflight; *pp; pp = &(*pp)->next) {
+        if ((*pp)->op == op) {
+            InFlight *dead = *pp;
+            *pp = dead->next;
+            free(dead);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&inflight_lock);
+}
+
+// Size the name will have once everything already charged has landed: the
+// newest in-flight upload of it, else whatever is visible now.
+static int charged_size(const char *user, const char *name, size_t *len) {
+    int found = 0;
+    pthread_mutex_lock(&inflight_lock);
+    for (InFlight *f = inflight; f; f = f->next) {   // newest first
+        if (strcmp(f->op->user, user) == 0 && strcmp(f->op->name, name) == 0) {
+            *len = f->len;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&inflight_lock);
+    if (found) return 0;
+    return storage_stat(user, name, len);
+}
+
+/* ---------- UPLOAD ---------- */
+
+// Small files are stamped with their segment sequence number, which
+// survives compaction; plain files with their mtime, set when the data is
+// written and kept by the rename that replaces them.
+static void stamp_seq(char *out, size_t outlen, uint64_t seq) {
+    snprintf(out, outlen, "s%llx", (unsigned long long)seq);
+}
+
+static void stamp_mtime(char *out, size_t outlen, const struct stat *st) {
+    snprintf(out, outlen, "p%llx",
+             (unsigned long long)st->st_mtim.tv_sec * 1000000000ull +
+                 (unsigned long long)st->st_mtim.tv_nsec);
+}
+
+int storage_put_begin(StoragePut *op, const char *user, const char *name,
+                      const char *data, size_t len, uint32_t crc) {
+    memset(op, 0, sizeof(*op));
+    strncpy(op->user, user, sizeof(op->user) - 1);
+    strncpy(op->name, name, sizeof(op->name) - 1);
+
+    // Charge the quota up front, so an upload over quota never touches disk.
+    size_t old_len = 0;
+    int exists = charged_size(user, name, &old_len) == 0;
+    op->delta_bytes = (int64_t)len - (int64_t)old_len;
+    op->delta_files = exists ? 0 : 1;
+    int charged = quota_charge(user, op->delta_bytes, op->delta_files);
+    if (charged != 0) return charged == QUOTA_EIO ? -1 : STORAGE_EQUOTA;
+
+    // Segment entries shadow plain files, so when one is visible it is what
+    // this upload replaces and can be kept right away. A plain file is only
+    // replaced by the rename in the commit thread (or shadowed by a small
+    // put below), and in-flight uploads of the same name land first.
+    int plain_pending = 0;
+    size_t seg_len;
+    if (exists) {
+        if (len <= SEGSTORE_SMALL_MAX || segstore_size(user, name, &seg_len) == 0)
+            keep_visible(user, name);
+        else
+            plain_pending = versions_reserve(user, name, &op->version) == 0;
+    }
+
+    if (len <= SEGSTORE_SMALL_MAX) {
+        if (segstore_put(user, name, data, len, crc, &op->commit) != 0) {
+            quota_charge(user, -op->delta_bytes, -op->delta_files);
+            return -1;
+        }
+        op->seg_version = segstore_version(user, name);
+        stamp_seq(op->stamp, sizeof(op->stamp), op->seg_version);
+        // Segment entries are visible as soon as they are appended.
+        file_cache_invalidate(user, name);
+        return 0;
+    }
+
+    char path[512];
+    op->plain = 1;
+    op->seg_version = segstore_version(user, name);
+    InFlight *node = malloc(sizeof(InFlight));
+    if (!node || layout_prepare(user, name, path, sizeof(path)) != 0 ||
+        durable_prepare(&op->commit, path, data, len) != 0) {
+        free(node);
+        versions_release(&op->version);
+        quota_charge(user, -op->delta_bytes, -op->delta_files);
+        return -1;
+    }
+
+    // Set on the temp file, so the checksum lands atomically with the data.
+    // Filesystems without user xattrs just go without (checked on read).
+    if (crc32c_xattr_set(op->commit.fd, crc) != 0 && errno != ENOTSUP)
+        perror("fsetxattr crc32c");
+    struct stat st;
+    if (fstat(op->commit.fd, &st) == 0) stamp_mtime(op->stamp, sizeof(op->stamp), &st);
+    if (plain_pending) {
+        op->commit.before_publish = keep_replaced;
+        op->commit.publish_arg = op;
+    }
+    if (durable_submit(&op->commit) != 0) {
+        free(node);
+        versions_release(&op->version);
+        quota_charge(user, -op->delta_bytes, -op->delta_files);
+        return -1;
+    }
+    inflight_add(op, node, len);
+    return 0;
+}
+
+int storage_put_finish(StoragePut *op) {
+    int rc = durable_wait(&op->commit);
+    if (op->plain) inflight_remove(op);
+    versions_release(&op->version);     // no-op once the hook has filled it
+    if (rc != 0) {
+        quota_charge(op->user, -op->delta_bytes, -op->delta_files);
+        return -1;
+    }
+
+    if (op->plain) {
+        // The upload went to the sharded path; a legacy flat copy left
+        // behind would be migrated over it or come back on DELETE.
+        locks_acquire_user(op->user);
+        if (layout_drop_legacy(op->user, op->name) != 0) perror("unlink legacy copy");
+        locks_release_user(op->user);
+        // Retire the small copy this upload replaces, unless a newer small
+        // upload of the same name has landed since.
+        if (op->seg_version)
+            segstore_delete_if_version(op->user, op->name, op->seg_version);
+        file_cache_invalidate(op->user, op->name);
+        run_hooks(op->delta_files ? STORAGE_CREATE : STORAGE_PUT, op->user, op->name);
+        return 0;
+    }
+
+    // A plain file of the same name is now shadowed by the segment entry.
+    // Remove it under the user lock, and only while our entry is still the
+    // current one, so a later plain upload is never clobbered.
+    locks_acquire_user(op->user);
+    if (segstore_version(op->user, op->name) == op->seg_version)
+        unlink_plain(op->user, op->name);
+    locks_release_user(op->user);
+    run_hooks(op->delta_files ? STORAGE_CREATE : STORAGE_PUT, op->user, op->name);
+    return 0;
+}
+
+/* ---------- DOWNLOAD / DELETE / LIST ---------- */
+
+int storage_read(const char *user, const char *name, char **data, size_t *len) {
+    int rc = segstore_get(user, name, data, len, NULL);
+    if (rc != -1) return rc == 0 ? 0 : -1;
+
+    char path[512];
+    if (layout_resolve(user, name, path, sizeof(path)) != 0) return -1;
+    return read_plain(path, data, len);
+}
+
+// Map a plain file and hand it to the cache under name.
+static int open_mapped(const char *user, const char *name, unsigned long gen,
+                       const char *path, CachedFile **out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Uploads replace files by rename, so a mapping always sees one
+    // complete version of the file.
+    void *map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return -1;
+        }
+    }
+
+    // Files written before checksums existed (and reflinked versions, which
+    // do not carry xattrs) get one computed now and recorded.
+    uint32_t crc;
+    if (crc32c_xattr_get(fd, &crc) != 0) {
+        crc = crc32c(0, map, (size_t)st.st_size);
+        crc32c_xattr_set(fd, crc);
+    }
+    close(fd);
+
+    *out = file_cache_insert(user, name, gen, map, (size_t)st.st_size, crc, map != NULL);
+    return *out ? 0 : -1;
+}
+
+// "name@n" -> version n of name. Versions never change, so they are cached
+// under the full "name@n" key like any other file.
+static int open_version(const char *user, const char *spec, unsigned long gen,
+                        CachedFile **out) {
+    const char *at = strrchr(spec, '@');
+    if (!at || at == spec || at[1] == '\0' || strspn(at + 1, "0123456789") != strlen(at + 1))
+        return -1;
+
+    char name[128], path[600];
+    snprintf(name, sizeof(name), "%.*s", (int)(at - spec), spec);
+    if (versions_path(user, name, atoi(at + 1), path, sizeof(path)) != 0) return -1;
+    return open_mapped(user, spec, gen, path, out);
+}
+
+int storage_open(const char *user, const char *name, CachedFile **out) {
+    unsigned long gen;
+    CachedFile *f = file_cache_lookup(user, name, &gen);
+    if (f) {
+        *out = f;
+        return 0;
+    }
+
+    // Small entries come with the CRC stored at upload, already checked
+    // against the data just read. A damaged one is not served, and does not
+    // fall through to a plain file it shadows.
+    char *data = NULL;
+    size_t len = 0;
+    uint32_t crc;
+    int rc = segstore_get(user, name, &data, &len, &crc);
+    if (rc == 0) {
+        *out = file_cache_insert(user, name, gen, data, len, crc, 0);
+        return *out ? 0 : -1;
+    }
+    if (rc == SEGSTORE_ECORRUPT) return -1;
+
+    char path[512];
+    if (layout_resolve(user, name, path, sizeof(path)) != 0)
+        return open_version(user, name, gen, out);
+    return open_mapped(user, name, gen, path, out);
+}
+
+static int pack_body(const char *data, size_t len, char **out, size_t *out_len) {
+    return kernel_compress(data, len, NULL, out, out_len);
+}
+
+int storage_packed(CachedFile *f, const char **packed, size_t *packed_len) {
+    return file_cache_packed(f, pack_body, packed, packed_len);
+}
+
+int storage_stat(const char *user, const char *name, size_t *len) {
+    if (segstore_size(user, name, len) == 0) return 0;
+
+    char path[512];
+    struct stat st;
+    if (layout_resolve(user, name, path, sizeof(path)) != 0 || stat(path, &st) != 0) return -1;
+    *len = (size_t)st.st_size;
+    return 0;
+}
+
+int storage_delete(const char *user, const char *name) {
+    size_t len = 0;
+    int exists = storage_stat(user, name, &len) == 0;
+    if (exists) keep_visible(user, name);
+
+    int seg = segstore_delete(user, name);
+    int plain = unlink_plain(user, name);
+    file_cache_invalidate(user, name);
+    if (seg != 0 && plain != 0) return -1;
+
+    if (exists) quota_charge(user, -(int64_t)len, -1);
+    run_hooks(STORAGE_DELETE, user, name);
+    return 0;
+}
+
+char *storage_versions(const char *user, const char *name) {
+    return versions_list(user, name);
+}
+
+// Merge two sorted newline-terminated lists, dropping duplicates.
+static char *merge_lists(const char *a, const char *b) {
+    char *out = malloc(strlen(a) + strlen(b) + 1);
+    if (!out) return NULL;
+
+    char *p = out;
+    while (*a || *b) {
+        const char *ea = strchr(a, '\n');
+        const char *eb = strchr(b, '\n');
+        size_t la = ea ? (size_t)(ea - a) : strlen(a);
+        size_t lb = eb ? (size_t)(eb - b) : strlen(b);
+
+        int c;
+        if (!*a) c = 1;
+        else if (!*b) c = -1;
+        else {
+            size_t m = la < lb ? la : lb;
+            c = memcmp(a, b, m);
+            if (c == 0) c = (la > lb) - (la < lb);
+        }
+
+        const char *src = c <= 0 ? a : b;
+        size_t n = c <= 0 ? la : lb;
+        memcpy(p, src, n);
+        p[n] = '\n';
+        p += n + 1;
+
+        if (c <= 0) a += la + (ea ? 1 : 0);
+        if (c >= 0) b += lb + (eb ? 1 : 0);
+    }
+    *p = '\0';
+    return out;
+}
+
+char *storage_list(const char *user) {
+    char *plain = layout_list(user);
+    char *small = segstore_list(user);
+    char *out = merge_lists(plain ? plain : "", small ? small : "");
+    free(plain);
+    free(small);
+    return out;
+}
+
+char *storage_list_stamped(const char *user) {
+    char *names = storage_list(user);
+    if (!names) return NULL;
+
+    size_t count = 0;
+    for (const char *p = names; *p; p++) count += *p == '\n';
+    size_t cap = strlen(names) + count * 44 + 1;  // two 64-bit numbers per line
+    char *out = malloc(cap);
+    if (!out) {
+        free(names);
+        return NULL;
+    }
+
+    size_t n = 0;
+    out[0] = '\0';
+    const char *prev = "";
+    char *save = NULL;
+    for (char *name = strtok_r(names, "\n", &save); name; name = strtok_r(NULL, "\n", &save)) {
+        if (strcmp(name, prev) == 0) continue;      // mid-migration duplicate
+        prev = name;
+
+        size_t len;
+        uint64_t seq = segstore_version(user, name);
+        char path[512], stamp[24];
+        struct stat st;
+        if (seq && segstore_size(user, name, &len) == 0) {
+            stamp_seq(stamp, sizeof(stamp), seq);
+            n += (size_t)snprintf(out + n, cap - n, "%s %zu %s\n", name, len, stamp);
+        } else if (layout_resolve(user, name, path, sizeof(path)) == 0 && stat(path, &st) == 0) {
+            stamp_mtime(stamp, sizeof(stamp), &st);
+            n += (size_t)snprintf(out + n, cap - n, "%s %lld %s\n", name, (long long)st.st_size,
+                                  stamp);
+        }
+    }
+    free(names);
+    return out;
+}
+
+void storage_usage(const char *user, QuotaUsage *out) {
+    out->bytes = 0;
+    out->files = 0;
+
+    char *names = storage_list(user);
+    if (!names) return;
+
+    char *save = NULL;
+    for (char *name = strtok_r(names, "\n", &save); name; name = strtok_r(NULL, "\n", &save)) {
+        size_t len;
+        if (storage_stat(user, name, &len) != 0) continue;
+        out->bytes += (int64_t)len;
+        out->files++;
+    }
+    free(names);
+}
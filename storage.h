@@ -0,0 +1,95 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "durable.h"
+#include "file_cache.h"
+#include "quota.h"
+#include "scrub.h"
+#include "versions.h"
+
+#define STORAGE_EQUOTA -2
+#define STORAGE_MAX_HOOKS 4
+
+// Storage facade used by the worker threads. Small files go to the segment
+// store, everything else to plain files in the sharded layout. Callers hold
+// the user lock for writes and the file lock for reads, as before.
+
+typedef struct StoragePut {
+    DurableWrite commit;
+    char user[64];
+    char name[128];
+    int plain;                  // 1 = plain file, 0 = segment store
+    uint64_t seg_version;       // segment entry to retire once a plain put lands
+    int64_t delta_bytes;        // quota charged at begin, refunded on failure
+    int64_t delta_files;
+    VersionSlot version;        // where the replaced contents are kept
+    char stamp[24];             // its LIST S stamp, set by storage_put_begin()
+} StoragePut;
+
+typedef enum {
+    STORAGE_PUT,                // replaced an existing file
+    STORAGE_CREATE,             // put a name that was not there
+    STORAGE_DELETE
+} StorageEvent;
+
+// Called after each successful put or delete, in the thread that made it,
+// once the change is durable and visible. Must not block.
+typedef void (*storage_hook_fn)(StorageEvent ev, const char *user, const char *name);
+
+// Start/stop the group-commit thread, layout migration, compactor, the
+// hot-file cache (cache_bytes is its memory ceiling), quota accounting and
+// version pruning, and the checksum scrubber (scrub_mb_per_sec, 0 = off).
+void storage_init(int commit_delay_ms, size_t cache_bytes, uint64_t quota_bytes,
+                  int scrub_mb_per_sec);
+void storage_destroy(void);
+
+// Register a mutation hook. Call before serving requests.
+int storage_add_hook(storage_hook_fn fn);
+
+// Two-phase UPLOAD: begin under the user lock, finish after dropping it so
+// concurrent uploads share a group commit. Overwritten contents are kept
+// as a version. crc is the CRC32C of data, computed as it arrived; it is
+// kept with the file and sent back on DOWNLOAD. Both return 0 on success;
+// begin returns STORAGE_EQUOTA, before writing anything, if the upload
+// would take the user over quota. op->stamp is the stamp the file will
+// have in storage_list_stamped() once it lands.
+int storage_put_begin(StoragePut *op, const char *user, const char *name,
+                      const char *data, size_t len, uint32_t crc);
+int storage_put_finish(StoragePut *op);
+
+// Read a whole file into a malloc'd buffer. Returns 0 if found.
+int storage_read(const char *user, const char *name, char **data, size_t *len);
+
+// Get a referenced file body (with its CRC32C) for DOWNLOAD, from the hot-file cache when
+// possible. Release it with file_cache_release(). "name@n" names version n
+// of name, unless a file called exactly that exists. Returns 0 if found.
+int storage_open(const char *user, const char *name, CachedFile **out);
+
+// Compressed form (an lz stream, see lz.h) of a body from storage_open(),
+// compressed in parallel on first use and cached with the entry. Valid while
+// the entry is held. Returns 0 on success.
+int storage_packed(CachedFile *f, const char **packed, size_t *packed_len);
+
+// Size of a visible file. Returns 0 if found.
+int storage_stat(const char *user, const char *name, size_t *len);
+
+// Returns 0 if something was deleted. The deleted contents are kept as a
+// version.
+int storage_delete(const char *user, const char *name);
+
+// Version history of a file, see versions_list() (malloc'd).
+char *storage_versions(const char *user, const char *name);
+
+// Sorted, newline-terminated list of the user's files (malloc'd).
+char *storage_list(const char *user);
+
+// Same, one "<name> <size> <stamp>\n" line per file. The stamp is an
+// opaque token that changes whenever the file is replaced.
+char *storage_list_stamped(const char *user);
+
+// Recompute a user's usage from what is on disk.
+void storage_usage(const char *user, QuotaUsage *out);
+
+#endif
@@ -0,0 +1,584 @@
+// client/sync.c
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "sync.h"
+#include "crc32c.h"
+
+#define SYNC_NAME 128                   // server names are at most 127 bytes
+#define SYNC_STAMP 24
+#define SYNC_BLOCK (64 * 1024)
+#define SYNC_REPLY 4096                 // first reply buffer, grown as needed
+
+typedef struct {
+    char name[SYNC_NAME];               // "" = dropped from the manifest
+    uint64_t size;
+    int64_t mtime_ns;
+    uint32_t crc;
+    char stamp[SYNC_STAMP];             // server change stamp, "" = not known
+} SyncEntry;
+
+typedef struct {
+    SyncEntry *v;
+    size_t count, cap;
+} SyncList;
+
+typedef enum { SYNC_UPLOAD, SYNC_DOWNLOAD, SYNC_DELETE_REMOTE, SYNC_DELETE_LOCAL } SyncOp;
+
+typedef struct {
+    SyncOp op;
+    size_t slot;                        // its entry in the new manifest
+    SyncEntry local;                    // as scanned, for SYNC_DELETE_LOCAL
+    SyncEntry remote;                   // as listed, for SYNC_DOWNLOAD
+    int has_old;
+    SyncEntry old;                      // kept if the action fails
+    int ok;
+    int same;                           // an upload found the server already had it
+} SyncAction;
+
+typedef struct {
+    const char *dir;
+    const char *host;
+    int port;
+    const char *user;
+    SyncList *manifest;                 // the new one, filled in by the actions
+    SyncAction *actions;
+    size_t nactions;
+    atomic_size_t next;
+} SyncCtx;
+
+static const char *op_names[] = { "upload", "download", "delete on server", "delete here" };
+
+/* ---------- Helper Functions ---------- */
+
+static int list_add(SyncList *l, const SyncEntry *e) {
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 256;
+        SyncEntry *v = realloc(l->v, cap * sizeof(SyncEntry));
+        if (!v) return -1;
+        l->v = v;
+        l->cap = cap;
+    }
+    l->v[l->count++] = *e;
+    return 0;
+}
+
+static int cmp_entries(const void *a, const void *b) {
+    return strcmp(((const SyncEntry *)a)->name, ((const SyncEntry *)b)->name);
+}
+
+static int64_t mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// Names the server can hold: no whitespace (it parses them with %s), and
+// no dot files, which also keeps the manifest and temp files out.
+static int syncable(const char *name) {
+    if (name[0] == '.' || strlen(name) >= SYNC_NAME) return 0;
+    for (const char *p = name; *p; p++)
+        if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') return 0;
+    return 1;
+}
+
+static int file_crc(const char *path, uint32_t *crc) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    static __thread char block[SYNC_BLOCK];
+    uint32_t c = 0;
+    ssize_t n;
+    while ((n = read(fd, block, sizeof(block))) > 0) c = crc32c(c, block, (size_t)n);
+    close(fd);
+    if (n < 0) return -1;
+    *crc = c;
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+static ssize_t read_some(int fd, void *buf, size_t len) {
+    ssize_t r;
+    do {
+        r = read(fd, buf, len);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+/* ---------- Requests ---------- */
+
+// Connect and send the user header and command line. Returns the socket.
+static int request_open(const SyncCtx *c, const char *cmdline) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+
+    struct sockaddr_in serv = {0};
+    serv.sin_family = AF_INET;
+    serv.sin_port = htons((uint16_t)c->port);
+    char head[256];
+    int n = c->user[0] ? snprintf(head, sizeof(head), "USER %s\n%s", c->user, cmdline)
+                       : snprintf(head, sizeof(head), "%s", cmdline);
+    if (inet_pton(AF_INET, c->host, &serv.sin_addr) != 1 ||
+        connect(sock, (struct sockaddr *)&serv, sizeof(serv)) < 0 ||
+        write_all(sock, head, (size_t)n) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// The whole reply, NUL-terminated (malloc'd).
+static char *read_reply(int sock) {
+    size_t len = 0, cap = SYNC_REPLY;
+    char *buf = malloc(cap);
+    ssize_t r;
+    while (buf && (r = read_some(sock, buf + len, cap - len - 1)) > 0) {
+        len += (size_t)r;
+        if (cap - len - 1 == 0) {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown) {
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+    }
+    if (buf) buf[len] = '\0';
+    return buf;
+}
+
+static int simple_request(const SyncCtx *c, const char *cmdline, const char *expect) {
+    int sock = request_open(c, cmdline);
+    if (sock < 0) return -1;
+    shutdown(sock, SHUT_WR);
+    char *reply = read_reply(sock);
+    close(sock);
+    int ok = reply && strncmp(reply, expect, strlen(expect)) == 0;
+    free(reply);
+    return ok ? 0 : -1;
+}
+
+// "LIST S": the server's files with sizes and change stamps, sorted.
+static int fetch_remote(const SyncCtx *c, SyncList *out) {
+    int sock = request_open(c, "LIST S\n");
+    if (sock < 0) return -1;
+    shutdown(sock, SHUT_WR);
+    char *reply = read_reply(sock);
+    close(sock);
+    if (!reply || strncmp(reply, "ERR", 3) == 0) {
+        if (reply) fprintf(stderr, "SYNC: %s", reply);
+        free(reply);
+        return -1;
+    }
+
+    // "No files found" has no size field, so it parses as nothing.
+    char *save = NULL;
+    for (char *line = strtok_r(reply, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        SyncEntry e = {0};
+        unsigned long long size;
+        if (sscanf(line, "%127s %llu %23s", e.name, &size, e.stamp) != 3) continue;
+        e.size = size;
+        if (list_add(out, &e) != 0) break;
+    }
+    free(reply);
+    qsort(out->v, out->count, sizeof(SyncEntry), cmp_entries);
+    return 0;
+}
+
+static int do_upload(const SyncCtx *c, SyncEntry *e) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", c->dir, e->name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    // Stat before reading: an edit made during the upload moves the mtime,
+    // so the next sync sends the file again.
+    struct stat st;
+    char cmdline[SYNC_NAME + 16];
+    snprintf(cmdline, sizeof(cmdline), "UPLOAD %s\n", e->name);
+    int sock = fstat(fd, &st) == 0 ? request_open(c, cmdline) : -1;
+    if (sock < 0) {
+        close(fd);
+        return -1;
+    }
+
+    static __thread char block[SYNC_BLOCK];
+    uint32_t crc = 0;
+    uint64_t sent = 0;
+    ssize_t n;
+    while ((n = read(fd, block, sizeof(block))) > 0) {
+        crc = crc32c(crc, block, (size_t)n);
+        sent += (uint64_t)n;
+        if (write_all(sock, block, (size_t)n) != 0) break;
+    }
+    close(fd);
+    shutdown(sock, SHUT_WR);
+    char *reply = read_reply(sock);
+    close(sock);
+    // A file that grew past the limit since the scan was cut short.
+    int ok = n == 0 && sent <= SYNC_UPLOAD_MAX && reply && strncmp(reply, "UPLOAD OK", 9) == 0;
+    // "UPLOAD OK <stamp>": the stamp of exactly what was sent. Without one
+    // the next sync sees a server change and fetches the file back.
+    if (ok && sscanf(reply, "UPLOAD OK %23s", e->stamp) != 1) e->stamp[0] = '\0';
+    free(reply);
+    if (!ok) return -1;
+
+    e->size = sent;
+    e->mtime_ns = mtime_ns(&st);
+    e->crc = crc;
+    return 0;
+}
+
+// First sync of a file on both sides: if the server's copy has the same
+// size and CRC, there is nothing to send. "RANGE 0 0" gets just the header.
+// The mtime is taken before hashing, so an edit during the check is caught
+// by the next sync.
+static int same_as_remote(const SyncCtx *c, const SyncEntry *remote, SyncEntry *e) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", c->dir, e->name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    static __thread char block[SYNC_BLOCK];
+    uint32_t crc = 0;
+    ssize_t n = -1;
+    if (fstat(fd, &st) == 0)
+        while ((n = read_some(fd, block, sizeof(block))) > 0) crc = crc32c(crc, block, (size_t)n);
+    close(fd);
+    if (n != 0 || (uint64_t)st.st_size != remote->size) return 0;
+
+    char cmdline[SYNC_NAME + 32];
+    snprintf(cmdline, sizeof(cmdline), "DOWNLOAD %s RANGE 0 0\n", remote->name);
+    int sock = request_open(c, cmdline);
+    if (sock < 0) return 0;
+    shutdown(sock, SHUT_WR);
+    char *reply = read_reply(sock);
+    close(sock);
+    unsigned long long size;
+    unsigned int expected;
+    int same = reply && sscanf(reply, "SIZE %llu CRC %x", &size, &expected) == 2 &&
+               size == remote->size && expected == crc;
+    free(reply);
+    if (!same) return 0;
+
+    *e = *remote;
+    e->mtime_ns = mtime_ns(&st);
+    e->crc = crc;
+    return 1;
+}
+
+// Stream the body into a temp file, check it and rename it into place.
+static int do_download(const SyncCtx *c, const SyncEntry *remote, SyncEntry *e) {
+    char cmdline[SYNC_NAME + 16];
+    snprintf(cmdline, sizeof(cmdline), "DOWNLOAD %s\n", remote->name);
+    int sock = request_open(c, cmdline);
+    if (sock < 0) return -1;
+    shutdown(sock, SHUT_WR);
+
+    char header[96];
+    size_t idx = 0;
+    while (idx < sizeof(header) - 1 && read_some(sock, header + idx, 1) == 1)
+        if (header[idx++] == '\n') break;
+    header[idx] = '\0';
+    unsigned long long size;
+    unsigned int expected;
+    if (sscanf(header, "SIZE %llu CRC %x", &size, &expected) != 2) {
+        close(sock);
+        return -1;
+    }
+
+    char tmp[1024], path[1024];
+    snprintf(tmp, sizeof(tmp), "%s/.sync.%s.tmp", c->dir, remote->name);
+    snprintf(path, sizeof(path), "%s/%s", c->dir, remote->name);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        close(sock);
+        return -1;
+    }
+
+    static __thread char block[SYNC_BLOCK];
+    uint32_t crc = 0;
+    uint64_t got = 0;
+    ssize_t n = 0;
+    while (got < size && (n = read_some(sock, block, sizeof(block))) > 0) {
+        crc = crc32c(crc, block, (size_t)n);
+        got += (uint64_t)n;
+        if (write_all(fd, block, (size_t)n) != 0) break;
+    }
+    close(sock);
+
+    struct stat st;
+    int ok = got == size && crc == expected && fstat(fd, &st) == 0;
+    if (close(fd) != 0) ok = 0;
+    if (!ok || rename(tmp, path) != 0 || stat(path, &st) != 0) {
+        if (ok) perror("rename");
+        else fprintf(stderr, "SYNC: %s: download corrupted (%llu/%llu bytes)\n", remote->name,
+                     (unsigned long long)got, size);
+        unlink(tmp);
+        return -1;
+    }
+
+    *e = *remote;
+    e->size = size;
+    e->mtime_ns = mtime_ns(&st);
+    e->crc = crc;
+    return 0;
+}
+
+// Only if it has not been edited since the scan.
+static int do_delete_local(const SyncCtx *c, const SyncEntry *local) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", c->dir, local->name);
+    struct stat st;
+    if (stat(path, &st) != 0) return 0;
+    if ((uint64_t)st.st_size != local->size || mtime_ns(&st) != local->mtime_ns) return -1;
+    return unlink(path);
+}
+
+static void *pool_main(void *arg) {
+    SyncCtx *c = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&c->next, 1)) < c->nactions) {
+        SyncAction *a = &c->actions[i];
+        SyncEntry *slot = &c->manifest->v[a->slot];
+        const char *name = a->local.name[0] ? a->local.name : a->remote.name;
+        char cmdline[SYNC_NAME + 16];
+        int rc = -1;
+        switch (a->op) {
+        case SYNC_UPLOAD:
+            a->same = !a->has_old && a->remote.name[0] && same_as_remote(c, &a->remote, slot);
+            rc = a->same ? 0 : do_upload(c, slot);
+            break;
+        case SYNC_DOWNLOAD:
+            rc = do_download(c, &a->remote, slot);
+            break;
+        case SYNC_DELETE_REMOTE:
+            snprintf(cmdline, sizeof(cmdline), "DELETE %s\n", slot->name);
+            rc = simple_request(c, cmdline, "DELETE OK");
+            break;
+        case SYNC_DELETE_LOCAL:
+            rc = do_delete_local(c, &a->local);
+            break;
+        }
+
+        // A failed action leaves the old manifest entry, so the next sync
+        // tries again.
+        a->ok = rc == 0;
+        if (a->ok && (a->op == SYNC_DELETE_REMOTE || a->op == SYNC_DELETE_LOCAL))
+            slot->name[0] = '\0';
+        else if (!a->ok && a->has_old)
+            *slot = a->old;
+        else if (!a->ok)
+            slot->name[0] = '\0';
+        if (!a->ok) fprintf(stderr, "SYNC: %s: %s failed\n", name, op_names[a->op]);
+    }
+    return NULL;
+}
+
+/* ---------- Manifest ---------- */
+
+static int scan_local(const char *dir, SyncList *out) {
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (!syncable(de->d_name)) continue;
+        struct stat st;
+        if (fstatat(dirfd(d), de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) continue;
+
+        SyncEntry e = {0};
+        memcpy(e.name, de->d_name, strlen(de->d_name) + 1);   // syncable() checked the length
+        e.size = (uint64_t)st.st_size;
+        e.mtime_ns = mtime_ns(&st);
+        if (list_add(out, &e) != 0) break;
+    }
+    closedir(d);
+    qsort(out->v, out->count, sizeof(SyncEntry), cmp_entries);
+    return 0;
+}
+
+// "SYNC1" then "<name> <size> <mtime_ns> <crc> <stamp|->" per file. A
+// missing or unreadable manifest is an empty one: a first sync.
+static void manifest_load(const char *dir, SyncList *out) {
+    char path[1024], line[512];
+    snprintf(path, sizeof(path), "%s/" SYNC_MANIFEST, dir);
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    if (!fgets(line, sizeof(line), f) || strcmp(line, "SYNC1\n") != 0) {
+        fclose(f);
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        SyncEntry e = {0};
+        unsigned long long size;
+        long long mtime;
+        if (sscanf(line, "%127s %llu %lld %x %23s", e.name, &size, &mtime, &e.crc, e.stamp) != 5)
+            continue;
+        e.size = size;
+        e.mtime_ns = mtime;
+        if (strcmp(e.stamp, "-") == 0) e.stamp[0] = '\0';
+        if (list_add(out, &e) != 0) break;
+    }
+    fclose(f);
+    qsort(out->v, out->count, sizeof(SyncEntry), cmp_entries);
+}
+
+static int manifest_store(const char *dir, const SyncList *l) {
+    char path[1024], tmp[1024];
+    snprintf(path, sizeof(path), "%s/" SYNC_MANIFEST, dir);
+    snprintf(tmp, sizeof(tmp), "%s/" SYNC_MANIFEST ".tmp", dir);
+    FILE *f = fopen(tmp, "w");
+    if (!f) return -1;
+    fprintf(f, "SYNC1\n");
+    for (size_t i = 0; i < l->count; i++) {
+        const SyncEntry *e = &l->v[i];
+        if (!e->name[0]) continue;
+        fprintf(f, "%s %llu %lld %08x %s\n", e->name, (unsigned long long)e->size,
+                (long long)e->mtime_ns, e->crc, e->stamp[0] ? e->stamp : "-");
+    }
+    int rc = fflush(f) == 0 && fsync(fileno(f)) == 0 ? 0 : -1;
+    if (fclose(f) != 0) rc = -1;
+    if (rc == 0) rc = rename(tmp, path);
+    if (rc != 0) unlink(tmp);
+    return rc;
+}
+
+/* ---------- SYNC ---------- */
+
+int sync_dir(const char *dir, const char *host, int port, const char *user, int connections) {
+    SyncList local = {0}, old = {0}, remote = {0}, manifest = {0};
+    SyncAction *actions = NULL;
+    size_t nactions = 0, unchanged = 0, skipped = 0, failed = 0;
+    SyncCtx c = { dir, host, port, user, &manifest, NULL, 0, 0 };
+    int rc = -1;
+
+    if (scan_local(dir, &local) != 0) {
+        fprintf(stderr, "SYNC: cannot read %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    manifest_load(dir, &old);
+    if (fetch_remote(&c, &remote) != 0) {
+        fprintf(stderr, "SYNC: cannot list the server's files\n");
+        goto out;
+    }
+    size_t most = local.count + old.count + remote.count + 1;
+    actions = calloc(most, sizeof(SyncAction));
+    if (!actions) goto out;
+
+    // Walk the three sorted lists together, one name at a time.
+    size_t il = 0, io = 0, ir = 0;
+    while (il < local.count || io < old.count || ir < remote.count) {
+        const char *name = NULL;
+        if (il < local.count) name = local.v[il].name;
+        if (io < old.count && (!name || strcmp(old.v[io].name, name) < 0)) name = old.v[io].name;
+        if (ir < remote.count && (!name || strcmp(remote.v[ir].name, name) < 0)) name = remote.v[ir].name;
+        SyncEntry *L = il < local.count && strcmp(local.v[il].name, name) == 0 ? &local.v[il++] : NULL;
+        SyncEntry *M = io < old.count && strcmp(old.v[io].name, name) == 0 ? &old.v[io++] : NULL;
+        SyncEntry *R = ir < remote.count && strcmp(remote.v[ir].name, name) == 0 ? &remote.v[ir++] : NULL;
+
+        // A size or mtime change is only an edit if the contents moved.
+        int local_changed = L && (!M || L->size != M->size || L->mtime_ns != M->mtime_ns);
+        if (local_changed && M && L->size == M->size) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", dir, L->name);
+            uint32_t crc;
+            if (file_crc(path, &crc) == 0 && crc == M->crc) local_changed = 0;
+        }
+        int remote_changed = R && (!M || !M->stamp[0] || strcmp(R->stamp, M->stamp) != 0);
+
+        SyncOp op;
+        if (L && R) {
+            if (!local_changed && !remote_changed) {
+                SyncEntry e = *M;
+                e.mtime_ns = L->mtime_ns;   // touched, or nothing at all
+                if (list_add(&manifest, &e) != 0) goto out;
+                unchanged++;
+                continue;
+            }
+            op = local_changed ? SYNC_UPLOAD : SYNC_DOWNLOAD;
+        } else if (L) {
+            op = M && !local_changed ? SYNC_DELETE_LOCAL : SYNC_UPLOAD;
+        } else if (R) {
+            op = M && !remote_changed ? SYNC_DELETE_REMOTE : SYNC_DOWNLOAD;
+        } else {
+            continue;                       // gone from both sides
+        }
+
+        if (op == SYNC_UPLOAD && L->size > SYNC_UPLOAD_MAX) {
+            fprintf(stderr, "SYNC: %s: too large to upload (%llu bytes)\n", L->name,
+                    (unsigned long long)L->size);
+            if (M && list_add(&manifest, M) != 0) goto out;
+            skipped++;
+            continue;
+        }
+
+        SyncAction *a = &actions[nactions++];
+        a->op = op;
+        a->slot = manifest.count;
+        if (L) a->local = *L;
+        if (R) a->remote = *R;
+        a->has_old = M != NULL;
+        if (M) a->old = *M;
+        SyncEntry e = L ? *L : *R;
+        if (list_add(&manifest, &e) != 0) goto out;
+    }
+
+    // The pool: each thread takes the next action until none are left.
+    c.actions = actions;
+    c.nactions = nactions;
+    size_t nthreads = connections < 1 ? 1 : (size_t)connections;
+    if (nthreads > nactions) nthreads = nactions;
+    pthread_t *threads = calloc(nthreads ? nthreads : 1, sizeof(pthread_t));
+    size_t started = 0;
+    while (threads && started < nthreads &&
+           pthread_create(&threads[started], NULL, pool_main, &c) == 0)
+        started++;
+    if (started == 0) pool_main(&c);
+    for (size_t i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+
+    size_t counts[4] = {0};
+    for (size_t i = 0; i < nactions; i++) {
+        if (actions[i].same) unchanged++;
+        else if (actions[i].ok) counts[actions[i].op]++;
+        else failed++;
+    }
+
+    if (manifest_store(dir, &manifest) != 0) {
+        fprintf(stderr, "SYNC: cannot write the manifest in %s: %s\n", dir, strerror(errno));
+        failed++;
+    }
+    printf("SYNC %s: %zu uploaded, %zu downloaded, %zu deleted on the server, %zu deleted here, "
+           "%zu unchanged, %zu skipped, %zu failed\n",
+           dir, counts[SYNC_UPLOAD], counts[SYNC_DOWNLOAD], counts[SYNC_DELETE_REMOTE],
+           counts[SYNC_DELETE_LOCAL], unchanged, skipped, failed);
+    rc = failed ? -1 : 0;
+
+out:
+    free(local.v);
+    free(old.v);
+    free(remote.v);
+    free(manifest.v);
+    free(actions);
+    return rc;
+}
@@ -0,0 +1,25 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#define SYNC_MANIFEST ".sync_manifest"
+#define SYNC_DEFAULT_CONNECTIONS 8
+#define SYNC_UPLOAD_MAX 4095            // server's MAX_PAYLOAD - 1
+
+// Two-way sync of the regular files directly in a directory with the
+// user's files on the server (SYNC <dir>). The manifest in dir records, per
+// file, what both sides held after the last sync: size, mtime and CRC32C
+// of the local copy, and the server's change stamp (LIST S). One listing
+// and a stat per local file find what changed since; a file whose size or
+// mtime moved is hashed to tell a real edit from a touch. Then:
+//   changed here only        -> UPLOAD
+//   changed on the server    -> DOWNLOAD
+//   changed on both sides    -> UPLOAD (the server keeps its copy as a version)
+//   deleted here, unchanged there -> DELETE on the server
+//   deleted there, unchanged here -> removed here
+// The transfers run on a pool of connections, one request per connection
+// as usual. Dot files and files the server cannot hold are left alone.
+
+// Returns 0 if everything was synced.
+int sync_dir(const char *dir, const char *host, int port, const char *user, int connections);
+
+#endif
@@ -4,6 +4,7 @@
 #include <pthread.h>
 #include <stdatomic.h>
 #include "server.h"
+#include "stats.h"
 
 // Use atomic version of server_running (from server.h)
 extern atomic_int server_running;
@@ -13,12 +14,13 @@ void initTaskQueue(TaskQueue *q, int capacity) {
     q->head = q->tail = NULL;
     q->count = 0;
     q->capacity = capacity;
+    q->running = &server_running;
     pthread_mutex_init(&q->mutex, NULL);
     pthread_cond_init(&q->cond, NULL);
 }
 
-// Enqueue a new task into the queue
-void enqueueTask(TaskQueue *q, Task t) {
+// Enqueue a new task into the queue. Returns -1 if it could not be queued.
+int enqueueTask(TaskQueue *q, Task t) {
     pthread_mutex_lock(&q->mutex);
 
     // Create new node
@@ -26,10 +28,11 @@ void enqueueTask(TaskQueue *q, Task t) {
     if (!node) {
         pthread_mutex_unlock(&q->mutex);
         fprintf(stderr, "Error: malloc failed in enqueueTask\n");
-        return;
+        return -1;
     }
 
     node->task = t;
+    node->task.enqueued_us = stats_now_us();
     node->next = NULL;
 
     // Add to tail
@@ -40,8 +43,14 @@ void enqueueTask(TaskQueue *q, Task t) {
     q->tail = node;
 
     q->count++;
+    stats_gauge_set(STATS_TASK_QUEUE, q->count);
     pthread_cond_signal(&q->cond);
     pthread_mutex_unlock(&q->mutex);
+    return 0;
+}
+
+static int queue_running(TaskQueue *q) {
+    return !q->running || atomic_load(q->running);
 }
 
 // Dequeue a task from the queue (blocking)
@@ -49,7 +58,7 @@ Task dequeueTask(TaskQueue *q) {
     pthread_mutex_lock(&q->mutex);
 
     // Wait until there is a task or server is shutting down
-    while (q->count == 0 && atomic_load(&server_running)) {
+    while (q->count == 0 && queue_running(q)) {
         pthread_cond_wait(&q->cond, &q->mutex);
     }
 
@@ -57,7 +66,7 @@ Task dequeueTask(TaskQueue *q) {
     memset(&t, 0, sizeof(t));
 
     // If server is shutting down and no tasks left
-    if (q->count == 0 && !atomic_load(&server_running)) {
+    if (q->count == 0 && !queue_running(q)) {
         t.cmd = CMD_UNKNOWN;
         strncpy(t.data, "EXIT_WORKER", sizeof(t.data) - 1);
         t.result = NULL;
@@ -81,6 +90,8 @@ Task dequeueTask(TaskQueue *q) {
 
     free(node);
     q->count--;
+    stats_gauge_set(STATS_TASK_QUEUE, q->count);
+    t.dequeued_us = stats_now_us();
 
     pthread_cond_signal(&q->cond);
     pthread_mutex_unlock(&q->mutex);
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+typedef struct {
+    uint64_t start;
+    uint64_t dur;
+    uint32_t trace;
+    uint16_t stage;
+    int16_t arg;
+} TraceEvent;
+
+// Single-producer (the owning thread) / single-consumer (trace_flush) ring.
+typedef struct {
+    TraceEvent events[TRACE_RING];
+    atomic_uint_fast64_t head;          // next slot the owner writes
+    atomic_uint_fast64_t tail;          // next slot the flush reads
+    atomic_uint_fast64_t dropped;
+    int tid;
+    char name[32];
+} TraceRing;
+
+static const char *stage_names[TRACE_NSTAGES] = {
+    "request", "client_queue", "read", "body", "task_queue", "lock",
+    "io", "commit", "compress", "wait", "write",
+};
+
+static int sample_every;
+static atomic_uint sample_count;
+static atomic_uint next_id;
+
+static TraceRing *rings[TRACE_MAX_THREADS];
+static int nrings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int flush_seq;
+static __thread TraceRing *my_ring;
+static __thread int my_ring_full;       // no slot left for this thread
+
+/* ---------- Helper Functions ---------- */
+
+static TraceRing *ring(const char *name) {
+    if (my_ring || my_ring_full) return my_ring;
+
+    pthread_mutex_lock(&rings_lock);
+    if (nrings < TRACE_MAX_THREADS) {
+        TraceRing *r = calloc(1, sizeof(TraceRing));
+        if (r) {
+            r->tid = nrings + 1;
+            snprintf(r->name, sizeof(r->name), "%s-%d", name, r->tid);
+            rings[nrings++] = r;
+        }
+        my_ring = r;
+    }
+    if (!my_ring) my_ring_full = 1;
+    pthread_mutex_unlock(&rings_lock);
+    return my_ring;
+}
+
+/* ---------- Init / Destroy ---------- */
+
+void trace_init(int every) {
+    sample_every = every > 0 ? every : 0;
+    atomic_init(&sample_count, 0);
+    atomic_init(&next_id, 0);
+}
+
+void trace_destroy(void) {
+    pthread_mutex_lock(&rings_lock);
+    for (int i = 0; i < nrings; i++) {
+        free(rings[i]);
+        rings[i] = NULL;
+    }
+    nrings = 0;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+/* ---------- Recording ---------- */
+
+void trace_thread_name(const char *name) {
+    if (sample_every) ring(name);
+}
+
+uint32_t trace_sample(void) {
+    if (!sample_every) return 0;
+    if (atomic_fetch_add_explicit(&sample_count, 1, memory_order_relaxed) % (unsigned)sample_every)
+        return 0;
+    uint32_t id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed) + 1;
+    return id ? id : 1;
+}
+
+void trace_record(uint32_t trace, TraceStage stage, uint64_t start_us, uint64_t end_us, int arg) {
+    TraceRing *r = ring("thread");
+    if (!r) return;
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail >= TRACE_RING) {
+        // Full until the next flush: drop rather than stall the request.
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    TraceEvent *e = &r->events[head % TRACE_RING];
+    e->start = start_us;
+    e->dur = end_us > start_us ? end_us - start_us : 0;
+    e->trace = trace;
+    e->stage = (uint16_t)stage;
+    e->arg = (int16_t)arg;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/* ---------- Flush ---------- */
+
+char *trace_flush(void) {
+    char path[128];
+    snprintf(path, sizeof(path), "trace-%ld-%d.json", (long)time(NULL),
+             atomic_fetch_add(&flush_seq, 1));
+
+    pthread_mutex_lock(&flush_lock);
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        pthread_mutex_unlock(&flush_lock);
+        perror("fopen trace");
+        return strdup("ERR: Cannot write trace file\n");
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"server\"}}");
+
+    unsigned long long events = 0, dropped = 0;
+    pthread_mutex_lock(&rings_lock);
+    int n = nrings;
+    pthread_mutex_unlock(&rings_lock);
+
+    for (int i = 0; i < n; i++) {
+        TraceRing *r = rings[i];
+        fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                r->tid, r->name);
+
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        for (; tail < head; tail++) {
+            const TraceEvent *e = &r->events[tail % TRACE_RING];
+            fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                         "\"ts\":%llu,\"dur\":%llu,\"args\":{\"req\":%u",
+                    stage_names[e->stage], r->tid, (unsigned long long)e->start,
+                    (unsigned long long)e->dur, e->trace);
+            if (e->stage == TRACE_REQUEST)
+                fprintf(out, ",\"cmd\":\"%s\"", stats_command_name(e->arg));
+            fprintf(out, "}}");
+            events++;
+        }
+        atomic_store_explicit(&r->tail, head, memory_order_release);
+        dropped += atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+    }
+
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    pthread_mutex_unlock(&flush_lock);
+
+    char reply[256];
+    snprintf(reply, sizeof(reply), "TRACE %s %llu events (%llu dropped)\n", path, events, dropped);
+    return strdup(reply);
+}
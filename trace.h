@@ -0,0 +1,58 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "stats.h"
+
+#define TRACE_DEFAULT_SAMPLE 100        // trace 1 request in N (0 = off)
+#define TRACE_RING 4096                 // events per thread between flushes
+#define TRACE_MAX_THREADS 64
+
+// Sampled request tracing. The accept loop gives one connection in N a
+// trace id; that id travels with the connection and its Task, and every
+// thread that touches the request records spans for the stages it runs
+// into its own lock-free ring. trace_flush() drains the rings into a Chrome
+// trace file (chrome://tracing, ui.perfetto.dev). Untraced requests (id 0)
+// cost one branch per stage.
+
+typedef enum {
+    TRACE_REQUEST,                      // accept -> connection closed
+    TRACE_CLIENT_QUEUE,                 // accept -> client thread picks it up
+    TRACE_READ,                         // USER/command lines
+    TRACE_BODY,                         // UPLOAD body (and decompression)
+    TRACE_TASK_QUEUE,                   // enqueueTask -> dequeueTask
+    TRACE_LOCK,                         // waiting for the user/file lock
+    TRACE_IO,                           // storage call under the lock
+    TRACE_COMMIT,                       // waiting for the group commit
+    TRACE_COMPRESS,                     // wire compression of a download
+    TRACE_WAIT,                         // client thread waiting on the worker
+    TRACE_WRITE,                        // response write
+    TRACE_NSTAGES
+} TraceStage;
+
+void trace_init(int sample_every);
+void trace_destroy(void);
+
+// Label the calling thread in trace output ("client", "worker", ...).
+void trace_thread_name(const char *name);
+
+// Trace id for a newly accepted connection, or 0 if it is not sampled.
+uint32_t trace_sample(void);
+
+// Record a finished span; arg is shown in the event (the command for
+// TRACE_REQUEST). Drops the event if the thread's ring is full.
+void trace_record(uint32_t trace, TraceStage stage, uint64_t start_us, uint64_t end_us, int arg);
+
+static inline uint64_t trace_begin(uint32_t trace) {
+    return trace ? stats_now_us() : 0;
+}
+
+static inline void trace_end(uint32_t trace, TraceStage stage, uint64_t start_us) {
+    if (trace) trace_record(trace, stage, start_us, stats_now_us(), 0);
+}
+
+// Drain every ring into a new trace-<time>.json in the working directory.
+// Returns a malloc'd reply line naming the file.
+char *trace_flush(void);
+
+#endif
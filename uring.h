@@ -0,0 +1,49 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper on the raw syscalls (no liburing): one ring,
+// owned by one thread. Get SQEs with uring_sqe, submit and wait with
+// uring_enter, then walk completions with uring_cqe / uring_cqe_seen.
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned pending;                   // SQEs queued since the last enter
+} Uring;
+
+// Returns -1 with errno set if the kernel has no (or a disabled) io_uring.
+int uring_init(Uring *r, unsigned entries);
+void uring_destroy(Uring *r);
+
+int uring_register_buffers(Uring *r, const struct iovec *iov, unsigned n);
+
+// Next free SQE, zeroed, or NULL if the submission queue is full.
+struct io_uring_sqe *uring_sqe(Uring *r);
+
+// Submit the queued SQEs and wait for at least wait_nr completions.
+int uring_enter(Uring *r, unsigned wait_nr);
+
+// Oldest unseen completion, or NULL.
+static inline struct io_uring_cqe *uring_cqe(Uring *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+static inline void uring_cqe_seen(Uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
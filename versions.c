@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "versions.h"
+#include "file_cache.h"
+#include "layout.h"
+#include "locks.h"
+
+static pthread_t prune_thread;
+static pthread_mutex_t prune_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prune_cond = PTHREAD_COND_INITIALIZER;
+static int prune_running = 0;
+
+/* ---------- Helper Functions ---------- */
+
+static void versions_dir(char *out, size_t outlen, const char *user, const char *name) {
+    char dir[512];
+    layout_user_dir(dir, sizeof(dir), user);
+    snprintf(out, outlen, "%s/.versions/%s", dir, name);
+}
+
+/* "<n>" is a version, ".<n>" a reserved slot; both count as taken */
+static int parse_version(const char *entry, int *reserved) {
+    *reserved = entry[0] == '.';
+    const char *p = entry + *reserved;
+    if (*p < '1' || *p > '9') return 0;
+    char *end;
+    long n = strtol(p, &end, 10);
+    return (*end == '\0' && n > 0 && n < 1000000000L) ? (int)n : 0;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Sorted version numbers in dir (malloc'd); reserved slots only if asked.
+static int *scan_versions(const char *dir, int with_reserved, int *count) {
+    *count = 0;
+    DIR *d = opendir(dir);
+    if (!d) return NULL;
+
+    int *nums = NULL, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        int reserved;
+        int n = parse_version(e->d_name, &reserved);
+        if (!n || (reserved && !with_reserved)) continue;
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 16;
+            int *grown = realloc(nums, (size_t)cap * sizeof(int));
+            if (!grown) break;
+            nums = grown;
+        }
+        nums[(*count)++] = n;
+    }
+    closedir(d);
+    if (nums) qsort(nums, (size_t)*count, sizeof(int), cmp_int);
+    return nums;
+}
+
+static int fsync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+static void slot_paths(const VersionSlot *slot, char *final, char *placeholder, size_t len) {
+    snprintf(final, len, "%s/%d", slot->dir, slot->n);
+    snprintf(placeholder, len, "%s/.%d", slot->dir, slot->n);
+}
+
+/* ---------- Snapshots ---------- */
+
+int versions_reserve(const char *user, const char *name, VersionSlot *slot) {
+    memset(slot, 0, sizeof(*slot));
+
+    char udir[512], vroot[600];
+    layout_user_dir(udir, sizeof(udir), user);
+    snprintf(vroot, sizeof(vroot), "%s/.versions", udir);
+    mkdir(LAYOUT_ROOT, 0755);
+    mkdir(udir, 0755);
+    int new_root = mkdir(vroot, 0755) == 0;
+    versions_dir(slot->dir, sizeof(slot->dir), user, name);
+    if (mkdir(slot->dir, 0755) != 0) {
+        if (errno != EEXIST) {
+            perror("mkdir versions");
+            return -1;
+        }
+    } else if ((new_root && fsync_dir(udir) != 0) || fsync_dir(vroot) != 0) {
+        // The file's first version: its directory must outlive a crash too.
+        perror("fsync versions dir");
+    }
+
+    // Callers hold the user lock, so nobody else is picking a number.
+    int count;
+    int *nums = scan_versions(slot->dir, 1, &count);
+    int next = count > 0 ? nums[count - 1] + 1 : 1;
+    free(nums);
+
+    char final[600], placeholder[600];
+    slot->n = next;
+    slot_paths(slot, final, placeholder, sizeof(final));
+    int fd = open(placeholder, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open version slot");
+        slot->n = 0;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+void versions_release(VersionSlot *slot) {
+    if (!slot->n) return;
+    char final[600], placeholder[600];
+    slot_paths(slot, final, placeholder, sizeof(final));
+    unlink(placeholder);
+    slot->n = 0;
+}
+
+void versions_fill_from_file(VersionSlot *slot, const char *src_path) {
+    if (!slot->n) return;
+
+    char final[600], placeholder[600];
+    slot_paths(slot, final, placeholder, sizeof(final));
+
+    int src = open(src_path, O_RDONLY | O_CLOEXEC);
+    if (src < 0) {                  // nothing to keep (new file)
+        versions_release(slot);
+        return;
+    }
+
+    // Reflink first (btrfs, XFS): a private copy that shares extents.
+    int ok = 0;
+    int dst = open(final, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (dst >= 0) {
+        if (ioctl(dst, FICLONE, src) == 0) {
+            struct stat st;
+            if (fstat(src, &st) == 0) {
+                struct timespec times[2] = { st.st_atim, st.st_mtim };
+                futimens(dst, times);
+            }
+            if (fsync(dst) != 0) perror("fsync version");
+            ok = 1;
+        }
+        close(dst);
+        if (!ok) unlink(final);
+    }
+    close(src);
+
+    // Otherwise a hardlink: the upload renames a new inode over the name,
+    // so the old one is never modified in place.
+    if (!ok) {
+        ok = link(src_path, final) == 0;
+        if (!ok && errno != ENOENT) perror("link version");
+    }
+
+    // The old data is already on disk; the new name must be too before the
+    // overwrite is acknowledged.
+    if (ok && fsync_dir(slot->dir) != 0) perror("fsync versions dir");
+    unlink(placeholder);
+    slot->n = 0;
+}
+
+// A copy: the old data sits inside a shared segment file, so there is no
+// inode to link and its records are not block-aligned for a clone.
+void versions_fill_from_data(VersionSlot *slot, const char *data, size_t len) {
+    if (!slot->n) return;
+
+    char final[600], placeholder[600];
+    slot_paths(slot, final, placeholder, sizeof(final));
+
+    int fd = open(final, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open version");
+    } else {
+        size_t off = 0;
+        while (off < len) {
+            ssize_t w = write(fd, data + off, len - off);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                perror("write version");
+                break;
+            }
+            off += (size_t)w;
+        }
+        // The overwrite is acknowledged once this returns, so the copy
+        // must already be durable.
+        if (off == len && (fdatasync(fd) != 0 || fsync_dir(slot->dir) != 0))
+            perror("fsync version");
+        close(fd);
+    }
+
+    unlink(placeholder);
+    slot->n = 0;
+}
+
+/* ---------- Lookup ---------- */
+
+int versions_path(const char *user, const char *name, int n, char *out, size_t outlen) {
+    char dir[512];
+    versions_dir(dir, sizeof(dir), user, name);
+    snprintf(out, outlen, "%s/%d", dir, n);
+
+    struct stat st;
+    return (n > 0 && stat(out, &st) == 0 && S_ISREG(st.st_mode)) ? 0 : -1;
+}
+
+char *versions_list(const char *user, const char *name) {
+    char dir[512];
+    versions_dir(dir, sizeof(dir), user, name);
+
+    int count;
+    int *nums = scan_versions(dir, 0, &count);
+
+    size_t cap = (size_t)count * 64 + 1, used = 0;
+    char *out = malloc(cap);
+    if (!out) {
+        free(nums);
+        return NULL;
+    }
+    out[0] = '\0';
+
+    for (int i = 0; i < count; i++) {
+        char path[600];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%d", dir, nums[i]);
+        if (stat(path, &st) != 0) continue;   // pruned meanwhile
+
+        char when[32];
+        struct tm tm;
+        localtime_r(&st.st_mtime, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        used += (size_t)snprintf(out + used, cap - used, "%d %lld %s\n",
+                                 nums[i], (long long)st.st_size, when);
+    }
+    free(nums);
+    return out;
+}
+
+/* ---------- Pruning ---------- */
+
+// Keep the newest VERSIONS_KEEP versions of a file and drop those that were
+// superseded more than VERSIONS_MAX_AGE ago. A version stopped being current
+// when the next one was written: link and clone keep that content's mtime,
+// and a copy is written no earlier, so the next version's mtime dates it.
+// (ctime moves whenever a link count changes.) The newest version always
+// survives, so numbers are never reused.
+static int prune_file(const char *user, const char *name) {
+    char dir[512];
+    versions_dir(dir, sizeof(dir), user, name);
+
+    int removed = 0;
+    int count;
+    int *nums = scan_versions(dir, 1, &count);
+    time_t now = time(NULL);
+
+    for (int i = 0; i < count - 1; i++) {
+        char path[600];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%d", dir, nums[i]);
+        int reserved = stat(path, &st) != 0;
+        if (reserved) {
+            // A slot left behind by a crash between reserve and fill.
+            snprintf(path, sizeof(path), "%s/.%d", dir, nums[i]);
+            if (stat(path, &st) != 0) continue;
+        }
+
+        // A leftover slot is dated by its own creation.
+        time_t superseded = st.st_mtime;
+        if (!reserved) {
+            char next[600];
+            struct stat nst;
+            snprintf(next, sizeof(next), "%s/%d", dir, nums[i + 1]);
+            if (stat(next, &nst) != 0) {
+                snprintf(next, sizeof(next), "%s/.%d", dir, nums[i + 1]);
+                if (stat(next, &nst) != 0) nst.st_mtime = now;
+            }
+            superseded = nst.st_mtime;
+        }
+
+        int too_many = i < count - VERSIONS_KEEP;
+        int too_old = now - superseded > VERSIONS_MAX_AGE;
+        if (!too_many && !too_old) continue;
+        if (reserved && !too_old) continue;   // may still be filled in
+
+        if (unlink(path) == 0) {
+            removed++;
+            if (!reserved) {
+                char key[160];
+                snprintf(key, sizeof(key), "%s@%d", name, nums[i]);
+                file_cache_invalidate(user, key);
+            }
+        }
+    }
+    free(nums);
+
+    // Forget files whose history is gone entirely (fails while non-empty).
+    if (count == 0) rmdir(dir);
+    return removed;
+}
+
+static void prune_user(const char *user) {
+    char udir[512], vroot[600];
+    layout_user_dir(udir, sizeof(udir), user);
+    snprintf(vroot, sizeof(vroot), "%s/.versions", udir);
+
+    DIR *d = opendir(vroot);
+    if (!d) return;
+
+    int removed = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        locks_acquire_user(user);
+        removed += prune_file(user, e->d_name);
+        locks_release_user(user);
+    }
+    closedir(d);
+
+    if (removed > 0)
+        fprintf(stderr, "[Versions] pruned %d old versions for %s\n", removed, user);
+}
+
+static void *prune_thread_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&prune_lock);
+    while (prune_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += VERSIONS_PRUNE_INTERVAL;
+        pthread_cond_timedwait(&prune_cond, &prune_lock, &deadline);
+        if (!prune_running) break;
+        pthread_mutex_unlock(&prune_lock);
+
+        DIR *d = opendir(LAYOUT_ROOT);
+        if (d) {
+            struct dirent *e;
+            while ((e = readdir(d)) != NULL) {
+                if (e->d_name[0] == '.') continue;
+                prune_user(e->d_name);
+            }
+            closedir(d);
+        }
+
+        pthread_mutex_lock(&prune_lock);
+    }
+    pthread_mutex_unlock(&prune_lock);
+    return NULL;
+}
+
+/* ---------- Lifecycle ---------- */
+
+void versions_init(void) {
+    pthread_mutex_lock(&prune_lock);
+    prune_running = 1;
+    pthread_mutex_unlock(&prune_lock);
+    pthread_create(&prune_thread, NULL, prune_thread_main, NULL);
+}
+
+void versions_destroy(void) {
+    pthread_mutex_lock(&prune_lock);
+    int was_running = prune_running;
+    prune_running = 0;
+    pthread_cond_broadcast(&prune_cond);
+    pthread_mutex_unlock(&prune_lock);
+    if (was_running) pthread_join(prune_thread, NULL);
+}
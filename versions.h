@@ -0,0 +1,37 @@
+#ifndef VERSIONS_H
+#define VERSIONS_H
+
+#include <stddef.h>
+
+#define VERSIONS_KEEP 10                        // per file
+#define VERSIONS_MAX_AGE (7 * 24 * 3600)        // seconds
+#define VERSIONS_PRUNE_INTERVAL 60              // seconds between pruning passes
+
+// Old contents of a file are kept as storage/<user>/.versions/<name>/<n>.
+// Plain files are snapshotted with a FICLONE reflink where the filesystem
+// supports it and a hardlink otherwise; uploads always replace files by
+// rename, so either way history costs metadata rather than a data copy.
+// Small files from the segment store are copied (they are small).
+
+// A version number reserved under the user lock and filled in later, once
+// the old contents are about to be replaced.
+typedef struct {
+    char dir[512];
+    int n;                      // 0 = no slot
+} VersionSlot;
+
+void versions_init(void);
+void versions_destroy(void);
+
+int  versions_reserve(const char *user, const char *name, VersionSlot *slot);
+void versions_fill_from_file(VersionSlot *slot, const char *src_path);
+void versions_fill_from_data(VersionSlot *slot, const char *data, size_t len);
+void versions_release(VersionSlot *slot);
+
+// Path of an existing version. Returns 0 if found.
+int versions_path(const char *user, const char *name, int n, char *out, size_t outlen);
+
+// "<n> <size> <mtime>" lines, oldest first (malloc'd, "" if none).
+char *versions_list(const char *user, const char *name);
+
+#endif
@@ -0,0 +1,420 @@
+// src/watch.c
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "watch.h"
+#include "storage.h"
+#include "stats.h"
+#include "log.h"
+
+#define WATCH_OUT 4096                  // formatted events waiting for the socket
+#define WATCH_LINE 192                  // longest event line
+#define WATCH_BATCH 64                  // records copied out of the history at a time
+
+typedef struct {
+    uint64_t seq;
+    StorageEvent ev;
+    char user[64];
+    char name[128];
+} WatchRecord;
+
+typedef struct {
+    uint64_t seq;
+    StorageEvent ev;
+    char name[128];
+} WatchEvent;
+
+typedef struct Sub {
+    int fd;
+    char user[64];
+    uint64_t since;                     // resume point, if resume
+    int resume;
+    struct Sub *next;                   // bucket chain, or the pending list
+    struct Sub *next_dirty;
+    int dirty;
+    int overflow;
+    int want_out;                       // EPOLLOUT armed
+    WatchEvent queue[WATCH_QUEUE];
+    unsigned qhead, qlen;
+    char out[WATCH_OUT];
+    size_t out_len, out_off;
+} Sub;
+
+// ===== History, written by the storage hook =====
+static WatchRecord history[WATCH_HISTORY];      // record seq lives at seq % WATCH_HISTORY
+static uint64_t history_head;                   // last seq handed out
+static uint64_t base;                           // seq before the first change
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ===== Subscribers, owned by the watcher thread =====
+static Sub *buckets[WATCH_BUCKETS];
+static Sub *dirty;
+static uint64_t fanned;                         // last seq fanned out
+static pthread_mutex_t subs_lock = PTHREAD_MUTEX_INITIALIZER;
+static Sub *pending;                            // under subs_lock, not yet registered
+static int nsubs;                               // under subs_lock, pending included
+static atomic_ulong dropped;                    // disconnected for overflowing
+
+static pthread_t watcher_thread;
+static int epoll_fd = -1;
+static int event_fd = -1;
+static atomic_int running;
+
+static void report(FILE *out, int json);
+
+/* ---------- Helper Functions ---------- */
+
+static uint64_t wall_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static unsigned bucket_of(const char *user) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)user; *p; p++) h = (h ^ *p) * 16777619u;
+    return h % WATCH_BUCKETS;
+}
+
+static void wake(void) {
+    uint64_t one = 1;
+    ssize_t w = write(event_fd, &one, sizeof(one));
+    (void)w;                            // EAGAIN: a wakeup is pending anyway
+}
+
+static const char *event_name(StorageEvent ev) {
+    switch (ev) {
+    case STORAGE_CREATE: return "CREATED";
+    case STORAGE_DELETE: return "DELETED";
+    default:             return "MODIFIED";
+    }
+}
+
+/* ---------- Recording ---------- */
+
+static void record(StorageEvent ev, const char *user, const char *name) {
+    if (!atomic_load(&running)) return;
+    pthread_mutex_lock(&history_lock);
+    WatchRecord *r = &history[++history_head % WATCH_HISTORY];
+    r->seq = history_head;
+    r->ev = ev;
+    strncpy(r->user, user, sizeof(r->user) - 1);
+    r->user[sizeof(r->user) - 1] = '\0';
+    strncpy(r->name, name, sizeof(r->name) - 1);
+    r->name[sizeof(r->name) - 1] = '\0';
+    pthread_mutex_unlock(&history_lock);
+    wake();
+}
+
+/* ---------- Subscribers ---------- */
+
+static void sub_drop(Sub *s) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    Sub **pp = &buckets[bucket_of(s->user)];
+    while (*pp && *pp != s) pp = &(*pp)->next;
+    if (*pp) *pp = s->next;
+    free(s);
+    pthread_mutex_lock(&subs_lock);
+    nsubs--;
+    pthread_mutex_unlock(&subs_lock);
+}
+
+// Queue s for flush_dirty.
+static void mark_dirty(Sub *s) {
+    if (s->dirty) return;
+    s->dirty = 1;
+    s->next_dirty = dirty;
+    dirty = s;
+}
+
+static void sub_push(Sub *s, uint64_t seq, StorageEvent ev, const char *name) {
+    if (s->qlen == WATCH_QUEUE) {
+        s->overflow = 1;
+    } else {
+        WatchEvent *e = &s->queue[(s->qhead + s->qlen++) % WATCH_QUEUE];
+        e->seq = seq;
+        e->ev = ev;
+        memcpy(e->name, name, sizeof(e->name));
+    }
+    mark_dirty(s);
+}
+
+static void sub_arm(Sub *s) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | (s->want_out ? EPOLLOUT : 0),
+                              .data.ptr = s };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+// Format queued events into the output buffer and send what the socket
+// takes. Returns -1 if the subscriber is gone.
+static int sub_flush(Sub *s) {
+    for (;;) {
+        if (s->out_off == s->out_len) s->out_off = s->out_len = 0;
+        while (s->qlen > 0 && WATCH_OUT - s->out_len >= WATCH_LINE) {
+            WatchEvent *e = &s->queue[s->qhead];
+            s->out_len += (size_t)snprintf(s->out + s->out_len, WATCH_LINE, "%llu %s %s\n",
+                                           (unsigned long long)e->seq, event_name(e->ev), e->name);
+            s->qhead = (s->qhead + 1) % WATCH_QUEUE;
+            s->qlen--;
+        }
+        if (s->out_off == s->out_len) break;
+        ssize_t w = send(s->fd, s->out + s->out_off, s->out_len - s->out_off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            if (!s->want_out) {
+                s->want_out = 1;
+                sub_arm(s);
+            }
+            return 0;
+        }
+        stats_bytes(0, (size_t)w);
+        s->out_off += (size_t)w;
+    }
+    if (s->want_out) {
+        s->want_out = 0;
+        sub_arm(s);
+    }
+    return 0;
+}
+
+// Nothing more is expected from a subscriber, so input is discarded and
+// end of input means it left.
+static int sub_gone(Sub *s) {
+    char buf[256];
+    for (;;) {
+        ssize_t r = recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (r > 0) continue;
+        if (r < 0 && errno == EINTR) continue;
+        return r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    }
+}
+
+// Start following: replay the user's changes since the resume point from
+// the history, or tell the client to resync when they are not all there.
+static void sub_register(Sub *s) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = s };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->fd, &ev) != 0) {
+        close(s->fd);
+        free(s);
+        pthread_mutex_lock(&subs_lock);
+        nsubs--;
+        pthread_mutex_unlock(&subs_lock);
+        return;
+    }
+
+    int resync = 0;
+    if (s->resume) {
+        pthread_mutex_lock(&history_lock);
+        uint64_t oldest = history_head > base + WATCH_HISTORY ? history_head - WATCH_HISTORY : base;
+        if (s->since < oldest || s->since > fanned) {
+            resync = 1;
+        } else {
+            for (uint64_t seq = s->since + 1; seq <= fanned && !s->overflow; seq++) {
+                WatchRecord *r = &history[seq % WATCH_HISTORY];
+                if (strcmp(r->user, s->user) == 0) sub_push(s, r->seq, r->ev, r->name);
+            }
+        }
+        pthread_mutex_unlock(&history_lock);
+        if (s->overflow) {
+            // More changes than the queue holds: cheaper to LIST again.
+            resync = 1;
+            s->overflow = 0;
+            s->qlen = 0;
+        }
+    }
+    s->out_len = (size_t)snprintf(s->out, WATCH_LINE, "WATCH %s %llu\n", resync ? "RESYNC" : "OK",
+                                  (unsigned long long)fanned);
+
+    unsigned b = bucket_of(s->user);
+    s->next = buckets[b];
+    buckets[b] = s;
+    mark_dirty(s);
+}
+
+/* ---------- Watcher Thread ---------- */
+
+// Hand new changes to the subscribers of their users.
+static void fan_out(void) {
+    WatchRecord batch[WATCH_BATCH];
+    for (;;) {
+        int n = 0, lost = 0;
+        pthread_mutex_lock(&history_lock);
+        if (history_head - fanned > WATCH_HISTORY) {
+            fanned = history_head - WATCH_HISTORY;
+            lost = 1;
+        }
+        while (n < WATCH_BATCH && fanned + (uint64_t)n < history_head) {
+            batch[n] = history[(fanned + (uint64_t)n + 1) % WATCH_HISTORY];
+            n++;
+        }
+        pthread_mutex_unlock(&history_lock);
+
+        if (lost) {
+            // This thread fell behind the history itself; everyone resumes.
+            log_warn("[Watch] fan-out fell behind; disconnecting all watchers");
+            for (int b = 0; b < WATCH_BUCKETS; b++)
+                for (Sub *s = buckets[b]; s; s = s->next) {
+                    s->overflow = 1;
+                    mark_dirty(s);
+                }
+        }
+        for (int i = 0; i < n; i++) {
+            for (Sub *s = buckets[bucket_of(batch[i].user)]; s; s = s->next)
+                if (strcmp(s->user, batch[i].user) == 0)
+                    sub_push(s, batch[i].seq, batch[i].ev, batch[i].name);
+            fanned = batch[i].seq;
+        }
+        if (n < WATCH_BATCH) break;
+    }
+}
+
+static void flush_dirty(void) {
+    while (dirty) {
+        Sub *s = dirty;
+        dirty = s->next_dirty;
+        s->dirty = 0;
+        if (s->overflow) {
+            // It can resume from the last event it got, from the history.
+            atomic_fetch_add(&dropped, 1);
+            log_debug("[Watch] watcher of %s fell %d events behind; disconnecting", s->user,
+                      WATCH_QUEUE);
+            sub_drop(s);
+        } else if (sub_flush(s) != 0) {
+            sub_drop(s);
+        }
+    }
+}
+
+static void *watcher_main(void *arg) {
+    (void)arg;
+    struct epoll_event evs[64];
+    while (atomic_load(&running)) {
+        int n = epoll_wait(epoll_fd, evs, 64, -1);
+        if (n < 0 && errno != EINTR) break;
+        for (int i = 0; i < n; i++) {
+            Sub *s = evs[i].data.ptr;
+            if (!s) {
+                uint64_t v;
+                ssize_t r = read(event_fd, &v, sizeof(v));
+                (void)r;
+                continue;
+            }
+            if ((evs[i].events & (EPOLLHUP | EPOLLERR)) ||
+                ((evs[i].events & (EPOLLIN | EPOLLRDHUP)) && sub_gone(s))) {
+                sub_drop(s);
+                continue;
+            }
+            if ((evs[i].events & EPOLLOUT) && sub_flush(s) != 0) sub_drop(s);
+        }
+
+        pthread_mutex_lock(&subs_lock);
+        Sub *fresh = pending;
+        pending = NULL;
+        pthread_mutex_unlock(&subs_lock);
+        fan_out();
+        while (fresh) {
+            Sub *s = fresh;
+            fresh = s->next;
+            sub_register(s);
+        }
+        flush_dirty();
+    }
+    return NULL;
+}
+
+/* ---------- Public API ---------- */
+
+char *watch_subscribe(int fd, const char *user, const char *cmdline) {
+    if (!atomic_load(&running)) return strdup("ERR: WATCH is not available\n");
+    Sub *s = calloc(1, sizeof(Sub));
+    if (!s) return strdup("ERR: Out of memory\n");
+    unsigned long long since;
+    s->resume = sscanf(cmdline, "WATCH %llu", &since) == 1;
+    s->since = s->resume ? since : 0;
+    s->fd = fd;
+    strncpy(s->user, user, sizeof(s->user) - 1);
+
+    pthread_mutex_lock(&subs_lock);
+    if (nsubs >= WATCH_MAX_SUBSCRIBERS) {
+        pthread_mutex_unlock(&subs_lock);
+        free(s);
+        return strdup("ERR: Too many watchers\n");
+    }
+    nsubs++;
+    s->next = pending;
+    pending = s;
+    pthread_mutex_unlock(&subs_lock);
+
+    // Events are a line each and should not wait for the next one.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    wake();
+    return NULL;
+}
+
+void watch_init(void) {
+    base = history_head = fanned = wall_us();
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_fd < 0 || event_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev) != 0) {
+        log_error("[Watch] cannot start the watcher: %s", strerror(errno));
+        if (epoll_fd >= 0) close(epoll_fd);
+        if (event_fd >= 0) close(event_fd);
+        epoll_fd = event_fd = -1;
+        return;
+    }
+    atomic_store(&running, 1);
+    storage_add_hook(record);
+    stats_add_section(report);
+    pthread_create(&watcher_thread, NULL, watcher_main, NULL);
+}
+
+void watch_destroy(void) {
+    if (!atomic_exchange(&running, 0)) return;
+    wake();
+    pthread_join(watcher_thread, NULL);
+    for (int b = 0; b < WATCH_BUCKETS; b++)
+        while (buckets[b]) sub_drop(buckets[b]);
+    while (pending) {
+        Sub *s = pending;
+        pending = s->next;
+        close(s->fd);
+        free(s);
+        nsubs--;
+    }
+    close(epoll_fd);
+    close(event_fd);
+    epoll_fd = event_fd = -1;
+}
+
+// Watch lines for STATS.
+static void report(FILE *out, int json) {
+    pthread_mutex_lock(&subs_lock);
+    int subs = nsubs;
+    pthread_mutex_unlock(&subs_lock);
+    pthread_mutex_lock(&history_lock);
+    unsigned long long changes = history_head - base;
+    pthread_mutex_unlock(&history_lock);
+    unsigned long drops = atomic_load(&dropped);
+    if (json)
+        fprintf(out, ",\"watch\":{\"watchers\":%d,\"changes\":%llu,\"dropped\":%lu}", subs, changes,
+                drops);
+    else
+        fprintf(out, "watch watchers %d changes %llu dropped %lu\n", subs, changes, drops);
+}
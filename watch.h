@@ -0,0 +1,40 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#define WATCH_HISTORY 4096              // changes a reconnecting client can resume from
+#define WATCH_QUEUE 64                  // events buffered per subscriber
+#define WATCH_MAX_SUBSCRIBERS 1024
+#define WATCH_BUCKETS 256               // subscribers hashed by user
+
+// Change notification (WATCH). Every put and delete the storage layer
+// makes is recorded, through a storage hook, in an in-memory history with
+// a sequence number. One watcher thread owns all subscriber connections:
+// it fans each change out to the subscribers of that user, through a
+// bounded queue per subscriber, and writes the queues out with
+// non-blocking sends, so a slow subscriber never holds up a write or the
+// other subscribers. A subscriber whose queue overflows is disconnected
+// and resumes where it left off.
+//
+// Wire format, after "WATCH [<seq>]\n":
+//   WATCH OK <seq>\n               following from seq, the newest change
+//   WATCH RESYNC <seq>\n           changes after the given seq are lost
+//                                  (or it is from an earlier server run):
+//                                  LIST, then follow from seq
+//   <seq> CREATED|MODIFIED|DELETED <name>\n
+// With a seq the changes of this user since then are replayed first. The
+// client keeps its side of the connection open: closing it ends the watch.
+// Sequence numbers start at the wall-clock time in microseconds when the
+// server starts, so one from an earlier run is always older than the
+// history.
+
+void watch_init(void);
+
+// Call after the request threads are gone, before storage_destroy.
+void watch_destroy(void);
+
+// Take over a connection that sent "WATCH [<seq>]": from here on the
+// watcher thread writes to fd and closes it. Returns NULL, or a malloc'd
+// error reply if it cannot, in which case fd is still the caller's.
+char *watch_subscribe(int fd, const char *user, const char *cmdline);
+
+#endif
@@ -6,200 +6,254 @@
 #include <sys/stat.h>
 #include "server.h"
 #include "locks.h"
+#include "storage.h"
+#include "request.h"
+#include "search.h"
+#include "trace.h"
+#include "log.h"
 
 extern TaskQueue g_task_queue;
 
 /* ---------- Helper Functions ---------- */
 
-void save_file(const char *path, const char *data, int len) {
-    FILE *f = fopen(path, "wb");
-    if (!f) {
-        perror("fopen");
-        return;
-    }
-    fwrite(data, 1, len, f);
-    fclose(f);
-}
-
-static void make_userdir_if_needed(const char *user) {
-    mkdir("storage", 0755);
-    char userdir[256];
-    snprintf(userdir, sizeof(userdir), "storage/%s", user && strlen(user) ? user : "guest");
-    mkdir(userdir, 0755);
-}
-
 /* helper to produce file key: "user/filename" */
 static void make_file_key(char *out, size_t outlen, const char *user, const char *filename) {
     snprintf(out, outlen, "%s/%s", user && strlen(user) ? user : "guest", filename ? filename : "");
 }
 
-/* ---------- Worker Thread Main ---------- */
-
-void *worker_thread_main(void *arg) {
-    (void)arg;
-
-    locks_init();
-
-    while (1) {
-        Task t = dequeueTask(&g_task_queue);
-/* If sentinel for shutdown (no result pointer and special data), exit thread */
-if (t.result == NULL && strncmp(t.data, "EXIT_WORKER", 11) == 0) {
-    fprintf(stderr, "[Worker %lu] received EXIT_WORKER sentinel — exiting\n",
-            (unsigned long)pthread_self());
-    break;
-}
-        /* Check for sentinel task (server shutdown) */
-        if (strncmp(t.data, "EXIT_WORKER", 11) == 0) {
-            fprintf(stderr, "[WorkerThread] Received shutdown signal. Exiting...\n");
-            break;
+/* ---------- Task Execution ---------- */
+
+// Run one task and complete its result. The result fields are filled in
+// before task_result_complete publishes them to the waiting thread.
+void worker_process_task(Task *t) {
+    const char *user = (strlen(t->username) > 0) ? t->username : "guest";
+    TaskResult *res = t->result;
+
+    // Queue timestamps for the client thread's stats; it reads them
+    // once done is set.
+    res->enqueued_us = t->enqueued_us;
+    res->dequeued_us = t->dequeued_us;
+    if (t->trace) trace_record(t->trace, TRACE_TASK_QUEUE, t->enqueued_us, t->dequeued_us, 0);
+    uint64_t span;
+
+    // ===== UPLOAD =====
+    if (t->cmd == CMD_UPLOAD) {
+        span = trace_begin(t->trace);
+        locks_acquire_user(user);
+        trace_end(t->trace, TRACE_LOCK, span);
+
+        // Data is written under the lock; the fsyncs happen in the
+        // group-commit thread, so other uploads can join the same batch
+        // while we wait.
+        StoragePut put;
+        span = trace_begin(t->trace);
+        int rc = storage_put_begin(&put, user, t->filename, t->data, (size_t)t->data_len, t->crc);
+        trace_end(t->trace, TRACE_IO, span);
+        locks_release_user(user);
+        span = trace_begin(t->trace);
+        if (rc == 0) rc = storage_put_finish(&put);
+        trace_end(t->trace, TRACE_COMMIT, span);
+
+        // The stamp lets SYNC record exactly this version, not whatever a
+        // later listing shows.
+        if (rc == 0) {
+            char ok[64];
+            snprintf(ok, sizeof(ok), "UPLOAD OK%s%s\n", put.stamp[0] ? " " : "", put.stamp);
+            res->response = strdup(ok);
         }
+        else if (rc == STORAGE_EQUOTA)
+            res->response = strdup("ERR: Quota exceeded\n");
+        else
+            res->response = strdup("ERR: Upload failed\n");
+    }
 
-        const char *user = (strlen(t.username) > 0) ? t.username : "guest";
-
-        // ===== UPLOAD =====
-        if (t.cmd == CMD_UPLOAD) {
-            locks_acquire_user(user);
-
-            mkdir("storage", 0755);
-            char userdir[128];
-            snprintf(userdir, sizeof(userdir), "storage/%s", user);
-            mkdir(userdir, 0755);
-
-            char path[256];
-            snprintf(path, sizeof(path), "%s/%s", userdir, t.filename);
-            save_file(path, t.data, t.data_len);
-
-            pthread_mutex_lock(&t.result->lock);
-            t.result->response = strdup("UPLOAD OK\n");
-            t.result->done = 1;
-            pthread_cond_signal(&t.result->cond);
-            pthread_mutex_unlock(&t.result->lock);
+    // ===== LIST =====
+    else if (t->cmd == CMD_LIST) {
+        span = trace_begin(t->trace);
+        locks_acquire_user(user);
+        trace_end(t->trace, TRACE_LOCK, span);
+        // "LIST S": with sizes and change stamps, for SYNC.
+        char flag[8] = "";
+        sscanf(t->data, "%*s %7s", flag);
+        span = trace_begin(t->trace);
+        char *names = strcmp(flag, "S") == 0 ? storage_list_stamped(user) : storage_list(user);
+        trace_end(t->trace, TRACE_IO, span);
+        locks_release_user(user);
+
+        if (names && strlen(names) > 0) {
+            res->response = names;
+        } else {
+            free(names);
+            res->response = strdup("No files found\n");
+        }
+    }
 
-            locks_release_user(user);
+    // ===== DOWNLOAD =====
+    else if (t->cmd == CMD_DOWNLOAD) {
+        char filekey[512];
+        make_file_key(filekey, sizeof(filekey), user, t->filename);
+        span = trace_begin(t->trace);
+        locks_acquire(filekey);
+        trace_end(t->trace, TRACE_LOCK, span);
+
+        CachedFile *body = NULL;
+        span = trace_begin(t->trace);
+        int rc = storage_open(user, t->filename, &body);
+        trace_end(t->trace, TRACE_IO, span);
+        locks_release(filekey);
+
+        // "DOWNLOAD <file> RANGE <off> <len>": bytes [off, off + len) of
+        // the file, clipped to its end, for clients that fetch segments over
+        // several connections. SIZE and CRC still describe the whole file.
+        char flag[8] = "";
+        unsigned long long off = 0, len = 0;
+        int fields = sscanf(t->data, "%*s %*s %7s %llu %llu", flag, &off, &len);
+        int ranged = strcmp(flag, "RANGE") == 0;
+
+        if (rc != 0) {
+            res->response = strdup("ERR: File not found\n");
+        } else if (ranged && (fields != 3 || off > body->len)) {
+            file_cache_release(body);
+            res->response = strdup("ERR: Bad range\n");
+        } else if (ranged) {
+            if (len > body->len - off) len = body->len - off;
+            snprintf(res->header, sizeof(res->header), "SIZE %zu CRC %08x RANGE %llu %llu\n",
+                     body->len, body->crc, off, len);
+            res->body = body;
+            res->body_ranged = 1;
+            res->range_off = (size_t)off;
+            res->range_len = (size_t)len;
+        } else {
+            // "DOWNLOAD <file> Z": the client takes an lz stream. Use it
+            // when it actually saves bytes; the compressed copy is cached
+            // with the body, so hot files are compressed only once.
+            const char *packed = NULL;
+            size_t packed_len = 0;
+            span = trace_begin(t->trace);
+            int send_packed = strcmp(flag, "Z") == 0 && body->len >= WIRE_COMPRESS_MIN &&
+                              storage_packed(body, &packed, &packed_len) == 0 &&
+                              packed_len < body->len;
+            if (send_packed) trace_end(t->trace, TRACE_COMPRESS, span);
+
+            // Hand the cached body to the client thread; it sends it and
+            // drops the reference, so a hit costs no open, read or copy.
+            if (send_packed)
+                snprintf(res->header, sizeof(res->header), "SIZE %zu CRC %08x LZ %zu\n",
+                         body->len, body->crc, packed_len);
+            else
+                snprintf(res->header, sizeof(res->header), "SIZE %zu CRC %08x\n",
+                         body->len, body->crc);
+            res->body = body;
+            res->body_packed = send_packed;
         }
+    }
 
-        // ===== LIST =====
-        else if (t.cmd == CMD_LIST) {
-            locks_acquire_user(user);
-            make_userdir_if_needed(user);
+    // ===== DELETE =====
+    else if (t->cmd == CMD_DELETE) {
+        // Deletes are writes: serialize them with uploads on the user lock.
+        span = trace_begin(t->trace);
+        locks_acquire_user(user);
+        trace_end(t->trace, TRACE_LOCK, span);
+        span = trace_begin(t->trace);
+        int rc = storage_delete(user, t->filename);
+        trace_end(t->trace, TRACE_IO, span);
+        locks_release_user(user);
+
+        res->response = (rc == 0)
+            ? strdup("DELETE OK\n")
+            : strdup("ERR: Delete failed\n");
+    }
 
-            char userdir[256];
-            snprintf(userdir, sizeof(userdir), "storage/%s", user);
+    // ===== USAGE =====
+    else if (t->cmd == CMD_USAGE) {
+        QuotaUsage usage;
+        uint64_t limit;
+        quota_get(user, &usage, &limit);
 
-            char cmd[512];
-            snprintf(cmd, sizeof(cmd), "ls %s 2>/dev/null", userdir);
+        char buf[128];
+        snprintf(buf, sizeof(buf), "USAGE %lld bytes %lld files (quota %llu bytes)\n",
+                 (long long)usage.bytes, (long long)usage.files, (unsigned long long)limit);
+        res->response = strdup(buf);
+    }
 
-            FILE *p = popen(cmd, "r");
-            char buf[1024] = {0};
-            if (p) {
-                fread(buf, 1, sizeof(buf)-1, p);
-                pclose(p);
-            }
-            locks_release_user(user);
-
-            pthread_mutex_lock(&t.result->lock);
-            t.result->response = (strlen(buf) == 0)
-                ? strdup("No files found\n")
-                : strdup(buf);
-            t.result->done = 1;
-            pthread_cond_signal(&t.result->cond);
-            pthread_mutex_unlock(&t.result->lock);
+    // ===== VERSIONS =====
+    else if (t->cmd == CMD_VERSIONS) {
+        span = trace_begin(t->trace);
+        locks_acquire_user(user);
+        trace_end(t->trace, TRACE_LOCK, span);
+        span = trace_begin(t->trace);
+        char *list = storage_versions(user, t->filename);
+        trace_end(t->trace, TRACE_IO, span);
+        locks_release_user(user);
+
+        if (list && strlen(list) > 0) {
+            res->response = list;
+        } else {
+            free(list);
+            res->response = strdup("No versions found\n");
         }
+    }
 
-        // ===== DOWNLOAD =====
-        else if (t.cmd == CMD_DOWNLOAD) {
-            char filekey[512];
-            make_file_key(filekey, sizeof(filekey), user, t.filename);
-            locks_acquire(filekey);
-
-            char path[512];
-            snprintf(path, sizeof(path), "storage/%s/%s", user, t.filename);
-
-            FILE *f = fopen(path, "rb");
-            if (!f) {
-                locks_release(filekey);
-                pthread_mutex_lock(&t.result->lock);
-                t.result->response = strdup("ERR: File not found\n");
-                t.result->done = 1;
-                pthread_cond_signal(&t.result->cond);
-                pthread_mutex_unlock(&t.result->lock);
-                continue;
+    // ===== SEARCH =====
+    else if (t->cmd == CMD_SEARCH) {
+        if (strlen(t->filename) == 0) {
+            res->response = strdup("ERR: Usage: SEARCH <text> or SEARCH <prefix>*\n");
+        } else {
+            // The index has its own lock, so no user lock here.
+            span = trace_begin(t->trace);
+            char *names = search_query(user, t->filename);
+            trace_end(t->trace, TRACE_IO, span);
+
+            if (!names) {
+                res->response = strdup("ERR: Search failed\n");
+            } else if (strlen(names) > 0) {
+                res->response = names;
+            } else {
+                free(names);
+                res->response = strdup("No files found\n");
             }
+        }
+    }
 
-            fseek(f, 0, SEEK_END);
-            long filesize = ftell(f);
-            rewind(f);
-
-            char *data = malloc(filesize ? filesize : 1);
-            size_t n = fread(data, 1, filesize, f);
-            fclose(f);
+    // ===== SIGNUP / LOGIN / TRACE =====
+    // From the event loops, which must not wait on their file I/O.
+    else if (request_blocking(t->cmd)) {
+        res->response = request_inline(t->cmd, user, t->data, &res->failed);
+        if (!res->response) res->response = strdup("ERR: Unknown command\n");
+    }
 
-            char header[64];
-            snprintf(header, sizeof(header), "SIZE %zu\n", n);
+    // ===== UNKNOWN =====
+    else {
+        res->response = strdup("ERR: Unknown command\n");
+    }
 
-            size_t total_len = strlen(header) + n;
-            char *resp = malloc(total_len + 1);
-            memcpy(resp, header, strlen(header));
-            memcpy(resp + strlen(header), data, n);
-            resp[total_len] = '\0';
-            free(data);
+    task_result_complete(res);
+}
 
-            locks_release(filekey);
+/* ---------- Worker Thread Main ---------- */
 
-            pthread_mutex_lock(&t.result->lock);
-            t.result->response = resp;
-            t.result->done = 1;
-            pthread_cond_signal(&t.result->cond);
-            pthread_mutex_unlock(&t.result->lock);
-        }
+void *worker_thread_main(void *arg) {
+    TaskQueue *queue = arg ? arg : &g_task_queue;
 
-        // ===== DELETE =====
-        else if (t.cmd == CMD_DELETE) {
-            char filekey[512];
-            make_file_key(filekey, sizeof(filekey), user, t.filename);
-            locks_acquire(filekey);
-
-            char path[512];
-            snprintf(path, sizeof(path), "storage/%s/%s", user, t.filename);
-            int res = unlink(path);
-
-            locks_release(filekey);
-
-            pthread_mutex_lock(&t.result->lock);
-            t.result->response = (res == 0)
-                ? strdup("DELETE OK\n")
-                : strdup("ERR: Delete failed\n");
-            t.result->done = 1;
-            pthread_cond_signal(&t.result->cond);
-            pthread_mutex_unlock(&t.result->lock);
-        }
+    trace_thread_name("worker");
 
-        // ===== PROCESS =====
-        else if (t.cmd == CMD_PROCESS) {
-            int secs = 1;
-            sscanf(t.data, "PROCESS %d", &secs);
-            fprintf(stderr, "Worker %ld processing %d seconds...\n",
-                    pthread_self(), secs);
-            sleep(secs);
-
-            pthread_mutex_lock(&t.result->lock);
-            t.result->response = strdup("DONE PROCESS\n");
-            t.result->done = 1;
-            pthread_cond_signal(&t.result->cond);
-            pthread_mutex_unlock(&t.result->lock);
+    while (1) {
+        Task t = dequeueTask(queue);
+/* If sentinel for shutdown (no result pointer and special data), exit thread */
+if (t.result == NULL && strncmp(t.data, "EXIT_WORKER", 11) == 0) {
+    log_debug("[Worker %lu] received EXIT_WORKER sentinel — exiting",
+              (unsigned long)pthread_self());
+    break;
+}
+        /* Check for sentinel task (server shutdown) */
+        if (strncmp(t.data, "EXIT_WORKER", 11) == 0) {
+            log_debug("[WorkerThread] Received shutdown signal. Exiting...");
+            break;
         }
 
-        // ===== UNKNOWN =====
-        else {
-            pthread_mutex_lock(&t.result->lock);
-            t.result->response = strdup("ERR: Unknown command\n");
-            t.result->done = 1;
-            pthread_cond_signal(&t.result->cond);
-            pthread_mutex_unlock(&t.result->lock);
-        }
+        worker_process_task(&t);
     }
 
-    fprintf(stderr, "[WorkerThread] Exiting cleanly.\n");
+    log_debug("[WorkerThread] Exiting cleanly.");
     return NULL;
 }
-